@@ -0,0 +1,277 @@
+# bench.tcl --
+#
+# Benchmark suite of the bridge: ingest throughput against vector count, asyncvector conversion time against vector
+# length, waitevent wake-up latency, circuit load time against deck size, instance create/destroy cycle time and
+# the time of a small job on a fresh instance against a recycled one ("reset").
+# Results are written as JSON, so builds can be compared.
+#
+# Runs against the mock library built by "make mock" (synthetic producer, measures the bridge alone) or against a real
+# libngspice (resistor ladder decks are generated); the producer is detected from the library.
+#
+#   tclsh bench.tcl ?-lib path? ?-output file? ?-repeat N? ?-quick? ?-only names? ?-load script?
+#
+#   -lib path      library given to ngspicetclbridge::new (default libngspicemock in the current directory)
+#   -output file   JSON output file (default stdout)
+#   -repeat N      repetitions of each timed step (default 5)
+#   -quick         smaller sizes, for a smoke run
+#   -only names    list of benchmarks to run: ingest asyncvector waitevent circuit lifecycle recycle
+#   -load script   script evaluated before "package require ngspicetclbridge" (used by "make bench")
+
+namespace eval ::bench {
+    variable opts [dict create -lib [file join [pwd] libngspicemock[info sharedlibextension]] -output {} -repeat 5\
+                           -quick 0 -only {ingest asyncvector waitevent circuit lifecycle recycle}\
+                           -load {}]
+    variable producer {}
+    variable results {}
+}
+
+#** JSON output
+
+proc ::bench::jsonString {s} {
+    # Returns s as a JSON string literal.
+    return "\"[string map {\\ \\\\ \" \\\" \n \\n \r \\r \t \\t} $s]\""
+}
+
+proc ::bench::jsonObject {pairs} {
+    # Returns a JSON object from a list of key and already encoded value pairs.
+    set items {}
+    foreach {key value} $pairs {
+        lappend items "[jsonString $key]: $value"
+    }
+    return "\{[join $items {, }]\}"
+}
+
+proc ::bench::jsonNumbers {dict} {
+    # Returns a JSON object from a dict of numeric values; empty values become null.
+    set pairs {}
+    dict for {key value} $dict {
+        lappend pairs $key [expr {$value eq {} ? "null" : $value}]
+    }
+    return [jsonObject $pairs]
+}
+
+proc ::bench::record {name params values} {
+    # Adds one result: benchmark name, dict of parameters and dict of measured values.
+    variable results
+    lappend results [jsonObject [list name [jsonString $name] params [jsonNumbers $params]\
+                                         values [jsonNumbers $values]]]
+    puts stderr [format "%-12s %-30s %s" $name $params $values]
+}
+
+#** helpers
+
+proc ::bench::timeSteps {count script} {
+    # Evaluates script count times in the caller and returns the dict {mean_us min_us max_us} of the durations.
+    set times {}
+    for {set i 0} {$i < $count} {incr i} {
+        set t0 [clock microseconds]
+        uplevel 1 $script
+        lappend times [expr {[clock microseconds] - $t0}]
+    }
+    set sum [tcl::mathop::+ {*}$times]
+    return [dict create mean_us [expr {$sum / double($count)}] min_us [tcl::mathfunc::min {*}$times]\
+                    max_us [tcl::mathfunc::max {*}$times]]
+}
+
+proc ::bench::ladderDeck {n rows} {
+    # Returns a resistor ladder deck with n sections swept over rows dc points, as a list of lines. ngspice saves
+    # n+3 vectors for it: n0..nn, v-sweep and v1#branch.
+    set deck [list {bench ladder} {v1 n0 0 1}]
+    for {set i 1} {$i <= $n} {incr i} {
+        lappend deck "r$i n[expr {$i - 1}] n$i 1k" "rg$i n$i 0 1meg"
+    }
+    lappend deck [format ".dc v1 0 1 %.12g" [expr {1.0 / max(1, $rows - 1)}]] .end
+    return $deck
+}
+
+proc ::bench::setup {sim vectors rows args} {
+    # Prepares a run of about rows points with the given number of vectors; extra args are mock settings.
+    variable producer
+    if {$producer eq {mock}} {
+        foreach {key value} [list vectors $vectors rows $rows rate 0 stat 0 chars 0 {*}$args] {
+            $sim command [list mock $key $value]
+        }
+    } else {
+        $sim command remcirc
+        $sim circuit [ladderDeck [expr {max(1, $vectors - 3)}] $rows]
+    }
+}
+
+proc ::bench::runToEnd {sim} {
+    # Runs in the background thread and waits until every row is visible in "vectors".
+    $sim command bg_run
+    $sim waitevent bg_running -n 2 600000
+    $sim vectors
+    return
+}
+
+proc ::bench::vectorName {} {
+    # Name of the first non-scale vector of the runs prepared by setup.
+    variable producer
+    return [expr {$producer eq {mock} ? "v(n1)" : "n1"}]
+}
+
+#** benchmarks
+
+proc ::bench::ingest {sim} {
+    # Rows per second from bg_run until all rows are visible in "vectors", against the vector count.
+    variable opts
+    set rows [expr {[dict get $opts -quick] ? 2000 : 20000}]
+    foreach vectors {4 16 64 256} {
+        setup $sim $vectors $rows
+        set t [timeSteps [dict get $opts -repeat] {runToEnd $sim}]
+        set info [$sim runinfo]
+        set n [dict get $info rows]
+        record ingest [dict create vectors [dict size [$sim vectors]] rows $n]\
+                [dict merge $t [dict create rows_per_s [expr {$n * 1e6 / [dict get $t mean_us]}]\
+                                        callback_rows_per_s [dict get $info rows_per_s]\
+                                        drain_us [dict get $info drain_us]]]
+    }
+}
+
+proc ::bench::asyncvector {sim} {
+    # Time of "asyncvector" against the length of the vector.
+    variable opts
+    set lengths [expr {[dict get $opts -quick] ? {1000 10000} : {1000 10000 100000 1000000}}]
+    foreach length $lengths {
+        setup $sim 4 $length
+        $sim configure -storedata 0
+        runToEnd $sim
+        $sim configure -storedata 1
+        set name [vectorName]
+        set n [llength [$sim asyncvector $name]]
+        set t [timeSteps [dict get $opts -repeat] {$sim asyncvector $name}]
+        record asyncvector [dict create length $n]\
+                [dict merge $t [dict create values_per_s [expr {$n * 1e6 / [dict get $t mean_us]}]]]
+    }
+}
+
+proc ::bench::waitevent {sim} {
+    # Wake-up latency of "waitevent send_data" while rows stream in, from the C histograms of "latency" and as seen
+    # by the Tcl caller.
+    variable opts
+    set waits [expr {[dict get $opts -quick] ? 50 : 500}]
+    setup $sim 4 [expr {$waits * 4}] rate 2000
+    $sim latency -reset
+    $sim command bg_run
+    set t [timeSteps $waits {$sim waitevent send_data 1000}]
+    $sim waitevent bg_running -n 1 600000
+    update
+    set wake [dict get [$sim latency] wake send_data]
+    record waitevent [dict create waits $waits]\
+            [dict create p50_us [dict get $wake p50_us] p99_us [dict get $wake p99_us] max_us [dict get $wake max_us]\
+                     call_mean_us [dict get $t mean_us]]
+}
+
+proc ::bench::circuit {sim} {
+    # Time of "circuit" against the number of deck lines.
+    variable opts
+    set sizes [expr {[dict get $opts -quick] ? {10 100 1000} : {10 100 1000 10000}}]
+    foreach n $sizes {
+        set deck [ladderDeck $n 2]
+        set t [timeSteps [dict get $opts -repeat] {
+            $sim circuit $deck
+            $sim command remcirc
+        }]
+        record circuit [dict create lines [llength $deck]]\
+                [dict merge $t [dict create lines_per_s [expr {[llength $deck] * 1e6 / [dict get $t mean_us]}]]]
+    }
+}
+
+proc ::bench::lifecycle {lib} {
+    # Cycle time of ngspicetclbridge::new followed by destroy.
+    variable opts
+    set cycles [expr {[dict get $opts -quick] ? 5 : 20}]
+    set t [timeSteps $cycles {
+        set s [ngspicetclbridge::new $lib]
+        $s destroy
+    }]
+    record lifecycle [dict create cycles $cycles] $t
+}
+
+proc ::bench::recycle {lib} {
+    # Time of a small job (setup, run, read vectors) on a new instance destroyed afterwards, against the same job on
+    # one instance returned to its initial state with "reset" before each run.
+    variable opts
+    set cycles [expr {[dict get $opts -quick] ? 5 : 20}]
+    set fresh [timeSteps $cycles {
+        set s [ngspicetclbridge::new $lib]
+        setup $s 4 100
+        runToEnd $s
+        $s destroy
+    }]
+    set s [ngspicetclbridge::new $lib]
+    set reset {}
+    set recycled [timeSteps $cycles {
+        lappend reset [dict get [$s reset] time_us]
+        setup $s 4 100
+        runToEnd $s
+    }]
+    $s destroy
+    record recycle [dict create cycles $cycles]\
+            [dict create new_us [dict get $fresh mean_us] reset_us [dict get $recycled mean_us]\
+                     reset_only_us [expr {[tcl::mathop::+ {*}$reset] / double($cycles)}]\
+                     speedup [expr {[dict get $fresh mean_us] / [dict get $recycled mean_us]}]]
+}
+
+#** main
+
+proc ::bench::main {argv} {
+    variable opts
+    variable producer
+    variable results
+    for {set i 0} {$i < [llength $argv]} {incr i} {
+        set key [lindex $argv $i]
+        if {$key eq {-quick}} {
+            dict set opts -quick 1
+        } elseif {![dict exists $opts $key]} {
+            return -code error "unknown option: $key (expected -lib, -output, -repeat, -quick, -only or -load)"
+        } elseif {$i + 1 == [llength $argv]} {
+            return -code error "missing value for option $key"
+        } else {
+            dict set opts $key [lindex $argv [incr i]]
+        }
+    }
+    uplevel #0 [dict get $opts -load]
+    package require ngspicetclbridge
+    set lib [dict get $opts -lib]
+    set sim [ngspicetclbridge::new $lib]
+    set probe [dict get [$sim command -capture mock] output]
+    set producer [expr {[string match {stdout mock vectors *} [lindex $probe 0]] ? "mock" : "ngspice"}]
+    foreach name [dict get $opts -only] {
+        switch -- $name {
+            ingest - asyncvector - waitevent - circuit {
+                $name $sim
+            }
+            lifecycle - recycle {
+                $sim destroy
+                $name $lib
+                set sim [ngspicetclbridge::new $lib]
+            }
+            default {
+                return -code error "unknown benchmark: $name (expected ingest, asyncvector, waitevent, circuit,\
+                        lifecycle or recycle)"
+            }
+        }
+    }
+    $sim destroy
+    set meta [jsonObject [list package [jsonString [package provide ngspicetclbridge]]\
+                                  tcl [jsonString [info patchlevel]] producer [jsonString $producer]\
+                                  lib [jsonString $lib] host [jsonString [info hostname]]\
+                                  platform [jsonString "$::tcl_platform(os) $::tcl_platform(machine)"]\
+                                  date [jsonString [clock format [clock seconds] -format %Y-%m-%dT%H:%M:%SZ -gmt 1]]\
+                                  repeat [dict get $opts -repeat] quick [dict get $opts -quick]]]
+    set json "\{\"meta\": $meta,\n \"results\": \[\n  [join $results ",\n  "]\n \]\}\n"
+    if {[dict get $opts -output] eq {}} {
+        puts -nonewline $json
+    } else {
+        set fh [open [dict get $opts -output] w]
+        puts -nonewline $fh $json
+        close $fh
+    }
+}
+
+# stress.tcl sources this file for its JSON helpers
+if {[file normalize [info script]] eq [file normalize $::argv0]} {
+    ::bench::main $argv
+}
@@ -0,0 +1,322 @@
+# stress.tcl --
+#
+# Concurrency stress harness of the bridge. The mock library sends rows from its background thread and stdout and
+# status lines from extra threads ("mock threads N"), helper threads attached with ngspicetclbridge::attach wait and
+# abort, and the Tcl thread issues command, vectors, waitevent, abort and destroy in a random order, for a fixed time,
+# and switches trace and record on and off and replays the latest recording while the callbacks are running.
+# Throughput and latency percentiles of every operation are written as JSON, in the format of bench.tcl; the exit
+# status is 1 when an operation failed; the refusals listed in ::stress::expected are not failures. The recordings are
+# written to the current directory and deleted at the end.
+#
+# Meant to be run under ThreadSanitizer as well ("make stress-tsan"), so it only needs the mock library.
+#
+#   tclsh stress.tcl ?-lib path? ?-duration s? ?-threads N? ?-waiters N? ?-rate R? ?-seed N? ?-output file?
+#                    ?-load script?
+#
+#   -lib path      mock library given to ngspicetclbridge::new (default libngspicemock in the current directory)
+#   -duration s    length of the run in seconds (default 10)
+#   -threads N     extra mock threads sending lines during a run (default 4)
+#   -waiters N     helper threads waiting and aborting through attach (default 2)
+#   -rate R        rows per second of the mock runs, 0 for as fast as possible (default 0)
+#   -seed N        seed of the operation sequence (default 1)
+#   -output file   JSON output file (default stdout)
+#   -load script   script evaluated before "package require ngspicetclbridge", in every thread
+
+package require Thread
+source [file join [file dirname [info script]] bench.tcl]
+
+namespace eval ::stress {
+    variable opts [dict create -lib [file join [pwd] libngspicemock[info sharedlibextension]] -duration 10\
+                           -threads 4 -waiters 2 -rate 0 -seed 1 -output {} -load {}]
+    # operations of the Tcl thread and their relative weights
+    variable weights {run 4 halt 2 command 6 vectors 6 waitevent 8 abort 2 update 8 trace 1 record 1 replay 1 destroy 1}
+    # errors that are the documented answer to an operation issued at the wrong time
+    variable expected {{replay already in progress} {simulation is running, replay needs an idle instance}
+        {callback replay in progress, command * is refused}}
+    # file being recorded and the latest complete recording, replayed by the replay operation
+    variable recFile [file join [pwd] stress-[pid].rec]
+    variable replayFile [file join [pwd] stress-[pid]-replay.rec]
+    variable lat {}
+    variable errors {}
+    variable rows 0
+    variable runs 0
+    variable lastRun 0
+}
+
+#** helpers
+
+proc ::stress::percentiles {times} {
+    # Returns the dict {p50_us p99_us p999_us max_us} of a list of durations, empty values for an empty list.
+    if {[llength $times] == 0} {
+        return [dict create p50_us {} p99_us {} p999_us {} max_us {}]
+    }
+    set sorted [lsort -integer $times]
+    set n [llength $sorted]
+    set result {}
+    foreach {key q} {p50_us 0.5 p99_us 0.99 p999_us 0.999} {
+        dict set result $key [lindex $sorted [expr {min($n - 1, int($q * $n))}]]
+    }
+    dict set result max_us [lindex $sorted end]
+    return $result
+}
+
+proc ::stress::isExpected {message} {
+    # Returns 1 if message is one of the expected refusals.
+    variable expected
+    foreach pattern $expected {
+        if {[string match $pattern $message]} {
+            return 1
+        }
+    }
+    return 0
+}
+
+proc ::stress::pick {} {
+    # Returns a random operation according to weights.
+    variable weights
+    set r [expr {rand() * [tcl::mathop::+ {*}[dict values $weights]]}]
+    dict for {op w} $weights {
+        if {[set r [expr {$r - $w}]] < 0} {
+            return $op
+        }
+    }
+    return $op
+}
+
+proc ::stress::countRows {sim all} {
+    # Adds the rows of the runs finished since the last call (of all runs, finished or not, if all is 1).
+    variable rows
+    variable runs
+    variable lastRun
+    foreach info [$sim runinfo -all] {
+        if {([dict get $info run] > $lastRun) && ($all || ![dict get $info running])} {
+            incr rows [dict get $info rows]
+            incr runs
+            set lastRun [dict get $info run]
+        }
+    }
+}
+
+proc ::stress::create {} {
+    # Creates an instance configured for the stress run and publishes it to the helper threads.
+    variable opts
+    variable lastRun
+    set sim [ngspicetclbridge::new [dict get $opts -lib]]
+    foreach {key value} [list rows 20000 vectors 8 rate [dict get $opts -rate] burst 64 chars 100 stat 50\
+                                 threads [dict get $opts -threads] noise 20000] {
+        $sim command [list mock $key $value]
+    }
+    set lastRun 0
+    tsv::set stress instance $sim
+    return $sim
+}
+
+#** helper threads
+
+# body of the helper threads: waits on random events through an attached command, sometimes aborts, until stopped;
+# returns {waits times aborts errors}
+set ::stress::helper {
+    proc loop {seed} {
+        expr {srand($seed)}
+        set name {}
+        set times {}
+        set aborts 0
+        set errors {}
+        while {![tsv::get stress stop]} {
+            set cur [tsv::get stress instance]
+            if {$cur ne $name} {
+                catch {::w detach}
+                if {[catch {ngspicetclbridge::attach $cur ::w}]} {
+                    continue
+                }
+                set name $cur
+            }
+            if {rand() < 0.1} {
+                set code [catch {::w abort} result]
+                incr aborts
+            } else {
+                set event [lindex {send_data send_char send_stat bg_running} [expr {int(rand() * 4)}]]
+                set t0 [clock microseconds]
+                set code [catch {::w waitevent $event [expr {1 + int(rand() * 20)}]} result]
+                lappend times [expr {[clock microseconds] - $t0}]
+            }
+            if {$code && ![string match {*does not exist*} $result]} {
+                lappend errors $result
+            }
+        }
+        catch {::w detach}
+        return [list [llength $times] $times $aborts $errors]
+    }
+}
+
+proc ::stress::startHelpers {} {
+    # Starts the helper threads; returns their ids.
+    variable opts
+    variable helper
+    set tids {}
+    for {set i 0} {$i < [dict get $opts -waiters]} {incr i} {
+        set tid [thread::create [list apply {{load helper} {
+            uplevel #0 $load
+            package require ngspicetclbridge
+            uplevel #0 $helper
+            thread::wait
+        }} [dict get $opts -load] $helper]]
+        thread::send -async $tid [list loop [expr {[dict get $opts -seed] + $i + 1}]] ::stress::helperResult($tid)
+        lappend tids $tid
+    }
+    return $tids
+}
+
+#** main
+
+proc ::stress::main {argv} {
+    variable opts
+    variable lat
+    variable errors
+    variable rows
+    variable runs
+    variable helperResult
+    for {set i 0} {$i < [llength $argv]} {incr i} {
+        set key [lindex $argv $i]
+        if {![dict exists $opts $key]} {
+            return -code error "unknown option: $key (expected -lib, -duration, -threads, -waiters, -rate, -seed,\
+                    -output or -load)"
+        } elseif {$i + 1 == [llength $argv]} {
+            return -code error "missing value for option $key"
+        } else {
+            dict set opts $key [lindex $argv [incr i]]
+        }
+    }
+    uplevel #0 [dict get $opts -load]
+    package require ngspicetclbridge
+    expr {srand([dict get $opts -seed])}
+    tsv::set stress stop 0
+    set sim [create]
+    set tids [startHelpers]
+    set start [clock microseconds]
+    set deadline [expr {$start + int([dict get $opts -duration] * 1e6)}]
+    while {[clock microseconds] < $deadline} {
+        set op [pick]
+        set t0 [clock microseconds]
+        switch -- $op {
+            run {
+                set code [catch {$sim command bg_run} result]
+            }
+            halt {
+                set code [catch {$sim command bg_halt} result]
+            }
+            command {
+                set code [catch {$sim command -capture {echo stress}} result]
+            }
+            vectors {
+                set code [catch {$sim vectors} result]
+            }
+            waitevent {
+                set event [lindex {send_data send_stat bg_running} [expr {int(rand() * 3)}]]
+                set code [catch {$sim waitevent $event [expr {1 + int(rand() * 20)}]} result]
+            }
+            abort {
+                set code [catch {$sim abort} result]
+            }
+            update {
+                set code [catch {update} result]
+            }
+            trace {
+                if {[dict get [$sim trace status] enabled]} {
+                    set code [catch {$sim trace stop} result]
+                } else {
+                    set code [catch {$sim trace start -capacity 4096} result]
+                }
+            }
+            record {
+                if {[dict get [$sim record status] enabled]} {
+                    set code [catch {$sim record stop} result]
+                    if {!$code} {
+                        file rename -force $::stress::recFile $::stress::replayFile
+                    }
+                } else {
+                    set code [catch {$sim record start $::stress::recFile} result]
+                }
+            }
+            replay {
+                if {[dict get [$sim replay status] active]} {
+                    set code [catch {$sim replay stop} result]
+                } elseif {[file exists $::stress::replayFile]} {
+                    set code [catch {$sim replay start $::stress::replayFile -speed 0} result]
+                } else {
+                    set code 0
+                }
+            }
+            destroy {
+                countRows $sim 1
+                set t0 [clock microseconds]
+                set code [catch {$sim destroy} result]
+            }
+        }
+        dict lappend lat $op [expr {[clock microseconds] - $t0}]
+        if {$code && ![isExpected $result]} {
+            dict lappend errors $op $result
+        }
+        if {$op eq {destroy}} {
+            set sim [create]
+        } elseif {$op in {run halt}} {
+            countRows $sim 0
+        }
+    }
+    countRows $sim 1
+    tsv::set stress stop 1
+    set waits {}
+    set aborts 0
+    foreach tid $tids {
+        if {![info exists helperResult($tid)]} {
+            vwait ::stress::helperResult($tid)
+        }
+        lassign $helperResult($tid) n times a errs
+        lappend waits {*}$times
+        incr aborts $a
+        foreach e $errs {
+            dict lappend errors attached $e
+        }
+        thread::release $tid
+    }
+    $sim destroy
+    file delete $::stress::recFile $::stress::replayFile
+    set elapsed [expr {([clock microseconds] - $start) / 1e6}]
+
+    foreach op [dict keys $::stress::weights] {
+        set times [expr {[dict exists $lat $op] ? [dict get $lat $op] : {}}]
+        ::bench::record $op [dict create count [llength $times]]\
+                [dict merge [dict create ops_per_s [expr {[llength $times] / $elapsed}]] [percentiles $times]\
+                         [dict create errors [expr {[dict exists $errors $op] ? [llength [dict get $errors $op]] : 0}]]]
+    }
+    ::bench::record attached [dict create waits [llength $waits] aborts $aborts]\
+            [dict merge [dict create waits_per_s [expr {[llength $waits] / $elapsed}]] [percentiles $waits]\
+                     [dict create errors [expr {[dict exists $errors attached] ?\
+                                                       [llength [dict get $errors attached]] : 0}]]]
+    ::bench::record ingest [dict create runs $runs rows $rows] [dict create rows_per_s [expr {$rows / $elapsed}]]
+
+    set meta [::bench::jsonObject [list package [::bench::jsonString [package provide ngspicetclbridge]]\
+                                           tcl [::bench::jsonString [info patchlevel]]\
+                                           lib [::bench::jsonString [dict get $opts -lib]]\
+                                           duration_s $elapsed threads [dict get $opts -threads]\
+                                           waiters [dict get $opts -waiters] rate [dict get $opts -rate]\
+                                           seed [dict get $opts -seed]]]
+    set json "\{\"meta\": $meta,\n \"results\": \[\n  [join $::bench::results ",\n  "]\n \]\}\n"
+    if {[dict get $opts -output] eq {}} {
+        puts -nonewline $json
+    } else {
+        set fh [open [dict get $opts -output] w]
+        puts -nonewline $fh $json
+        close $fh
+    }
+    set failed 0
+    dict for {op messages} $errors {
+        foreach message [lsort -unique $messages] {
+            puts stderr "unexpected error in $op: $message"
+        }
+        incr failed [llength $messages]
+    }
+    return [expr {$failed > 0}]
+}
+
+exit [::stress::main $argv]
@@ -4,6 +4,10 @@
 static int g_disable_dlclose = 0;
 static int g_heap_poisoned = 0;
 
+/* instances reachable from other threads with "attach", guarded by g_reg_mu */
+static Tcl_Mutex g_reg_mu;
+static RegEntry *g_reg_head = NULL;
+
 /* void PrintRefCount(Tcl_Obj *objPtr) { */
 /*     if (objPtr) { */
 /*         fprintf(stderr, "refCount = %d\n", objPtr->refCount); */
@@ -14,1970 +18,13382 @@ static int g_heap_poisoned = 0;
 /*     } */
 /* } */
 
-//** small helpers
-//***  ckstrdup function
+//** telemetry
+static const char *EvtIdToName(int id);
+//***  Stats_Now function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * ckstrdup --
+ * Stats_Now --
  *
- *      Allocate a copy of a NUL-terminated C string using Tcl's memory allocator.
+ *      Current time in microseconds, used for the hot-path telemetry reported by "stats".
  *
  * Parameters:
- *      const char *s               - input: pointer to a valid NUL-terminated string to duplicate
+ *      None.
  *
  * Results:
- *      Returns a pointer to a newly allocated string buffer containing an exact copy of the input string,
- *      including the terminating NUL character. The returned pointer must be freed using Tcl_Free().
+ *      Microseconds since the epoch (Tcl_GetTime()).
  *
  * Side Effects:
- *      Allocates memory from Tcl's memory subsystem via Tcl_Alloc().
- *      The allocation size is strlen(s) + 1 bytes.
- *      The contents are copied with memcpy(), so the source string must remain valid for the duration
- *      of the copy operation.
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static char *ckstrdup(const char *s) {
-    size_t len = strlen(s) + (size_t)1;
-    /* cppcheck-suppress misra-c2012-11.5 */
-    return memcpy(Tcl_Alloc(len), s, len);
-}
-
-static char **splitStringByNewline(const char *text, Tcl_Size *nlines) {
-    char **lines = NULL;
-    Tcl_Size cap = 0;
-    Tcl_Size count = 0;
-    Tcl_Size len_text = strlen(text);
-    Tcl_Size start = 0;
-    Tcl_Size i = 0;
-    while (i < len_text) {
-        if ((text[i] == '\n') || (text[i] == '\r')) {
-            Tcl_Size len = i - start;
-            if (count == cap) {
-                cap = cap ? (cap * 2) : 4;
-                char **tmp = Tcl_AttemptRealloc(lines, (size_t)cap * sizeof(char *));
-                if (tmp == NULL) {
-                    for (Tcl_Size k = 0; k < count; k++) {
-                        Tcl_Free(lines[k]);
-                    }
-                    Tcl_Free(lines);
-                    *nlines = 0;
-                    return NULL;
-                }
-                lines = tmp;
-            }
-            lines[count] = Tcl_AttemptAlloc(len + 1);
-            if (lines[count] == NULL) {
-                for (Tcl_Size k = 0; k < count; k++) {
-                    Tcl_Free(lines[k]);
-                }
-                Tcl_Free(lines);
-                *nlines = 0;
-                return NULL;
-            }
-            /* cppcheck-suppress misra-c2012-17.7 */
-            memcpy(lines[count], &text[start], len);
-            lines[count][len] = '\0';
-            count++;
-            // Handle CRLF: if we saw '\r' and next char is '\n', skip it
-            if ((text[i] == '\r') && ((i + 1) < len_text) && (text[i + 1] == '\n')) {
-                i++;
-            }
-            i++;
-            start = i;
-        } else {
-            i++;
-        }
-    }
-    // Last line (after the final newline, or whole text if no newline)
-    // This also adds an empty last line if the text ended with a newline.
-    if (start <= len_text) {
-        Tcl_Size len = len_text - start;
-        if (count == cap) {
-            cap = cap ? (cap * 2) : 4;
-            char **tmp = Tcl_AttemptRealloc(lines, (size_t)cap * sizeof(char *));
-            if (tmp == NULL) {
-                for (Tcl_Size k = 0; k < count; k++) {
-                    Tcl_Free(lines[k]);
-                }
-                Tcl_Free(lines);
-                *nlines = 0;
-                return NULL;
-            }
-            lines = tmp;
-        }
-        lines[count] = Tcl_AttemptAlloc(len + 1);
-        if (lines[count] == NULL) {
-            for (Tcl_Size k = 0; k < count; k++) {
-                Tcl_Free(lines[k]);
-            }
-            Tcl_Free(lines);
-            *nlines = 0;
-            return NULL;
-        }
-        /* cppcheck-suppress misra-c2012-17.7 */
-        memcpy(lines[count], &text[start], len);
-        lines[count][len] = '\0';
-        count++;
-    }
-    *nlines = count;
-    return lines;
+static inline Tcl_WideInt Stats_Now(void) {
+    Tcl_Time t;
+    Tcl_GetTime(&t);
+    return ((Tcl_WideInt)t.sec * 1000000) + (Tcl_WideInt)t.usec;
 }
-//***  NameToEvtId function
+//***  Flag_Load function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * NameToEvtId --
+ * Flag_Load --
  *
- *      Map a Tcl string object containing an event name to its corresponding internal event identifier constant.
+ *      Reads an on/off flag that the Tcl thread switches under a lock while the callback threads test it without
+ *      that lock, to skip the lock when the feature is off. The load is atomic and relaxed: a callback may see a
+ *      switch a little late, so it rechecks the guarded state under the lock before using it.
  *
  * Parameters:
- *      Tcl_Obj *obj                - input: Tcl object whose string value specifies the event name
- *      int *idOut                  - output: pointer to an integer to receive the matched event ID
+ *      const int *flag              - input: flag to read
  *
  * Results:
- *      Returns TCL_OK if the event name matches one of the known entries in the internal name–ID mapping table,
- *      and stores the corresponding ID in *idOut.
- *      Returns TCL_ERROR if the string does not match any known event name.
+ *      Current value of the flag.
  *
  * Side Effects:
  *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static int NameToEvtId(Tcl_Obj *obj, int *idOut) {
-    const char *s = Tcl_GetString(obj);
-    struct {
-        const char *n;
-        int id;
-    } map[] = {
-        {"send_char", SEND_CHAR}, {"send_stat", SEND_STAT},           {"controlled_exit", CONTROLLED_EXIT},
-        {"send_data", SEND_DATA}, {"send_init_data", SEND_INIT_DATA}, {"bg_running", BG_THREAD_RUNNING},
-    };
-    for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
-        if (strcmp(s, map[i].n) == 0) {
-            *idOut = map[i].id;
-            return TCL_OK;
-        }
-    }
-    return TCL_ERROR;
+static inline int Flag_Load(const int *flag) {
+    return __atomic_load_n(flag, __ATOMIC_RELAXED);
 }
-//***  BumpAndSignal function
+//***  Flag_Store function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * BumpAndSignal --
+ * Flag_Store --
  *
- *      Atomically increment the specified event counter and signal any threads waiting on the
- *      associated condition variable.
+ *      Switches a flag read with Flag_Load(). The store is atomic with release ordering, so a callback that sees
+ *      the new value also sees the state set up before it.
  *
  * Parameters:
- *      NgSpiceContext *ctx          - input/output: pointer to the ngspice context containing the mutex,
- *                                      event counters, and condition variable
- *      int which                    - input: index into ctx->evt_counts[] identifying the event counter to increment
+ *      int *flag                    - output: flag to set
+ *      int value                    - input: new value
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      Increments the selected event counter by 1 (monotonically).
- *      Acquires and releases ctx->mutex around the update and signal.
- *      Calls Tcl_ConditionNotify() to wake all threads waiting on ctx->cond.
+ *      Updates *flag.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static inline void BumpAndSignal(NgSpiceContext *ctx, int which) {
-    Tcl_MutexLock(&ctx->mutex);
-    ctx->evt_counts[which]++;
-    Tcl_ConditionNotify(&ctx->cond);
-    Tcl_MutexUnlock(&ctx->mutex);
+static inline void Flag_Store(int *flag, int value) {
+    __atomic_store_n(flag, value, __ATOMIC_RELEASE);
 }
-//***  wait_for function
+//***  Trace_Add function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * wait_for --
- *
- *      Wait for a specific event counter in an NgSpiceContext to reach a target value, with optional timeout
- *      and abort handling. This function blocks until one of the following occurs:
- *
- *          - The specified event counter increases by at least `need` increments since the start of the wait
- *          - The context is marked for destruction (abort condition)
- *          - The timeout period expires
+ * Trace_Add --
  *
- *      This allows waiting for multiple occurrences of a given event after the call to waitevent from Tcl.
- *      For example, with need = 3, the function will return only after three new events of the requested
- *      type have been registered since the call began.
+ *      Adds a record to the trace ring of the instance if tracing is enabled ("trace start"). When the ring is full
+ *      the oldest record is overwritten. Costs one unlocked flag test while tracing is disabled.
  *
  * Parameters:
- *      NgSpiceContext *ctx   - input/output: pointer to the ngspice context containing the mutex,
- *                               event counters, and condition variable.
- *      int which             - input: index into ctx->evt_counts[] identifying the event to monitor.
- *      uint64_t need         - input: number of new events required before returning (minimum 1).
- *      long timeout_ms       - input: timeout in milliseconds; 0 or negative means wait indefinitely.
- *      int *reached_out      - output (optional): set to nonzero if the target count was reached
- *                               (i.e., the event fired `need` times) during the wait.
- *      uint64_t *count_out   - output (optional): set to the current cumulative total count for this
- *                               event when the wait terminates (since instance creation).
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      const char *cat              - input: static category name
+ *      const char *name             - input: record name, copied and truncated to TRACE_NAMELEN-1 characters
+ *      Tcl_WideInt start            - input: Stats_Now() at the start of the span or at the instant
+ *      Tcl_WideInt dur              - input: duration of a span in microseconds, -1 for an instant
+ *      Tcl_WideInt arg              - input: numeric argument shown in the trace viewer
  *
  * Results:
- *      Returns one of:
- *          NGSPICE_WAIT_OK       - target count reached during the wait
- *          NGSPICE_WAIT_TIMEOUT  - timeout expired before target reached
- *          NGSPICE_WAIT_ABORTED  - context was marked for destruction before target reached
+ *      None.
  *
  * Side Effects:
- *      Locks and unlocks ctx->mutex around counter checks and condition waits.
- *      May sleep in slices (25 ms by default) for finite timeouts, polling the counter between sleeps.
- *      For indefinite waits, uses Tcl_ConditionWait() to block until signaled or aborted.
- *
- * Notes:
- *      - The function checks event deltas relative to the counter value observed at entry time.
- *      - If multiple Tcl threads share a context, only one should call this function at a time.
- *      - The returned count is always cumulative; use `eventcounts -clear` in Tcl to zero counters
- *        if you prefer delta-based semantics between independent tests.
+ *      Updates ctx->trace under ctx->trace_mu.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static wait_rc wait_for(NgSpiceContext *ctx, int which, uint64_t need, long timeout_ms, int *reached_out,
-                        uint64_t *count_out) {
-    uint64_t needLoc;
-    if (need == (uint64_t)0) {
-        needLoc = 1;
-    } else {
-        needLoc = need;
-    }
-    const int slice_ms = 25;
-    Tcl_MutexLock(&ctx->mutex);
-    uint64_t start = ctx->evt_counts[which];
-    uint64_t target = start + needLoc;
-    if (ctx->evt_counts[which] >= target) {
-        uint64_t cnt = ctx->evt_counts[which];
-        Tcl_MutexUnlock(&ctx->mutex);
-        if (reached_out != NULL) {
-            *reached_out = 1;
-        }
-        if (count_out != NULL) {
-            *count_out = cnt;
-        }
-        return NGSPICE_WAIT_OK;
+static void Trace_Add(NgSpiceContext *ctx, const char *cat, const char *name, Tcl_WideInt start, Tcl_WideInt dur,
+                      Tcl_WideInt arg) {
+    if (Flag_Load(&ctx->trace.enabled) == 0) {
+        return;
     }
-    if (timeout_ms <= 0) {
-        while (!ctx->destroying && !ctx->aborting && (ctx->evt_counts[which] < target)) {
-            Tcl_ConditionWait(&ctx->cond, &ctx->mutex, NULL);
+    Tcl_MutexLock(&ctx->trace_mu);
+    TraceRing *tr = &ctx->trace;
+    if (tr->enabled == 1) {
+        size_t slot;
+        if (tr->count == tr->cap) {
+            slot = tr->head;
+            tr->head = (tr->head + 1U) % tr->cap;
+            tr->dropped++;
+        } else {
+            slot = (tr->head + tr->count) % tr->cap;
+            tr->count++;
         }
-    } else {
-        long remaining = timeout_ms;
-        while (!ctx->destroying && (ctx->evt_counts[which] < target) && (remaining > 0)) {
-            Tcl_MutexUnlock(&ctx->mutex);
-            int step = (remaining < slice_ms) ? (int)remaining : slice_ms;
-            Tcl_Sleep(step);
-            remaining -= step;
-            Tcl_MutexLock(&ctx->mutex);
-        }
-    }
-    int reached = (ctx->evt_counts[which] >= target) ? 1 : 0;
-    uint64_t cnt = ctx->evt_counts[which];
-    int aborted = (ctx->destroying || ctx->aborting) ? 1 : 0;
-    Tcl_MutexUnlock(&ctx->mutex);
-    if (reached_out != NULL) {
-        *reached_out = reached;
-    }
-    if (count_out != NULL) {
-        *count_out = cnt;
-    }
-    if (aborted == 1) {
-        return NGSPICE_WAIT_ABORTED;
+        TraceRec *r = &tr->recs[slot];
+        r->ts = start - tr->t0;
+        r->dur = (dur < 0) ? -1 : dur;
+        r->tid = Tcl_GetCurrentThread();
+        r->cat = cat;
+        (void)snprintf(r->name, sizeof r->name, "%s", name);
+        r->arg = arg;
     }
-    if (!reached && (timeout_ms > 0)) {
-        return NGSPICE_WAIT_TIMEOUT;
-    }
-    return NGSPICE_WAIT_OK;
+    Tcl_MutexUnlock(&ctx->trace_mu);
 }
-
-//** DataBuf helpers
-//***  DataBuf_Init function
+//***  Trace_Span function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * DataBuf_Init --
+ * Trace_Span --
  *
- *      Initialize a DataBuf structure to an empty state.
+ *      Adds a span that started at t0 and ends now (see Trace_Add).
  *
  * Parameters:
- *      DataBuf *b                   - output: pointer to the DataBuf structure to initialize
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      const char *cat              - input: static category name
+ *      const char *name             - input: span name
+ *      Tcl_WideInt t0               - input: Stats_Now() at the start of the span
+ *      Tcl_WideInt arg              - input: numeric argument
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      Sets b->rows to NULL, b->count to 0, and b->cap to 0.
- *      Does not allocate any memory; the buffer remains empty until explicitly grown.
+ *      See Trace_Add().
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void DataBuf_Init(DataBuf *b) {
-    b->rows = NULL;
-    b->count = 0;
-    b->cap = 0;
+static inline void Trace_Span(NgSpiceContext *ctx, const char *cat, const char *name, Tcl_WideInt t0,
+                              Tcl_WideInt arg) {
+    if (Flag_Load(&ctx->trace.enabled) == 1) {
+        Trace_Add(ctx, cat, name, t0, Stats_Now() - t0, arg);
+    }
 }
-//***  FreeDataRow function
+//***  Trace_Instant function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * FreeDataRow --
+ * Trace_Instant --
  *
- *      Release all memory associated with a single DataRow, including vector names and the vector array itself.
+ *      Adds an instant record stamped now (see Trace_Add).
  *
  * Parameters:
- *      DataRow *r                   - input: pointer to the DataRow to free; may be NULL
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      const char *cat              - input: static category name
+ *      const char *name             - input: record name
+ *      Tcl_WideInt arg              - input: numeric argument
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      If r is not NULL:
- *          - Iterates over r->vecs[0..veccount-1], freeing each vecs[i].name with Tcl_Free().
- *          - Frees the vecs array itself with Tcl_Free().
- *      The DataRow structure pointed to by r is not freed; caller retains ownership.
+ *      See Trace_Add().
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void FreeDataRow(DataRow *r) {
-    if (!r) {
-        return;
-    }
-    for (int i = 0; i < r->veccount; i++) {
-        Tcl_Free(r->vecs[i].name);
+static inline void Trace_Instant(NgSpiceContext *ctx, const char *cat, const char *name, Tcl_WideInt arg) {
+    if (Flag_Load(&ctx->trace.enabled) == 1) {
+        Trace_Add(ctx, cat, name, Stats_Now(), -1, arg);
     }
-    Tcl_Free(r->vecs);
 }
-//***  DataBuf_Free function
+/* names of the NgState values, as recorded by State_Set */
+static const char *const stateNames[] = {"idle", "starting_bg", "bg_active", "stopping_bg", "dead"};
+//***  State_Set function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * DataBuf_Free --
+ * State_Set --
  *
- *      Release all memory associated with a DataBuf structure, including all contained DataRow entries.
+ *      Changes the high-level simulator state and records the transition in the trace ring. Must be called with
+ *      ctx->bg_mu held.
  *
  * Parameters:
- *      DataBuf *b                     - input/output: pointer to the DataBuf structure to free
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      NgState st                   - input: new state
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      - Calls FreeDataRow() for each row in the buffer to release vector name strings and associated data.
- *      - Frees the underlying row array.
- *      - Resets the structure fields (rows pointer to NULL, count and capacity to 0).
+ *      Sets ctx->state; adds a "state" instant (see Trace_Add).
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void DataBuf_Free(DataBuf *b) {
-    for (size_t i = 0; i < b->count; i++) {
-        FreeDataRow(&b->rows[i]);
-    }
-    Tcl_Free(b->rows);
-    b->rows = NULL;
-    b->count = 0;
-    b->cap = 0;
+static void State_Set(NgSpiceContext *ctx, NgState st) {
+    ctx->state = st;
+    Trace_Instant(ctx, "state", stateNames[st], (Tcl_WideInt)st);
 }
-//***  DataBuf_Ensure function
+//***  Inst_Destroying function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * DataBuf_Ensure --
+ * Inst_Destroying --
  *
- *      Ensure that a DataBuf has capacity for at least a specified number of DataRow entries,
- *      expanding the buffer if necessary.
+ *      Reads ctx->destroying under ctx->exit_mu, for the ngspice callbacks, the replay thread, attached threads and
+ *      the subcommands that refuse to start work during teardown ("replay start", "reset"). ctx->exit_mu is a leaf
+ *      lock, so the caller may hold ctx->mutex or ctx->bg_mu.
  *
  * Parameters:
- *      DataBuf *b                   - input/output: pointer to the DataBuf structure to check and resize
- *      size_t need                  - input: minimum number of DataRow slots required
+ *      NgSpiceContext *ctx          - input: instance context
  *
  * Results:
- *      None.
+ *      1 once InstDeleteProc started the teardown, 0 otherwise.
  *
  * Side Effects:
- *      If b->cap is less than 'need':
- *          - Computes a new capacity as either twice the current capacity, or 64 if the current capacity is zero.
- *          - If the computed capacity is still less than 'need', sets it to 'need'.
- *          - Resizes b->rows via Tcl_Realloc() to hold the new capacity in DataRow elements.
- *          - Updates b->cap to the new capacity.
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void DataBuf_Ensure(DataBuf *b, size_t need) {
-    if (need <= b->cap) {
-        return;
-    }
-    size_t ncap = b->cap ? b->cap * (size_t)2 : (size_t)64;
-    if (ncap < need) {
-        ncap = need;
-    }
-    b->rows = (DataRow *)Tcl_Realloc(b->rows, ncap * sizeof(DataRow));
-    b->cap = ncap;
+static int Inst_Destroying(NgSpiceContext *ctx) {
+    Tcl_MutexLock(&ctx->exit_mu);
+    int destroying = ctx->destroying;
+    Tcl_MutexUnlock(&ctx->exit_mu);
+    return destroying;
 }
-//***  FreeInitSnap function
+/* names of the LockIds, as used by "stats" and the trace ring */
+static const char *const lockNames[NUM_LOCKS] = {"mutex", "bg_mu", "cmd_mu"};
+//***  Stats_Add function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * FreeInitSnap --
+ * Stats_Add --
  *
- *      Release all dynamically allocated memory associated with an InitSnap structure,
- *      including vector name strings, the vector array, and the structure itself.
+ *      Adds one sample to a TimeStat. The caller holds the lock guarding the TimeStat.
  *
  * Parameters:
- *      InitSnap *snap               - input: pointer to the InitSnap structure to free; may be NULL
+ *      TimeStat *ts                 - input/output: statistic to update
+ *      Tcl_WideInt us               - input: sample in microseconds; negative values (clock steps) count as 0
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      If snap is non-NULL:
- *          - Iterates over snap->vecs[0..veccount-1], freeing each vecs[i].name with Tcl_Free().
- *          - Frees the vecs array with Tcl_Free().
- *          - Frees the InitSnap structure itself with Tcl_Free().
+ *      Updates ts->count, ts->total and ts->max.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void FreeInitSnap(InitSnap *snap) {
-    if (!snap) {
-        return;
+static inline void Stats_Add(TimeStat *ts, Tcl_WideInt us) {
+    uint64_t v = (us > 0) ? (uint64_t)us : 0U;
+    ts->count++;
+    ts->total += v;
+    if (v > ts->max) {
+        ts->max = v;
     }
-    for (int i = 0; i < snap->veccount; i++) {
-        Tcl_Free(snap->vecs[i].name);
-    }
-    Tcl_Free(snap->vecs);
-    Tcl_Free(snap);
 }
-
-//***  DictLappend function
+//***  Lock_Mutex function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * DictLappend --
+ * Lock_Mutex --
  *
- *      Append a list of values to an existing list stored at a given key in a Tcl dictionary.  
- *      If the key does not exist, a new list is created and inserted.
+ *      Maps a LockIds value to the mutex of the instance it describes.
  *
  * Parameters:
- *      Tcl_Interp *interp         - input: target interpreter
- *      Tcl_Obj *dictObjPtr        - input: pointer to Tcl_Obj representing the dictionary (duplicated if shared)
- *      Tcl_Obj *keyObj            - input: pointer to Tcl_Obj representing the dictionary key to update
- *      Tcl_Obj *valuesList        - input: pointer to Tcl_Obj representing the list of values to append
+ *      NgSpiceContext *ctx          - input: instance context
+ *      int which                    - input: LockIds value
  *
  * Results:
- *      Code TCL_OK - values were successfully appended or inserted
+ *      Pointer to ctx->mutex, ctx->bg_mu or ctx->cmd_mu.
  *
  * Side Effects:
- *      If `dictObjPtr` or the existing list at `keyObj` is shared, it is duplicated before modification  
- *      A new list is created if the key does not exist in the dictionary  
- *      The updated list is stored under `keyObj` in the dictionary
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static int DictLappend(Tcl_Interp *interp, Tcl_Obj *dictObjPtr, Tcl_Obj *keyObj, Tcl_Obj *valuesList) {
-    Tcl_Obj *existingList = NULL;
-    Tcl_Size listLen;
-    Tcl_Obj **elements;
-    if (Tcl_IsShared(dictObjPtr)) {
-        /* cppcheck-suppress misra-c2012-17.8 */
-        dictObjPtr = Tcl_DuplicateObj(dictObjPtr);
-    }
-    Tcl_DictObjGet(interp, dictObjPtr, keyObj, &existingList);
-    if (existingList == NULL) {
-        existingList = Tcl_NewListObj(0, NULL);
-    } else if (Tcl_IsShared(existingList)) {
-        existingList = Tcl_DuplicateObj(existingList);
-    } else {
-        /* No action required: all valid cases handled above (MISRA 15.7) */
+static inline Tcl_Mutex *Lock_Mutex(NgSpiceContext *ctx, int which) {
+    if (which == LOCK_BG_MU) {
+        return &ctx->bg_mu;
     }
-    Tcl_ListObjGetElements(interp, valuesList, &listLen, &elements);
-    for (Tcl_Size i = 0; i < listLen; i++) {
-        Tcl_ListObjAppendElement(interp, existingList, elements[i]);
+    if (which == LOCK_CMD_MU) {
+        return &ctx->cmd_mu;
     }
-    Tcl_DictObjPut(interp, dictObjPtr, keyObj, existingList);
-    return TCL_OK;
+    return &ctx->mutex;
 }
-//***  DictLappendElem function
+//***  Lock_Enter function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * DictLappend --
+ * Lock_Enter --
  *
- *      Append a value to an existing list stored at a given key in a Tcl dictionary.  
- *      If the key does not exist, a new list is created and inserted.
+ *      Locks one of the instance mutexes and records how long the caller waited for it.
  *
  * Parameters:
- *      Tcl_Interp *interp         - input: target interpreter
- *      Tcl_Obj *dictObjPtr        - input: pointer to Tcl_Obj representing the dictionary (duplicated if shared)
- *      Tcl_Obj *keyObj            - input: pointer to Tcl_Obj representing the dictionary key to update
- *      Tcl_Obj *valueObj          - input: pointer to Tcl_Obj representing the value to append
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int which                    - input: LockIds value
  *
  * Results:
- *      Code TCL_OK - values were successfully appended or inserted
+ *      None.
  *
  * Side Effects:
- *      If `dictObjPtr` or the existing list at `keyObj` is shared, it is duplicated before modification  
- *      A new list is created if the key does not exist in the dictionary  
- *      The updated list is stored under `keyObj` in the dictionary
+ *      Locks the mutex; updates ctx->stats.locks[which] (guarded by that mutex). A wait of 1 us or more is added to
+ *      the trace ring as a "lock" span.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static int DictLappendElem(Tcl_Interp *interp, Tcl_Obj *dictObjPtr, Tcl_Obj *keyObj, Tcl_Obj *valueObj) {
-    Tcl_Obj *existingList = NULL;
-    if (Tcl_IsShared(dictObjPtr)) {
-        /* cppcheck-suppress misra-c2012-17.8 */
-        dictObjPtr = Tcl_DuplicateObj(dictObjPtr);
-    }
-    Tcl_DictObjGet(interp, dictObjPtr, keyObj, &existingList);
-    if (existingList == NULL) {
-        existingList = Tcl_NewListObj(0, NULL);
-    } else if (Tcl_IsShared(existingList)) {
-        existingList = Tcl_DuplicateObj(existingList);
-    } else {
-        /* No action required: all valid cases handled above (MISRA 15.7) */
+static inline void Lock_Enter(NgSpiceContext *ctx, int which) {
+    Tcl_WideInt t0 = Stats_Now();
+    Tcl_MutexLock(Lock_Mutex(ctx, which));
+    LockStat *ls = &ctx->stats.locks[which];
+    ls->since = Stats_Now();
+    Stats_Add(&ls->wait, ls->since - t0);
+    if (ls->since > t0) {
+        Trace_Add(ctx, "lock", lockNames[which], t0, ls->since - t0, which);
     }
-    Tcl_ListObjAppendElement(interp, existingList, valueObj);
-    Tcl_DictObjPut(interp, dictObjPtr, keyObj, existingList);
-    return TCL_OK;
 }
-
-//** functions to work with message queue
-//***  MsgQ_Init function
+//***  Lock_Leave function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * MsgQ_Init --
+ * Lock_Leave --
  *
- *      Initialize a MsgQueue structure to an empty state.
+ *      Records how long one of the instance mutexes was held and unlocks it.
  *
  * Parameters:
- *      MsgQueue *q                  - output: pointer to the MsgQueue structure to initialize
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int which                    - input: LockIds value
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      Sets q->items to NULL, q->count to 0, and q->cap to 0.
- *      Does not allocate any memory; the queue remains empty until explicitly grown.
+ *      Updates ctx->stats.locks[which] and unlocks the mutex.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void MsgQ_Init(MsgQueue *q) {
-    q->items = NULL;
-    q->count = 0;
-    q->cap = 0;
+static inline void Lock_Leave(NgSpiceContext *ctx, int which) {
+    LockStat *ls = &ctx->stats.locks[which];
+    Stats_Add(&ls->hold, Stats_Now() - ls->since);
+    Tcl_MutexUnlock(Lock_Mutex(ctx, which));
 }
-//***  MsgQ_Push function
+//***  Lock_Wait function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * MsgQ_Push --
+ * Lock_Wait --
  *
- *      Append a copy of a message string to the end of a MsgQueue, expanding the queue's capacity if necessary.
+ *      Tcl_ConditionWait() on a mutex taken with Lock_Enter(). The time spent in the wait, when the mutex is
+ *      released, is not counted as hold time.
  *
  * Parameters:
- *      MsgQueue *q                  - input/output: pointer to the message queue to modify
- *      const char *s                - input: NUL-terminated string to add to the queue
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int which                    - input: LockIds value of the held mutex
+ *      Tcl_Condition *cond          - input: condition to wait on
+ *      const Tcl_Time *timeout      - input: relative timeout, NULL to wait forever
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      If q->count equals q->cap, grows the queue's storage:
- *          - New capacity is twice the current capacity, or 32 if the current capacity is zero.
- *          - Resizes q->items via Tcl_Realloc() to hold the new capacity.
- *      Allocates and stores a copy of the input string using ckstrdup().
- *      Increments q->count to reflect the added item.
+ *      Releases and re-acquires the mutex; updates ctx->stats.locks[which].
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void MsgQ_Push(MsgQueue *q, const char *s) {
-    if (q->count == q->cap) {
-        size_t ncap = q->cap ? q->cap * (size_t)2 : (size_t)32; // grow
-        char **n = (char **)Tcl_Realloc(q->items, ncap * sizeof(char *));
-        q->items = n;
-        q->cap = ncap;
-    }
-    q->items[q->count] = ckstrdup(s);
-    q->count++;
+static void Lock_Wait(NgSpiceContext *ctx, int which, Tcl_Condition *cond, const Tcl_Time *timeout) {
+    LockStat *ls = &ctx->stats.locks[which];
+    Stats_Add(&ls->hold, Stats_Now() - ls->since);
+    Tcl_ConditionWait(cond, Lock_Mutex(ctx, which), timeout);
+    ls->since = Stats_Now();
 }
-//***  MsgQ_Clear function
+//***  Stats_Callback function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * MsgQ_Clear --
+ * Stats_Callback --
  *
- *      Remove all messages from a MsgQueue and free their associated memory,
- *      leaving the queue empty but retaining its allocated capacity.
+ *      Records the time spent inside an ngspice callback.
  *
  * Parameters:
- *      MsgQueue *q                  - input/output: pointer to the message queue to clear
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int which                    - input: CallbacksIds value of the callback
+ *      Tcl_WideInt t0               - input: Stats_Now() at callback entry
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      Iterates over q->items[0..count-1], freeing each stored string with Tcl_Free().
- *      Sets q->count to 0.
- *      Does not free or shrink the q->items array; capacity remains available for reuse.
+ *      Updates ctx->stats.callbacks[which] under ctx->stats_mu; adds a "callback" span to the trace ring.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void MsgQ_Clear(MsgQueue *q) {
-    for (size_t i = 0; i < q->count; i++) {
-        Tcl_Free(q->items[i]);
-    }
-    q->count = 0;
+static void Stats_Callback(NgSpiceContext *ctx, int which, Tcl_WideInt t0) {
+    Tcl_WideInt t1 = Stats_Now();
+    Tcl_MutexLock(&ctx->stats_mu);
+    Stats_Add(&ctx->stats.callbacks[which], t1 - t0);
+    Tcl_MutexUnlock(&ctx->stats_mu);
+    Trace_Add(ctx, "callback", EvtIdToName(which), t0, t1 - t0, which);
 }
-//***  MsgQ_Free function
+//***  Stats_Queued function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * MsgQ_Free --
+ * Stats_Queued --
  *
- *      Free all resources associated with a MsgQueue, including all stored messages
- *      and the message array itself, and reset the queue to an empty state.
+ *      Tracks the number of ngspice Tcl events waiting in the event queue of the owning thread.
  *
  * Parameters:
- *      MsgQueue *q                  - input/output: pointer to the message queue to free
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int delta                    - input: +1 when an event is queued, -1 when it is processed or deleted
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      Calls MsgQ_Clear() to free all stored message strings.
- *      Frees the q->items array with Tcl_Free() and sets it to NULL.
- *      Sets q->cap to 0 and leaves q->count at 0.
+ *      Updates ctx->stats.queued and ctx->stats.queued_max under ctx->stats_mu.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void MsgQ_Free(MsgQueue *q) {
-    MsgQ_Clear(q);
-    Tcl_Free(q->items);
-    q->items = NULL;
-    q->cap = 0;
+static void Stats_Queued(NgSpiceContext *ctx, int delta) {
+    Tcl_MutexLock(&ctx->stats_mu);
+    if (delta > 0) {
+        ctx->stats.queued++;
+        if (ctx->stats.queued > ctx->stats.queued_max) {
+            ctx->stats.queued_max = ctx->stats.queued;
+        }
+    } else if (ctx->stats.queued > 0U) {
+        ctx->stats.queued--;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    Tcl_MutexUnlock(&ctx->stats_mu);
 }
-//***  QueueMsg function
+//***  Lat_Bucket function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * QueueMsg --
+ * Lat_Bucket --
  *
- *      Thread-safe helper to append a message to the NgSpiceContext's message queue.
+ *      Maps a latency to its LatHist bucket. Values below 4 us have a bucket each, above that every power of two is
+ *      split into 4 buckets, so the relative width of a bucket is at most 25%.
  *
  * Parameters:
- *      NgSpiceContext *ctx          - input/output: pointer to the ngspice context containing the target message queue
- *      const char *msg              - input: NUL-terminated string to enqueue
+ *      uint64_t us                  - input: latency in microseconds
  *
  * Results:
- *      None.
+ *      Bucket index, clamped to LAT_BUCKETS-1.
  *
  * Side Effects:
- *      Acquires ctx->mutex before modifying the queue to ensure thread safety.
- *      Calls MsgQ_Push() to add a copy of the message string to ctx->msgq.
- *      Releases ctx->mutex after the operation completes.
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void QueueMsg(NgSpiceContext *ctx, const char *msg) {
-    Tcl_MutexLock(&ctx->mutex);
-    MsgQ_Push(&ctx->msgq, msg);
-    Tcl_MutexUnlock(&ctx->mutex);
+static int Lat_Bucket(uint64_t us) {
+    if (us < 4U) {
+        return (int)us;
+    }
+    int msb = 2;
+    while ((msb < 63) && ((us >> (msb + 1)) != 0U)) {
+        msb++;
+    }
+    int idx = ((msb - 1) * 4) + (int)((us >> (msb - 2)) & 3U);
+    return (idx < LAT_BUCKETS) ? idx : (LAT_BUCKETS - 1);
 }
-
-//** events processing
-//***  NgSpiceEventProc function
+//***  Lat_Upper function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * NgSpiceEventProc --
+ * Lat_Upper --
  *
- *      Tcl event handler for processing deferred ngspice callbacks in the main interpreter thread.
- *      This procedure is invoked via Tcl's event loop when ngspice-related events are queued from background
- *      threads or asynchronous callbacks. It unpacks the event data, updates shared state in NgSpiceContext,
- *      and performs any required Tcl_Obj manipulations in a thread-safe manner. If generation of the event is not the
- *      same as the current generation, skip event processing.
+ *      Returns the largest latency that falls into a bucket (inverse of Lat_Bucket).
  *
  * Parameters:
- *      Tcl_Event *ev                - input: pointer to the queued Tcl event, castable to NgSpiceEvent
- *      int flags                    - input: bitmask of flags from Tcl's event loop (currently unused)
+ *      int idx                      - input: bucket index
  *
  * Results:
- *      Always returns 1 to indicate the event was processed and should be removed from the queue.
+ *      Upper bound of the bucket in microseconds.
  *
  * Side Effects:
- *      For SEND_INIT_DATA:
- *          - Retrieves and clears ctx->init_snap under ctx->mutex.
- *          - Resets previous generation vectorData
- *          - Builds a Tcl dictionary mapping vector names to metadata ("number" and "real").
- *          - Stores the dictionary in ctx->vectorInit, updating reference counts appropriately.
- *          - Frees the InitSnap structure.
- *
- *      For SEND_DATA:
- *          - Detaches ctx->prod into a local DataBuf under ctx->mutex, leaving ctx->prod empty.
- *          - Ensures ctx->vectorData is unshared if necessary by duplicating it.
- *          - Iterates over all DataRow entries, appending numeric or complex values into ctx->vectorData
- *            using DictLappend() or DictLappendElem().
- *          - Frees all DataRow entries and their vector name strings.
- *
- *      For all other callbacks:
- *          - No per-event processing is performed.
- *
- *      In all cases:
- *          - Calls Tcl_Release() on ctx to match a Tcl_Preserve() performed when queuing the event.
- *          - May allocate and free Tcl_Obj values.
- *          - May adjust Tcl reference counts and free dynamically allocated buffers.
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-/* cppcheck-suppress misra-c2012-2.7 - have to comply with Tcl expected interface*/
-static int NgSpiceEventProc(Tcl_Event *ev, int flags) {
-    /* cppcheck-suppress misra-c2012-11.3 - Tcl embedding pattern*/
-    NgSpiceEvent *sp = (NgSpiceEvent *)ev;
-    NgSpiceContext *ctx = sp->ctx;
-    Tcl_Interp *interp = ctx->interp;
-    Tcl_MutexLock(&ctx->mutex);
-    uint64_t curgen = ctx->gen;
-    Tcl_MutexUnlock(&ctx->mutex);
-    if (sp->gen != curgen) {
-        Tcl_Release((ClientData)ctx);
-        return 1;
-    }
-    switch ((enum CallbacksIds)sp->callbackId) {
-    case SEND_INIT_DATA: {
-        InitSnap *isnap = NULL;
-        Tcl_MutexLock(&ctx->mutex);
-        isnap = ctx->init_snap;
-        ctx->init_snap = NULL;
-        Tcl_MutexUnlock(&ctx->mutex);
-        if (isnap != NULL) {
-            Tcl_Obj *dict = Tcl_NewDictObj();
-            for (int i = 0; i < isnap->veccount; i++) {
-                Tcl_Obj *meta = Tcl_NewDictObj();
-                Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("number", -1), Tcl_NewIntObj(isnap->vecs[i].number));
-                Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("real", -1), Tcl_NewBooleanObj(isnap->vecs[i].is_real));
-                Tcl_DictObjPut(interp, dict, Tcl_NewStringObj(isnap->vecs[i].name, -1), meta);
-            }
-            Tcl_MutexLock(&ctx->mutex);
-            if (ctx->vectorInit != NULL) {
-                Tcl_DecrRefCount(ctx->vectorInit);
-            }
-            ctx->vectorInit = dict;
-            Tcl_IncrRefCount(dict);
-            Tcl_MutexUnlock(&ctx->mutex);
-            FreeInitSnap(isnap);
-        }
-        break;
-    }
-    case SEND_DATA: {
-        DataBuf take;
-        DataBuf_Init(&take);
-        /* detach producer buffer */
-        Tcl_MutexLock(&ctx->mutex);
-        take = ctx->prod;
-        ctx->prod.rows = NULL;
-        ctx->prod.count = 0;
-        ctx->prod.cap = 0;
-        if (Tcl_IsShared(ctx->vectorData)) {
-            Tcl_Obj *dup = Tcl_DuplicateObj(ctx->vectorData);
-            Tcl_IncrRefCount(dup);
-            Tcl_DecrRefCount(ctx->vectorData);
-            ctx->vectorData = dup;
-        }
-        Tcl_MutexUnlock(&ctx->mutex);
-        for (size_t r = 0; r < take.count; r++) {
-            DataRow *dr = &take.rows[r];
-            for (int i = 0; i < dr->veccount; i++) {
-                Tcl_Obj *key = Tcl_NewStringObj(dr->vecs[i].name, -1);
-                if (dr->vecs[i].is_complex == 1) {
-                    Tcl_Obj *pair = Tcl_NewListObj(0, NULL);
-                    Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(dr->vecs[i].creal));
-                    Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(dr->vecs[i].cimag));
-                    DictLappend(interp, ctx->vectorData, key, pair);
-                } else {
-                    DictLappendElem(interp, ctx->vectorData, key, Tcl_NewDoubleObj(dr->vecs[i].creal));
-                }
-            }
-            FreeDataRow(dr);
-        }
-        Tcl_Free(take.rows);
-        break;
-    }
-    default:
-        break;
+static uint64_t Lat_Upper(int idx) {
+    if (idx < 4) {
+        return (uint64_t)idx;
     }
-    Tcl_Release((ClientData)ctx);
-    return 1;
+    int msb = (idx / 4) + 1;
+    uint64_t sub = (uint64_t)(idx % 4);
+    return ((5U + sub) << (msb - 2)) - 1U;
 }
-//***  DeleteNgSpiceEventProc function
+//***  Lat_Add function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * DeleteNgSpiceEventProc --
- *
- *      Predicate/deletion callback used with Tcl_DeleteEvents() to remove all pending ngspice-related
- *      events for a specific NgSpiceContext. This is called during teardown (InstDeleteProc) to ensure
- *      that no queued NgSpiceEvent objects referencing a soon-to-be-freed context are left in the Tcl
- *      event queue.
- *
- *      The procedure is invoked by Tcl for each queued event. If the event is an NgSpiceEvent belonging
- *      to the target context, this function:
- *
- *          - Releases the context reference previously preserved when the event was queued, and
- *          - Instructs Tcl to delete the event from the queue without delivering it.
+ * Lat_Add --
  *
- *      Otherwise, it tells Tcl to leave the event alone.
+ *      Adds one latency sample to a histogram. The caller holds the lock guarding the histogram.
  *
  * Parameters:
- *      Tcl_Event *evPtr          - input: pointer to a queued Tcl event. May or may not actually be
- *                                   an NgSpiceEvent. We assume NgSpiceEvent layout only after checking.
- *
- *      ClientData cd             - input: opaque pointer passed to Tcl_DeleteEvents(), expected to be
- *                                   the NgSpiceContext * whose events we want to purge.
+ *      LatHist *h                   - input/output: histogram
+ *      Tcl_WideInt us               - input: latency in microseconds; negative values (clock steps) count as 0
  *
  * Results:
- *      Returns 1 if the event should be removed from the queue (and not processed later).
- *      Returns 0 if the event should be kept.
+ *      None.
  *
  * Side Effects:
- *      - If evPtr is an NgSpiceEvent whose e->ctx matches the provided NgSpiceContext:
- *          - Calls Tcl_Release(e->ctx) to balance the Tcl_Preserve() done when the event
- *            was queued in NgSpiceQueueEvent().
- *          - Prevents NgSpiceEventProc from ever running for that event by returning 1.
- *
- *      - For all other events (not ours, or wrong instance):
- *          - Leaves them untouched by returning 0.
- *
- *      This function is critical for safe teardown:
- *          After InstDeleteProc() marks the context as destroying, it uses
- *          Tcl_DeleteEvents(DeleteNgSpiceEventProc, ctx) so that no stale NgSpiceEvent
- *          callbacks will later run and access freed memory.
+ *      Updates the bucket, h->n and h->max.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static int DeleteNgSpiceEventProc(Tcl_Event *evPtr, ClientData cd) {
-    /* cppcheck-suppress misra-c2012-11.3 - Tcl embedding pattern*/
-    NgSpiceEvent *e = (NgSpiceEvent *)evPtr;
-    const NgSpiceContext *ctx = (NgSpiceContext *)cd;
-    if (e->header.proc != NgSpiceEventProc) {
-        return 0;
+static void Lat_Add(LatHist *h, Tcl_WideInt us) {
+    uint64_t v = (us > 0) ? (uint64_t)us : 0U;
+    h->counts[Lat_Bucket(v)]++;
+    h->n++;
+    if (v > h->max) {
+        h->max = v;
     }
-    if (e->ctx != ctx) {
-        return 0;
-    }
-    /* Balance the Tcl_Preserve(ctx) we did when queuing the event */
-    Tcl_Release((ClientData)e->ctx);
-    /* tell Tcl to delete (discard) this event */
-    return 1;
 }
-//***  NgSpiceQueueEvent function
+//***  Lat_Quantile function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * NgSpiceQueueEvent --
+ * Lat_Quantile --
  *
- *      Queue an NgSpiceEvent for processing in the Tcl event loop, preserving the NgSpiceContext
- *      until the event is handled. Events are delivered to the same thread that created the
- *      NgSpiceContext, regardless of the calling thread.
+ *      Estimates a quantile of a latency histogram as the upper bound of the bucket holding it.
  *
  * Parameters:
- *      NgSpiceContext *ctx          - input/output: pointer to the ngspice context that owns the event
- *      int callbackId               - input: identifier for the type of callback/event to be processed
- *      uint64_t gen                 - input: generation identifier of the event
+ *      const LatHist *h             - input: histogram
+ *      double q                     - input: quantile in (0, 1]
  *
  * Results:
- *      None.
+ *      Latency in microseconds, never above h->max; 0 for an empty histogram.
  *
  * Side Effects:
- *      - If ctx->destroying is nonzero, returns immediately without queuing an event.
- *      - Calls Tcl_Preserve(ctx) to keep the context alive until NgSpiceEventProc() calls Tcl_Release().
- *      - Allocates an NgSpiceEvent structure via Tcl_Alloc() and initializes its fields.
- *      - If called from the same thread as ctx->tclid, queues the event with Tcl_QueueEvent().
- *      - If called from a different thread, queues the event with Tcl_ThreadQueueEvent() and alerts
- *        the target thread with Tcl_ThreadAlert().
- *      - Event is processed by NgSpiceEventProc() when the Tcl event loop runs.
- *
- *----------------------------------------------------------------------------------------------------------------------
- */
-/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; function must match the prototype defined in Tcl C API */
-static void NgSpiceQueueEvent(NgSpiceContext *ctx, int callbackId, uint64_t gen) {
-    if (ctx->destroying == 1) {
-        return;
-    }
-    Tcl_Preserve((ClientData)ctx);
-    NgSpiceEvent *ev = Tcl_Alloc(sizeof *ev);
-    ev->header.proc = NgSpiceEventProc;
-    ev->header.nextPtr = NULL;
-    ev->ctx = ctx;
-    ev->callbackId = callbackId;
-    ev->gen = gen;
-    if (Tcl_GetCurrentThread() == ctx->tclid) {
-        Tcl_QueueEvent((Tcl_Event *)ev, TCL_QUEUE_TAIL);
-    } else {
-        Tcl_ThreadQueueEvent(ctx->tclid, (Tcl_Event *)ev, TCL_QUEUE_TAIL);
-        Tcl_ThreadAlert(ctx->tclid);
-    }
-}
-//***  QuiesceNgspice function
-/*
- *----------------------------------------------------------------------------------------------------------------------
- *
- * QuiesceNgspice --
- *
- *      Requests ngspice to halt any ongoing background simulation activity and optionally waits for confirmation.
- *      Used during context destruction or controlled shutdown to ensure ngspice stops producing callbacks
- *      before issuing further cleanup commands.
- *
- * Parameters:
- *      NgSpiceContext *ctx            - input: pointer to the NgSpiceContext structure.
- *      int wait_ms                    - input: maximum number of milliseconds to wait for background thread to stop;
- *                                        if 0 or negative, returns immediately after sending the halt command.
- *
- * Results:
  *      None.
  *
- * Side Effects:
- *      - Issues a "bg_halt" command through ctx->ngSpice_Command() to request ngspice to pause or stop background work.
- *      - If wait_ms > 0 and ctx->ngSpice_running is available:
- *          * Polls ngSpice_running() in small time slices (25 ms) up to wait_ms total.
- *          * Re-sends "bg_halt" every 200 ms if the background thread remains active.
- *      - Sleeps briefly between polling intervals to reduce CPU usage.
- *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void QuiesceNgspice(NgSpiceContext *ctx, int wait_ms) {
-    if (!ctx || !ctx->ngSpice_Command) {
-        return;
+static uint64_t Lat_Quantile(const LatHist *h, double q) {
+    if (h->n == 0U) {
+        return 0;
     }
-    if (ctx->ngSpice_running && ctx->ngSpice_running() == 1) {
-        ctx->ngSpice_Command("bg_halt");
-        if (wait_ms > 0) {
-            const int slice = 25;
-            int left = wait_ms;
-            while (left > 0) {
-                if (ctx->ngSpice_running() == 0) {
-                    break;
-                }
-                if ((left % 200) == 0) {
-                    ctx->ngSpice_Command("bg_halt");
-                }
-                Tcl_Sleep(slice);
-                left -= slice;
-            }
+    uint64_t rank = (uint64_t)ceil(q * (double)h->n);
+    uint64_t seen = 0;
+    int idx = 0;
+    while (idx < (LAT_BUCKETS - 1)) {
+        seen += h->counts[idx];
+        if (seen >= rank) {
+            break;
         }
+        idx++;
     }
+    uint64_t v = Lat_Upper(idx);
+    return (v < h->max) ? v : h->max;
 }
-//***  EnqueuePending function
+//***  Run_Active function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * EnqueuePending --
+ * Run_Active --
  *
- *      Adds a command to the pending command queue of an NgSpiceContext.
- *      Used when ngspice is in a transitional state (e.g., background thread
- *      starting or stopping) and cannot immediately process new commands.
+ *      Returns the report of the bg_run whose background thread has not ended yet. Caller holds ctx->mutex.
  *
  * Parameters:
- *      NgSpiceContext *ctx    - input: target simulator context.
- *      const char *cmd        - input: command string to queue (copied).
- *      int capture            - input: 1 if this was invoked with -capture mode, else 0.
+ *      NgSpiceContext *ctx          - input: instance context
  *
  * Results:
- *      None.
+ *      Pointer into ctx->runs, or NULL if no run was started or the latest one has ended.
  *
  * Side Effects:
- *      - Allocates a new PendingCmd node containing a strdup of cmd.
- *      - Appends the node to ctx->pending_head/tail under ctx->cmd_mu.
- *      - The queued commands will later be executed by FlushPending().
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void EnqueuePending(NgSpiceContext *ctx, const char *cmd, int capture) {
-    PendingCmd *n = Tcl_Alloc(sizeof *n);
-    n->cmd = ckstrdup(cmd);
-    n->capture = capture;
-    n->next = NULL;
-    Tcl_MutexLock(&ctx->cmd_mu);
-    if (ctx->pending_tail != NULL) {
-        ctx->pending_tail->next = n;
-    } else {
-        ctx->pending_head = n;
+static RunInfo *Run_Active(NgSpiceContext *ctx) {
+    if (ctx->run_count == 0U) {
+        return NULL;
     }
-    ctx->pending_tail = n;
-    Tcl_MutexUnlock(&ctx->cmd_mu);
+    RunInfo *r = &ctx->runs[(ctx->run_count - 1U) % (uint64_t)RUNINFO_KEEP];
+    return (r->ended == 0) ? r : NULL;
 }
-//***  FlushPending function
+//***  Run_Begin function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * FlushPending --
+ * Run_Begin --
  *
- *      Executes and clears all commands previously queued with EnqueuePending().
- *      This function is called when ngspice transitions back to a stable state
- *      (e.g., after the background thread starts or stops), allowing deferred
- *      commands to run safely.
+ *      Starts the report of a new bg_run, overwriting the oldest one when RUNINFO_KEEP reports are held. Caller holds
+ *      ctx->mutex.
  *
  * Parameters:
- *      NgSpiceContext *ctx    - input: simulator context whose pending queue will be flushed.
+ *      NgSpiceContext *ctx          - input/output: instance context
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      - Takes ctx->cmd_mu to detach the entire queue atomically.
- *      - For each PendingCmd node:
- *            * If ctx->destroying is false, calls ctx->ngSpice_Command(cmd).
- *            * Frees the command string and node.
- *      - Leaves ctx->pending_head and ctx->pending_tail NULL after flushing.
- *      - If ctx->destroying is true or ngSpice_Command is unavailable, queued
- *        commands are silently discarded.
+ *      Increments ctx->run_count and initializes its slot of ctx->runs.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void FlushPending(NgSpiceContext *ctx) {
-    Tcl_MutexLock(&ctx->cmd_mu);
-    PendingCmd *list = ctx->pending_head;
-    ctx->pending_head = NULL;
-    ctx->pending_tail = NULL;
-    Tcl_MutexUnlock(&ctx->cmd_mu);
-    PendingCmd *p = list;
-    while (p != NULL)  {
-        PendingCmd *next = p->next;
-        if (!ctx->destroying && ctx->ngSpice_Command) {
-            ctx->ngSpice_Command((char *)p->cmd);
-        }
-        Tcl_Free(p->cmd);
-        Tcl_Free(p);
-        p = next;
-    }
+static void Run_Begin(NgSpiceContext *ctx) {
+    RunInfo *r = &ctx->runs[ctx->run_count % (uint64_t)RUNINFO_KEEP];
+    memset(r, 0, sizeof *r);
+    ctx->run_count++;
+    r->run = ctx->run_count;
+    r->gen = ctx->gen;
+    r->issued = Stats_Now();
 }
-//***  MsgMaybeCaptureAndSignal function
+//***  Run_Halted function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * MsgMaybeCaptureAndSignal --
+ * Run_Halted --
  *
- *      Pushes a message into the main ngspice message queue and, if capture mode is active,
- *      also duplicates it into the capture queue. Increments the event counter for the
- *      specified event type and signals any waiters.
+ *      Records that bg_halt is about to be sent while the latest run is still active, so "runinfo" can report how
+ *      long ngspice took to stop. Later halts of the same run are ignored.
  *
  * Parameters:
- *      NgSpiceContext *ctx            - input/output: pointer to the ngspice context holding
- *                                        message queues, mutex, condition variable, and event counters.
- *      const char *msg                - input: message string to enqueue (typically from a callback).
- *      int evt                        - input: index into ctx->evt_counts[] specifying the event type to update.
- *      uint64_t *gen_out              - output (optional): set to the current generation number (ctx->gen)
- *                                        at the time the message was queued.
+ *      NgSpiceContext *ctx          - input/output: instance context
  *
  * Results:
  *      None.
  *
  * Side Effects:
- *      - Appends msg to ctx->msgq (always).
- *      - If ctx->cap_active is true, appends msg to ctx->capq as well.
- *      - Increments ctx->evt_counts[evt] and notifies ctx->cond to wake any waiters.
- *      - Returns the current generation counter through gen_out, if provided.
- *      - Thread-safe: protects all shared state with ctx->mutex.
+ *      Sets the halted time of the active report under ctx->mutex.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static inline void MsgMaybeCaptureAndSignal(NgSpiceContext *ctx, const char *msg, int evt, uint64_t *gen_out) {
-    Tcl_MutexLock(&ctx->mutex);
-    MsgQ_Push(&ctx->msgq, msg);
-    if (ctx->cap_active == 1) {
-        MsgQ_Push(&ctx->capq, msg);
-    }
-    ctx->evt_counts[evt]++;
-    Tcl_ConditionNotify(&ctx->cond);
-    if (gen_out != NULL) {
-        *gen_out = ctx->gen;
+static void Run_Halted(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    RunInfo *r = Run_Active(ctx);
+    if ((r != NULL) && (r->halted == 0)) {
+        r->halted = Stats_Now();
     }
-    Tcl_MutexUnlock(&ctx->mutex);
+    Lock_Leave(ctx, LOCK_MUTEX);
 }
-//** ngspice callbacks (instance-scoped via ctx user ptr)
-//***  SendCharCallback function
+//***  Run_Drained function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * SendCharCallback --
+ * Run_Drained --
  *
- *      ngspice callback function invoked whenever new textual output is produced on ngspice’s stdout or stderr.
- *      Captures the message, updates event counters, signals waiting threads, and queues a Tcl event
- *      for deferred processing in the main thread.
+ *      Marks the latest run drained once its background thread has ended and no row is left in ctx->prod or
+ *      ctx->pend, i.e. every row of the run is visible in ctx->vectorData. Tcl thread only.
  *
  * Parameters:
- *      char *msg                      - input: pointer to the NUL-terminated message string from ngspice.
- *      int id                         - input: identification number of the calling ngspice shared library instance
- *                                        (usually 0; can be ignored).
- *      void *user                     - input: user data pointer supplied during ngspice initialization,
- *                                        expected to be an NgSpiceContext *.
+ *      NgSpiceContext *ctx          - input/output: instance context
  *
  * Results:
- *      Always returns 0 (ignored by ngspice).
+ *      None.
  *
  * Side Effects:
- *      - If ctx is valid, msg is non-NULL, and ctx->destroying is false:
- *          - Appends msg to the main message queue (ctx->msgq), and if capture mode is active, also to ctx->capq.
- *          - Increments the SEND_CHAR event counter and signals any waiters on ctx->cond.
- *          - Queues a SEND_CHAR Tcl event (via NgSpiceQueueEvent) for main-thread processing.
- *      - Thread-safe: protects shared structures with ctx->mutex internally through MsgMaybeCaptureAndSignal().
+ *      Sets the drained time of the latest report under ctx->mutex.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-/* cppcheck-suppress constParameterCallback -- function signature cannot be changed */
-/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; same as above */
-static int SendCharCallback(char *msg, int id, void *user) {
-    NgSpiceContext *ctx = (NgSpiceContext *)user;
-    if (!ctx || !msg || ctx->destroying) {
-        return 0;
+static void Run_Drained(NgSpiceContext *ctx) {
+    if ((ctx->pend.count != 0U) || (ctx->run_count == 0U)) {
+        return;
     }
-    uint64_t mygen = 0;
-    MsgMaybeCaptureAndSignal(ctx, msg, SEND_CHAR, &mygen);
-    NgSpiceQueueEvent(ctx, SEND_CHAR, mygen);
-    return 0;
+    Lock_Enter(ctx, LOCK_MUTEX);
+    RunInfo *r = &ctx->runs[(ctx->run_count - 1U) % (uint64_t)RUNINFO_KEEP];
+    if ((r->ended != 0) && (r->drained == 0) && (ctx->prod.count == 0U)) {
+        r->drained = Stats_Now();
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
 }
-//***  SendStatCallback function
+//***  Lat_DataVisible function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * SendStatCallback --
+ * Lat_DataVisible --
  *
- *      ngspice callback function invoked whenever the simulator’s status changes
- *      (e.g., transitions such as "--ready--", "--stopped--", or "--running--").
- *      Formats the status message, records it in the message queue, updates the event
- *      counters, and queues a Tcl event for processing in the main thread.
+ *      Records the send_data dispatch latency once every queued row is visible in ctx->vectorData, measured from the
+ *      queue time of the oldest send_data event processed since the backlog was last empty. Tcl thread only.
  *
  * Parameters:
- *      char *msg                      - input: pointer to the NUL-terminated status message from ngspice.
- *      int id                         - input: identification number of the calling ngspice shared library instance.
- *      void *user                     - input: user data pointer supplied during ngspice initialization,
- *                                        expected to be an NgSpiceContext *.
+ *      NgSpiceContext *ctx          - input/output: instance context
  *
  * Results:
- *      Always returns 0 (ignored by ngspice).
+ *      None.
  *
  * Side Effects:
- *      - If ctx is valid and ctx->destroying is false:
- *          - Formats the message as: "# status[<id>]: <msg>".
- *          - Appends the formatted line to ctx->msgq via QueueMsg().
- *          - Increments the SEND_STAT event counter and signals waiters via BumpAndSignal().
- *          - Queues a SEND_STAT Tcl event via NgSpiceQueueEvent() for deferred processing.
- *      - Thread-safe: protects access to ctx->gen with ctx->mutex.
+ *      Updates ctx->stats.dispatch[SEND_DATA] and clears ctx->stats.data_since; marks the latest run drained
+ *      (Run_Drained).
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-/* cppcheck-suppress constParameterCallback -- function signature cannot be changed */
-static int SendStatCallback(char *msg, int id, void *user) {
-    NgSpiceContext *ctx = (NgSpiceContext *)user;
-    uint64_t mygen;
-    if (!ctx || ctx->destroying) {
-        return 0;
+static void Lat_DataVisible(NgSpiceContext *ctx) {
+    if ((ctx->stats.data_since != 0) && (ctx->pend.count == 0U)) {
+        Lat_Add(&ctx->stats.dispatch[SEND_DATA], Stats_Now() - ctx->stats.data_since);
+        ctx->stats.data_since = 0;
     }
-    const char *line = Tcl_GetString(Tcl_ObjPrintf("# status[%d]: %s", id, msg));
-    QueueMsg(ctx, line);
-    BumpAndSignal(ctx, SEND_STAT);
-    Tcl_MutexLock(&ctx->mutex);
-    mygen = ctx->gen;
-    Tcl_MutexUnlock(&ctx->mutex);
-    NgSpiceQueueEvent(ctx, SEND_STAT, mygen);
-    return 0;
+    Run_Drained(ctx);
 }
-//***  ControlledExitCallback function
+
+//** small helpers
+//***  ckstrdup function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * ControlledExitCallback --
+ * ckstrdup --
  *
- *      ngspice callback function invoked when ngspice requests a controlled shutdown,
- *      either due to a normal "quit" command or an internal unrecoverable error.
- *      Signals the Tcl-side logic that ngspice has exited, updates state flags,
- *      and queues a CONTROLLED_EXIT event for main-thread processing.
+ *      Allocate a copy of a NUL-terminated C string using Tcl's memory allocator.
  *
  * Parameters:
- *      int status                     - input: exit status code provided by ngspice.
- *      bool immediate                 - input: if true, ngspice requests immediate unloading of the shared library.
- *      bool exit_upon_exit            - input: if true, indicates user-requested quit; otherwise, internal ngspice
- *                                              error.
- *      int id                         - input: identification number of the ngspice shared library instance. void
- *      user                           - input: user data pointer supplied during ngspice initialization, expected
- *                                              to be anNgSpiceContext.
+ *      const char *s               - input: pointer to a valid NUL-terminated string to duplicate
  *
  * Results:
- *      Always returns 0 (ignored by ngspice).
+ *      Returns a pointer to a newly allocated string buffer containing an exact copy of the input string,
+ *      including the terminating NUL character. The returned pointer must be freed using Tcl_Free().
  *
  * Side Effects:
- *      - Marks the ngspice context as exited (ctx->exited = 1) and clears ctx->quitting.
- *      - Signals ctx->exit_cv to wake any threads waiting for ngspice termination.
- *      - Increments the CONTROLLED_EXIT event counter via BumpAndSignal().
- *      - If ctx->destroying is false:
- *          - Captures the current generation counter (ctx->gen) under ctx->mutex.
- *          - Queues a CONTROLLED_EXIT Tcl event for deferred handling in the main thread.
- *      - Ensures proper synchronization using ctx->exit_mu and ctx->mutex.
+ *      Allocates memory from Tcl's memory subsystem via Tcl_Alloc().
+ *      The allocation size is strlen(s) + 1 bytes.
+ *      The contents are copied with memcpy(), so the source string must remain valid for the duration
+ *      of the copy operation.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
-static int ControlledExitCallback(int status, bool immediate, bool exit_upon_exit, int id, void *user) {
-    NgSpiceContext *ctx = (NgSpiceContext *)user;
-    if (!ctx) {
-        return 0;
-    }
-    Tcl_MutexLock(&ctx->exit_mu);
-    ctx->exited = 1;
-    ctx->quitting = 0;
-    Tcl_ConditionNotify(&ctx->exit_cv);
-    Tcl_MutexUnlock(&ctx->exit_mu);
-    BumpAndSignal(ctx, CONTROLLED_EXIT);
-    if (!ctx->destroying) {
-        uint64_t mygen;
-        Tcl_MutexLock(&ctx->mutex);
-        mygen = ctx->gen;
-        Tcl_MutexUnlock(&ctx->mutex);
-        NgSpiceQueueEvent(ctx, CONTROLLED_EXIT, mygen);
-    }
-    return 0;
+static char *ckstrdup(const char *s) {
+    size_t len = strlen(s) + (size_t)1;
+    /* cppcheck-suppress misra-c2012-11.5 */
+    return memcpy(Tcl_Alloc(len), s, len);
 }
-//***  SendDataCallback function
-/*
- *----------------------------------------------------------------------------------------------------------------------
- *
- * SendDataCallback --
- *
- *      ngspice callback function invoked whenever new simulation data (vector values)
- *      become available during analysis. Each invocation provides one or more sets of
- *      vector values that represent the current simulation point.
- *
- * Parameters:
- *      pvecvaluesall all              - input: pointer to a structure containing the current set of vectors and values.
- *      int count                      - input: number of vector sets provided (usually 1).
- *      int id                         - input: identification number of the calling ngspice shared library instance.
- *      void *user                     - input: user data pointer supplied during ngspice initialization,
- *                                        expected to be an NgSpiceContext *.
+
+static char **splitStringByNewline(const char *text, Tcl_Size *nlines) {
+    char **lines = NULL;
+    Tcl_Size cap = 0;
+    Tcl_Size count = 0;
+    Tcl_Size len_text = strlen(text);
+    Tcl_Size start = 0;
+    Tcl_Size i = 0;
+    while (i < len_text) {
+        if ((text[i] == '\n') || (text[i] == '\r')) {
+            Tcl_Size len = i - start;
+            if (count == cap) {
+                cap = cap ? (cap * 2) : 4;
+                char **tmp = Tcl_AttemptRealloc(lines, (size_t)cap * sizeof(char *));
+                if (tmp == NULL) {
+                    for (Tcl_Size k = 0; k < count; k++) {
+                        Tcl_Free(lines[k]);
+                    }
+                    Tcl_Free(lines);
+                    *nlines = 0;
+                    return NULL;
+                }
+                lines = tmp;
+            }
+            lines[count] = Tcl_AttemptAlloc(len + 1);
+            if (lines[count] == NULL) {
+                for (Tcl_Size k = 0; k < count; k++) {
+                    Tcl_Free(lines[k]);
+                }
+                Tcl_Free(lines);
+                *nlines = 0;
+                return NULL;
+            }
+            /* cppcheck-suppress misra-c2012-17.7 */
+            memcpy(lines[count], &text[start], len);
+            lines[count][len] = '\0';
+            count++;
+            // Handle CRLF: if we saw '\r' and next char is '\n', skip it
+            if ((text[i] == '\r') && ((i + 1) < len_text) && (text[i + 1] == '\n')) {
+                i++;
+            }
+            i++;
+            start = i;
+        } else {
+            i++;
+        }
+    }
+    // Last line (after the final newline, or whole text if no newline)
+    // This also adds an empty last line if the text ended with a newline.
+    if (start <= len_text) {
+        Tcl_Size len = len_text - start;
+        if (count == cap) {
+            cap = cap ? (cap * 2) : 4;
+            char **tmp = Tcl_AttemptRealloc(lines, (size_t)cap * sizeof(char *));
+            if (tmp == NULL) {
+                for (Tcl_Size k = 0; k < count; k++) {
+                    Tcl_Free(lines[k]);
+                }
+                Tcl_Free(lines);
+                *nlines = 0;
+                return NULL;
+            }
+            lines = tmp;
+        }
+        lines[count] = Tcl_AttemptAlloc(len + 1);
+        if (lines[count] == NULL) {
+            for (Tcl_Size k = 0; k < count; k++) {
+                Tcl_Free(lines[k]);
+            }
+            Tcl_Free(lines);
+            *nlines = 0;
+            return NULL;
+        }
+        /* cppcheck-suppress misra-c2012-17.7 */
+        memcpy(lines[count], &text[start], len);
+        lines[count][len] = '\0';
+        count++;
+    }
+    *nlines = count;
+    return lines;
+}
+//***  NameToEvtId function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * NameToEvtId --
+ *
+ *      Map a Tcl string object containing an event name to its corresponding internal event identifier constant.
+ *
+ * Parameters:
+ *      Tcl_Obj *obj                - input: Tcl object whose string value specifies the event name
+ *      int *idOut                  - output: pointer to an integer to receive the matched event ID
  *
  * Results:
- *      Always returns 0 (ignored by ngspice).
+ *      Returns TCL_OK if the event name matches one of the known entries in the internal name–ID mapping table,
+ *      and stores the corresponding ID in *idOut.
+ *      Returns TCL_ERROR if the string does not match any known event name.
  *
  * Side Effects:
- *      - If ctx is valid, count > 0, and ctx->destroying is false:
- *          - Allocates a new DataRow to hold the current vector values.
- *          - Copies each vector’s metadata and values into a new array of DataCell entries.
- *          - Appends the completed DataRow to ctx->prod (the producer data buffer) under ctx->mutex protection.
- *          - Increments the SEND_DATA event counter and signals any waiting threads via BumpAndSignal().
- *          - Queues a SEND_DATA Tcl event (NgSpiceQueueEvent) for deferred main-thread processing.
- *      - Ensures thread safety with ctx->mutex around shared buffer access.
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-/* cppcheck-suppress misra-c2012-7.3 - not in my code */
-/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
-static int SendDataCallback(pvecvaluesall all, int count, int id, void *user) {
-    NgSpiceContext *ctx = (NgSpiceContext *)user;
-    uint64_t mygen;
-    if (!ctx || !all || (count <= 0) || (ctx->destroying)) {
-        return 0;
-    }
-    DataRow row;
-    row.veccount = all->veccount;
-    row.vecs = Tcl_Alloc(sizeof(DataCell) * (size_t)row.veccount);
-    for (int i = 0; i < row.veccount; i++) {
-        pvecvalues v = all->vecsa[i];
-        row.vecs[i].name = ckstrdup(v->name);
-        row.vecs[i].is_complex = v->is_complex;
-        row.vecs[i].creal = v->creal;
-        row.vecs[i].cimag = v->cimag;
+static int NameToEvtId(Tcl_Obj *obj, int *idOut) {
+    const char *s = Tcl_GetString(obj);
+    struct {
+        const char *n;
+        int id;
+    } map[] = {
+        {"send_char", SEND_CHAR}, {"send_stat", SEND_STAT},           {"controlled_exit", CONTROLLED_EXIT},
+        {"send_data", SEND_DATA}, {"send_init_data", SEND_INIT_DATA}, {"bg_running", BG_THREAD_RUNNING},
+        {"trigger", TRIGGER_FIRED},   {"memory", MEMORY_BUDGET},
+    };
+    for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+        if (strcmp(s, map[i].n) == 0) {
+            *idOut = map[i].id;
+            return TCL_OK;
+        }
     }
-    Tcl_MutexLock(&ctx->mutex);
-    mygen = ctx->gen;
-    DataBuf_Ensure(&ctx->prod, ctx->prod.count + (size_t)1);
-    ctx->prod.rows[ctx->prod.count] = row;
-    ctx->prod.count++;
-    Tcl_MutexUnlock(&ctx->mutex);
-    BumpAndSignal(ctx, SEND_DATA);
-    NgSpiceQueueEvent(ctx, SEND_DATA, mygen);
-    return 0;
+    return TCL_ERROR;
 }
-//***  SendInitDataCallback function
+//***  BumpAndSignal function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * SendInitDataCallback --
+ * BumpAndSignal --
  *
- *      ngspice callback function invoked once at the start of a simulation run,
- *      after the simulator has completed initialization and all vectors for the
- *      upcoming analysis have been defined. Captures metadata describing each vector
- *      (name, index, and type), resets the data buffer, and triggers a new generation.
+ *      Atomically increment the specified event counter and signal any threads waiting on the
+ *      associated condition variable.
  *
  * Parameters:
- *      pvecinfoall vinfo              - input: pointer to a structure containing information about all initialized
- *vectors. int id                         - input: identification number of the calling ngspice shared library instance.
- *      void *user                     - input: user data pointer supplied during ngspice initialization,
- *                                              expected to be an NgSpiceContext *.
+ *      NgSpiceContext *ctx          - input/output: pointer to the ngspice context containing the mutex,
+ *                                      event counters, and condition variable
+ *      int which                    - input: index into ctx->evt_counts[] identifying the event counter to increment
  *
  * Results:
- *      Always returns 0 (ignored by ngspice).
+ *      None.
  *
  * Side Effects:
- *      - If ctx is valid and ctx->destroying is false:
- *          - Allocates a new InitSnap structure holding vector metadata (name, number, is_real flag).
- *          - Frees any previously stored initialization snapshot (ctx->init_snap) before replacing it.
- *          - Resets ctx->prod (the producer data buffer) to prepare for new simulation data.
- *          - Increments ctx->gen (the generation counter), marking a new run boundary.
- *          - Sets ctx->new_run_pending to request a data reset in NgSpiceEventProc.
- *          - Increments the SEND_INIT_DATA event counter and signals any waiting threads via BumpAndSignal().
- *          - Queues a SEND_INIT_DATA Tcl event (NgSpiceQueueEvent) for deferred main-thread processing.
- *      - Ensures thread safety by locking ctx->mutex during all shared state updates.
+ *      Increments the selected event counter by 1 (monotonically).
+ *      Acquires and releases ctx->mutex around the update and signal.
+ *      Calls Tcl_ConditionNotify() to wake all threads waiting on ctx->cond.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
-static int SendInitDataCallback(pvecinfoall vinfo, int id, void *user) {
-    NgSpiceContext *ctx = (NgSpiceContext *)user;
-    if (!ctx || !vinfo || ctx->destroying) {
-        return 0;
-    }
-    InitSnap *snap = Tcl_Alloc(sizeof *snap);
-    snap->veccount = vinfo->veccount;
-    snap->vecs = Tcl_Alloc((size_t)snap->veccount * sizeof *snap->vecs);
-    for (int i = 0; i < snap->veccount; i++) {
-        pvecinfo vec = vinfo->vecs[i];
-        snap->vecs[i].name = ckstrdup(vec->vecname);
-        snap->vecs[i].number = vec->number;
-        snap->vecs[i].is_real = vec->is_real;
-    }
-    Tcl_MutexLock(&ctx->mutex);
-    if (ctx->init_snap != NULL) {
-        for (int i = 0; i < ctx->init_snap->veccount; i++) {
-            Tcl_Free(ctx->init_snap->vecs[i].name);
-        }
-        Tcl_Free(ctx->init_snap->vecs);
-        Tcl_Free(ctx->init_snap);
-    }
-    ctx->init_snap = snap;
-    uint64_t mygen = ctx->gen;
-    Tcl_MutexUnlock(&ctx->mutex);
-    BumpAndSignal(ctx, SEND_INIT_DATA);
-    NgSpiceQueueEvent(ctx, SEND_INIT_DATA, mygen);
-    return 0;
+static inline void BumpAndSignal(NgSpiceContext *ctx, int which) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    ctx->evt_counts[which]++;
+    ctx->stats.bumped[which] = Stats_Now();
+    Tcl_ConditionNotify(&ctx->cond);
+    Lock_Leave(ctx, LOCK_MUTEX);
 }
-//***  BGThreadRunningCallback function
+//***  Deadline_Init function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * BGThreadRunningCallback --
+ * Deadline_Init --
  *
- *      libngspice callback that fires when the background simulation thread changes state.
- *      We record whether the background thread just started or ended, update internal
- *      bookkeeping, wake any waiters, and enqueue a Tcl event for the main thread.
+ *      Computes the absolute time at which a wait of timeout_ms milliseconds starting now expires.
  *
  * Parameters:
- *      bool running   - false means the background thread has just STARTED,
- *                       true  means the background thread has just STOPPED.
- *      int id         - ngspice instance ID (unused here).
- *      void *user     - NgSpiceContext * passed at ngSpice_Init() time.
+ *      Tcl_Time *deadline           - output: absolute deadline
+ *      long timeout_ms              - input: timeout in milliseconds (positive)
  *
  * Results:
- *      Always returns 0 (ngspice ignores the return value).
+ *      None.
  *
  * Side Effects:
- *      - If ctx is NULL or ctx->destroying is already set, we return immediately.
+ *      None.
  *
- *      - Otherwise:
- *          * Take ctx->bg_mu and update ctx->bg_started / ctx->bg_ended:
- *                running == false:
- *                    - mark ctx->bg_started = 1
- *                    - if ctx->state == NGSTATE_STARTING_BG:
- *                        set ctx->state = NGSTATE_BG_ACTIVE
- *                        FlushPending(ctx)   ;# run any commands queued while starting
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Deadline_Init(Tcl_Time *deadline, long timeout_ms) {
+    Tcl_GetTime(deadline);
+    deadline->sec += timeout_ms / 1000;
+    deadline->usec += (timeout_ms % 1000) * 1000;
+    if (deadline->usec >= 1000000) {
+        deadline->usec -= 1000000;
+        deadline->sec += 1;
+    }
+}
+//***  Deadline_Remaining function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *                running == true:
- *                    - mark ctx->bg_ended = 1
- *                    - if ctx->state == NGSTATE_STOPPING_BG or NGSTATE_BG_ACTIVE:
- *                        set ctx->state = NGSTATE_IDLE
- *                        FlushPending(ctx)   ;# now safe to run deferred commands
+ * Deadline_Remaining --
  *
- *          * Signal ctx->bg_cv so threads waiting in WaitForBGStarted()/WaitForBGEnded()
- *            can make progress.
+ *      Computes the time left until an absolute deadline, in the relative form expected by Tcl_ConditionWait().
  *
- *          * Log a human-readable status line into ctx->msgq via QueueMsg(), e.g.:
- *                "# background thread running started"
- *                "# background thread running ended"
+ * Parameters:
+ *      const Tcl_Time *deadline     - input: absolute deadline from Deadline_Init()
+ *      Tcl_Time *rel                - output: remaining time (valid only when 1 is returned)
  *
- *          * Call BumpAndSignal(ctx, BG_THREAD_RUNNING) to:
- *                - increment the BG_THREAD_RUNNING counter in ctx->evt_counts[]
- *                - wake up anyone blocked in waitevent bg_running
+ * Results:
+ *      1 if the deadline is still in the future, 0 if it has passed.
  *
- *          * Snapshot ctx->gen under ctx->mutex and queue a BG_THREAD_RUNNING Tcl event
- *            (NgSpiceQueueEvent), so the main thread can service it later.
+ * Side Effects:
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
-static int BGThreadRunningCallback(bool running, int id, void *user) {
-    NgSpiceContext *ctx = (NgSpiceContext *)user;
-    uint64_t mygen;
-    if (!ctx || ctx->destroying) {
+static int Deadline_Remaining(const Tcl_Time *deadline, Tcl_Time *rel) {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    if ((now.sec > deadline->sec) || ((now.sec == deadline->sec) && (now.usec >= deadline->usec))) {
         return 0;
     }
-    Tcl_MutexLock(&ctx->bg_mu);
-    if (!running) {
-        if (!ctx->bg_started) {
-            ctx->bg_started = 1;
-            if (ctx->state == NGSTATE_STARTING_BG) {
-                ctx->state = NGSTATE_BG_ACTIVE;
-                FlushPending(ctx);
-            }
-        }
-    } else {
-        ctx->bg_ended = 1;
-        if (ctx->state == NGSTATE_STOPPING_BG) {
-            ctx->state = NGSTATE_IDLE;
-            FlushPending(ctx);
-        } else if (ctx->state == NGSTATE_BG_ACTIVE) {
-            ctx->state = NGSTATE_IDLE;
-            FlushPending(ctx);
-        } else {
-            /* No action required: all valid cases handled above (MISRA 15.7) */
-        }
+    rel->sec = deadline->sec - now.sec;
+    rel->usec = deadline->usec - now.usec;
+    if (rel->usec < 0) {
+        rel->usec += 1000000;
+        rel->sec -= 1;
     }
-    Tcl_ConditionNotify(&ctx->bg_cv);
-    Tcl_MutexUnlock(&ctx->bg_mu);
-    QueueMsg(ctx, running ? "# background thread running ended" : "# background thread running started");
-    BumpAndSignal(ctx, BG_THREAD_RUNNING);
-    Tcl_MutexLock(&ctx->mutex);
-    mygen = ctx->gen;
-    Tcl_MutexUnlock(&ctx->mutex);
-    NgSpiceQueueEvent(ctx, BG_THREAD_RUNNING, mygen);
-    return 0;
+    return 1;
 }
-//***  WaitForBGStarted function
+//***  wait_any function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * WaitForBGStarted --
+ * wait_any --
  *
- *      Waits until the ngspice background simulation thread has started, or until an optional timeout expires.
- *      Ensures that subsequent operations (e.g. event waiting or destruction) occur only after ngspice has
- *      fully initialized its background thread.
+ *      Wait until at least one of several event counters in an NgSpiceContext advances by its requested number of
+ *      increments, with optional timeout and abort handling. This function blocks until one of the following occurs:
+ *
+ *          - Any counter which[k] increases by at least need[k] since the start of the wait
+ *          - The context is aborted ("abort" subcommand) or marked for destruction
+ *          - The timeout period expires
+ *
+ *      Finite timeouts are turned into an absolute deadline and waited for with Tcl_ConditionWait(), so the caller
+ *      wakes as soon as BumpAndSignal() notifies ctx->cond instead of at the next polling slice.
+ *
+ *      Several threads may wait on the same context at once. Every waiter keeps its own targets and deadline, and
+ *      Tcl_ConditionNotify() wakes all of them, so an event cannot be consumed by another waiter: counters only grow
+ *      and each waiter compares them with the targets it computed at entry. A plain "abort" bumps ctx->abort_epoch
+ *      and ends every wait that started before it; "abort -token T" ends only the waits registered with token T.
  *
  * Parameters:
- *      NgSpiceContext *ctx            - input: pointer to the NgSpiceContext structure.
- *      int timeout_ms                 - input: maximum time to wait in milliseconds (0 or negative for infinite wait).
+ *      NgSpiceContext *ctx   - input/output: pointer to the ngspice context containing the mutex,
+ *                               event counters, and condition variable.
+ *      int nwait             - input: number of entries in which[] and need[] (minimum 1).
+ *      const int *which      - input: indices into ctx->evt_counts[] identifying the events to monitor.
+ *      const uint64_t *need  - input: number of new events required for each entry (0 is treated as 1).
+ *      long timeout_ms       - input: timeout in milliseconds; 0 or negative means wait indefinitely.
+ *      const char *token     - input (optional): abort token of this waiter, NULL if none.
+ *      int *reached_out      - output (optional): array of nwait flags, set to nonzero for every entry whose target
+ *                               was reached when the wait terminated.
+ *      uint64_t *counts_out  - output (optional): array of nwait cumulative counts observed when the wait terminated,
+ *                               relative to the last "eventcounts -clear".
  *
  * Results:
- *      None. Returns after the background thread has started or the timeout has elapsed.
+ *      Returns one of:
+ *          NGSPICE_WAIT_OK       - at least one target reached during the wait
+ *          NGSPICE_WAIT_TIMEOUT  - timeout expired before any target was reached
+ *          NGSPICE_WAIT_ABORTED  - context was aborted or marked for destruction
  *
  * Side Effects:
- *      - Polls ngSpice_running() and waits on ctx->bg_cv until ctx->bg_started is set by BGThreadRunningCallback().
- *      - If timeout_ms > 0, the wait is bounded by the specified duration.
- *      - Uses Tcl_MutexLock/Tcl_ConditionWait to safely synchronize with the callback thread.
+ *      Locks and unlocks ctx->mutex around counter checks and condition waits; links a Waiter record into
+ *      ctx->waiters for the duration of the wait. For every reached entry, records the time since the last counter
+ *      bump in ctx->stats.wake.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void WaitForBGStarted(NgSpiceContext *ctx, int timeout_ms) {
-    if (!ctx->ngSpice_running) {
-        Tcl_Sleep(10);
-        return;
+static wait_rc wait_any(NgSpiceContext *ctx, int nwait, const int *which, const uint64_t *need, long timeout_ms,
+                        const char *token, int *reached_out, uint64_t *counts_out) {
+    uint64_t target_stack[NUM_EVTS];
+    uint64_t *target = target_stack;
+    if (nwait > NUM_EVTS) {
+        target = Tcl_Alloc((size_t)nwait * sizeof(uint64_t));
     }
     Tcl_Time deadline;
-    Tcl_Time now;
-    int use_deadline = (timeout_ms > 0) ? 1 : 0;
-    if (use_deadline == 1) {
-        Tcl_GetTime(&deadline);
-        long us = (long)timeout_ms * 1000;
-        deadline.usec += us % 1000000;
-        deadline.sec += (us / 1000000) + (deadline.usec / 1000000);
-        deadline.usec %= 1000000;
+    Tcl_Time rel;
+    if (timeout_ms > 0) {
+        Deadline_Init(&deadline, timeout_ms);
     }
-    Tcl_MutexLock(&ctx->bg_mu);
-    while (!ctx->bg_started) {
-        if (ctx->ngSpice_running() == 1) {
-            ctx->bg_started = 1;
+    Waiter self;
+    self.token = token;
+    self.aborted = 0;
+    Lock_Enter(ctx, LOCK_MUTEX);
+    uint64_t epoch = ctx->abort_epoch;
+    self.next = ctx->waiters;
+    ctx->waiters = &self;
+    for (int k = 0; k < nwait; k++) {
+        target[k] = ctx->evt_counts[which[k]] + ((need[k] == (uint64_t)0) ? (uint64_t)1 : need[k]);
+    }
+    int reached = 0;
+    int timed_out = 0;
+    int aborted = 0;
+    for (;;) {
+        for (int k = 0; k < nwait; k++) {
+            if (ctx->evt_counts[which[k]] >= target[k]) {
+                reached = 1;
+            }
+        }
+        aborted = ((Inst_Destroying(ctx) == 1) || (ctx->abort_epoch != epoch) || (self.aborted == 1)) ? 1 : 0;
+        if ((reached == 1) || (aborted == 1)) {
             break;
         }
-        if (!use_deadline) {
-            Tcl_ConditionWait(&ctx->bg_cv, &ctx->bg_mu, NULL);
+        if (timeout_ms <= 0) {
+            Lock_Wait(ctx, LOCK_MUTEX, &ctx->cond, NULL);
+        } else if (Deadline_Remaining(&deadline, &rel) == 1) {
+            Lock_Wait(ctx, LOCK_MUTEX, &ctx->cond, &rel);
         } else {
-            Tcl_GetTime(&now);
-            if ((now.sec > deadline.sec) || ((now.sec == deadline.sec) && (now.usec >= deadline.usec))) {
-                break;
-            }
-            Tcl_Time rel = deadline;
-            rel.sec -= now.sec;
-            rel.usec -= now.usec;
-            if (rel.usec < 0) {
-                rel.usec += 1000000;
-                rel.sec -= 1;
-            }
-            Tcl_ConditionWait(&ctx->bg_cv, &ctx->bg_mu, &rel);
+            timed_out = 1;
+            break;
+        }
+    }
+    Tcl_WideInt now = Stats_Now();
+    for (int k = 0; k < nwait; k++) {
+        if ((ctx->evt_counts[which[k]] >= target[k]) && (ctx->stats.bumped[which[k]] != 0)) {
+            Lat_Add(&ctx->stats.wake[which[k]], now - ctx->stats.bumped[which[k]]);
+        }
+        if (reached_out != NULL) {
+            reached_out[k] = (ctx->evt_counts[which[k]] >= target[k]) ? 1 : 0;
+        }
+        if (counts_out != NULL) {
+            counts_out[k] = ctx->evt_counts[which[k]] - ctx->evt_base[which[k]];
+        }
+    }
+    for (Waiter **pp = &ctx->waiters; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == &self) {
+            *pp = self.next;
+            break;
         }
     }
-    Tcl_MutexUnlock(&ctx->bg_mu);
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (target != target_stack) {
+        Tcl_Free(target);
+    }
+    if ((reached == 0) && (aborted == 1)) {
+        return NGSPICE_WAIT_ABORTED;
+    }
+    if ((reached == 0) && (timed_out == 1)) {
+        return NGSPICE_WAIT_TIMEOUT;
+    }
+    return NGSPICE_WAIT_OK;
 }
-//***  WaitForBGEnded function
+//***  wait_for function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * WaitForBGEnded --
+ * wait_for --
  *
- *      Waits until the ngspice background simulation thread has finished running, or until an optional timeout expires.
- *      Ensures that cleanup or context destruction does not proceed while the background thread is still active.
+ *      Wait for a specific event counter in an NgSpiceContext to reach a target value, with optional timeout
+ *      and abort handling. This is wait_any() with a single entry; it returns when the counter increases by at
+ *      least `need` increments since the start of the wait, the context is aborted or destroyed, or the timeout
+ *      expires.
+ *
+ *      This allows waiting for multiple occurrences of a given event after the call to waitevent from Tcl.
+ *      For example, with need = 3, the function will return only after three new events of the requested
+ *      type have been registered since the call began.
  *
  * Parameters:
- *      NgSpiceContext *ctx            - input: pointer to the NgSpiceContext structure.
- *      int timeout_ms                 - input: maximum time to wait in milliseconds (0 or negative for infinite wait).
+ *      NgSpiceContext *ctx   - input/output: pointer to the ngspice context containing the mutex,
+ *                               event counters, and condition variable.
+ *      int which             - input: index into ctx->evt_counts[] identifying the event to monitor.
+ *      uint64_t need         - input: number of new events required before returning (minimum 1).
+ *      long timeout_ms       - input: timeout in milliseconds; 0 or negative means wait indefinitely.
+ *      const char *token     - input (optional): abort token of this waiter, NULL if none.
+ *      int *reached_out      - output (optional): set to nonzero if the target count was reached
+ *                               (i.e., the event fired `need` times) during the wait.
+ *      uint64_t *count_out   - output (optional): set to the current cumulative total count for this
+ *                               event when the wait terminates (since instance creation or the last
+ *                               "eventcounts -clear").
  *
  * Results:
- *      None. Returns after the background thread has ended or the timeout has elapsed.
+ *      Returns one of:
+ *          NGSPICE_WAIT_OK       - target count reached during the wait
+ *          NGSPICE_WAIT_TIMEOUT  - timeout expired before target reached
+ *          NGSPICE_WAIT_ABORTED  - context was aborted or marked for destruction before target reached
  *
  * Side Effects:
- *      - Polls ngSpice_running() and waits on ctx->bg_cv until ctx->bg_ended is set by BGThreadRunningCallback().
- *      - If ngSpice_running() returns 0, marks ctx->bg_ended = 1 immediately.
- *      - Uses Tcl_MutexLock/Tcl_ConditionWait to synchronize with the callback thread.
- *      - If timeout_ms > 0, the wait is bounded by the specified duration.
+ *      Locks and unlocks ctx->mutex around counter checks and condition waits (see wait_any()).
+ *
+ * Notes:
+ *      - The function checks event deltas relative to the counter value observed at entry time.
+ *      - The returned count is always cumulative; use `eventcounts -clear` in Tcl to zero counters
+ *        if you prefer delta-based semantics between independent tests.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void WaitForBGEnded(NgSpiceContext *ctx, int timeout_ms) {
-    Tcl_Time deadline;
-    Tcl_Time now;
-    int use_deadline = (timeout_ms > 0) ? 1 : 0;
-    if (use_deadline == 1) {
-        Tcl_GetTime(&deadline);
-        long us = (long)timeout_ms * 1000;
-        deadline.usec += us % 1000000;
-        deadline.sec += (us / 1000000) + (deadline.usec / 1000000);
-        deadline.usec %= 1000000;
+static wait_rc wait_for(NgSpiceContext *ctx, int which, uint64_t need, long timeout_ms, const char *token,
+                        int *reached_out, uint64_t *count_out) {
+    int reached = 0;
+    uint64_t cnt = 0;
+    wait_rc rc = wait_any(ctx, 1, &which, &need, timeout_ms, token, &reached, &cnt);
+    if (reached_out != NULL) {
+        *reached_out = reached;
     }
-    Tcl_MutexLock(&ctx->bg_mu);
-    while (!ctx->bg_ended) {
-        if (!ctx->ngSpice_running || ctx->ngSpice_running() == 0) {
-            ctx->bg_ended = 1;
-            break;
-        }
-        if (!use_deadline) {
-            Tcl_ConditionWait(&ctx->bg_cv, &ctx->bg_mu, NULL);
-        } else {
-            Tcl_GetTime(&now);
-            if ((now.sec > deadline.sec) || ((now.sec == deadline.sec) && (now.usec >= deadline.usec))) {
-                break;
-            }
-            Tcl_Time rel = deadline;
-            rel.sec -= now.sec;
-            rel.usec -= now.usec;
-            if (rel.usec < 0) {
-                rel.usec += 1000000;
-                rel.sec -= 1;
-            }
-            Tcl_ConditionWait(&ctx->bg_cv, &ctx->bg_mu, &rel);
-        }
+    if (count_out != NULL) {
+        *count_out = cnt;
     }
-    Tcl_MutexUnlock(&ctx->bg_mu);
+    return rc;
 }
 
-//** free functions
-//***  InstFreeProc function
+//** DataBuf helpers
+//***  DataBuf_Init function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * InstFreeProc --
- *
- *      Final cleanup routine for an NgSpiceContext. This is the last stage of teardown for a simulator instance. It
- *      runs asynchronously after Tcl_EventuallyFree() decides that no Tcl events in the queue still reference this
- *      context.
- *
- *      IMPORTANT: InstFreeProc must only run after ngspice is fully quiesced and will never call back into us
- *      again. InstDeleteProc is responsible for:
- *          - stopping any background simulation activity,
- *          - synchronizing with ControlledExitCallback() so ctx->exited is set,
- *          - purging all queued NgSpiceEvent records for this ctx,
- *          - marking ctx->destroying = 1 and moving ctx->state to NGSTATE_DEAD,
- *          - detaching and freeing any deferred command queue.
+ * DataBuf_Init --
  *
- *      By the time InstFreeProc executes, we assume:
- *          - no callbacks are still racing on this ctx,
- *          - no Tcl event in the system will try to access ctx,
- *          - ctx is no longer visible from Tcl,
- *          - and it is now safe to tear everything down for real.
+ *      Initialize a DataBuf structure to an empty state.
  *
  * Parameters:
- *      void *cdata            - input: pointer to the NgSpiceContext being freed.
+ *      DataBuf *b                   - output: pointer to the DataBuf structure to initialize
  *
  * Results:
  *      None.
  *
  * Side Effects:
+ *      Sets b->rows to NULL, b->count, b->cap and b->bytes to 0.
+ *      Does not allocate any memory; the buffer remains empty until explicitly grown.
  *
- *   1. Global poison guard.
- *      If g_heap_poisoned is nonzero, we assume libngspice went down in an unsafe or partially torn state earlier
- *      In that mode:
- *          - We return immediately without touching ctx.
- *          - We do NOT free any memory owned by ctx.
- *          - We do NOT attempt to dlclose() the ngspice handle.
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void DataBuf_Init(DataBuf *b) {
+    b->rows = NULL;
+    b->count = 0;
+    b->cap = 0;
+    b->bytes = 0;
+}
+//***  FreeDataRow function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *      Rationale: once the process is marked poisoned, libngspice (and anything it may have corrupted) is considered
- *      unsafe to poke. We intentionally leak ctx to avoid risking a crash in a compromised heap.
+ * FreeDataRow --
  *
- *   2. Wake any waitevent stragglers.
- *      As a last courtesy, we notify ctx->cond under ctx->mutex so any thread still stuck in [$s waitevent ...] can
- *      unblock. At this point the Tcl command is already gone, but this avoids leaving a thread permanently asleep
- *      on a dying context.
+ *      Release all memory associated with a single DataRow, including vector names and the vector array itself.
  *
- *   3. Release Tcl-managed objects.
- *      We drop our holds on refcounted Tcl objects stored in the context:
+ * Parameters:
+ *      DataRow *r                   - input: pointer to the DataRow to free; may be NULL
  *
- *          if (ctx->vectorData)  Tcl_DecrRefCount(ctx->vectorData);
- *          if (ctx->vectorInit)  Tcl_DecrRefCount(ctx->vectorInit);
+ * Results:
+ *      None.
  *
- *      After this, Tcl may free those objects if nothing else references them.
+ * Side Effects:
+ *      If r is not NULL:
+ *          - Iterates over r->vecs[0..veccount-1], freeing each vecs[i].name with Tcl_Free() unless it is a shared
+ *            derived vector name.
+ *          - Frees the vecs array itself with Tcl_Free().
+ *      The DataRow structure pointed to by r is not freed; caller retains ownership.
  *
- *   4. Free dynamic data structures owned by the context.
- *      We clean up everything we allocated for runtime data capture:
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void FreeDataRow(DataRow *r) {
+    if (!r) {
+        return;
+    }
+    for (int i = 0; i < r->veccount; i++) {
+        if (r->vecs[i].shared_name == 0) {
+            Tcl_Free(r->vecs[i].name);
+        }
+    }
+    Tcl_Free(r->vecs);
+}
+//***  DataRow_Bytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *          - MsgQ_Free(&ctx->msgq);
- *          - MsgQ_Free(&ctx->capq);
- *          - DataBuf_Free(&ctx->prod);
- *          - DataBuf_Free(&ctx->pend);
+ * DataRow_Bytes --
  *
- *      This releases any queued message strings and any buffered vector rows.
+ *      Compute the bytes allocated for a single DataRow: the cell array and the copies of the vector names (shared
+ *      derived vector names are not owned by the row).
  *
- *   5. Tear down synchronization primitives. We finalize all mutexes and condition variables associated with this
- *      context so they are no longer usable:
+ * Parameters:
+ *      const DataRow *r             - input: row
  *
- *          Tcl_ConditionFinalize(&ctx->cond);
- *          Tcl_MutexFinalize(&ctx->mutex);
+ * Results:
+ *      Number of bytes, not counting the DataRow structure itself (it lives in the DataBuf row array).
  *
- *          Tcl_ConditionFinalize(&ctx->exit_cv);
- *          Tcl_MutexFinalize(&ctx->exit_mu);
+ * Side Effects:
+ *      None.
  *
- *          Tcl_ConditionFinalize(&ctx->bg_cv);
- *          Tcl_MutexFinalize(&ctx->bg_mu);
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static size_t DataRow_Bytes(const DataRow *r) {
+    size_t n = (size_t)r->veccount * sizeof(DataCell);
+    for (int i = 0; i < r->veccount; i++) {
+        if (r->vecs[i].shared_name == 0) {
+            n += strlen(r->vecs[i].name) + 1U;
+        }
+    }
+    return n;
+}
+//***  DataBuf_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *          Tcl_MutexFinalize(&ctx->cmd_mu);
+ * DataBuf_Free --
  *
- *      After this point, no thread should attempt to lock or wait on any of these.
+ *      Release all memory associated with a DataBuf structure, including all contained DataRow entries.
  *
- *   6. Optionally unload libngspice.
- *      If ctx->handle is non-NULL, we attempt to close the dynamically loaded ngspice library handle with PDl_Close(),
- *      but ONLY if it is considered safe:
+ * Parameters:
+ *      DataBuf *b                     - input/output: pointer to the DataBuf structure to free
  *
- *          - We skip dlclose() if ctx->skip_dlclose is set on this instance, or if the
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      - Calls FreeDataRow() for each row in the buffer to release vector name strings and associated data.
+ *      - Frees the underlying row array.
+ *      - Resets the structure fields (rows pointer to NULL, count, capacity and byte count to 0).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void DataBuf_Free(DataBuf *b) {
+    for (size_t i = 0; i < b->count; i++) {
+        FreeDataRow(&b->rows[i]);
+    }
+    Tcl_Free(b->rows);
+    b->rows = NULL;
+    b->count = 0;
+    b->cap = 0;
+    b->bytes = 0;
+}
+//***  DataBuf_Ensure function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DataBuf_Ensure --
+ *
+ *      Ensure that a DataBuf has capacity for at least a specified number of DataRow entries,
+ *      expanding the buffer if necessary.
+ *
+ * Parameters:
+ *      DataBuf *b                   - input/output: pointer to the DataBuf structure to check and resize
+ *      size_t need                  - input: minimum number of DataRow slots required
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      If b->cap is less than 'need':
+ *          - Computes a new capacity as either twice the current capacity, or 64 if the current capacity is zero.
+ *          - If the computed capacity is still less than 'need', sets it to 'need'.
+ *          - Resizes b->rows via Tcl_Realloc() to hold the new capacity in DataRow elements.
+ *          - Updates b->cap to the new capacity.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void DataBuf_Ensure(DataBuf *b, size_t need) {
+    if (need <= b->cap) {
+        return;
+    }
+    size_t ncap = b->cap ? b->cap * (size_t)2 : (size_t)64;
+    if (ncap < need) {
+        ncap = need;
+    }
+    b->rows = (DataRow *)Tcl_Realloc(b->rows, ncap * sizeof(DataRow));
+    b->cap = ncap;
+}
+//***  FreeInitSnap function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * FreeInitSnap --
+ *
+ *      Release all dynamically allocated memory associated with an InitSnap structure,
+ *      including vector name strings, the vector array, and the structure itself.
+ *
+ * Parameters:
+ *      InitSnap *snap               - input: pointer to the InitSnap structure to free; may be NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      If snap is non-NULL:
+ *          - Iterates over snap->vecs[0..veccount-1], freeing each vecs[i].name with Tcl_Free().
+ *          - Frees the vecs array with Tcl_Free().
+ *          - Frees the InitSnap structure itself with Tcl_Free().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void FreeInitSnap(InitSnap *snap) {
+    if (!snap) {
+        return;
+    }
+    for (int i = 0; i < snap->veccount; i++) {
+        Tcl_Free(snap->vecs[i].name);
+    }
+    Tcl_Free(snap->vecs);
+    Tcl_Free(snap);
+}
+
+//***  DictLappend function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DictLappend --
+ *
+ *      Append a list of values to an existing list stored at a given key in a Tcl dictionary.  
+ *      If the key does not exist, a new list is created and inserted.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp         - input: target interpreter
+ *      Tcl_Obj *dictObjPtr        - input: pointer to Tcl_Obj representing the dictionary (duplicated if shared)
+ *      Tcl_Obj *keyObj            - input: pointer to Tcl_Obj representing the dictionary key to update
+ *      Tcl_Obj *valuesList        - input: pointer to Tcl_Obj representing the list of values to append
+ *
+ * Results:
+ *      Code TCL_OK - values were successfully appended or inserted
+ *
+ * Side Effects:
+ *      If `dictObjPtr` or the existing list at `keyObj` is shared, it is duplicated before modification  
+ *      A new list is created if the key does not exist in the dictionary  
+ *      The updated list is stored under `keyObj` in the dictionary
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int DictLappend(Tcl_Interp *interp, Tcl_Obj *dictObjPtr, Tcl_Obj *keyObj, Tcl_Obj *valuesList) {
+    Tcl_Obj *existingList = NULL;
+    Tcl_Size listLen;
+    Tcl_Obj **elements;
+    if (Tcl_IsShared(dictObjPtr)) {
+        /* cppcheck-suppress misra-c2012-17.8 */
+        dictObjPtr = Tcl_DuplicateObj(dictObjPtr);
+    }
+    Tcl_DictObjGet(interp, dictObjPtr, keyObj, &existingList);
+    if (existingList == NULL) {
+        existingList = Tcl_NewListObj(0, NULL);
+    } else if (Tcl_IsShared(existingList)) {
+        existingList = Tcl_DuplicateObj(existingList);
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    Tcl_ListObjGetElements(interp, valuesList, &listLen, &elements);
+    for (Tcl_Size i = 0; i < listLen; i++) {
+        Tcl_ListObjAppendElement(interp, existingList, elements[i]);
+    }
+    Tcl_DictObjPut(interp, dictObjPtr, keyObj, existingList);
+    return TCL_OK;
+}
+//***  DictLappendElem function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DictLappend --
+ *
+ *      Append a value to an existing list stored at a given key in a Tcl dictionary.  
+ *      If the key does not exist, a new list is created and inserted.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp         - input: target interpreter
+ *      Tcl_Obj *dictObjPtr        - input: pointer to Tcl_Obj representing the dictionary (duplicated if shared)
+ *      Tcl_Obj *keyObj            - input: pointer to Tcl_Obj representing the dictionary key to update
+ *      Tcl_Obj *valueObj          - input: pointer to Tcl_Obj representing the value to append
+ *
+ * Results:
+ *      Code TCL_OK - values were successfully appended or inserted
+ *
+ * Side Effects:
+ *      If `dictObjPtr` or the existing list at `keyObj` is shared, it is duplicated before modification  
+ *      A new list is created if the key does not exist in the dictionary  
+ *      The updated list is stored under `keyObj` in the dictionary
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int DictLappendElem(Tcl_Interp *interp, Tcl_Obj *dictObjPtr, Tcl_Obj *keyObj, Tcl_Obj *valueObj) {
+    Tcl_Obj *existingList = NULL;
+    if (Tcl_IsShared(dictObjPtr)) {
+        /* cppcheck-suppress misra-c2012-17.8 */
+        dictObjPtr = Tcl_DuplicateObj(dictObjPtr);
+    }
+    Tcl_DictObjGet(interp, dictObjPtr, keyObj, &existingList);
+    if (existingList == NULL) {
+        existingList = Tcl_NewListObj(0, NULL);
+    } else if (Tcl_IsShared(existingList)) {
+        existingList = Tcl_DuplicateObj(existingList);
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    Tcl_ListObjAppendElement(interp, existingList, valueObj);
+    Tcl_DictObjPut(interp, dictObjPtr, keyObj, existingList);
+    return TCL_OK;
+}
+
+//** memory accounting
+//***  Mem_BufBytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_BufBytes --
+ *
+ *      Computes the memory held by a row buffer (row slots, cells and vector name copies).
+ *
+ * Parameters:
+ *      const DataBuf *b             - input: buffer
+ *
+ * Results:
+ *      Number of bytes.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static uint64_t Mem_BufBytes(const DataBuf *b) {
+    return ((uint64_t)b->cap * sizeof(DataRow)) + (uint64_t)b->bytes;
+}
+//***  Mem_MsgBytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_MsgBytes --
+ *
+ *      Computes the memory held by a message ring (slots and line copies).
+ *
+ * Parameters:
+ *      const MsgQueue *q            - input: message ring
+ *
+ * Results:
+ *      Number of bytes.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static uint64_t Mem_MsgBytes(const MsgQueue *q) {
+    return ((uint64_t)q->cap * sizeof(char *)) + (uint64_t)q->bytes;
+}
+//***  Mem_VectorBytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_VectorBytes --
+ *
+ *      Estimates the memory held by ctx->vectorData: one Tcl_Obj and one list slot per value, and a two-element list
+ *      per value of vectors that ctx->vectorInit marks as complex. Must be called with ctx->mutex held.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: instance context
+ *
+ * Results:
+ *      Number of bytes.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static uint64_t Mem_VectorBytes(const NgSpiceContext *ctx) {
+    uint64_t bytes = 0;
+    const uint64_t per = sizeof(Tcl_Obj) + sizeof(Tcl_Obj *);
+    Tcl_DictSearch search;
+    Tcl_Obj *key;
+    Tcl_Obj *vals;
+    int done;
+    if ((ctx->vectorData == NULL) ||
+        (Tcl_DictObjFirst(NULL, ctx->vectorData, &search, &key, &vals, &done) != TCL_OK)) {
+        return 0;
+    }
+    Tcl_Obj *realKey = Tcl_NewStringObj("real", -1);
+    Tcl_IncrRefCount(realKey);
+    while (done == 0) {
+        Tcl_Size n = 0;
+        Tcl_Obj *meta = NULL;
+        Tcl_Obj *real = NULL;
+        int is_real = 1;
+        (void)Tcl_ListObjLength(NULL, vals, &n);
+        if ((ctx->vectorInit != NULL) && (Tcl_DictObjGet(NULL, ctx->vectorInit, key, &meta) == TCL_OK) &&
+            (meta != NULL) && (Tcl_DictObjGet(NULL, meta, realKey, &real) == TCL_OK) &&
+            (real != NULL)) {
+            (void)Tcl_GetBooleanFromObj(NULL, real, &is_real);
+        }
+        bytes += sizeof(Tcl_Obj) + ((uint64_t)n * per);
+        if (is_real == 0) {
+            bytes += (uint64_t)n * 2U * per;
+        }
+        Tcl_DictObjNext(&search, &key, &vals, &done);
+    }
+    Tcl_DictObjDone(&search);
+    Tcl_DecrRefCount(realKey);
+    return bytes;
+}
+//***  Mem_StrBytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_StrBytes --
+ *
+ *      Returns the bytes of a NUL-terminated copy, 0 for NULL.
+ *
+ * Parameters:
+ *      const char *s                - input: string; may be NULL
+ *
+ * Results:
+ *      strlen(s)+1 or 0.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static uint64_t Mem_StrBytes(const char *s) {
+    return (s != NULL) ? ((uint64_t)strlen(s) + 1U) : 0U;
+}
+//***  Mem_ProgBytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_ProgBytes --
+ *
+ *      Computes the memory of a compiled expression and of the per-operand index array its owner (derived vector,
+ *      trigger or capture condition) allocates next to it.
+ *
+ * Parameters:
+ *      const XProg *prog            - input: program; may be NULL
+ *
+ * Results:
+ *      Number of bytes.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static uint64_t Mem_ProgBytes(const XProg *prog) {
+    if (prog == NULL) {
+        return 0;
+    }
+    uint64_t bytes = sizeof(XProg) + ((uint64_t)prog->ncode * sizeof(XInstr)) +
+                     ((uint64_t)prog->nnames * 2U * sizeof(char *)) + (((uint64_t)prog->nnames + 1U) * sizeof(int));
+    for (int i = 0; i < prog->nnames; i++) {
+        bytes += Mem_StrBytes(prog->names[i]) + Mem_StrBytes(prog->alts[i]);
+    }
+    return bytes;
+}
+//***  Mem_AnalysisBytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_AnalysisBytes --
+ *
+ *      Computes the memory held by the streaming analyses of an instance: histogram grids, derived vectors,
+ *      triggers, capture windows with their pre-trigger rings and segments, and min/max pyramids. Must be called on
+ *      the Tcl thread (pyramids) with ctx->mutex held (the others).
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: instance context
+ *
+ * Results:
+ *      Number of bytes.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static uint64_t Mem_AnalysisBytes(const NgSpiceContext *ctx) {
+    uint64_t bytes = 0;
+    for (const HistAcc *h = ctx->hist_head; h != NULL; h = h->next) {
+        bytes += sizeof(HistAcc) + Mem_StrBytes(h->name) + Mem_StrBytes(h->vecname) +
+                 ((uint64_t)h->tbins * (uint64_t)h->vbins * sizeof(uint64_t));
+    }
+    for (const DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        bytes += sizeof(DerivedVec) + Mem_StrBytes(d->name) + Mem_StrBytes(d->src) + Mem_ProgBytes(d->prog) +
+                 ((uint64_t)(d->prog->nnames + d->prog->maxstack + 2) * sizeof(XVal));
+    }
+    for (int i = 0; i < ctx->nderived_names; i++) {
+        bytes += sizeof(char *) + Mem_StrBytes(ctx->derived_names[i]);
+    }
+    for (const Trigger *t = ctx->trig_head; t != NULL; t = t->next) {
+        bytes += sizeof(Trigger) + Mem_StrBytes(t->name) + Mem_StrBytes(t->src) + Mem_ProgBytes(t->prog) +
+                 ((uint64_t)(t->prog->nnames + t->prog->maxstack + 2) * sizeof(XVal));
+    }
+    for (const Capture *c = ctx->cap_head; c != NULL; c = c->next) {
+        uint64_t width = (uint64_t)c->nvec * 2U * sizeof(double);
+        bytes += sizeof(Capture) + Mem_StrBytes(c->name) + Mem_StrBytes(c->cond.src) + Mem_ProgBytes(c->cond.prog) +
+                 ((uint64_t)(c->cond.prog->nnames + c->cond.prog->maxstack + 2) * sizeof(XVal));
+        bytes += (uint64_t)c->nvec * (sizeof(char *) + sizeof(int) + 1U);
+        for (int k = 0; k < c->nvec; k++) {
+            bytes += Mem_StrBytes(c->names[k]);
+        }
+        if (c->ring != NULL) {
+            bytes += (uint64_t)c->pre * width;
+        }
+        for (const CapSegment *sg = c->seg_head; sg != NULL; sg = sg->next) {
+            bytes += sizeof(CapSegment) + ((uint64_t)sg->cap * width);
+        }
+    }
+    for (const Pyramid *p = ctx->pyr_head; p != NULL; p = p->next) {
+        bytes += sizeof(Pyramid) + Mem_StrBytes(p->name) + ((uint64_t)p->s.n * 2U * sizeof(double)) +
+                 (((uint64_t)p->nlevels + 1U) * 2U * sizeof(size_t *));
+        size_t prevn = p->s.n;
+        for (int k = 0; k < p->nlevels; k++) {
+            prevn = (prevn + 1U) / 2U;
+            bytes += (uint64_t)prevn * 2U * sizeof(size_t);
+        }
+    }
+    return bytes;
+}
+//***  Mem_Refresh function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_Refresh --
+ *
+ *      Accounts the memory held by an instance per MemCategories entry and refreshes the part of the total that the
+ *      budget check in SendDataCallback cannot compute itself (everything but ctx->prod and the message rings, which
+ *      it reads directly). Tcl thread only.
+ *
+ *      Row buffers, message rings, analyses, the trace ring and the recorder are counted exactly as allocated; the
+ *      vectors dict is estimated from its object count (Mem_VectorBytes).
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      uint64_t *cat                - output: MEM_NCAT byte counts indexed by MemCategories; may be NULL
+ *
+ * Results:
+ *      Total number of bytes.
+ *
+ * Side Effects:
+ *      Takes ctx->trace_mu, ctx->rec_mu and ctx->replay_mu one after the other, then ctx->mutex to update
+ *      ctx->mem.cached and ctx->mem.peak.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static uint64_t Mem_Refresh(NgSpiceContext *ctx, uint64_t *cat) {
+    uint64_t c[MEM_NCAT];
+    memset(c, 0, sizeof(c));
+    Tcl_MutexLock(&ctx->trace_mu);
+    if (ctx->trace.recs != NULL) {
+        c[MEM_TRACE] = (uint64_t)ctx->trace.cap * sizeof(TraceRec);
+    }
+    c[MEM_TRACE] += Mem_StrBytes(ctx->trace.path);
+    Tcl_MutexUnlock(&ctx->trace_mu);
+    Tcl_MutexLock(&ctx->rec_mu);
+    c[MEM_RECORD] = (uint64_t)ctx->rec.cap + Mem_StrBytes(ctx->rec.path) + ((uint64_t)ctx->rec.nnames * sizeof(char *));
+    for (int i = 0; i < ctx->rec.nnames; i++) {
+        c[MEM_RECORD] += Mem_StrBytes(ctx->rec.names[i]);
+    }
+    Tcl_MutexUnlock(&ctx->rec_mu);
+    Tcl_MutexLock(&ctx->replay_mu);
+    c[MEM_RECORD] += (uint64_t)ctx->replay.size + Mem_StrBytes(ctx->replay.path);
+    Tcl_MutexUnlock(&ctx->replay_mu);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    uint64_t live = Mem_BufBytes(&ctx->prod) + Mem_MsgBytes(&ctx->msgq) + Mem_MsgBytes(&ctx->capq);
+    c[MEM_ROWS] = Mem_BufBytes(&ctx->prod) + Mem_BufBytes(&ctx->pend);
+    c[MEM_VECTORS] = Mem_VectorBytes(ctx);
+    c[MEM_MESSAGES] = Mem_MsgBytes(&ctx->msgq) + Mem_MsgBytes(&ctx->capq);
+    c[MEM_ANALYSIS] = Mem_AnalysisBytes(ctx);
+    uint64_t total = 0;
+    for (int k = 0; k < MEM_NCAT; k++) {
+        total += c[k];
+    }
+    ctx->mem.cached = total - live;
+    if (total > ctx->mem.peak) {
+        ctx->mem.peak = total;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (cat != NULL) {
+        memcpy(cat, c, sizeof(c));
+    }
+    return total;
+}
+//***  Mem_DropProd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_DropProd --
+ *
+ *      Frees the oldest rows of ctx->prod until the rows hold at most the given number of bytes. Used by the drop
+ *      policy on the callback thread, so memory stays bounded while the Tcl thread does not convert rows (blocked in
+ *      "waitevent" or a long script). Must be called with ctx->mutex held.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      uint64_t keep                - input: bytes of rows to keep
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees rows, moves the remaining ones to the front of ctx->prod and adds the rows to ctx->mem.dropped_rows.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mem_DropProd(NgSpiceContext *ctx, uint64_t keep) {
+    DataBuf *b = &ctx->prod;
+    size_t j = 0;
+    while (((uint64_t)b->bytes > keep) && (j < b->count)) {
+        b->bytes -= DataRow_Bytes(&b->rows[j]);
+        FreeDataRow(&b->rows[j]);
+        j++;
+    }
+    if (j > 0U) {
+        memmove(b->rows, &b->rows[j], (b->count - j) * sizeof(DataRow));
+        b->count -= j;
+        ctx->mem.dropped_rows += (uint64_t)j;
+    }
+}
+//***  Mem_Check function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_Check --
+ *
+ *      Compares the accounted memory with the budget after SendDataCallback stored a row. Must be called with
+ *      ctx->mutex held and a budget set.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      1 if the total just rose above the budget, 0 otherwise.
+ *
+ * Side Effects:
+ *      Updates ctx->mem.peak and ctx->mem.over; on a rise increments ctx->mem.exceeded and, for the stop policy, sets
+ *      ctx->mem.stopped so the following rows of the run are not stored. For the drop policy, once the rows not yet
+ *      taken by the Tcl thread alone hold more than MEM_DROP_TARGET percent of the budget, drops the oldest of them
+ *      down to half of that (Mem_DropProd).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Mem_Check(NgSpiceContext *ctx) {
+    MemBudget *m = &ctx->mem;
+    uint64_t total =
+        m->cached + Mem_BufBytes(&ctx->prod) + Mem_MsgBytes(&ctx->msgq) + Mem_MsgBytes(&ctx->capq);
+    if (total > m->peak) {
+        m->peak = total;
+    }
+    uint64_t target = (m->budget * MEM_DROP_TARGET) / 100U;
+    if ((m->policy == MEM_POLICY_DROP) && ((uint64_t)ctx->prod.bytes > target)) {
+        Mem_DropProd(ctx, target / 2U);
+    }
+    if (total <= m->budget) {
+        m->over = 0;
+        return 0;
+    }
+    if (m->over == 1) {
+        return 0;
+    }
+    m->over = 1;
+    m->exceeded++;
+    if (m->policy == MEM_POLICY_STOP) {
+        m->stopped = 1;
+    }
+    return 1;
+}
+//***  Mem_Drop function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_Drop --
+ *
+ *      Frees at least the given number of bytes of row data, oldest first: the heads of the vectorData lists, then
+ *      the oldest rows of the conversion backlog. The bytes of a stored row are taken as the vectors estimate divided
+ *      by the longest list. Tcl thread only.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      uint64_t excess              - input: bytes to free
+ *      uint64_t vbytes              - input: current vectors estimate (Mem_VectorBytes)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Unshares ctx->vectorData and its lists, shifts ctx->stored_rows and the pending "on send_data" range by the
+ *      dropped rows, frees backlog rows and adds the rows to ctx->mem.dropped_rows.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mem_Drop(NgSpiceContext *ctx, uint64_t excess, uint64_t vbytes) {
+    uint64_t freed = 0;
+    Tcl_Size k = 0;
+    Tcl_Size nrows = 0;
+    Tcl_Obj *keys = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(keys);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (Tcl_IsShared(ctx->vectorData)) {
+        Tcl_Obj *dup = Tcl_DuplicateObj(ctx->vectorData);
+        Tcl_IncrRefCount(dup);
+        Tcl_DecrRefCount(ctx->vectorData);
+        ctx->vectorData = dup;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Tcl_DictSearch search;
+    Tcl_Obj *key;
+    Tcl_Obj *vals;
+    int done;
+    if (Tcl_DictObjFirst(NULL, ctx->vectorData, &search, &key, &vals, &done) == TCL_OK) {
+        while (done == 0) {
+            Tcl_Size n = 0;
+            (void)Tcl_ListObjLength(NULL, vals, &n);
+            if (n > nrows) {
+                nrows = n;
+            }
+            Tcl_ListObjAppendElement(NULL, keys, key);
+            Tcl_DictObjNext(&search, &key, &vals, &done);
+        }
+        Tcl_DictObjDone(&search);
+    }
+    if ((nrows > 0) && (vbytes > 0U)) {
+        uint64_t per_row = vbytes / (uint64_t)nrows;
+        if (per_row == 0U) {
+            per_row = 1;
+        }
+        uint64_t want = (excess + per_row - 1U) / per_row;
+        k = (want < (uint64_t)nrows) ? (Tcl_Size)want : nrows;
+        Tcl_Size nkeys;
+        Tcl_Obj **kv;
+        Tcl_ListObjGetElements(NULL, keys, &nkeys, &kv);
+        for (Tcl_Size i = 0; i < nkeys; i++) {
+            Tcl_Obj *list = NULL;
+            Tcl_Size n = 0;
+            Tcl_DictObjGet(NULL, ctx->vectorData, kv[i], &list);
+            if (Tcl_IsShared(list)) {
+                list = Tcl_DuplicateObj(list);
+            }
+            (void)Tcl_ListObjLength(NULL, list, &n);
+            Tcl_ListObjReplace(NULL, list, 0, (k < n) ? k : n, 0, NULL);
+            Tcl_DictObjPut(NULL, ctx->vectorData, kv[i], list);
+        }
+        freed = per_row * (uint64_t)k;
+        ctx->stored_rows = (ctx->stored_rows > (Tcl_WideInt)k) ? (ctx->stored_rows - (Tcl_WideInt)k) : 0;
+        if (ctx->subs.first_row >= 0) {
+            ctx->subs.first_row =
+                (ctx->subs.first_row > (Tcl_WideInt)k) ? (ctx->subs.first_row - (Tcl_WideInt)k) : 0;
+        }
+    }
+    Tcl_DecrRefCount(keys);
+    DataBuf *b = &ctx->pend;
+    size_t j = 0;
+    while ((freed < excess) && (j < b->count)) {
+        size_t rb = DataRow_Bytes(&b->rows[j]);
+        freed += (uint64_t)rb;
+        b->bytes -= rb;
+        FreeDataRow(&b->rows[j]);
+        j++;
+    }
+    if (j > 0U) {
+        memmove(b->rows, &b->rows[j], (b->count - j) * sizeof(DataRow));
+        b->count -= j;
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    ctx->mem.dropped_rows += (uint64_t)k + (uint64_t)j;
+    Lock_Leave(ctx, LOCK_MUTEX);
+}
+//***  Mem_Enforce function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_Enforce --
+ *
+ *      Refreshes the accounting after a conversion slice and, with the drop policy, trims the oldest rows down to
+ *      MEM_DROP_TARGET percent of the budget once it is exceeded, so trimming does not run on every row. The other
+ *      policies act in SendDataCallback. Tcl thread only, with a budget set.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      See Mem_Refresh() and Mem_Drop().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mem_Enforce(NgSpiceContext *ctx) {
+    uint64_t cat[MEM_NCAT];
+    uint64_t total = Mem_Refresh(ctx, cat);
+    if ((ctx->mem.policy == MEM_POLICY_DROP) && (total > ctx->mem.budget)) {
+        Mem_Drop(ctx, total - ((ctx->mem.budget * MEM_DROP_TARGET) / 100U), cat[MEM_VECTORS]);
+        (void)Mem_Refresh(ctx, NULL);
+    }
+}
+
+//** incremental conversion
+//***  Conv_Take function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Conv_Take --
+ *
+ *      Detach the rows appended by SendDataCallback from ctx->prod and append them to the conversion backlog
+ *      ctx->pend. Called from the Tcl thread.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Swaps or moves ctx->prod rows into ctx->pend under ctx->mutex; ctx->prod is left empty. With a memory budget
+ *      the moved bytes are added to ctx->mem.cached in the same critical section, so budget checks keep seeing them.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Conv_Take(NgSpiceContext *ctx) {
+    DataBuf take;
+    Lock_Enter(ctx, LOCK_MUTEX);
+    take = ctx->prod;
+    DataBuf_Init(&ctx->prod);
+    if (ctx->mem.budget > 0U) {
+        ctx->mem.cached += take.bytes;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (take.count == 0U) {
+        Tcl_Free(take.rows);
+    } else if (ctx->pend.count == 0U) {
+        Tcl_Free(ctx->pend.rows);
+        ctx->pend = take;
+    } else {
+        DataBuf_Ensure(&ctx->pend, ctx->pend.count + take.count);
+        memcpy(&ctx->pend.rows[ctx->pend.count], take.rows, take.count * sizeof(DataRow));
+        ctx->pend.count += take.count;
+        ctx->pend.bytes += take.bytes;
+        Tcl_Free(take.rows);
+    }
+}
+//***  Conv_Run function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Conv_Run --
+ *
+ *      Convert rows of the backlog ctx->pend to Tcl objects appended to ctx->vectorData, oldest first. With a budget
+ *      the slice stops after ctx->conv_rows rows or ctx->conv_budget_ms milliseconds (checked every 32 rows),
+ *      whichever comes first, so one call never blocks the event loop for long; the remaining rows stay in the
+ *      backlog.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter used for list operations
+ *      int budgeted                 - input: 1 to apply the "-convbudget"/"-convrows" limits, 0 to convert all
+ *
+ * Results:
+ *      Number of rows converted.
+ *
+ * Side Effects:
+ *      Unshares and extends ctx->vectorData, frees converted rows, moves the remaining ones to the front of
+ *      ctx->pend and advances ctx->stored_rows. Records the first converted row for the "on send_data" script, the
+ *      time of the slice in ctx->stats.conv and, once the backlog is empty, the send_data latency (Lat_DataVisible).
+ *      With a memory budget refreshes the accounting and applies the drop policy (Mem_Enforce).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static size_t Conv_Run(NgSpiceContext *ctx, Tcl_Interp *interp, int budgeted) {
+    DataBuf *b = &ctx->pend;
+    if (b->count == 0U) {
+        Lat_DataVisible(ctx);
+        return 0;
+    }
+    Tcl_WideInt t0 = Stats_Now();
+    size_t limit = b->count;
+    Tcl_Time deadline;
+    long budget_ms = 0;
+    if (budgeted == 1) {
+        if ((ctx->conv_rows > 0) && ((size_t)ctx->conv_rows < limit)) {
+            limit = (size_t)ctx->conv_rows;
+        }
+        budget_ms = ctx->conv_budget_ms;
+        if (budget_ms > 0) {
+            Deadline_Init(&deadline, budget_ms);
+        }
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (Tcl_IsShared(ctx->vectorData)) {
+        Tcl_Obj *dup = Tcl_DuplicateObj(ctx->vectorData);
+        Tcl_IncrRefCount(dup);
+        Tcl_DecrRefCount(ctx->vectorData);
+        ctx->vectorData = dup;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    size_t r = 0;
+    while (r < limit) {
+        DataRow *dr = &b->rows[r];
+        for (int i = 0; i < dr->veccount; i++) {
+            Tcl_Obj *key = Tcl_NewStringObj(dr->vecs[i].name, -1);
+            if (dr->vecs[i].is_complex == 1) {
+                Tcl_Obj *pair = Tcl_NewListObj(0, NULL);
+                Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(dr->vecs[i].creal));
+                Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(dr->vecs[i].cimag));
+                DictLappend(interp, ctx->vectorData, key, pair);
+            } else {
+                DictLappendElem(interp, ctx->vectorData, key, Tcl_NewDoubleObj(dr->vecs[i].creal));
+            }
+        }
+        b->bytes -= DataRow_Bytes(dr);
+        FreeDataRow(dr);
+        r++;
+        if ((budget_ms > 0) && ((r % 32U) == 0U)) {
+            Tcl_Time rel;
+            if (Deadline_Remaining(&deadline, &rel) == 0) {
+                break;
+            }
+        }
+    }
+    if (r < b->count) {
+        memmove(b->rows, &b->rows[r], (b->count - r) * sizeof(DataRow));
+    }
+    b->count -= r;
+    if ((ctx->subs.script[SEND_DATA] != NULL) && (ctx->subs.first_row < 0)) {
+        ctx->subs.first_row = ctx->stored_rows;
+    }
+    ctx->stored_rows += (Tcl_WideInt)r;
+    Stats_Add(&ctx->stats.conv, Stats_Now() - t0);
+    ctx->stats.conv_rows += (uint64_t)r;
+    if (ctx->mem.budget > 0U) {
+        Mem_Enforce(ctx);
+    }
+    Lat_DataVisible(ctx);
+    return r;
+}
+//***  Conv_Finish function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Conv_Finish --
+ *
+ *      Bring ctx->vectorData up to date before it is read or modified from Tcl: takes the rows still in ctx->prod and
+ *      converts the whole backlog without a budget.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter used for list operations
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      See Conv_Take() and Conv_Run().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Conv_Finish(NgSpiceContext *ctx, Tcl_Interp *interp) {
+    Conv_Take(ctx);
+    (void)Conv_Run(ctx, interp, 0);
+}
+//***  Conv_Discard function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Conv_Discard --
+ *
+ *      Drop the conversion backlog when ctx->vectorData is replaced by an empty dict (new run or "vectors -clear").
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees all rows of ctx->pend and forgets the pending send_data latency sample. With a memory budget refreshes
+ *      the accounting (Mem_Refresh), the callers having replaced ctx->vectorData already.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Conv_Discard(NgSpiceContext *ctx) {
+    DataBuf_Free(&ctx->pend);
+    DataBuf_Init(&ctx->pend);
+    ctx->stats.data_since = 0;
+    if (ctx->mem.budget > 0U) {
+        (void)Mem_Refresh(ctx, NULL);
+    }
+}
+
+//** functions to work with message queue
+//***  MsgQ_Init function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgQ_Init --
+ *
+ *      Initialize a MsgQueue structure to an empty state.
+ *
+ * Parameters:
+ *      MsgQueue *q                  - output: pointer to the MsgQueue structure to initialize
+ *      size_t limit                 - input: maximum number of messages kept, 0 for unbounded
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Sets q->items to NULL and all counters to 0.
+ *      Does not allocate any memory; the queue remains empty until explicitly grown.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void MsgQ_Init(MsgQueue *q, size_t limit) {
+    q->items = NULL;
+    q->head = 0;
+    q->count = 0;
+    q->cap = 0;
+    q->limit = limit;
+    q->dropped = 0;
+    q->bytes = 0;
+}
+//***  MsgQ_At function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgQ_At --
+ *
+ *      Return a message of a MsgQueue by age.
+ *
+ * Parameters:
+ *      const MsgQueue *q            - input: message queue
+ *      size_t i                     - input: position, 0 for the oldest message, must be below q->count
+ *
+ * Results:
+ *      Pointer to the stored string, owned by the queue.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static const char *MsgQ_At(const MsgQueue *q, size_t i) {
+    return q->items[(q->head + i) % q->cap];
+}
+//***  MsgQ_Resize function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgQ_Resize --
+ *
+ *      Reallocate the ring storage of a MsgQueue with a new number of slots, keeping the newest messages that fit
+ *      and laying them out from index 0.
+ *
+ * Parameters:
+ *      MsgQueue *q                  - input/output: message queue
+ *      size_t ncap                  - input: new number of slots (minimum 1)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the oldest messages that do not fit and adds them to q->dropped; replaces q->items.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void MsgQ_Resize(MsgQueue *q, size_t ncap) {
+    char **n = (char **)Tcl_Alloc(ncap * sizeof(char *));
+    size_t skip = (q->count > ncap) ? (q->count - ncap) : 0U;
+    for (size_t i = 0; i < skip; i++) {
+        char *old = q->items[(q->head + i) % q->cap];
+        q->bytes -= strlen(old) + 1U;
+        Tcl_Free(old);
+    }
+    for (size_t i = skip; i < q->count; i++) {
+        n[i - skip] = q->items[(q->head + i) % q->cap];
+    }
+    Tcl_Free(q->items);
+    q->items = n;
+    q->cap = ncap;
+    q->head = 0;
+    q->count -= skip;
+    q->dropped += (uint64_t)skip;
+}
+//***  MsgQ_Push function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgQ_Push --
+ *
+ *      Append a copy of a message string to the end of a MsgQueue. Storage grows geometrically up to q->limit; once
+ *      the limit is reached the oldest message is overwritten, so memory stays bounded however long the instance
+ *      lives.
+ *
+ * Parameters:
+ *      MsgQueue *q                  - input/output: pointer to the message queue to modify
+ *      const char *s                - input: NUL-terminated string to add to the queue
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      If the queue is full and below its limit, grows the storage (twice the current capacity, or 32 slots, capped
+ *      at q->limit) via MsgQ_Resize(). If it is full at its limit, frees the oldest message and increments
+ *      q->dropped. Allocates and stores a copy of the input string and keeps q->bytes up to date.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void MsgQ_Push(MsgQueue *q, const char *s) {
+    if ((q->count == q->cap) && ((q->limit == 0U) || (q->cap < q->limit))) {
+        size_t ncap = q->cap ? q->cap * (size_t)2 : (size_t)32; // grow
+        if ((q->limit != 0U) && (ncap > q->limit)) {
+            ncap = q->limit;
+        }
+        MsgQ_Resize(q, ncap);
+    }
+    size_t len = strlen(s) + 1U;
+    q->bytes += len;
+    if (q->count == q->cap) {
+        q->bytes -= strlen(q->items[q->head]) + 1U;
+        Tcl_Free(q->items[q->head]);
+        q->items[q->head] = memcpy(Tcl_Alloc(len), s, len);
+        q->head = (q->head + 1U) % q->cap;
+        q->dropped++;
+        return;
+    }
+    q->items[(q->head + q->count) % q->cap] = memcpy(Tcl_Alloc(len), s, len);
+    q->count++;
+}
+//***  MsgQ_SetLimit function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgQ_SetLimit --
+ *
+ *      Change the maximum number of messages of a MsgQueue, dropping the oldest messages beyond the new limit.
+ *
+ * Parameters:
+ *      MsgQueue *q                  - input/output: message queue
+ *      size_t limit                 - input: new limit (minimum 1)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May shrink the storage via MsgQ_Resize().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void MsgQ_SetLimit(MsgQueue *q, size_t limit) {
+    q->limit = limit;
+    if (q->cap > limit) {
+        MsgQ_Resize(q, limit);
+    }
+}
+//***  MsgQ_Clear function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgQ_Clear --
+ *
+ *      Remove all messages from a MsgQueue and free their associated memory,
+ *      leaving the queue empty but retaining its allocated capacity.
+ *
+ * Parameters:
+ *      MsgQueue *q                  - input/output: pointer to the message queue to clear
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees each stored string with Tcl_Free().
+ *      Sets q->count, q->head and q->bytes to 0; q->dropped is kept.
+ *      Does not free or shrink the q->items array; capacity remains available for reuse.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void MsgQ_Clear(MsgQueue *q) {
+    for (size_t i = 0; i < q->count; i++) {
+        Tcl_Free(q->items[(q->head + i) % q->cap]);
+    }
+    q->count = 0;
+    q->head = 0;
+    q->bytes = 0;
+}
+//***  MsgQ_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgQ_Free --
+ *
+ *      Free all resources associated with a MsgQueue, including all stored messages
+ *      and the message array itself, and reset the queue to an empty state.
+ *
+ * Parameters:
+ *      MsgQueue *q                  - input/output: pointer to the message queue to free
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls MsgQ_Clear() to free all stored message strings.
+ *      Frees the q->items array with Tcl_Free() and sets it to NULL.
+ *      Sets q->cap to 0 and leaves q->count at 0.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void MsgQ_Free(MsgQueue *q) {
+    MsgQ_Clear(q);
+    Tcl_Free(q->items);
+    q->items = NULL;
+    q->cap = 0;
+}
+//***  Msg_Contains function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_Contains --
+ *
+ *      ASCII case-insensitive substring search, usable on the ngspice thread.
+ *
+ * Parameters:
+ *      const char *s                - input: NUL-terminated string to search
+ *      const char *needle           - input: NUL-terminated lower-case string to find
+ *
+ * Results:
+ *      1 if needle occurs in s, 0 otherwise.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Msg_Contains(const char *s, const char *needle) {
+    for (; *s != '\0'; s++) {
+        size_t i = 0;
+        while (needle[i] != '\0') {
+            char c = s[i];
+            if ((c >= 'A') && (c <= 'Z')) {
+                c = (char)(c - 'A' + 'a');
+            }
+            if (c != needle[i]) {
+                break;
+            }
+            i++;
+        }
+        if (needle[i] == '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+//***  Msg_Leads function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_Leads --
+ *
+ *      Tells whether a line is led by a severity word, the way ngspice writes them ("Error: ...", "Error on line 3",
+ *      "stderr Warning: ..."): the stream prefix ("stdout ", "stderr ", "# ") and blanks are skipped, the word is
+ *      matched ignoring ASCII case and must not go on with a letter or digit, so "Errors: 0" and "no errors found"
+ *      do not match.
+ *
+ * Parameters:
+ *      const char *msg              - input: NUL-terminated line
+ *      const char *word             - input: NUL-terminated lower-case word
+ *
+ * Results:
+ *      1 if the line is led by word, 0 otherwise.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Msg_Leads(const char *msg, const char *word) {
+    if ((strncmp(msg, "stdout ", 7) == 0) || (strncmp(msg, "stderr ", 7) == 0)) {
+        msg += 7;
+    } else if (msg[0] == '#') {
+        msg++;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    while ((*msg == ' ') || (*msg == '\t')) {
+        msg++;
+    }
+    size_t i = 0;
+    for (; word[i] != '\0'; i++) {
+        char c = msg[i];
+        if ((c >= 'A') && (c <= 'Z')) {
+            c = (char)(c - 'A' + 'a');
+        }
+        if (c != word[i]) {
+            return 0;
+        }
+    }
+    char next = msg[i];
+    if (((next >= 'a') && (next <= 'z')) || ((next >= 'A') && (next <= 'Z')) || ((next >= '0') && (next <= '9'))) {
+        return 0;
+    }
+    return 1;
+}
+/* names of the MsgCategories, as used by "msgstats" and "configure -msgkeep" */
+static const char *const msgCatNames[] = {"stdout", "stderr", "status", "error", "warning", "convergence", NULL};
+//***  Msg_Classify function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_Classify --
+ *
+ *      Classify a log/status line. The stream is taken from the prefix added by ngspice ("stdout ", "stderr ") or
+ *      the bridge ("# "); the severity from the text: a leading "Error" or "Warning" word (Msg_Leads) and the usual
+ *      convergence failures anywhere in the line ("timestep too small", "singular matrix", gmin/source stepping
+ *      failures, iteration limit). A line may be in several categories, e.g. "stderr Warning: singular matrix" is
+ *      stderr, warning and convergence.
+ *
+ * Parameters:
+ *      const char *msg              - input: NUL-terminated line
+ *
+ * Results:
+ *      Bit mask of MsgCategories.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static unsigned int Msg_Classify(const char *msg) {
+    static const char *const convergence[] = {"timestep too small",     "singular matrix",         "gmin stepping failed",
+                                              "source stepping failed", "iteration limit reached", "no convergence",
+                                              NULL};
+    unsigned int cats;
+    if (strncmp(msg, "stderr ", 7) == 0) {
+        cats = 1U << MSG_CAT_STDERR;
+    } else if (msg[0] == '#') {
+        cats = 1U << MSG_CAT_STATUS;
+    } else {
+        cats = 1U << MSG_CAT_STDOUT;
+    }
+    if (Msg_Leads(msg, "error") == 1) {
+        cats |= 1U << MSG_CAT_ERROR;
+    }
+    if (Msg_Leads(msg, "warning") == 1) {
+        cats |= 1U << MSG_CAT_WARNING;
+    }
+    for (int k = 0; convergence[k] != NULL; k++) {
+        if (Msg_Contains(msg, convergence[k]) == 1) {
+            cats |= 1U << MSG_CAT_CONVERGENCE;
+            break;
+        }
+    }
+    return cats;
+}
+//***  Msg_NewRun function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_NewRun --
+ *
+ *      Start a new run scope for the message counters: clears the per-run counts and first lines. Called when the
+ *      background thread starts and by "msgstats -reset", with ctx->mutex held.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees ctx->msgclass.first[] strings.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Msg_NewRun(NgSpiceContext *ctx) {
+    MsgClass *mc = &ctx->msgclass;
+    for (int k = 0; k < MSG_NCAT; k++) {
+        mc->run[k] = 0;
+        Tcl_Free(mc->first[k]);
+        mc->first[k] = NULL;
+    }
+}
+//***  Msg_SetPatterns function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_SetPatterns --
+ *
+ *      Replace the glob patterns of the message filter ("-msgpattern"). Must be called with ctx->mutex held.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Size n                   - input: number of patterns, 0 to remove the filter
+ *      Tcl_Obj *const pats[]        - input: patterns (syntax of "string match", case-insensitive)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the previous patterns and copies the new ones.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Msg_SetPatterns(NgSpiceContext *ctx, Tcl_Size n, Tcl_Obj *const pats[]) {
+    MsgClass *mc = &ctx->msgclass;
+    for (int k = 0; k < mc->npatterns; k++) {
+        Tcl_Free(mc->patterns[k]);
+    }
+    Tcl_Free(mc->patterns);
+    mc->patterns = NULL;
+    mc->npatterns = 0;
+    if (n > 0) {
+        mc->patterns = Tcl_Alloc((size_t)n * sizeof(char *));
+        for (Tcl_Size k = 0; k < n; k++) {
+            mc->patterns[k] = ckstrdup(Tcl_GetString(pats[k]));
+        }
+        mc->npatterns = (int)n;
+    }
+}
+//***  Msg_FreeClass function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_FreeClass --
+ *
+ *      Free the strings held by ctx->msgclass.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the first lines and the filter patterns.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Msg_FreeClass(NgSpiceContext *ctx) {
+    Msg_NewRun(ctx);
+    Msg_SetPatterns(ctx, 0, NULL);
+}
+//***  Msg_Put function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_Put --
+ *
+ *      Pass a log/status line to the message sink of the instance ("configure -msgsink"): the "ring" sink keeps it in
+ *      ctx->msgq, "discard" drops it and "file" appends it to ctx->msg_file. Before that the line is classified
+ *      (Msg_Classify) and counted in ctx->msgclass, and it is passed to the sink only if it is in one of the
+ *      "-msgkeep" categories and matches one of the "-msgpattern" patterns (when set). Called from the ngspice
+ *      thread with ctx->mutex held.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      const char *msg              - input: NUL-terminated line without trailing newline
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Updates ctx->msg_received, the counters and first lines of ctx->msgclass and, for the file sink,
+ *      ctx->msg_written or ctx->msg_failed. File output is buffered and flushed by Msg_Flush().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Msg_Put(NgSpiceContext *ctx, const char *msg) {
+    MsgClass *mc = &ctx->msgclass;
+    unsigned int cats = Msg_Classify(msg);
+    ctx->msg_received++;
+    for (int k = 0; k < MSG_NCAT; k++) {
+        if ((cats & (1U << k)) != 0U) {
+            mc->total[k]++;
+            mc->run[k]++;
+            if (mc->first[k] == NULL) {
+                mc->first[k] = ckstrdup(msg);
+            }
+        }
+    }
+    int pass = ((mc->keep == 0U) || ((mc->keep & cats) != 0U)) ? 1 : 0;
+    if ((pass == 1) && (mc->npatterns > 0)) {
+        pass = 0;
+        for (int k = 0; (k < mc->npatterns) && (pass == 0); k++) {
+            pass = Tcl_StringCaseMatch(msg, mc->patterns[k], TCL_MATCH_NOCASE);
+        }
+    }
+    if (pass == 0) {
+        mc->filtered++;
+        return;
+    }
+    if (ctx->msg_sink == MSG_SINK_RING) {
+        MsgQ_Push(&ctx->msgq, msg);
+    } else if (ctx->msg_sink == MSG_SINK_FILE) {
+        if ((ctx->msg_file != NULL) && (fputs(msg, ctx->msg_file) >= 0) && (fputc('\n', ctx->msg_file) != EOF)) {
+            ctx->msg_written++;
+        } else {
+            ctx->msg_failed++;
+        }
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+}
+//***  Msg_Flush function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_Flush --
+ *
+ *      Flush the buffered output of the file sink, so the file is current each time the event loop processed the
+ *      queued output events. Called from the Tcl thread.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls fflush() on ctx->msg_file under ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Msg_Flush(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (ctx->msg_file != NULL) {
+        (void)fflush(ctx->msg_file);
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+}
+//***  Msg_SetFile function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Msg_SetFile --
+ *
+ *      Open (for appending) the file used by the file sink, replacing and closing the previous one. An empty path
+ *      only closes the current file.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for errors, may be NULL
+ *      const char *path             - input: file name in Tcl form, empty to close
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result if the file cannot be opened (the previous file
+ *      is then kept).
+ *
+ * Side Effects:
+ *      Opens and closes files; updates ctx->msg_file and ctx->msg_path under ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Msg_SetFile(NgSpiceContext *ctx, Tcl_Interp *interp, const char *path) {
+    FILE *f = NULL;
+    if (path[0] != '\0') {
+        Tcl_DString ds;
+        Tcl_DStringInit(&ds);
+        const char *native = Tcl_TranslateFileName(interp, path, &ds);
+        if (native != NULL) {
+            f = fopen(native, "a");
+        }
+        Tcl_DStringFree(&ds);
+        if (f == NULL) {
+            if (native != NULL) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\": %s", path, Tcl_PosixError(interp)));
+            }
+            return TCL_ERROR;
+        }
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    FILE *old = ctx->msg_file;
+    ctx->msg_file = f;
+    Tcl_Free(ctx->msg_path);
+    ctx->msg_path = (f != NULL) ? ckstrdup(path) : NULL;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (old != NULL) {
+        (void)fclose(old);
+    }
+    return TCL_OK;
+}
+//***  QueueMsg function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * QueueMsg --
+ *
+ *      Thread-safe helper to pass a message to the NgSpiceContext's message sink.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: pointer to the ngspice context containing the target message queue
+ *      const char *msg              - input: NUL-terminated string to enqueue
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Acquires ctx->mutex before modifying the queue to ensure thread safety.
+ *      Calls Msg_Put() to store, write or discard the message string.
+ *      Releases ctx->mutex after the operation completes.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void QueueMsg(NgSpiceContext *ctx, const char *msg) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    Msg_Put(ctx, msg);
+    Lock_Leave(ctx, LOCK_MUTEX);
+}
+
+//** run vector table helpers
+//***  VecNameEq function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * VecNameEq --
+ *
+ *      Compare two vector names ignoring ASCII case. ngspice reports names like "V(12)" for a vector saved as
+ *      "v(12)", so user-supplied names are matched case-insensitively.
+ *
+ * Parameters:
+ *      const char *a                - input: first NUL-terminated name
+ *      const char *b                - input: second NUL-terminated name
+ *
+ * Results:
+ *      Returns 1 if the names are equal ignoring case, 0 otherwise.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int VecNameEq(const char *a, const char *b) {
+    while ((*a != '\0') && (*b != '\0')) {
+        unsigned char ca = (unsigned char)*a;
+        unsigned char cb = (unsigned char)*b;
+        if ((ca >= (unsigned char)'A') && (ca <= (unsigned char)'Z')) {
+            ca = (unsigned char)(ca + 32U);
+        }
+        if ((cb >= (unsigned char)'A') && (cb <= (unsigned char)'Z')) {
+            cb = (unsigned char)(cb + 32U);
+        }
+        if (ca != cb) {
+            return 0;
+        }
+        a++;
+        b++;
+    }
+    return ((*a == '\0') && (*b == '\0')) ? 1 : 0;
+}
+//***  RunNames_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * RunNames_Free --
+ *
+ *      Release the callback-side table of vector names of the current run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: context owning ctx->run_names; caller holds ctx->mutex
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees every name and the array itself, resets ctx->run_names to NULL and ctx->run_veccount to 0.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void RunNames_Free(NgSpiceContext *ctx) {
+    for (int i = 0; i < ctx->run_veccount; i++) {
+        Tcl_Free(ctx->run_names[i]);
+    }
+    Tcl_Free(ctx->run_names);
+    ctx->run_names = NULL;
+    ctx->run_veccount = 0;
+}
+//***  ResolveRunVector function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * ResolveRunVector --
+ *
+ *      Map a vector name to its index in the vecsa array delivered by SendDataCallback for the current run. The table
+ *      is filled by SendInitDataCallback, so the lookup is done once per run and never on the per-row hot path.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context with the current run table; caller holds ctx->mutex
+ *      const char *name             - input: vector name (matched with VecNameEq)
+ *
+ * Results:
+ *      Index of the vector, or -1 if no vector with that name exists in the current run.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int ResolveRunVector(const NgSpiceContext *ctx, const char *name) {
+    for (int i = 0; i < ctx->run_veccount; i++) {
+        if (VecNameEq(ctx->run_names[i], name) == 1) {
+            return i;
+        }
+    }
+    return -1;
+}
+//***  ResolveRunOperand function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * ResolveRunOperand --
+ *
+ *      Map operand k of a compiled expression to its vecsa index: the literal name first, then for v()/i()
+ *      references the name inside the parentheses.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context with the current run table; caller holds ctx->mutex
+ *      const XProg *prog            - input: compiled expression
+ *      int k                        - input: operand index
+ *
+ * Results:
+ *      Index of the vector, or -1 if neither name exists in the current run.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int ResolveRunOperand(const NgSpiceContext *ctx, const XProg *prog, int k) {
+    int idx = ResolveRunVector(ctx, prog->names[k]);
+    if ((idx < 0) && (prog->alts[k] != NULL)) {
+        idx = ResolveRunVector(ctx, prog->alts[k]);
+    }
+    return idx;
+}
+
+//** histogram accumulators
+//***  Hist_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Hist_Free --
+ *
+ *      Release a single histogram accumulator.
+ *
+ * Parameters:
+ *      HistAcc *h                   - input: accumulator to free; may be NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the name strings, the counter grid and the structure itself.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Hist_Free(HistAcc *h) {
+    if (h == NULL) {
+        return;
+    }
+    Tcl_Free(h->name);
+    Tcl_Free(h->vecname);
+    Tcl_Free(h->counts);
+    Tcl_Free(h);
+}
+//***  Hist_Reset function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Hist_Reset --
+ *
+ *      Zero all counters of a histogram accumulator, keeping its geometry.
+ *
+ * Parameters:
+ *      HistAcc *h                   - input/output: accumulator to reset
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Clears the counter grid and the total/underflow/overflow/nan counters.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Hist_Reset(HistAcc *h) {
+    size_t cells = (size_t)h->vbins * (size_t)((h->mode == HIST_EYE) ? h->tbins : 1);
+    memset(h->counts, 0, cells * sizeof(uint64_t));
+    h->total = 0;
+    h->under = 0;
+    h->over = 0;
+    h->nan = 0;
+}
+//***  Hist_Find function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Hist_Find --
+ *
+ *      Look up a histogram accumulator by name.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context owning the accumulator list; caller holds ctx->mutex
+ *      const char *name             - input: accumulator name
+ *      HistAcc **prev_out           - output (optional): predecessor in the list, NULL if the match is the head
+ *
+ * Results:
+ *      Pointer to the accumulator, or NULL if it does not exist.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static HistAcc *Hist_Find(const NgSpiceContext *ctx, const char *name, HistAcc **prev_out) {
+    HistAcc *prev = NULL;
+    for (HistAcc *h = ctx->hist_head; h != NULL; h = h->next) {
+        if (strcmp(h->name, name) == 0) {
+            if (prev_out != NULL) {
+                *prev_out = prev;
+            }
+            return h;
+        }
+        prev = h;
+    }
+    return NULL;
+}
+//***  Hist_AccumulateRow function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Hist_AccumulateRow --
+ *
+ *      Fold one row of simulation data into every attached accumulator. Called from SendDataCallback on the ngspice
+ *      thread, so it only does index arithmetic on the preallocated grid: memory use is bounded by the bin grid and
+ *      does not grow with the length of the run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: context with the accumulator list; caller holds ctx->mutex
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      - Latches ctx->scale_idx from the is_scale flag of the row if SendInitDataCallback could not determine it.
+ *      - For HIST_VALUE accumulators, increments the value bin of the vector's real part.
+ *      - For HIST_EYE accumulators, folds the scale value modulo the period into a time bin and increments the
+ *        (time bin, value bin) cell.
+ *      - Values outside [vlo, vhi] increment the underflow/overflow counters instead of the grid; vhi itself belongs
+ *        to the last bin.
+ *      - NaN values, and in eye mode non-finite scale values, increment the nan counter; bin indexes are clamped to
+ *        the grid before the conversion to int, so a diverging run cannot index outside of it.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Hist_AccumulateRow(NgSpiceContext *ctx, pvecvaluesall all) {
+    if ((ctx->scale_idx < 0) || (ctx->scale_idx >= all->veccount)) {
+        ctx->scale_idx = -1;
+        for (int i = 0; i < all->veccount; i++) {
+            if (all->vecsa[i]->is_scale) {
+                ctx->scale_idx = i;
+                break;
+            }
+        }
+    }
+    for (HistAcc *h = ctx->hist_head; h != NULL; h = h->next) {
+        if ((h->vec_idx < 0) || (h->vec_idx >= all->veccount)) {
+            continue;
+        }
+        double v = all->vecsa[h->vec_idx]->creal;
+        if (isnan(v)) {
+            h->nan++;
+            continue;
+        }
+        if (v < h->vlo) {
+            h->under++;
+            continue;
+        }
+        if (v > h->vhi) {
+            h->over++;
+            continue;
+        }
+        double fv = ((v - h->vlo) / (h->vhi - h->vlo)) * (double)h->vbins;
+        int vb = (fv < 0.0) ? 0 : ((fv >= (double)h->vbins) ? (h->vbins - 1) : (int)fv);
+        size_t cell = (size_t)vb;
+        if (h->mode == HIST_EYE) {
+            if (ctx->scale_idx < 0) {
+                continue;
+            }
+            double sv = all->vecsa[ctx->scale_idx]->creal;
+            if (!isfinite(sv)) {
+                h->nan++;
+                continue;
+            }
+            double ph = fmod(sv - h->offset, h->period);
+            if (ph < 0.0) {
+                ph += h->period;
+            }
+            double ft = (ph / h->period) * (double)h->tbins;
+            int tb = (ft < 0.0) ? 0 : ((ft >= (double)h->tbins) ? (h->tbins - 1) : (int)ft);
+            cell += (size_t)tb * (size_t)h->vbins;
+        }
+        h->counts[cell]++;
+        h->total++;
+    }
+}
+//***  Hist_ToObj function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Hist_ToObj --
+ *
+ *      Build the Tcl representation of an accumulator.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter used for dict/list construction
+ *      const HistAcc *h             - input: accumulator to export; caller holds ctx->mutex
+ *      int binary                   - input: 1 to export the grid as a byte array of native-endian 64-bit unsigned
+ *                                     integers (time major), 0 to export it as a Tcl list (list of rows for eye mode)
+ *
+ * Results:
+ *      New dict object with keys vector, mode, bins, range, total, underflow, overflow, nan, counts and, for eye mode,
+ *      period, offset and tbins.
+ *
+ * Side Effects:
+ *      Allocates Tcl objects.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *Hist_ToObj(Tcl_Interp *interp, const HistAcc *h, int binary) {
+    int rows = (h->mode == HIST_EYE) ? h->tbins : 1;
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_Obj *range = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(interp, range, Tcl_NewDoubleObj(h->vlo));
+    Tcl_ListObjAppendElement(interp, range, Tcl_NewDoubleObj(h->vhi));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("vector", -1), Tcl_NewStringObj(h->vecname, -1));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("mode", -1),
+                   Tcl_NewStringObj((h->mode == HIST_EYE) ? "eye" : "value", -1));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("bins", -1), Tcl_NewIntObj(h->vbins));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("range", -1), range);
+    if (h->mode == HIST_EYE) {
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("tbins", -1), Tcl_NewIntObj(h->tbins));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("period", -1), Tcl_NewDoubleObj(h->period));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("offset", -1), Tcl_NewDoubleObj(h->offset));
+    }
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("total", -1), Tcl_NewWideIntObj((Tcl_WideInt)h->total));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("underflow", -1), Tcl_NewWideIntObj((Tcl_WideInt)h->under));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("overflow", -1), Tcl_NewWideIntObj((Tcl_WideInt)h->over));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("nan", -1), Tcl_NewWideIntObj((Tcl_WideInt)h->nan));
+    Tcl_Obj *counts;
+    if (binary == 1) {
+        size_t nbytes = (size_t)rows * (size_t)h->vbins * sizeof(uint64_t);
+        counts = Tcl_NewByteArrayObj((const unsigned char *)h->counts, (Tcl_Size)nbytes);
+    } else if (h->mode == HIST_EYE) {
+        counts = Tcl_NewListObj(0, NULL);
+        for (int r = 0; r < rows; r++) {
+            Tcl_Obj *row = Tcl_NewListObj(0, NULL);
+            for (int c = 0; c < h->vbins; c++) {
+                Tcl_ListObjAppendElement(
+                    interp, row, Tcl_NewWideIntObj((Tcl_WideInt)h->counts[((size_t)r * (size_t)h->vbins) + (size_t)c]));
+            }
+            Tcl_ListObjAppendElement(interp, counts, row);
+        }
+    } else {
+        counts = Tcl_NewListObj(0, NULL);
+        for (int c = 0; c < h->vbins; c++) {
+            Tcl_ListObjAppendElement(interp, counts, Tcl_NewWideIntObj((Tcl_WideInt)h->counts[c]));
+        }
+    }
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("counts", -1), counts);
+    return d;
+}
+
+//** vector expression engine
+/* function table: name, arity; indexed by XFunc */
+static const struct {
+    const char *name;
+    int arity;
+} XFuncTable[] = {{"abs", 1},  {"mag", 1}, {"ph", 1},  {"real", 1}, {"imag", 1}, {"sqrt", 1},
+                  {"log", 1},  {"ln", 1},  {"exp", 1}, {"db", 1},   {"min", 2},  {"max", 2}};
+
+typedef struct {
+    const char *src; // expression text
+    const char *p;   // current position
+    XProg *prog;     // program under construction
+    int depth;       // current evaluation stack depth
+    char *err;       // error message buffer
+    size_t errlen;   // size of err
+} XParser;
+
+static int XParse_Expr(XParser *ps);
+//***  XProg_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XProg_Free --
+ *
+ *      Release a compiled expression program.
+ *
+ * Parameters:
+ *      XProg *prog                  - input: program to free; may be NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the instruction array, the operand names with their fallbacks and the structure itself.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XProg_Free(XProg *prog) {
+    if (prog == NULL) {
+        return;
+    }
+    for (int i = 0; i < prog->nnames; i++) {
+        Tcl_Free(prog->names[i]);
+        if (prog->alts[i] != NULL) {
+            Tcl_Free(prog->alts[i]);
+        }
+    }
+    Tcl_Free(prog->names);
+    Tcl_Free(prog->alts);
+    Tcl_Free(prog->code);
+    Tcl_Free(prog);
+}
+//***  XParse_Emit function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_Emit --
+ *
+ *      Append one instruction to the program being compiled and track the evaluation stack depth.
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *      XOpCode op                   - input: opcode
+ *      int arg                      - input: operand index or function id
+ *      double num                   - input: constant for XOP_NUM
+ *      int delta                    - input: net stack effect of the instruction
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May grow ps->prog->code; updates ps->depth and ps->prog->maxstack.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XParse_Emit(XParser *ps, XOpCode op, int arg, double num, int delta) {
+    XProg *prog = ps->prog;
+    if ((prog->ncode % 16) == 0) {
+        prog->code = Tcl_Realloc(prog->code, (size_t)(prog->ncode + 16) * sizeof(XInstr));
+    }
+    prog->code[prog->ncode].op = op;
+    prog->code[prog->ncode].arg = arg;
+    prog->code[prog->ncode].num = num;
+    prog->ncode++;
+    ps->depth += delta;
+    if (ps->depth > prog->maxstack) {
+        prog->maxstack = ps->depth;
+    }
+}
+//***  XParse_Operand function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_Operand --
+ *
+ *      Emit a push of a vector operand, interning its name in the program's operand table. A v(node) or i(device)
+ *      reference is interned under its literal text, since ngspice plots name node vectors "v(node)", with the name
+ *      inside the parentheses ("device#branch" for i()) kept as the fallback tried when the literal one is missing.
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *      const char *name             - input: start of the vector name (the text inside the parentheses for v()/i())
+ *      size_t len                   - input: length of the name
+ *      char kind                    - input: 'v', 'V', 'i' or 'I' as written for v()/i() references, '\0' otherwise
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May append a new name to ps->prog->names and ps->prog->alts; emits XOP_VEC.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XParse_Operand(XParser *ps, const char *name, size_t len, char kind) {
+    char *full = NULL;
+    char *alt = NULL;
+    if (kind == '\0') {
+        full = Tcl_Alloc(len + 1);
+        memcpy(full, name, len);
+        full[len] = '\0';
+    } else {
+        const char *suffix = ((kind == 'i') || (kind == 'I')) ? "#branch" : "";
+        size_t slen = strlen(suffix);
+        full = Tcl_Alloc(len + 4);
+        full[0] = kind;
+        full[1] = '(';
+        memcpy(full + 2, name, len);
+        full[len + 2] = ')';
+        full[len + 3] = '\0';
+        alt = Tcl_Alloc(len + slen + 1);
+        memcpy(alt, name, len);
+        memcpy(alt + len, suffix, slen + 1);
+    }
+    XProg *prog = ps->prog;
+    int idx = -1;
+    for (int i = 0; i < prog->nnames; i++) {
+        if (VecNameEq(prog->names[i], full) == 1) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx < 0) {
+        prog->names = Tcl_Realloc(prog->names, (size_t)(prog->nnames + 1) * sizeof(char *));
+        prog->alts = Tcl_Realloc(prog->alts, (size_t)(prog->nnames + 1) * sizeof(char *));
+        prog->names[prog->nnames] = full;
+        prog->alts[prog->nnames] = alt;
+        idx = prog->nnames;
+        prog->nnames++;
+    } else {
+        Tcl_Free(full);
+        if (alt != NULL) {
+            Tcl_Free(alt);
+        }
+    }
+    XParse_Emit(ps, XOP_VEC, idx, 0.0, 1);
+}
+//***  XParse_Fail function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_Fail --
+ *
+ *      Record a syntax error with the current position.
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *      const char *what             - input: description of the error
+ *
+ * Results:
+ *      Always 0, so callers can write "return XParse_Fail(...)".
+ *
+ * Side Effects:
+ *      Writes a message into ps->err.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XParse_Fail(XParser *ps, const char *what) {
+    snprintf(ps->err, ps->errlen, "%s at position %d in \"%s\"", what, (int)(ps->p - ps->src), ps->src);
+    return 0;
+}
+//***  XParse_SkipWs function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_SkipWs --
+ *
+ *      Advance the parser past blanks.
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Moves ps->p.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XParse_SkipWs(XParser *ps) {
+    while ((*ps->p == ' ') || (*ps->p == '\t') || (*ps->p == '\n') || (*ps->p == '\r')) {
+        ps->p++;
+    }
+}
+//***  XIsIdentChar function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XIsIdentChar --
+ *
+ *      Classify a character of a bare vector name: names start with a letter or underscore and may continue with
+ *      digits, '#' and '.' (for names like v1#branch).
+ *
+ * Parameters:
+ *      char c                       - input: character to test
+ *      int first                    - input: 1 if c is the first character of the name
+ *
+ * Results:
+ *      1 if c may appear at that position, 0 otherwise.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XIsIdentChar(char c, int first) {
+    if (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || (c == '_')) {
+        return 1;
+    }
+    if (first == 1) {
+        return 0;
+    }
+    return (((c >= '0') && (c <= '9')) || (c == '#') || (c == '.')) ? 1 : 0;
+}
+//***  XParse_Primary function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_Primary --
+ *
+ *      Parse a primary: number, parenthesized expression, function call, v(node), i(device), {any name} or bare
+ *      vector name.
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *
+ * Results:
+ *      1 on success, 0 on syntax error (message in ps->err).
+ *
+ * Side Effects:
+ *      Emits instructions.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XParse_Primary(XParser *ps) {
+    XParse_SkipWs(ps);
+    char c = *ps->p;
+    if (((c >= '0') && (c <= '9')) || (c == '.')) {
+        char *end = NULL;
+        double num = strtod(ps->p, &end);
+        if (end == ps->p) {
+            return XParse_Fail(ps, "malformed number");
+        }
+        ps->p = end;
+        XParse_Emit(ps, XOP_NUM, 0, num, 1);
+        return 1;
+    }
+    if (c == '(') {
+        ps->p++;
+        if (XParse_Expr(ps) == 0) {
+            return 0;
+        }
+        XParse_SkipWs(ps);
+        if (*ps->p != ')') {
+            return XParse_Fail(ps, "expected \")\"");
+        }
+        ps->p++;
+        return 1;
+    }
+    if (c == '{') {
+        const char *start = ps->p + 1;
+        const char *end = strchr(start, '}');
+        if ((end == NULL) || (end == start)) {
+            return XParse_Fail(ps, "unterminated or empty {name}");
+        }
+        XParse_Operand(ps, start, (size_t)(end - start), '\0');
+        ps->p = end + 1;
+        return 1;
+    }
+    if (XIsIdentChar(c, 1) == 0) {
+        return XParse_Fail(ps, (c == '\0') ? "unexpected end of expression" : "unexpected character");
+    }
+    const char *start = ps->p;
+    while (XIsIdentChar(*ps->p, 0) == 1) {
+        ps->p++;
+    }
+    size_t len = (size_t)(ps->p - start);
+    const char *after = ps->p;
+    XParse_SkipWs(ps);
+    if (*ps->p != '(') {
+        ps->p = after;
+        XParse_Operand(ps, start, len, '\0');
+        return 1;
+    }
+    if ((len == 1) && ((*start == 'v') || (*start == 'V') || (*start == 'i') || (*start == 'I'))) {
+        const char *nstart = ps->p + 1;
+        const char *nend = nstart;
+        while ((*nend != '\0') && (*nend != ')') && (*nend != ',') && (*nend != '(')) {
+            nend++;
+        }
+        if ((*nend == ',') || (*nend == '(')) {
+            ps->p = nend;
+            return XParse_Fail(ps, (*nend == ',') ? "v()/i() takes a single name, write v(a)-v(b) for a difference" :
+                                                    "unexpected \"(\" inside v()/i() reference");
+        }
+        if ((*nend == '\0') || (nend == nstart)) {
+            return XParse_Fail(ps, "unterminated or empty v()/i() reference");
+        }
+        XParse_Operand(ps, nstart, (size_t)(nend - nstart), *start);
+        ps->p = nend + 1;
+        return 1;
+    }
+    int fn = -1;
+    for (int i = 0; i < (int)(sizeof(XFuncTable) / sizeof(XFuncTable[0])); i++) {
+        if ((strlen(XFuncTable[i].name) == len) && (strncmp(XFuncTable[i].name, start, len) == 0)) {
+            fn = i;
+            break;
+        }
+    }
+    if (fn < 0) {
+        ps->p = start;
+        return XParse_Fail(ps, "unknown function");
+    }
+    ps->p++;
+    for (int a = 0; a < XFuncTable[fn].arity; a++) {
+        if (a > 0) {
+            XParse_SkipWs(ps);
+            if (*ps->p != ',') {
+                return XParse_Fail(ps, "expected \",\"");
+            }
+            ps->p++;
+        }
+        if (XParse_Expr(ps) == 0) {
+            return 0;
+        }
+    }
+    XParse_SkipWs(ps);
+    if (*ps->p != ')') {
+        return XParse_Fail(ps, "expected \")\"");
+    }
+    ps->p++;
+    XParse_Emit(ps, XOP_FUNC, fn, 0.0, 1 - XFuncTable[fn].arity);
+    return 1;
+}
+//***  XParse_Unary function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_Unary --
+ *
+ *      Parse unary plus/minus and the right-associative power operator, which binds tighter than unary minus
+ *      (-a^2 is -(a^2)).
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *
+ * Results:
+ *      1 on success, 0 on syntax error.
+ *
+ * Side Effects:
+ *      Emits instructions.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XParse_Unary(XParser *ps) {
+    XParse_SkipWs(ps);
+    if ((*ps->p == '-') || (*ps->p == '+')) {
+        int neg = (*ps->p == '-') ? 1 : 0;
+        ps->p++;
+        if (XParse_Unary(ps) == 0) {
+            return 0;
+        }
+        if (neg == 1) {
+            XParse_Emit(ps, XOP_NEG, 0, 0.0, 0);
+        }
+        return 1;
+    }
+    if (XParse_Primary(ps) == 0) {
+        return 0;
+    }
+    XParse_SkipWs(ps);
+    if (*ps->p == '^') {
+        ps->p++;
+        if (XParse_Unary(ps) == 0) {
+            return 0;
+        }
+        XParse_Emit(ps, XOP_POW, 0, 0.0, -1);
+    }
+    return 1;
+}
+//***  XParse_Term function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_Term --
+ *
+ *      Parse a chain of multiplications and divisions (left associative).
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *
+ * Results:
+ *      1 on success, 0 on syntax error.
+ *
+ * Side Effects:
+ *      Emits instructions.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XParse_Term(XParser *ps) {
+    if (XParse_Unary(ps) == 0) {
+        return 0;
+    }
+    for (;;) {
+        XParse_SkipWs(ps);
+        char c = *ps->p;
+        if ((c != '*') && (c != '/')) {
+            return 1;
+        }
+        ps->p++;
+        if (XParse_Unary(ps) == 0) {
+            return 0;
+        }
+        XParse_Emit(ps, (c == '*') ? XOP_MUL : XOP_DIV, 0, 0.0, -1);
+    }
+}
+//***  XParse_Expr function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XParse_Expr --
+ *
+ *      Parse a chain of additions and subtractions (left associative).
+ *
+ * Parameters:
+ *      XParser *ps                  - input/output: parser state
+ *
+ * Results:
+ *      1 on success, 0 on syntax error.
+ *
+ * Side Effects:
+ *      Emits instructions.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XParse_Expr(XParser *ps) {
+    if (XParse_Term(ps) == 0) {
+        return 0;
+    }
+    for (;;) {
+        XParse_SkipWs(ps);
+        char c = *ps->p;
+        if ((c != '+') && (c != '-')) {
+            return 1;
+        }
+        ps->p++;
+        if (XParse_Term(ps) == 0) {
+            return 0;
+        }
+        XParse_Emit(ps, (c == '+') ? XOP_ADD : XOP_SUB, 0, 0.0, -1);
+    }
+}
+//***  XExpr_Compile function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XExpr_Compile --
+ *
+ *      Compile an expression over vectors into a postfix program. Parsing happens once; the program is then evaluated
+ *      column by column by XExpr_Eval without touching the source text again. The compiler does not use the Tcl
+ *      object system, so programs may be compiled and evaluated on the ngspice callback thread.
+ *
+ *      Grammar (usual precedence, ^ is right associative):
+ *          expr    := term (('+'|'-') term)*
+ *          term    := unary (('*'|'/') unary)*
+ *          unary   := ('-'|'+') unary | primary ('^' unary)?
+ *          primary := number | '(' expr ')' | func '(' expr (',' expr)* ')' | v(node) | i(device) | {name} | name
+ *
+ *      v(node) refers to vector "v(node)" when the plot has one and to "node" otherwise; i(device) likewise to
+ *      "i(device)" or "device#branch". A comma or nested parenthesis inside v()/i() is a syntax error. {name} allows
+ *      names with operator characters such as {v-sweep}.
+ *
+ * Parameters:
+ *      const char *src              - input: expression text
+ *      char *err                    - output: buffer for the error message
+ *      size_t errlen                - input: size of err
+ *
+ * Results:
+ *      New program (free with XProg_Free), or NULL on syntax error with a message in err.
+ *
+ * Side Effects:
+ *      Allocates memory.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static XProg *XExpr_Compile(const char *src, char *err, size_t errlen) {
+    XParser ps;
+    ps.src = src;
+    ps.p = src;
+    ps.depth = 0;
+    ps.err = err;
+    ps.errlen = errlen;
+    ps.prog = Tcl_Alloc(sizeof(XProg));
+    memset(ps.prog, 0, sizeof(XProg));
+    int ok = XParse_Expr(&ps);
+    if (ok == 1) {
+        XParse_SkipWs(&ps);
+        if (*ps.p != '\0') {
+            ok = XParse_Fail(&ps, "unexpected character");
+        }
+    }
+    if (ok == 0) {
+        XProg_Free(ps.prog);
+        return NULL;
+    }
+    return ps.prog;
+}
+//***  XCol_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XCol_Free --
+ *
+ *      Release the arrays of an engine-owned column; borrowed columns are left untouched.
+ *
+ * Parameters:
+ *      XCol *c                      - input/output: column
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees c->re and c->im if c->owned, and clears the column.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XCol_Free(XCol *c) {
+    if (c->owned == 1) {
+        Tcl_Free(c->re);
+        Tcl_Free(c->im);
+    }
+    memset(c, 0, sizeof(XCol));
+}
+//***  XCol_Own function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XCol_Own --
+ *
+ *      Make a column writable: copy borrowed data into engine-owned arrays of length n, broadcasting a length-1 column
+ *      to n elements, and optionally promote it to complex.
+ *
+ * Parameters:
+ *      XCol *c                      - input/output: column
+ *      size_t n                     - input: required length (c->n must be 1 or >= n)
+ *      int want_complex             - input: 1 to make sure c->im is valid
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May allocate new arrays and free the old owned ones.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XCol_Own(XCol *c, size_t n, int want_complex) {
+    int cplx = ((c->is_complex == 1) || (want_complex == 1)) ? 1 : 0;
+    if ((c->owned == 1) && (c->n == n) && (c->is_complex == cplx)) {
+        return;
+    }
+    size_t bytes = (n > 0U) ? n * sizeof(double) : sizeof(double);
+    double *re = Tcl_Alloc(bytes);
+    double *im = (cplx == 1) ? Tcl_Alloc(bytes) : NULL;
+    size_t step = (c->n == 1U) ? 0U : 1U;
+    for (size_t i = 0; i < n; i++) {
+        re[i] = c->re[i * step];
+    }
+    if (cplx == 1) {
+        if (c->is_complex == 1) {
+            for (size_t i = 0; i < n; i++) {
+                im[i] = c->im[i * step];
+            }
+        } else {
+            memset(im, 0, bytes);
+        }
+    }
+    XCol_Free(c);
+    c->n = n;
+    c->is_complex = cplx;
+    c->owned = 1;
+    c->re = re;
+    c->im = im;
+}
+//***  XEval_Binary function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XEval_Binary --
+ *
+ *      Apply a binary operator element-wise, storing the result in a. Length-1 operands broadcast; otherwise both
+ *      operands must have the same length. Real operands use plain real loops; if either side is complex both are
+ *      promoted. The second operand is broadcast into a private copy first, so every inner loop is a unit-stride
+ *      loop the compiler can vectorize.
+ *
+ * Parameters:
+ *      XCol *a                      - input/output: left operand, replaced by the result
+ *      XCol *b                      - input: right operand, freed on return
+ *      XOpCode op                   - input: XOP_ADD, XOP_SUB, XOP_MUL, XOP_DIV, XOP_POW, or XOP_FUNC with fn
+ *      int fn                       - input: XF_MIN or XF_MAX when op is XOP_FUNC
+ *      char *err                    - output: error message buffer
+ *      size_t errlen                - input: size of err
+ *
+ * Results:
+ *      1 on success, 0 on error (operands of different lengths, min/max on complex operands).
+ *
+ * Side Effects:
+ *      Allocates/frees column arrays.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XEval_Binary(XCol *a, XCol *b, XOpCode op, int fn, char *err, size_t errlen) {
+    size_t n;
+    if (a->n == 1U) {
+        n = b->n;
+    } else if ((b->n == 1U) || (b->n == a->n)) {
+        n = a->n;
+    } else {
+        snprintf(err, errlen, "operands have different lengths: %zu and %zu", a->n, b->n);
+        XCol_Free(b);
+        return 0;
+    }
+    int cplx = ((a->is_complex == 1) || (b->is_complex == 1)) ? 1 : 0;
+    if ((op == XOP_FUNC) && (cplx == 1)) {
+        snprintf(err, errlen, "%s() requires real operands", XFuncTable[fn].name);
+        XCol_Free(b);
+        return 0;
+    }
+    XCol_Own(a, n, cplx);
+    if ((b->n == 1U) || ((cplx == 1) && (b->is_complex == 0))) {
+        XCol_Own(b, n, cplx);
+    }
+    double *restrict ar = a->re;
+    double *restrict ai = a->im;
+    const double *restrict br = b->re;
+    const double *restrict bi = b->im;
+    if (cplx == 0) {
+        switch (op) {
+        case XOP_ADD:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] += br[i];
+            }
+            break;
+        case XOP_SUB:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] -= br[i];
+            }
+            break;
+        case XOP_MUL:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] *= br[i];
+            }
+            break;
+        case XOP_DIV:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] /= br[i];
+            }
+            break;
+        case XOP_POW:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = pow(ar[i], br[i]);
+            }
+            break;
+        default:
+            if (fn == (int)XF_MIN) {
+                for (size_t i = 0; i < n; i++) {
+                    ar[i] = fmin(ar[i], br[i]);
+                }
+            } else {
+                for (size_t i = 0; i < n; i++) {
+                    ar[i] = fmax(ar[i], br[i]);
+                }
+            }
+            break;
+        }
+        XCol_Free(b);
+        return 1;
+    }
+    switch (op) {
+    case XOP_ADD:
+        for (size_t i = 0; i < n; i++) {
+            ar[i] += br[i];
+            ai[i] += bi[i];
+        }
+        break;
+    case XOP_SUB:
+        for (size_t i = 0; i < n; i++) {
+            ar[i] -= br[i];
+            ai[i] -= bi[i];
+        }
+        break;
+    case XOP_MUL:
+        for (size_t i = 0; i < n; i++) {
+            double re = (ar[i] * br[i]) - (ai[i] * bi[i]);
+            ai[i] = (ar[i] * bi[i]) + (ai[i] * br[i]);
+            ar[i] = re;
+        }
+        break;
+    case XOP_DIV:
+        for (size_t i = 0; i < n; i++) {
+            double d = (br[i] * br[i]) + (bi[i] * bi[i]);
+            double re = ((ar[i] * br[i]) + (ai[i] * bi[i])) / d;
+            ai[i] = ((ai[i] * br[i]) - (ar[i] * bi[i])) / d;
+            ar[i] = re;
+        }
+        break;
+    default:
+        /* XOP_POW: a^b = exp(b * ln(a)), 0^b = 0 */
+        for (size_t i = 0; i < n; i++) {
+            double mag = hypot(ar[i], ai[i]);
+            if (mag == 0.0) {
+                ar[i] = 0.0;
+                ai[i] = 0.0;
+                continue;
+            }
+            double lr = log(mag);
+            double li = atan2(ai[i], ar[i]);
+            double er = exp((br[i] * lr) - (bi[i] * li));
+            double ei = (br[i] * li) + (bi[i] * lr);
+            ar[i] = er * cos(ei);
+            ai[i] = er * sin(ei);
+        }
+        break;
+    }
+    XCol_Free(b);
+    return 1;
+}
+//***  XEval_Unary function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XEval_Unary --
+ *
+ *      Apply negation or a one-argument function element-wise, in place. Functions follow ngspice conventions: log is
+ *      base 10, ln is natural, ph is in radians, db is 20*log10(mag). abs, mag, ph, real, imag and db always produce
+ *      real columns; sqrt of a real column with negative elements produces a complex column.
+ *
+ * Parameters:
+ *      XCol *a                      - input/output: operand, replaced by the result
+ *      XOpCode op                   - input: XOP_NEG or XOP_FUNC
+ *      int fn                       - input: function id when op is XOP_FUNC
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Allocates/frees column arrays.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XEval_Unary(XCol *a, XOpCode op, int fn) {
+    size_t n = a->n;
+    if ((op == XOP_FUNC) && (fn == (int)XF_SQRT) && (a->is_complex == 0)) {
+        for (size_t i = 0; i < n; i++) {
+            if (a->re[i] < 0.0) {
+                XCol_Own(a, n, 1);
+                break;
+            }
+        }
+    }
+    int to_real = ((op == XOP_FUNC) && ((fn == (int)XF_ABS) || (fn == (int)XF_MAG) || (fn == (int)XF_PH) ||
+                                        (fn == (int)XF_REAL) || (fn == (int)XF_IMAG) || (fn == (int)XF_DB)))
+                      ? 1
+                      : 0;
+    XCol_Own(a, n, 0);
+    double *restrict ar = a->re;
+    double *restrict ai = a->im;
+    if (a->is_complex == 0) {
+        if (op == XOP_NEG) {
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = -ar[i];
+            }
+            return;
+        }
+        switch ((XFunc)fn) {
+        case XF_ABS:
+        case XF_MAG:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = fabs(ar[i]);
+            }
+            break;
+        case XF_PH:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = atan2(0.0, ar[i]);
+            }
+            break;
+        case XF_IMAG:
+            memset(ar, 0, n * sizeof(double));
+            break;
+        case XF_SQRT:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = sqrt(ar[i]);
+            }
+            break;
+        case XF_LOG:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = log10(ar[i]);
+            }
+            break;
+        case XF_LN:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = log(ar[i]);
+            }
+            break;
+        case XF_EXP:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = exp(ar[i]);
+            }
+            break;
+        case XF_DB:
+            for (size_t i = 0; i < n; i++) {
+                ar[i] = 20.0 * log10(fabs(ar[i]));
+            }
+            break;
+        default:
+            /* XF_REAL: identity */
+            break;
+        }
+        return;
+    }
+    if (op == XOP_NEG) {
+        for (size_t i = 0; i < n; i++) {
+            ar[i] = -ar[i];
+            ai[i] = -ai[i];
+        }
+        return;
+    }
+    switch ((XFunc)fn) {
+    case XF_ABS:
+    case XF_MAG:
+        for (size_t i = 0; i < n; i++) {
+            ar[i] = hypot(ar[i], ai[i]);
+        }
+        break;
+    case XF_PH:
+        for (size_t i = 0; i < n; i++) {
+            ar[i] = atan2(ai[i], ar[i]);
+        }
+        break;
+    case XF_IMAG:
+        memcpy(ar, ai, n * sizeof(double));
+        break;
+    case XF_DB:
+        for (size_t i = 0; i < n; i++) {
+            ar[i] = 20.0 * log10(hypot(ar[i], ai[i]));
+        }
+        break;
+    case XF_SQRT:
+        for (size_t i = 0; i < n; i++) {
+            double r = hypot(ar[i], ai[i]);
+            double sr = sqrt((r + ar[i]) * 0.5);
+            ai[i] = copysign(sqrt((r - ar[i]) * 0.5), ai[i]);
+            ar[i] = sr;
+        }
+        break;
+    case XF_LOG:
+    case XF_LN: {
+        double scale = (fn == (int)XF_LOG) ? (1.0 / log(10.0)) : 1.0;
+        for (size_t i = 0; i < n; i++) {
+            double lr = log(hypot(ar[i], ai[i])) * scale;
+            ai[i] = atan2(ai[i], ar[i]) * scale;
+            ar[i] = lr;
+        }
+        break;
+    }
+    case XF_EXP:
+        for (size_t i = 0; i < n; i++) {
+            double m = exp(ar[i]);
+            ar[i] = m * cos(ai[i]);
+            ai[i] = m * sin(ai[i]);
+        }
+        break;
+    default:
+        /* XF_REAL: drop the imaginary part below */
+        break;
+    }
+    if (to_real == 1) {
+        Tcl_Free(a->im);
+        a->im = NULL;
+        a->is_complex = 0;
+    }
+}
+//***  XExpr_Eval function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XExpr_Eval --
+ *
+ *      Evaluate a compiled program over whole columns. Each instruction runs one tight loop over all elements, so the
+ *      interpretation overhead is paid per instruction rather than per sample. Input columns are borrowed and never
+ *      modified.
+ *
+ * Parameters:
+ *      const XProg *prog            - input: compiled program
+ *      const XCol *inputs           - input: one column per prog->names entry
+ *      XCol *out                    - output: result column (engine-owned; release with XCol_Free)
+ *      char *err                    - output: error message buffer
+ *      size_t errlen                - input: size of err
+ *
+ * Results:
+ *      1 on success, 0 on evaluation error (message in err).
+ *
+ * Side Effects:
+ *      Allocates the result and temporary columns. Does not use the Tcl object system, so it may be called from any
+ *      thread.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XExpr_Eval(const XProg *prog, const XCol *inputs, XCol *out, char *err, size_t errlen) {
+    XCol *stack = Tcl_Alloc((size_t)(prog->maxstack + 1) * sizeof(XCol));
+    int sp = 0;
+    int ok = 1;
+    for (int pc = 0; (pc < prog->ncode) && (ok == 1); pc++) {
+        const XInstr *in = &prog->code[pc];
+        switch (in->op) {
+        case XOP_VEC:
+            stack[sp] = inputs[in->arg];
+            stack[sp].owned = 0;
+            sp++;
+            break;
+        case XOP_NUM:
+            memset(&stack[sp], 0, sizeof(XCol));
+            stack[sp].n = 1;
+            stack[sp].owned = 1;
+            stack[sp].re = Tcl_Alloc(sizeof(double));
+            stack[sp].re[0] = in->num;
+            sp++;
+            break;
+        case XOP_NEG:
+            XEval_Unary(&stack[sp - 1], XOP_NEG, 0);
+            break;
+        case XOP_FUNC:
+            if (XFuncTable[in->arg].arity == 1) {
+                XEval_Unary(&stack[sp - 1], XOP_FUNC, in->arg);
+            } else {
+                ok = XEval_Binary(&stack[sp - 2], &stack[sp - 1], XOP_FUNC, in->arg, err, errlen);
+                sp--;
+            }
+            break;
+        default:
+            ok = XEval_Binary(&stack[sp - 2], &stack[sp - 1], in->op, 0, err, errlen);
+            sp--;
+            break;
+        }
+    }
+    if (ok == 1) {
+        sp--;
+        *out = stack[sp];
+        XCol_Own(out, out->n, 0);
+    }
+    while (sp > 0) {
+        sp--;
+        XCol_Free(&stack[sp]);
+    }
+    Tcl_Free(stack);
+    return ok;
+}
+//***  XVal_Unary function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XVal_Unary --
+ *
+ *      Apply negation or a one-argument function to a single value, with the same conventions as XEval_Unary: sqrt of
+ *      a negative real value is complex, abs, mag, ph, real, imag and db are real.
+ *
+ * Parameters:
+ *      XVal *a                      - input/output: operand, replaced by the result
+ *      XOpCode op                   - input: XOP_NEG or XOP_FUNC
+ *      int fn                       - input: function id when op is XOP_FUNC
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void XVal_Unary(XVal *a, XOpCode op, int fn) {
+    if (op == XOP_NEG) {
+        a->re = -a->re;
+        a->im = -a->im;
+        return;
+    }
+    if ((fn == (int)XF_SQRT) && (a->is_complex == 0) && (a->re < 0.0)) {
+        a->is_complex = 1;
+        a->im = 0.0;
+    }
+    double re = a->re;
+    double im = a->im;
+    if (a->is_complex == 0) {
+        switch ((XFunc)fn) {
+        case XF_ABS:
+        case XF_MAG:
+            a->re = fabs(re);
+            break;
+        case XF_PH:
+            a->re = atan2(0.0, re);
+            break;
+        case XF_IMAG:
+            a->re = 0.0;
+            break;
+        case XF_SQRT:
+            a->re = sqrt(re);
+            break;
+        case XF_LOG:
+            a->re = log10(re);
+            break;
+        case XF_LN:
+            a->re = log(re);
+            break;
+        case XF_EXP:
+            a->re = exp(re);
+            break;
+        case XF_DB:
+            a->re = 20.0 * log10(fabs(re));
+            break;
+        default:
+            /* XF_REAL: identity */
+            break;
+        }
+        return;
+    }
+    switch ((XFunc)fn) {
+    case XF_ABS:
+    case XF_MAG:
+        a->re = hypot(re, im);
+        break;
+    case XF_PH:
+        a->re = atan2(im, re);
+        break;
+    case XF_IMAG:
+        a->re = im;
+        break;
+    case XF_DB:
+        a->re = 20.0 * log10(hypot(re, im));
+        break;
+    case XF_SQRT: {
+        double r = hypot(re, im);
+        a->re = sqrt((r + re) * 0.5);
+        a->im = copysign(sqrt((r - re) * 0.5), im);
+        return;
+    }
+    case XF_LOG:
+    case XF_LN: {
+        double scale = (fn == (int)XF_LOG) ? (1.0 / log(10.0)) : 1.0;
+        a->re = log(hypot(re, im)) * scale;
+        a->im = atan2(im, re) * scale;
+        return;
+    }
+    case XF_EXP:
+        a->re = exp(re) * cos(im);
+        a->im = exp(re) * sin(im);
+        return;
+    default:
+        /* XF_REAL: drop the imaginary part below */
+        break;
+    }
+    a->im = 0.0;
+    a->is_complex = 0;
+}
+//***  XVal_Binary function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XVal_Binary --
+ *
+ *      Apply a binary operator to two single values, with the same arithmetic as XEval_Binary.
+ *
+ * Parameters:
+ *      XVal *a                      - input/output: left operand, replaced by the result
+ *      const XVal *b                - input: right operand
+ *      XOpCode op                   - input: XOP_ADD, XOP_SUB, XOP_MUL, XOP_DIV, XOP_POW, or XOP_FUNC with fn
+ *      int fn                       - input: XF_MIN or XF_MAX when op is XOP_FUNC
+ *      char *err                    - output: error message buffer
+ *      size_t errlen                - input: size of err
+ *
+ * Results:
+ *      1 on success, 0 on error (min/max on complex operands).
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XVal_Binary(XVal *a, const XVal *b, XOpCode op, int fn, char *err, size_t errlen) {
+    if ((a->is_complex == 0) && (b->is_complex == 0)) {
+        switch (op) {
+        case XOP_ADD:
+            a->re += b->re;
+            break;
+        case XOP_SUB:
+            a->re -= b->re;
+            break;
+        case XOP_MUL:
+            a->re *= b->re;
+            break;
+        case XOP_DIV:
+            a->re /= b->re;
+            break;
+        case XOP_POW:
+            a->re = pow(a->re, b->re);
+            break;
+        default:
+            a->re = (fn == (int)XF_MIN) ? fmin(a->re, b->re) : fmax(a->re, b->re);
+            break;
+        }
+        return 1;
+    }
+    if (op == XOP_FUNC) {
+        snprintf(err, errlen, "%s() requires real operands", XFuncTable[fn].name);
+        return 0;
+    }
+    double ar = a->re;
+    double ai = (a->is_complex == 1) ? a->im : 0.0;
+    double br = b->re;
+    double bi = (b->is_complex == 1) ? b->im : 0.0;
+    a->is_complex = 1;
+    switch (op) {
+    case XOP_ADD:
+        a->re = ar + br;
+        a->im = ai + bi;
+        break;
+    case XOP_SUB:
+        a->re = ar - br;
+        a->im = ai - bi;
+        break;
+    case XOP_MUL:
+        a->re = (ar * br) - (ai * bi);
+        a->im = (ar * bi) + (ai * br);
+        break;
+    case XOP_DIV: {
+        double d = (br * br) + (bi * bi);
+        a->re = ((ar * br) + (ai * bi)) / d;
+        a->im = ((ai * br) - (ar * bi)) / d;
+        break;
+    }
+    default: {
+        /* XOP_POW: a^b = exp(b * ln(a)), 0^b = 0 */
+        double mag = hypot(ar, ai);
+        if (mag == 0.0) {
+            a->re = 0.0;
+            a->im = 0.0;
+            break;
+        }
+        double lr = log(mag);
+        double li = atan2(ai, ar);
+        double er = exp((br * lr) - (bi * li));
+        double ei = (br * li) + (bi * lr);
+        a->re = er * cos(ei);
+        a->im = er * sin(ei);
+        break;
+    }
+    }
+    return 1;
+}
+//***  XExpr_EvalRow function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XExpr_EvalRow --
+ *
+ *      Evaluate a compiled program on a single value per operand, as the streaming analyses do for every row. Gives
+ *      the same result as XExpr_Eval on length-1 columns, but works on a stack supplied by the caller and allocates
+ *      nothing, so it may run on the ngspice callback thread for every row.
+ *
+ * Parameters:
+ *      const XProg *prog            - input: compiled program
+ *      const XVal *inputs           - input: one value per prog->names entry
+ *      XVal *stack                  - input/output: scratch stack of prog->maxstack + 1 entries
+ *      XVal *out                    - output: result
+ *      char *err                    - output: error message buffer
+ *      size_t errlen                - input: size of err
+ *
+ * Results:
+ *      1 on success, 0 on evaluation error (message in err).
+ *
+ * Side Effects:
+ *      Overwrites the stack.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XExpr_EvalRow(const XProg *prog, const XVal *inputs, XVal *stack, XVal *out, char *err, size_t errlen) {
+    int sp = 0;
+    for (int pc = 0; pc < prog->ncode; pc++) {
+        const XInstr *in = &prog->code[pc];
+        switch (in->op) {
+        case XOP_VEC:
+            stack[sp] = inputs[in->arg];
+            sp++;
+            break;
+        case XOP_NUM:
+            stack[sp].re = in->num;
+            stack[sp].im = 0.0;
+            stack[sp].is_complex = 0;
+            sp++;
+            break;
+        case XOP_NEG:
+            XVal_Unary(&stack[sp - 1], XOP_NEG, 0);
+            break;
+        case XOP_FUNC:
+            if (XFuncTable[in->arg].arity == 1) {
+                XVal_Unary(&stack[sp - 1], XOP_FUNC, in->arg);
+                break;
+            }
+            sp--;
+            if (XVal_Binary(&stack[sp - 1], &stack[sp], XOP_FUNC, in->arg, err, errlen) == 0) {
+                return 0;
+            }
+            break;
+        default:
+            sp--;
+            if (XVal_Binary(&stack[sp - 1], &stack[sp], in->op, 0, err, errlen) == 0) {
+                return 0;
+            }
+            break;
+        }
+    }
+    *out = stack[0];
+    return 1;
+}
+//***  XVal_FromRow function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XVal_FromRow --
+ *
+ *      Load the operand values of a program from one row of simulation data, by the vecsa indices resolved for the
+ *      current run.
+ *
+ * Parameters:
+ *      const XProg *prog            - input: compiled program
+ *      const int *in_idx            - input: vecsa index per prog->names entry
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *      XVal *vals                   - output: one value per prog->names entry
+ *
+ * Results:
+ *      1 if every operand is present in the row, 0 otherwise.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XVal_FromRow(const XProg *prog, const int *in_idx, pvecvaluesall all, XVal *vals) {
+    for (int k = 0; k < prog->nnames; k++) {
+        if (in_idx[k] >= all->veccount) {
+            return 0;
+        }
+        pvecvalues v = all->vecsa[in_idx[k]];
+        vals[k].re = v->creal;
+        vals[k].im = v->is_complex ? v->cimag : 0.0;
+        vals[k].is_complex = v->is_complex ? 1 : 0;
+    }
+    return 1;
+}
+
+//***  XCol_FromList function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XCol_FromList --
+ *
+ *      Convert a vector as stored in ctx->vectorData (list of doubles, or list of {re im} pairs for complex vectors)
+ *      into an engine-owned column. Every element is inspected: the column is complex as soon as one element is a
+ *      pair, plain numbers then get a zero imaginary part.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter for error messages
+ *      Tcl_Obj *list                - input: vector values
+ *      XCol *c                      - output: column
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR if an element is not a number or pair of numbers.
+ *
+ * Side Effects:
+ *      Allocates c->re (and c->im for complex vectors).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int XCol_FromList(Tcl_Interp *interp, Tcl_Obj *list, XCol *c) {
+    Tcl_Size len;
+    Tcl_Obj **elems;
+    memset(c, 0, sizeof(XCol));
+    if (Tcl_ListObjGetElements(interp, list, &len, &elems) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    size_t bytes = (len > 0) ? (size_t)len * sizeof(double) : sizeof(double);
+    c->n = (size_t)len;
+    c->owned = 1;
+    c->re = Tcl_Alloc(bytes);
+    for (Tcl_Size i = 0; i < len; i++) {
+        /* numbers first, so the double representation of real vectors is kept */
+        if (Tcl_GetDoubleFromObj(NULL, elems[i], &c->re[i]) == TCL_OK) {
+            if (c->is_complex == 1) {
+                c->im[i] = 0.0;
+            }
+            continue;
+        }
+        Tcl_Size pl;
+        Tcl_Obj **pe;
+        double im;
+        if ((Tcl_ListObjGetElements(NULL, elems[i], &pl, &pe) != TCL_OK) || (pl != 2) ||
+            (Tcl_GetDoubleFromObj(NULL, pe[0], &c->re[i]) != TCL_OK) ||
+            (Tcl_GetDoubleFromObj(NULL, pe[1], &im) != TCL_OK)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("expected number or {re im} pair but got \"%s\"",
+                                                   Tcl_GetString(elems[i])));
+            XCol_Free(c);
+            return TCL_ERROR;
+        }
+        if (c->is_complex == 0) {
+            c->is_complex = 1;
+            c->im = Tcl_Alloc(bytes);
+            memset(c->im, 0, (size_t)i * sizeof(double));
+        }
+        c->im[i] = im;
+    }
+    return TCL_OK;
+}
+//***  XCol_ToObj function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * XCol_ToObj --
+ *
+ *      Build the Tcl representation of a column, in the same shape as the "vectors" and "asyncvector" subcommands use.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter used for list construction
+ *      const XCol *c                - input: column
+ *
+ * Results:
+ *      New list of doubles, or list of {re im} pairs for a complex column.
+ *
+ * Side Effects:
+ *      Allocates Tcl objects.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *XCol_ToObj(Tcl_Interp *interp, const XCol *c) {
+    Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+    for (size_t i = 0; i < c->n; i++) {
+        if (c->is_complex == 1) {
+            Tcl_Obj *pair = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(c->re[i]));
+            Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(c->im[i]));
+            Tcl_ListObjAppendElement(interp, list, pair);
+        } else {
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewDoubleObj(c->re[i]));
+        }
+    }
+    return list;
+}
+//***  VectorDict_Lookup function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * VectorDict_Lookup --
+ *
+ *      Find a vector in a dictionary shaped like ctx->vectorData (name -> values). An exact match is tried first,
+ *      then names are compared ignoring case.
+ *
+ * Parameters:
+ *      Tcl_Obj *data                - input: dictionary of vectors
+ *      const char *name             - input: vector name
+ *
+ * Results:
+ *      Borrowed reference to the values, or NULL if the vector does not exist or data is not a dictionary.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *VectorDict_Lookup(Tcl_Obj *data, const char *name) {
+    Tcl_Obj *key = Tcl_NewStringObj(name, -1);
+    Tcl_Obj *vals = NULL;
+    Tcl_IncrRefCount(key);
+    if (Tcl_DictObjGet(NULL, data, key, &vals) != TCL_OK) {
+        Tcl_DecrRefCount(key);
+        return NULL;
+    }
+    Tcl_DecrRefCount(key);
+    if (vals == NULL) {
+        Tcl_DictSearch search;
+        Tcl_Obj *dkey;
+        Tcl_Obj *dval;
+        int doneIter = 0;
+        Tcl_DictObjFirst(NULL, data, &search, &dkey, &dval, &doneIter);
+        while (doneIter == 0) {
+            if (VecNameEq(Tcl_GetString(dkey), name) == 1) {
+                vals = dval;
+                break;
+            }
+            Tcl_DictObjNext(&search, &dkey, &dval, &doneIter);
+        }
+        Tcl_DictObjDone(&search);
+    }
+    return vals;
+}
+//***  LoadColumns function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * LoadColumns --
+ *
+ *      Fetch named vectors into engine-owned columns, either from the bridge-stored vectors (ctx->vectorData, names
+ *      matched ignoring case) or directly from ngspice via ngGet_Vec_Info. All vectors are copied under a single
+ *      realloc lock, so they are consistent with each other while a simulation is running.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      Tcl_Interp *interp           - input: interpreter for error messages
+ *      char *const *names           - input: vector names
+ *      char *const *alts            - input: per name, a fallback tried when the name is missing (entries and the
+ *                                     array itself may be NULL)
+ *      int count                    - input: number of names
+ *      int async                    - input: 1 to read the current ngspice vectors, 0 to read ctx->vectorData
+ *      XCol *cols                   - output: count columns
+ *
+ * Results:
+ *      TCL_OK, or TCL_ERROR if a vector does not exist (already loaded columns are freed).
+ *
+ * Side Effects:
+ *      With async, locks ngspice output vector reallocation while copying.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int LoadColumns(NgSpiceContext *ctx, Tcl_Interp *interp, char *const *names, char *const *alts, int count,
+                       int async, XCol *cols) {
+    int k = 0;
+    int rc = TCL_OK;
+    if (async == 1) {
+        ctx->ngSpice_LockRealloc();
+        for (; k < count; k++) {
+            /* cppcheck-suppress misra-c2012-17.3 */
+            pvector_info vinfo = ctx->ngGet_Vec_Info(names[k]);
+            if ((vinfo == NULL) && (alts != NULL) && (alts[k] != NULL)) {
+                /* cppcheck-suppress misra-c2012-17.3 */
+                vinfo = ctx->ngGet_Vec_Info(alts[k]);
+            }
+            if (vinfo == NULL) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("vector with name \"%s\" does not exist",
+                                                       ((alts != NULL) && (alts[k] != NULL)) ? alts[k] : names[k]));
+                rc = TCL_ERROR;
+                break;
+            }
+            size_t n = (vinfo->v_length > 0) ? (size_t)vinfo->v_length : 0U;
+            size_t bytes = (n > 0U) ? n * sizeof(double) : sizeof(double);
+            XCol *c = &cols[k];
+            c->n = n;
+            c->owned = 1;
+            c->is_complex = ((vinfo->v_flags & (short)VF_COMPLEX) != 0) ? 1 : 0;
+            c->re = Tcl_Alloc(bytes);
+            c->im = NULL;
+            if (c->is_complex == 1) {
+                c->im = Tcl_Alloc(bytes);
+                for (size_t i = 0; i < n; i++) {
+                    c->re[i] = vinfo->v_compdata[i].cx_real;
+                    c->im[i] = vinfo->v_compdata[i].cx_imag;
+                }
+            } else if (n > 0U) {
+                memcpy(c->re, vinfo->v_realdata, n * sizeof(double));
+            } else {
+                /* No action required: all valid cases handled above (MISRA 15.7) */
+            }
+        }
+        ctx->ngSpice_UnlockRealloc();
+    } else {
+        Conv_Finish(ctx, interp);
+        Lock_Enter(ctx, LOCK_MUTEX);
+        Tcl_Obj *data = ctx->vectorData;
+        Tcl_IncrRefCount(data);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        for (; k < count; k++) {
+            Tcl_Obj *vals = VectorDict_Lookup(data, names[k]);
+            if ((vals == NULL) && (alts != NULL) && (alts[k] != NULL)) {
+                vals = VectorDict_Lookup(data, alts[k]);
+            }
+            if (vals == NULL) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("vector with name \"%s\" does not exist",
+                                                       ((alts != NULL) && (alts[k] != NULL)) ? alts[k] : names[k]));
+                rc = TCL_ERROR;
+                break;
+            }
+            if (XCol_FromList(interp, vals, &cols[k]) != TCL_OK) {
+                rc = TCL_ERROR;
+                break;
+            }
+        }
+        Tcl_DecrRefCount(data);
+    }
+    if (rc != TCL_OK) {
+        while (k > 0) {
+            k--;
+            XCol_Free(&cols[k]);
+        }
+    }
+    return rc;
+}
+//** derived vectors
+//***  Derived_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Derived_Free --
+ *
+ *      Release a single derived vector definition.
+ *
+ * Parameters:
+ *      DerivedVec *d                - input: definition to free; may be NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the name, expression text, compiled program, operand index table, evaluation buffers and the structure
+ *      itself. The interned cell name stays in ctx->derived_names, as stored rows may still point to it.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Derived_Free(DerivedVec *d) {
+    if (d == NULL) {
+        return;
+    }
+    Tcl_Free(d->name);
+    Tcl_Free(d->src);
+    XProg_Free(d->prog);
+    Tcl_Free(d->in_idx);
+    Tcl_Free(d->in_vals);
+    Tcl_Free(d->stack);
+    Tcl_Free(d);
+}
+//***  Derived_Intern function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Derived_Intern --
+ *
+ *      Return the copy of a derived vector name kept in ctx->derived_names, adding it on first use. The cells that
+ *      Derived_AppendRow adds to the stored rows point to this copy instead of duplicating the name for every row;
+ *      the table lives as long as the instance, so rows still waiting for conversion stay valid after "derived
+ *      remove".
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: context owning the table; caller holds ctx->mutex
+ *      const char *name             - input: derived vector name
+ *
+ * Results:
+ *      Interned name.
+ *
+ * Side Effects:
+ *      May grow ctx->derived_names.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static char *Derived_Intern(NgSpiceContext *ctx, const char *name) {
+    for (int i = 0; i < ctx->nderived_names; i++) {
+        if (strcmp(ctx->derived_names[i], name) == 0) {
+            return ctx->derived_names[i];
+        }
+    }
+    ctx->derived_names = Tcl_Realloc(ctx->derived_names, (size_t)(ctx->nderived_names + 1) * sizeof(char *));
+    ctx->derived_names[ctx->nderived_names] = ckstrdup(name);
+    ctx->nderived_names++;
+    return ctx->derived_names[ctx->nderived_names - 1];
+}
+//***  Derived_Find function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Derived_Find --
+ *
+ *      Look up a derived vector definition by name.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context owning the list; caller holds ctx->mutex
+ *      const char *name             - input: derived vector name
+ *      DerivedVec **prev_out        - output (optional): predecessor in the list, NULL if the match is the head
+ *
+ * Results:
+ *      Pointer to the definition, or NULL if it does not exist.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static DerivedVec *Derived_Find(const NgSpiceContext *ctx, const char *name, DerivedVec **prev_out) {
+    DerivedVec *prev = NULL;
+    for (DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        if (strcmp(d->name, name) == 0) {
+            if (prev_out != NULL) {
+                *prev_out = prev;
+            }
+            return d;
+        }
+        prev = d;
+    }
+    return NULL;
+}
+//***  Derived_Resolve function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Derived_Resolve --
+ *
+ *      Map the operands of a derived vector to vecsa indices of a new run and infer whether the result is real. The
+ *      inference walks the program once with a "complex" flag per stack slot, following what XExpr_EvalRow returns:
+ *      functions returning magnitudes/phases/parts are real, binary operators are complex if either side is, sqrt
+ *      keeps the kind of its operand (a negative real operand gives NaN in the stored real vector, see
+ *      Derived_AppendRow). A derived vector whose name is a native vector of the run is skipped for the run.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context with the current run table; caller holds ctx->mutex
+ *      DerivedVec *d                - input/output: definition to resolve
+ *      pvecinfoall vinfo            - input: run metadata from SendInitDataCallback
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Updates d->in_idx, d->resolved and d->is_real.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Derived_Resolve(const NgSpiceContext *ctx, DerivedVec *d, pvecinfoall vinfo) {
+    const XProg *prog = d->prog;
+    d->resolved = (ResolveRunVector(ctx, d->name) < 0) ? 1 : 0;
+    d->is_real = 1;
+    for (int k = 0; k < prog->nnames; k++) {
+        d->in_idx[k] = ResolveRunOperand(ctx, prog, k);
+        if (d->in_idx[k] < 0) {
+            d->resolved = 0;
+        }
+    }
+    if (d->resolved == 0) {
+        return;
+    }
+    XVal *cplx = d->stack;
+    int sp = 0;
+    for (int pc = 0; pc < prog->ncode; pc++) {
+        const XInstr *in = &prog->code[pc];
+        switch (in->op) {
+        case XOP_VEC:
+            cplx[sp].is_complex = (vinfo->vecs[d->in_idx[in->arg]]->is_real) ? 0 : 1;
+            sp++;
+            break;
+        case XOP_NUM:
+            cplx[sp].is_complex = 0;
+            sp++;
+            break;
+        case XOP_NEG:
+            break;
+        case XOP_FUNC:
+            if (XFuncTable[in->arg].arity == 2) {
+                sp--;
+                cplx[sp - 1].is_complex = 0;
+            } else if ((in->arg == (int)XF_ABS) || (in->arg == (int)XF_MAG) || (in->arg == (int)XF_PH) ||
+                       (in->arg == (int)XF_REAL) || (in->arg == (int)XF_IMAG) || (in->arg == (int)XF_DB)) {
+                cplx[sp - 1].is_complex = 0;
+            } else {
+                /* No action required: all valid cases handled above (MISRA 15.7) */
+            }
+            break;
+        default:
+            sp--;
+            cplx[sp - 1].is_complex |= cplx[sp].is_complex;
+            break;
+        }
+    }
+    d->is_real = (cplx[0].is_complex == 0) ? 1 : 0;
+}
+//***  Derived_UpdateKeep function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Derived_UpdateKeep --
+ *
+ *      Recompute the per-vector keep mask of the current run from the resolved derived vectors that were registered
+ *      with -drop.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: context; caller holds ctx->mutex
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Replaces ctx->run_keep; leaves it NULL when every vector is kept.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Derived_UpdateKeep(NgSpiceContext *ctx) {
+    Tcl_Free(ctx->run_keep);
+    ctx->run_keep = NULL;
+    for (const DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        if ((d->drop == 0) || (d->resolved == 0)) {
+            continue;
+        }
+        if (ctx->run_keep == NULL) {
+            ctx->run_keep = Tcl_Alloc((size_t)ctx->run_veccount + (size_t)1);
+            memset(ctx->run_keep, 1, (size_t)ctx->run_veccount + (size_t)1);
+        }
+        for (int k = 0; k < d->prog->nnames; k++) {
+            ctx->run_keep[d->in_idx[k]] = 0U;
+        }
+    }
+}
+//***  Derived_AppendRow function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Derived_AppendRow --
+ *
+ *      Evaluate every resolved derived vector on one row of simulation data and append the results to the row as
+ *      ordinary cells, then remove the cells of dropped input vectors. Called from SendDataCallback on the ngspice
+ *      thread; operands are taken straight from vecsa by index into the buffers of the definition and the cells
+ *      share the interned name, so no name lookup or allocation other than the row growth happens per row.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: context with derived vectors and keep mask; caller holds ctx->mutex
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *      DataRow *row                 - input/output: row copied from all, in vecsa order
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Reallocates row->vecs; frees the names of dropped cells. An evaluation error yields NaN for that row so the
+ *      derived vector stays aligned with the scale; the value is stored in the kind set by Derived_Resolve, so a
+ *      complex result of a vector inferred as real (sqrt of a negative value) is stored as NaN too.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Derived_AppendRow(NgSpiceContext *ctx, pvecvaluesall all, DataRow *row) {
+    int extra = 0;
+    for (const DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        extra += d->resolved;
+    }
+    if (extra > 0) {
+        row->vecs = Tcl_Realloc(row->vecs, sizeof(DataCell) * (size_t)(row->veccount + extra));
+    }
+    for (const DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        if (d->resolved == 0) {
+            continue;
+        }
+        char err[128];
+        XVal out;
+        DataCell *cell = &row->vecs[row->veccount];
+        cell->name = d->cell_name;
+        cell->shared_name = 1;
+        cell->is_complex = (d->is_real == 1) ? 0 : 1;
+        cell->creal = NAN;
+        cell->cimag = 0.0;
+        if ((XVal_FromRow(d->prog, d->in_idx, all, d->in_vals) == 1) &&
+            (XExpr_EvalRow(d->prog, d->in_vals, d->stack, &out, err, sizeof(err)) == 1) &&
+            ((out.is_complex == 0) || (d->is_real == 0))) {
+            cell->creal = out.re;
+            cell->cimag = out.im;
+        }
+        row->veccount++;
+    }
+    if (ctx->run_keep != NULL) {
+        int w = 0;
+        for (int i = 0; i < row->veccount; i++) {
+            if ((i < ctx->run_veccount) && (ctx->run_keep[i] == 0U)) {
+                Tcl_Free(row->vecs[i].name);
+                continue;
+            }
+            row->vecs[w] = row->vecs[i];
+            w++;
+        }
+        row->veccount = w;
+    }
+}
+//***  Derived_PatchSnap function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Derived_PatchSnap --
+ *
+ *      Make the vector metadata snapshot of a new run describe what will actually be stored: append an entry for every
+ *      resolved derived vector (numbered after the native vectors) and remove the entries of dropped inputs.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context with resolved derived vectors and keep mask; caller holds
+ *                                     ctx->mutex
+ *      InitSnap *snap               - input/output: snapshot built from the SendInitDataCallback metadata
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Reallocates snap->vecs and frees the names of removed entries.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Derived_PatchSnap(const NgSpiceContext *ctx, InitSnap *snap) {
+    int extra = 0;
+    for (const DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        extra += d->resolved;
+    }
+    if (extra == 0) {
+        return;
+    }
+    int native = snap->veccount;
+    snap->vecs = Tcl_Realloc(snap->vecs, (size_t)(native + extra) * sizeof *snap->vecs);
+    for (const DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        if (d->resolved == 0) {
+            continue;
+        }
+        snap->vecs[snap->veccount].name = ckstrdup(d->name);
+        snap->vecs[snap->veccount].number = snap->veccount;
+        snap->vecs[snap->veccount].is_real = d->is_real;
+        snap->veccount++;
+    }
+    if (ctx->run_keep != NULL) {
+        int w = 0;
+        for (int i = 0; i < snap->veccount; i++) {
+            if ((i < native) && (ctx->run_keep[i] == 0U)) {
+                Tcl_Free(snap->vecs[i].name);
+                continue;
+            }
+            snap->vecs[w] = snap->vecs[i];
+            w++;
+        }
+        snap->veccount = w;
+    }
+}
+//** data triggers
+//***  Trig_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_Free --
+ *
+ *      Release a single trigger definition.
+ *
+ * Parameters:
+ *      Trigger *t                   - input: definition to free; may be NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the name, expression text, compiled program, operand index table, evaluation buffers and the structure
+ *      itself.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Trig_Free(Trigger *t) {
+    if (t == NULL) {
+        return;
+    }
+    Tcl_Free(t->name);
+    Tcl_Free(t->src);
+    XProg_Free(t->prog);
+    Tcl_Free(t->in_idx);
+    Tcl_Free(t->in_vals);
+    Tcl_Free(t->stack);
+    Tcl_Free(t);
+}
+//***  Trig_Find function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_Find --
+ *
+ *      Look up a trigger by name.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context owning the list; caller holds ctx->mutex
+ *      const char *name             - input: trigger name
+ *      Trigger **prev_out           - output (optional): predecessor in the list, NULL if the match is the head
+ *
+ * Results:
+ *      Pointer to the trigger, or NULL if it does not exist.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Trigger *Trig_Find(const NgSpiceContext *ctx, const char *name, Trigger **prev_out) {
+    Trigger *prev = NULL;
+    for (Trigger *t = ctx->trig_head; t != NULL; t = t->next) {
+        if (strcmp(t->name, name) == 0) {
+            if (prev_out != NULL) {
+                *prev_out = prev;
+            }
+            return t;
+        }
+        prev = t;
+    }
+    return NULL;
+}
+//***  Trig_Reset function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_Reset --
+ *
+ *      Map the operands of a trigger to vecsa indices of the current run and clear its firing state, so it is armed
+ *      for the run.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context with the current run table; caller holds ctx->mutex
+ *      Trigger *t                   - input/output: trigger to resolve and re-arm
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Updates t->in_idx, t->resolved and the per-run state fields.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Trig_Reset(const NgSpiceContext *ctx, Trigger *t) {
+    t->resolved = 1;
+    for (int k = 0; k < t->prog->nnames; k++) {
+        t->in_idx[k] = ResolveRunOperand(ctx, t->prog, k);
+        if (t->in_idx[k] < 0) {
+            t->resolved = 0;
+        }
+    }
+    t->fired = 0;
+    t->at = NAN;
+    t->value = NAN;
+    t->row = -1;
+    t->have_prev = 0;
+    t->band_since = NAN;
+}
+//***  Trig_ParseCondition function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_ParseCondition --
+ *
+ *      Parse one condition option (-above L, -below L or -settle {target tol hold}) into a trigger definition. Shared
+ *      by the "trigger" and "capture" subcommands.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter for errors
+ *      const char *opt              - input: option name
+ *      Tcl_Obj *val                 - input: option value
+ *      Trigger *t                   - output: kind, level, tol and hold are set on success
+ *
+ * Results:
+ *      TCL_OK if the option was parsed, TCL_CONTINUE if it is not a condition option, TCL_ERROR with a message in
+ *      the interpreter result on a bad value.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Trig_ParseCondition(Tcl_Interp *interp, const char *opt, Tcl_Obj *val, Trigger *t) {
+    if ((strcmp(opt, "-above") == 0) || (strcmp(opt, "-below") == 0)) {
+        if (Tcl_GetDoubleFromObj(interp, val, &t->level) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        t->kind = (opt[1] == 'a') ? TRIG_ABOVE : TRIG_BELOW;
+        return TCL_OK;
+    }
+    if (strcmp(opt, "-settle") != 0) {
+        return TCL_CONTINUE;
+    }
+    Tcl_Size slen;
+    Tcl_Obj **selems;
+    if ((Tcl_ListObjGetElements(interp, val, &slen, &selems) != TCL_OK) || (slen != 3) ||
+        (Tcl_GetDoubleFromObj(interp, selems[0], &t->level) != TCL_OK) ||
+        (Tcl_GetDoubleFromObj(interp, selems[1], &t->tol) != TCL_OK) ||
+        (Tcl_GetDoubleFromObj(interp, selems[2], &t->hold) != TCL_OK) || (t->tol < 0.0) || (t->hold < 0.0)) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("expected {target tol hold} with non-negative tol and hold after -settle",
+                                          -1));
+        return TCL_ERROR;
+    }
+    t->kind = TRIG_SETTLE;
+    return TCL_OK;
+}
+//***  Trig_Crossing function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_Crossing --
+ *
+ *      Linear interpolation of the scale value at which the segment (x0, y0)-(x1, y1) crosses a level.
+ *
+ * Parameters:
+ *      double x0, double y0         - input: previous point
+ *      double x1, double y1         - input: current point
+ *      double level                 - input: level between y0 and y1
+ *
+ * Results:
+ *      Interpolated scale value; x1 if the segment is flat.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static double Trig_Crossing(double x0, double y0, double x1, double y1, double level) {
+    if (y1 == y0) {
+        return x1;
+    }
+    return x0 + ((level - y0) * (x1 - x0) / (y1 - y0));
+}
+//***  Trig_Step function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_Step --
+ *
+ *      Advance one armed trigger by one row and decide whether its condition holds:
+ *
+ *          -above L       value > L; the time is interpolated on the segment that crossed L
+ *          -below L       value < L; likewise
+ *          -settle        |value - L| <= tol continuously over a scale span >= hold; the time is where the value
+ *                         entered the band (interpolated on the band edge)
+ *
+ * Parameters:
+ *      Trigger *t                   - input/output: armed trigger
+ *      double x                     - input: scale value of the row
+ *      double y                     - input: expression value on the row (magnitude for complex results)
+ *
+ * Results:
+ *      1 if the trigger fired on this row, 0 otherwise.
+ *
+ * Side Effects:
+ *      Updates t->prev_x/prev_y/band_since and, when firing, t->fired, t->at and t->value.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Trig_Step(Trigger *t, double x, double y) {
+    int fire = 0;
+    double at = x;
+    if (isnan(y)) {
+        t->have_prev = 0;
+        t->band_since = NAN;
+        return 0;
+    }
+    if (t->kind == TRIG_ABOVE) {
+        if (y > t->level) {
+            fire = 1;
+            if ((t->have_prev == 1) && (t->prev_y <= t->level)) {
+                at = Trig_Crossing(t->prev_x, t->prev_y, x, y, t->level);
+            }
+        }
+    } else if (t->kind == TRIG_BELOW) {
+        if (y < t->level) {
+            fire = 1;
+            if ((t->have_prev == 1) && (t->prev_y >= t->level)) {
+                at = Trig_Crossing(t->prev_x, t->prev_y, x, y, t->level);
+            }
+        }
+    } else {
+        if (fabs(y - t->level) <= t->tol) {
+            if (isnan(t->band_since)) {
+                t->band_since = x;
+                if (t->have_prev == 1) {
+                    double edge = (t->prev_y > t->level) ? (t->level + t->tol) : (t->level - t->tol);
+                    t->band_since = Trig_Crossing(t->prev_x, t->prev_y, x, y, edge);
+                }
+            }
+            if (fabs(x - t->band_since) >= t->hold) {
+                fire = 1;
+                at = t->band_since;
+            }
+        } else {
+            t->band_since = NAN;
+        }
+    }
+    t->have_prev = 1;
+    t->prev_x = x;
+    t->prev_y = y;
+    if (fire == 1) {
+        t->fired = 1;
+        t->at = at;
+        t->value = y;
+    }
+    return fire;
+}
+//***  Trig_Holds function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_Holds --
+ *
+ *      Test the instantaneous part of a trigger condition on one value, ignoring crossing and hold time.
+ *
+ * Parameters:
+ *      const Trigger *t             - input: trigger
+ *      double y                     - input: expression value
+ *
+ * Results:
+ *      1 if the value is above/below the level or within the settle band, 0 otherwise (also for NaN).
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Trig_Holds(const Trigger *t, double y) {
+    if (t->kind == TRIG_ABOVE) {
+        return (y > t->level) ? 1 : 0;
+    }
+    if (t->kind == TRIG_BELOW) {
+        return (y < t->level) ? 1 : 0;
+    }
+    return (fabs(y - t->level) <= t->tol) ? 1 : 0;
+}
+//***  Trig_Value function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_Value --
+ *
+ *      Evaluate the expression of a resolved trigger on one row of simulation data; operands are taken straight from
+ *      vecsa by index into the buffers of the trigger, like Derived_AppendRow(), so nothing is allocated per row.
+ *
+ * Parameters:
+ *      Trigger *t                   - input/output: resolved trigger (t->in_vals and t->stack are overwritten)
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *
+ * Results:
+ *      Expression value (magnitude for complex results), NaN on evaluation error.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static double Trig_Value(Trigger *t, pvecvaluesall all) {
+    char err[128];
+    XVal out;
+    if ((XVal_FromRow(t->prog, t->in_idx, all, t->in_vals) == 0) ||
+        (XExpr_EvalRow(t->prog, t->in_vals, t->stack, &out, err, sizeof(err)) == 0)) {
+        return NAN;
+    }
+    return (out.is_complex == 1) ? hypot(out.re, out.im) : out.re;
+}
+//***  Trig_RowScale function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_RowScale --
+ *
+ *      Scale value of a row: the value of the scale vector of the current run, or the row index if the scale is not
+ *      known.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context with the current run table; caller holds ctx->mutex
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *
+ * Results:
+ *      Scale value.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static double Trig_RowScale(const NgSpiceContext *ctx, pvecvaluesall all) {
+    if ((ctx->scale_idx >= 0) && (ctx->scale_idx < all->veccount)) {
+        return all->vecsa[ctx->scale_idx]->creal;
+    }
+    return (double)all->vecindex;
+}
+//***  Trig_EvalRow function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_EvalRow --
+ *
+ *      Evaluate every armed trigger on one row of simulation data. Called from SendDataCallback on the ngspice
+ *      thread.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: context with triggers; caller holds ctx->mutex
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *      int *halt_out                - output: set to 1 if a trigger created with -halt fired on this row
+ *
+ * Results:
+ *      Number of triggers that fired on this row.
+ *
+ * Side Effects:
+ *      Updates trigger state; queues a "# trigger ... fired" message for every trigger that fired. A trigger fires
+ *      at most once per run.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Trig_EvalRow(NgSpiceContext *ctx, pvecvaluesall all, int *halt_out) {
+    int nfired = 0;
+    double x = Trig_RowScale(ctx, all);
+    for (Trigger *t = ctx->trig_head; t != NULL; t = t->next) {
+        if ((t->resolved == 0) || (t->fired == 1)) {
+            continue;
+        }
+        if (Trig_Step(t, x, Trig_Value(t, all)) == 1) {
+            t->row = all->vecindex;
+            nfired++;
+            if (t->halt == 1) {
+                *halt_out = 1;
+            }
+            char msg[256];
+            snprintf(msg, sizeof(msg), "# trigger %s fired at %.17g", t->name, t->at);
+            Msg_Put(ctx, msg);
+        }
+    }
+    return nfired;
+}
+//***  Trig_HaltThreadProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_HaltThreadProc --
+ *
+ *      Body of the helper thread that halts the background run after a -halt trigger fired. "bg_halt" waits for the
+ *      ngspice background thread to finish, so it cannot be sent from SendDataCallback itself, which runs on that
+ *      thread.
+ *
+ * Parameters:
+ *      ClientData cd                - input: NgSpiceContext * of the instance
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Moves ctx->state from NGSTATE_BG_ACTIVE to NGSTATE_STOPPING_BG, so commands issued meanwhile are deferred, and
+ *      sends "bg_halt" to ngspice only if it did; otherwise the run already ended or is being stopped by the Tcl
+ *      thread, and ngspice is not entered.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_ThreadCreateType Trig_HaltThreadProc(ClientData cd) {
+    NgSpiceContext *ctx = (NgSpiceContext *)cd;
+    int stopping = 0;
+    Lock_Enter(ctx, LOCK_BG_MU);
+    if (ctx->state == NGSTATE_BG_ACTIVE) {
+        State_Set(ctx, NGSTATE_STOPPING_BG);
+        stopping = 1;
+    }
+    Lock_Leave(ctx, LOCK_BG_MU);
+    if (stopping == 1) {
+        Run_Halted(ctx);
+        ctx->ngSpice_Command("bg_halt");
+    }
+    TCL_THREAD_CREATE_RETURN;
+}
+//***  Trig_StartHalt function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_StartHalt --
+ *
+ *      Start the helper thread that halts the background run, unless one is already pending.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Creates a joinable thread running Trig_HaltThreadProc(); sets ctx->halt_pending and ctx->halt_tid under
+ *      ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Trig_StartHalt(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if ((ctx->halt_pending == 0) && (Inst_Destroying(ctx) == 0)) {
+        if (Tcl_CreateThread(&ctx->halt_tid, Trig_HaltThreadProc, (ClientData)ctx, TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_JOINABLE) == TCL_OK) {
+            ctx->halt_pending = 1;
+        }
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+}
+//***  Trig_JoinHalt function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trig_JoinHalt --
+ *
+ *      Wait for a pending halt helper thread to finish. Called by InstObjCmd before every subcommand and during
+ *      instance deletion, so the Tcl thread never enters ngspice together with the helper (ngspice is not
+ *      re-entrant), and a late "bg_halt" can never hit a subsequent run or a freed context.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May block until the background run has stopped; clears ctx->halt_pending.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Trig_JoinHalt(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    int pending = ctx->halt_pending;
+    Tcl_ThreadId tid = ctx->halt_tid;
+    ctx->halt_pending = 0;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (pending == 1) {
+        int rc;
+        Tcl_JoinThread(tid, &rc);
+    }
+}
+
+//** capture windows
+//***  Cap_FreeSegments function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_FreeSegments --
+ *
+ *      Release all segments of a capture and re-arm it.
+ *
+ * Parameters:
+ *      Capture *c                   - input/output: capture
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the segment list; clears c->cur, c->nseg and the edge-triggering latch.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Cap_FreeSegments(Capture *c) {
+    CapSegment *s = c->seg_head;
+    while (s != NULL) {
+        CapSegment *next = s->next;
+        Tcl_Free(s->data);
+        Tcl_Free(s);
+        s = next;
+    }
+    c->seg_head = NULL;
+    c->seg_tail = NULL;
+    c->nseg = 0;
+    c->cur = NULL;
+    c->post_left = 0;
+    c->need_clear = 0;
+}
+//***  Cap_FreeRun function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_FreeRun --
+ *
+ *      Release the per-run tables of a capture (resolved vectors and pre-trigger ring).
+ *
+ * Parameters:
+ *      Capture *c                   - input/output: capture
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees c->names, c->vec_idx, c->cplx and c->ring and sets c->nvec to 0.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Cap_FreeRun(Capture *c) {
+    for (int k = 0; k < c->nvec; k++) {
+        Tcl_Free(c->names[k]);
+    }
+    Tcl_Free(c->names);
+    Tcl_Free(c->vec_idx);
+    Tcl_Free(c->cplx);
+    Tcl_Free(c->ring);
+    c->names = NULL;
+    c->vec_idx = NULL;
+    c->cplx = NULL;
+    c->ring = NULL;
+    c->nvec = 0;
+    c->ring_head = 0;
+    c->ring_fill = 0;
+}
+//***  Cap_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_Free --
+ *
+ *      Release a capture definition with its segments and its embedded condition.
+ *
+ * Parameters:
+ *      Capture *c                   - input: capture to free; may be NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees all memory owned by the capture and the structure itself.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Cap_Free(Capture *c) {
+    if (c == NULL) {
+        return;
+    }
+    Cap_FreeSegments(c);
+    Cap_FreeRun(c);
+    if (c->want != NULL) {
+        Tcl_DecrRefCount(c->want);
+    }
+    Tcl_Free(c->cond.src);
+    XProg_Free(c->cond.prog);
+    Tcl_Free(c->cond.in_idx);
+    Tcl_Free(c->cond.in_vals);
+    Tcl_Free(c->cond.stack);
+    Tcl_Free(c->name);
+    Tcl_Free(c);
+}
+//***  Cap_Find function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_Find --
+ *
+ *      Look up a capture by name.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context owning the list; caller holds ctx->mutex
+ *      const char *name             - input: capture name
+ *      Capture **prev_out           - output (optional): predecessor in the list, NULL if the match is the head
+ *
+ * Results:
+ *      Pointer to the capture, or NULL if it does not exist.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Capture *Cap_Find(const NgSpiceContext *ctx, const char *name, Capture **prev_out) {
+    Capture *prev = NULL;
+    for (Capture *c = ctx->cap_head; c != NULL; c = c->next) {
+        if (strcmp(c->name, name) == 0) {
+            if (prev_out != NULL) {
+                *prev_out = prev;
+            }
+            return c;
+        }
+        prev = c;
+    }
+    return NULL;
+}
+//***  Cap_Reset function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_Reset --
+ *
+ *      Prepare a capture for the current run: resolve its condition and the captured vectors (all vectors of the run
+ *      unless a list was given), allocate the pre-trigger ring and drop the segments of the previous run.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context with the current run table; caller holds ctx->mutex
+ *      Capture *c                   - input/output: capture
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Reallocates the per-run tables, frees all segments and re-arms the condition.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Cap_Reset(const NgSpiceContext *ctx, Capture *c) {
+    Cap_FreeSegments(c);
+    Cap_FreeRun(c);
+    Trig_Reset(ctx, &c->cond);
+    Tcl_Size nwant = 0;
+    Tcl_Obj **want = NULL;
+    if (c->want != NULL) {
+        Tcl_ListObjGetElements(NULL, c->want, &nwant, &want);
+        c->nvec = (int)nwant;
+    } else {
+        c->nvec = ctx->run_veccount;
+    }
+    if (c->nvec == 0) {
+        return;
+    }
+    c->names = Tcl_Alloc((size_t)c->nvec * sizeof(char *));
+    c->vec_idx = Tcl_Alloc((size_t)c->nvec * sizeof(int));
+    c->cplx = Tcl_Alloc((size_t)c->nvec);
+    memset(c->cplx, 0, (size_t)c->nvec);
+    for (int k = 0; k < c->nvec; k++) {
+        if (want != NULL) {
+            c->names[k] = ckstrdup(Tcl_GetString(want[k]));
+            c->vec_idx[k] = ResolveRunVector(ctx, c->names[k]);
+        } else {
+            c->names[k] = ckstrdup(ctx->run_names[k]);
+            c->vec_idx[k] = k;
+        }
+    }
+    if (c->pre > 0) {
+        c->ring = Tcl_Alloc((size_t)c->pre * (size_t)c->nvec * 2U * sizeof(double));
+    }
+}
+//***  Cap_Fill function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_Fill --
+ *
+ *      Copy the captured vectors of one row into a {re, im} pair buffer.
+ *
+ * Parameters:
+ *      Capture *c                   - input/output: capture; complex flags are updated
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *      double *dst                  - output: c->nvec pairs
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Vectors missing from the run are stored as NaN.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Cap_Fill(Capture *c, pvecvaluesall all, double *dst) {
+    for (int k = 0; k < c->nvec; k++) {
+        int i = c->vec_idx[k];
+        if ((i < 0) || (i >= all->veccount)) {
+            dst[2 * k] = NAN;
+            dst[(2 * k) + 1] = 0.0;
+            continue;
+        }
+        pvecvalues v = all->vecsa[i];
+        dst[2 * k] = v->creal;
+        dst[(2 * k) + 1] = v->cimag;
+        if (v->is_complex) {
+            c->cplx[k] = 1U;
+        }
+    }
+}
+//***  Cap_SegRow function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_SegRow --
+ *
+ *      Append an uninitialized row to a segment.
+ *
+ * Parameters:
+ *      CapSegment *s                - input/output: segment
+ *      size_t width                 - input: doubles per row (2 * nvec)
+ *
+ * Results:
+ *      Pointer to the new row.
+ *
+ * Side Effects:
+ *      May reallocate s->data (capacity doubles).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static double *Cap_SegRow(CapSegment *s, size_t width) {
+    if (s->nrows == s->cap) {
+        s->cap = (s->cap == 0) ? 16 : (s->cap * 2);
+        s->data = Tcl_Realloc(s->data, (size_t)s->cap * width * sizeof(double));
+    }
+    double *row = &s->data[(size_t)s->nrows * width];
+    s->nrows++;
+    return row;
+}
+//***  Cap_Row function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_Row --
+ *
+ *      Feed one row of simulation data to every capture, like the acquisition of an oscilloscope in normal trigger
+ *      mode. Called from SendDataCallback on the ngspice thread.
+ *
+ *      While armed, the condition is evaluated (Trig_Step); when it fires, a new segment is started with the rows of
+ *      the pre-trigger ring and the trigger row, and the next "post" rows are appended to it. After a segment is
+ *      complete the condition must stop holding before the capture re-arms, so a level that stays crossed produces
+ *      one segment. The ring always holds the last "pre" rows.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: context with captures; caller holds ctx->mutex
+ *      pvecvaluesall all            - input: current row as delivered by ngspice
+ *
+ * Results:
+ *      Number of segments started on this row.
+ *
+ * Side Effects:
+ *      Updates capture state and allocates segment storage.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Cap_Row(NgSpiceContext *ctx, pvecvaluesall all) {
+    int started = 0;
+    double x = Trig_RowScale(ctx, all);
+    for (Capture *c = ctx->cap_head; c != NULL; c = c->next) {
+        if ((c->cond.resolved == 0) || (c->nvec == 0)) {
+            continue;
+        }
+        size_t width = (size_t)c->nvec * 2U;
+        if (c->cur != NULL) {
+            Cap_Fill(c, all, Cap_SegRow(c->cur, width));
+            c->post_left--;
+            if (c->post_left <= 0) {
+                c->cur = NULL;
+                c->need_clear = 1;
+            }
+        } else {
+            double y = Trig_Value(&c->cond, all);
+            if (c->need_clear == 1) {
+                if (Trig_Holds(&c->cond, y) == 0) {
+                    c->need_clear = 0;
+                }
+                c->cond.have_prev = isnan(y) ? 0 : 1;
+                c->cond.prev_x = x;
+                c->cond.prev_y = y;
+                c->cond.band_since = NAN;
+            } else if (((c->maxseg == 0) || (c->nseg < c->maxseg)) && (Trig_Step(&c->cond, x, y) == 1)) {
+                CapSegment *s = Tcl_Alloc(sizeof *s);
+                memset(s, 0, sizeof *s);
+                s->at = c->cond.at;
+                s->row = all->vecindex;
+                for (int r = 0; r < c->ring_fill; r++) {
+                    int slot = (c->ring_head - c->ring_fill + r + c->pre) % c->pre;
+                    memcpy(Cap_SegRow(s, width), &c->ring[(size_t)slot * width], width * sizeof(double));
+                }
+                Cap_Fill(c, all, Cap_SegRow(s, width));
+                if (c->seg_tail == NULL) {
+                    c->seg_head = s;
+                } else {
+                    c->seg_tail->next = s;
+                }
+                c->seg_tail = s;
+                c->nseg++;
+                c->cond.fired = 0;
+                if (c->post > 0) {
+                    c->cur = s;
+                    c->post_left = c->post;
+                } else {
+                    c->need_clear = 1;
+                }
+                started++;
+            } else {
+                /* No action required: all valid cases handled above (MISRA 15.7) */
+            }
+        }
+        if (c->pre > 0) {
+            Cap_Fill(c, all, &c->ring[(size_t)c->ring_head * width]);
+            c->ring_head = (c->ring_head + 1) % c->pre;
+            if (c->ring_fill < c->pre) {
+                c->ring_fill++;
+            }
+        }
+    }
+    return started;
+}
+//***  Cap_SegmentObj function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cap_SegmentObj --
+ *
+ *      Convert one capture segment to a Tcl dict {at X row N rows N data {name values ...}}, with complex vectors as
+ *      lists of {re im} pairs like "vectors".
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter (for dict operations)
+ *      const Capture *c             - input: capture owning the segment; caller holds ctx->mutex
+ *      const CapSegment *s          - input: segment
+ *
+ * Results:
+ *      New Tcl dict object (refcount 0).
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *Cap_SegmentObj(Tcl_Interp *interp, const Capture *c, const CapSegment *s) {
+    size_t width = (size_t)c->nvec * 2U;
+    Tcl_Obj *data = Tcl_NewDictObj();
+    for (int k = 0; k < c->nvec; k++) {
+        Tcl_Obj *vals = Tcl_NewListObj(0, NULL);
+        for (int r = 0; r < s->nrows; r++) {
+            const double *cell = &s->data[((size_t)r * width) + (2U * (size_t)k)];
+            if (c->cplx[k] == 1U) {
+                Tcl_Obj *pair = Tcl_NewListObj(0, NULL);
+                Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(cell[0]));
+                Tcl_ListObjAppendElement(interp, pair, Tcl_NewDoubleObj(cell[1]));
+                Tcl_ListObjAppendElement(interp, vals, pair);
+            } else {
+                Tcl_ListObjAppendElement(interp, vals, Tcl_NewDoubleObj(cell[0]));
+            }
+        }
+        Tcl_DictObjPut(interp, data, Tcl_NewStringObj(c->names[k], -1), vals);
+    }
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("at", -1), Tcl_NewDoubleObj(s->at));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("row", -1), Tcl_NewIntObj(s->row));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("rows", -1), Tcl_NewIntObj(s->nrows));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("data", -1), data);
+    return d;
+}
+
+//** xy series helpers
+//***  Series_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Series_Free --
+ *
+ *      Release the arrays of a comparison series.
+ *
+ * Parameters:
+ *      XYSeries *s                  - input/output: series
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees s->x and s->y and clears the series.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Series_Free(XYSeries *s) {
+    Tcl_Free(s->x);
+    Tcl_Free(s->y);
+    s->x = NULL;
+    s->y = NULL;
+    s->n = 0;
+}
+//***  Series_Alloc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Series_Alloc --
+ *
+ *      Allocate the arrays of a comparison series.
+ *
+ * Parameters:
+ *      XYSeries *s                  - output: series
+ *      size_t n                     - input: number of points
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Allocates s->x and s->y.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Series_Alloc(XYSeries *s, size_t n) {
+    size_t bytes = (n > 0U) ? n * sizeof(double) : sizeof(double);
+    s->x = Tcl_Alloc(bytes);
+    s->y = Tcl_Alloc(bytes);
+    s->n = n;
+}
+//***  Series_FromColumns function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Series_FromColumns --
+ *
+ *      Build a comparison series from a scale column and a value column; complex values are compared by magnitude.
+ *
+ * Parameters:
+ *      XYSeries *s                  - output: series (length of the shorter column)
+ *      const XCol *scale            - input: scale column (real part is used)
+ *      const XCol *vals             - input: value column
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Allocates s->x and s->y.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Series_FromColumns(XYSeries *s, const XCol *scale, const XCol *vals) {
+    size_t n = (scale->n < vals->n) ? scale->n : vals->n;
+    Series_Alloc(s, n);
+    memcpy(s->x, scale->re, n * sizeof(double));
+    if (vals->is_complex == 1) {
+        for (size_t i = 0; i < n; i++) {
+            s->y[i] = hypot(vals->re[i], vals->im[i]);
+        }
+    } else {
+        memcpy(s->y, vals->re, n * sizeof(double));
+    }
+}
+//***  Series_Normalize function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Series_Normalize --
+ *
+ *      Make the scale of a series non-decreasing: a decreasing scale (e.g. a DC sweep with negative step) is reversed
+ *      in place, any other non-monotonic scale is rejected.
+ *
+ * Parameters:
+ *      XYSeries *s                  - input/output: series
+ *
+ * Results:
+ *      1 if the scale is now non-decreasing, 0 if it is not monotonic.
+ *
+ * Side Effects:
+ *      May reverse s->x and s->y.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Series_Normalize(XYSeries *s) {
+    if ((s->n > 1U) && (s->x[0] > s->x[s->n - 1U])) {
+        for (size_t i = 0, j = s->n - 1U; i < j; i++, j--) {
+            double tx = s->x[i];
+            double ty = s->y[i];
+            s->x[i] = s->x[j];
+            s->y[i] = s->y[j];
+            s->x[j] = tx;
+            s->y[j] = ty;
+        }
+    }
+    for (size_t i = 1; i < s->n; i++) {
+        if (s->x[i] < s->x[i - 1U]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+//***  Series_Interp function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Series_Interp --
+ *
+ *      Linear interpolation of a series at xq with a forward-only cursor. Queries must be non-decreasing for a given
+ *      cursor, so a full sweep costs O(n) in total.
+ *
+ * Parameters:
+ *      const XYSeries *s            - input: series with at least one point
+ *      size_t *cur                  - input/output: cursor (segment start index)
+ *      double xq                    - input: query position, clamped to the series range
+ *
+ * Results:
+ *      Interpolated value.
+ *
+ * Side Effects:
+ *      Advances *cur.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static double Series_Interp(const XYSeries *s, size_t *cur, double xq) {
+    if (s->n == 1U) {
+        return s->y[0];
+    }
+    size_t c = *cur;
+    while (((c + 2U) < s->n) && (s->x[c + 1U] <= xq)) {
+        c++;
+    }
+    *cur = c;
+    double x0 = s->x[c];
+    double x1 = s->x[c + 1U];
+    if (xq <= x0) {
+        return s->y[c];
+    }
+    if ((xq >= x1) || (x1 == x0)) {
+        return s->y[c + 1U];
+    }
+    return s->y[c] + (((s->y[c + 1U] - s->y[c]) * (xq - x0)) / (x1 - x0));
+}
+//***  CurrentScaleName function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * CurrentScaleName --
+ *
+ *      Determine the name of the scale vector to pair with a vector: the explicit name if given, otherwise the scale
+ *      of the current run as detected by SendInitDataCallback.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      const char *override         - input: explicit scale name, or NULL
+ *
+ * Results:
+ *      Newly allocated name (free with Tcl_Free), or NULL if no scale is known yet.
+ *
+ * Side Effects:
+ *      Locks ctx->mutex briefly.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static char *CurrentScaleName(NgSpiceContext *ctx, const char *override) {
+    char *name = NULL;
+    if (override != NULL) {
+        return ckstrdup(override);
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if ((ctx->scale_idx >= 0) && (ctx->scale_idx < ctx->run_veccount)) {
+        name = ckstrdup(ctx->run_names[ctx->scale_idx]);
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return name;
+}
+//***  Series_Load function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Series_Load --
+ *
+ *      Load a vector together with its scale into a series with a non-decreasing scale.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      Tcl_Interp *interp           - input: interpreter for errors
+ *      const char *vecname          - input: vector name
+ *      const char *scalename        - input: explicit scale name, or NULL for the scale of the current run
+ *      int async                    - input: 1 to read from ngspice, 0 to read the bridge-stored vectors
+ *      XYSeries *s                  - output: series
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result.
+ *
+ * Side Effects:
+ *      Allocates the series.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Series_Load(NgSpiceContext *ctx, Tcl_Interp *interp, const char *vecname, const char *scalename, int async,
+                       XYSeries *s) {
+    char *names[2];
+    names[1] = CurrentScaleName(ctx, scalename);
+    if (names[1] == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("scale vector is not known yet, use -scale name", -1));
+        return TCL_ERROR;
+    }
+    names[0] = ckstrdup(vecname);
+    XCol cols[2];
+    int rc = LoadColumns(ctx, interp, names, NULL, 2, async, cols);
+    Tcl_Free(names[0]);
+    Tcl_Free(names[1]);
+    if (rc != TCL_OK) {
+        return TCL_ERROR;
+    }
+    Series_FromColumns(s, &cols[1], &cols[0]);
+    XCol_Free(&cols[0]);
+    XCol_Free(&cols[1]);
+    if (Series_Normalize(s) == 0) {
+        Series_Free(s);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("scale is not monotonic", -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+//** waveform comparison
+//***  Cmp_Run function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cmp_Run --
+ *
+ *      Compare an actual waveform against a reference in a single merged pass over both scales. For every actual
+ *      sample inside the reference scale range the reference is interpolated at the same scale value. The tolerance
+ *      envelope is [lo - abstol - reltol*|lo|, hi + abstol + reltol*|hi|], where lo/hi are the minimum/maximum of the
+ *      reference over the window [x - shift, x + shift]: the interpolated values at the window ends plus every
+ *      reference sample inside it, maintained with monotonic min/max deques. With shift = 0 the envelope is centered
+ *      on the interpolated reference value. All cursors move forward only, so the cost is O(n + m).
+ *
+ * Parameters:
+ *      const XYSeries *act          - input: actual waveform (non-decreasing scale)
+ *      const XYSeries *ref          - input: reference waveform (non-decreasing scale)
+ *      const CmpOpts *opts          - input: tolerances
+ *      CmpResult *res               - output: comparison summary
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Allocates and frees the deque buffers.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Cmp_Run(const XYSeries *act, const XYSeries *ref, const CmpOpts *opts, CmpResult *res) {
+    memset(res, 0, sizeof *res);
+    res->maxdev_at = NAN;
+    res->maxexcess_at = NAN;
+    res->firstfail_at = NAN;
+    if (ref->n == 0U) {
+        return;
+    }
+    double xfirst = ref->x[0];
+    double xlast = ref->x[ref->n - 1U];
+    size_t *dqmin = Tcl_Alloc(ref->n * sizeof(size_t));
+    size_t *dqmax = Tcl_Alloc(ref->n * sizeof(size_t));
+    size_t minh = 0;
+    size_t mint = 0;
+    size_t maxh = 0;
+    size_t maxt = 0;
+    size_t cmid = 0;
+    size_t clo = 0;
+    size_t chi = 0;
+    size_t jin = 0;
+    for (size_t i = 0; i < act->n; i++) {
+        double xi = act->x[i];
+        double yi = act->y[i];
+        if ((xi < xfirst) || (xi > xlast)) {
+            continue;
+        }
+        res->points++;
+        double r = Series_Interp(ref, &cmid, xi);
+        double lo = r;
+        double hi = r;
+        if (opts->shift > 0.0) {
+            double a = (xi - opts->shift < xfirst) ? xfirst : (xi - opts->shift);
+            double b = (xi + opts->shift > xlast) ? xlast : (xi + opts->shift);
+            double ra = Series_Interp(ref, &clo, a);
+            double rb = Series_Interp(ref, &chi, b);
+            lo = fmin(lo, fmin(ra, rb));
+            hi = fmax(hi, fmax(ra, rb));
+            while ((jin < ref->n) && (ref->x[jin] <= b)) {
+                while ((mint > minh) && (ref->y[dqmin[mint - 1U]] >= ref->y[jin])) {
+                    mint--;
+                }
+                dqmin[mint] = jin;
+                mint++;
+                while ((maxt > maxh) && (ref->y[dqmax[maxt - 1U]] <= ref->y[jin])) {
+                    maxt--;
+                }
+                dqmax[maxt] = jin;
+                maxt++;
+                jin++;
+            }
+            while ((minh < mint) && (ref->x[dqmin[minh]] < a)) {
+                minh++;
+            }
+            while ((maxh < maxt) && (ref->x[dqmax[maxh]] < a)) {
+                maxh++;
+            }
+            if (minh < mint) {
+                lo = fmin(lo, ref->y[dqmin[minh]]);
+            }
+            if (maxh < maxt) {
+                hi = fmax(hi, ref->y[dqmax[maxh]]);
+            }
+        }
+        double dev;
+        double excess;
+        if (isnan(yi) || isnan(r)) {
+            dev = (isnan(yi) && isnan(r)) ? 0.0 : INFINITY;
+            excess = dev;
+        } else {
+            dev = fabs(yi - r);
+            double below = (lo - (opts->abstol + (opts->reltol * fabs(lo)))) - yi;
+            double above = yi - (hi + opts->abstol + (opts->reltol * fabs(hi)));
+            excess = fmax(0.0, fmax(below, above));
+        }
+        if ((dev > res->maxdev) || isnan(res->maxdev_at)) {
+            res->maxdev = dev;
+            res->maxdev_at = xi;
+        }
+        if (excess > 0.0) {
+            res->fails++;
+            if (isnan(res->firstfail_at)) {
+                res->firstfail_at = xi;
+            }
+            if (excess > res->maxexcess) {
+                res->maxexcess = excess;
+                res->maxexcess_at = xi;
+            }
+        }
+    }
+    Tcl_Free(dqmin);
+    Tcl_Free(dqmax);
+}
+//***  Cmp_LoadReference function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Cmp_LoadReference --
+ *
+ *      Load a reference waveform from one of the supported sources:
+ *          - "-binary": byte array of native doubles, interleaved scale/value pairs (binary format d*)
+ *          - "-snapshot": dict shaped like the result of "vectors"; vector and scale are looked up by name
+ *          - "-file": text file with scale and value in the first two columns of each line (as written by the
+ *            ngspice "wrdata" command); empty lines and lines starting with '#' or '*' are skipped
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter for errors
+ *      const char *kind             - input: "-binary", "-snapshot" or "-file"
+ *      Tcl_Obj *src                 - input: reference data, snapshot or file name
+ *      const char *vecname          - input: vector name (snapshot only)
+ *      const char *scalename        - input: scale name (snapshot only)
+ *      XYSeries *ref                - output: reference series
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result.
+ *
+ * Side Effects:
+ *      Allocates the series; reads the file for "-file".
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Cmp_LoadReference(Tcl_Interp *interp, const char *kind, Tcl_Obj *src, const char *vecname,
+                             const char *scalename, XYSeries *ref) {
+    memset(ref, 0, sizeof *ref);
+    if (strcmp(kind, "-binary") == 0) {
+        Tcl_Size len = 0;
+        const unsigned char *bytes = Tcl_GetByteArrayFromObj(src, &len);
+        if ((bytes == NULL) || ((len % (Tcl_Size)(2U * sizeof(double))) != 0)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("binary reference must hold scale/value pairs of doubles", -1));
+            return TCL_ERROR;
+        }
+        size_t n = (size_t)len / (2U * sizeof(double));
+        Series_Alloc(ref, n);
+        for (size_t i = 0; i < n; i++) {
+            memcpy(&ref->x[i], bytes + ((2U * i) * sizeof(double)), sizeof(double));
+            memcpy(&ref->y[i], bytes + (((2U * i) + 1U) * sizeof(double)), sizeof(double));
+        }
+        return TCL_OK;
+    }
+    if (strcmp(kind, "-snapshot") == 0) {
+        Tcl_Obj *svals = VectorDict_Lookup(src, scalename);
+        Tcl_Obj *vvals = VectorDict_Lookup(src, vecname);
+        if ((svals == NULL) || (vvals == NULL)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("snapshot has no vector \"%s\"", (svals == NULL) ? scalename : vecname));
+            return TCL_ERROR;
+        }
+        XCol scol;
+        XCol vcol;
+        if (XCol_FromList(interp, svals, &scol) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (XCol_FromList(interp, vvals, &vcol) != TCL_OK) {
+            XCol_Free(&scol);
+            return TCL_ERROR;
+        }
+        Series_FromColumns(ref, &scol, &vcol);
+        XCol_Free(&scol);
+        XCol_Free(&vcol);
+        return TCL_OK;
+    }
+    Tcl_Channel chan = Tcl_OpenFileChannel(interp, Tcl_GetString(src), "r", 0);
+    if (chan == NULL) {
+        return TCL_ERROR;
+    }
+    size_t cap = 1024;
+    Series_Alloc(ref, cap);
+    ref->n = 0;
+    Tcl_Obj *line = Tcl_NewObj();
+    Tcl_IncrRefCount(line);
+    int rc = TCL_OK;
+    int lineno = 0;
+    while (Tcl_GetsObj(chan, line) >= 0) {
+        lineno++;
+        const char *p = Tcl_GetString(line);
+        while ((*p == ' ') || (*p == '\t')) {
+            p++;
+        }
+        if ((*p != '\0') && (*p != '#') && (*p != '*') && (*p != '\r')) {
+            char *end1 = NULL;
+            char *end2 = NULL;
+            double x = strtod(p, &end1);
+            double y = strtod(end1, &end2);
+            if ((end1 == p) || (end2 == end1)) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("malformed line %d in reference file", lineno));
+                rc = TCL_ERROR;
+                break;
+            }
+            if (ref->n == cap) {
+                cap *= 2U;
+                ref->x = Tcl_Realloc(ref->x, cap * sizeof(double));
+                ref->y = Tcl_Realloc(ref->y, cap * sizeof(double));
+            }
+            ref->x[ref->n] = x;
+            ref->y[ref->n] = y;
+            ref->n++;
+        }
+        Tcl_SetObjLength(line, 0);
+    }
+    Tcl_DecrRefCount(line);
+    Tcl_Close(NULL, chan);
+    if (rc != TCL_OK) {
+        Series_Free(ref);
+    }
+    return rc;
+}
+
+//** downsampling
+//***  Series_LowerBound function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Series_LowerBound --
+ *
+ *      Binary search for the first point of a series whose scale value is not less than (or, with upper, greater
+ *      than) x.
+ *
+ * Parameters:
+ *      const XYSeries *s            - input: series with non-decreasing scale
+ *      double x                     - input: scale value
+ *      int upper                    - input: 0 for the first x[i] >= x, 1 for the first x[i] > x
+ *
+ * Results:
+ *      Index in [0, s->n].
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static size_t Series_LowerBound(const XYSeries *s, double x, int upper) {
+    size_t lo = 0;
+    size_t hi = s->n;
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) / 2U);
+        if ((s->x[mid] < x) || ((upper == 1) && (s->x[mid] == x))) {
+            lo = mid + 1U;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+//***  Pyr_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Pyr_Free --
+ *
+ *      Release a min/max pyramid.
+ *
+ * Parameters:
+ *      Pyramid *p                   - input: pyramid to free; may be NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the name, the data copy, every level and the structure itself.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Pyr_Free(Pyramid *p) {
+    if (p == NULL) {
+        return;
+    }
+    for (int k = 0; k < p->nlevels; k++) {
+        Tcl_Free(p->imin[k]);
+        Tcl_Free(p->imax[k]);
+    }
+    Tcl_Free(p->imin);
+    Tcl_Free(p->imax);
+    Series_Free(&p->s);
+    Tcl_Free(p->name);
+    Tcl_Free(p);
+}
+//***  Pyr_Find function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Pyr_Find --
+ *
+ *      Look up the pyramid of a vector (names matched ignoring case).
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: context owning the list
+ *      const char *name             - input: vector name
+ *      Pyramid **prev_out           - output (optional): predecessor in the list, NULL if the match is the head
+ *
+ * Results:
+ *      Pointer to the pyramid, or NULL if none was built for that vector.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Pyramid *Pyr_Find(const NgSpiceContext *ctx, const char *name, Pyramid **prev_out) {
+    Pyramid *prev = NULL;
+    for (Pyramid *p = ctx->pyr_head; p != NULL; p = p->next) {
+        if (VecNameEq(p->name, name) == 1) {
+            if (prev_out != NULL) {
+                *prev_out = prev;
+            }
+            return p;
+        }
+        prev = p;
+    }
+    return NULL;
+}
+//***  Pyr_DropStale function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Pyr_DropStale --
+ *
+ *      Free the pyramids built before the latest run or plot started: their private copy no longer matches the
+ *      vectors, and "downsample -method minmax" would answer from the previous data. Tcl thread only.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: context owning the list
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Reads ctx->plot_seq under ctx->mutex; unlinks and frees stale entries of ctx->pyr_head.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Pyr_DropStale(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    uint64_t plot = ctx->plot_seq;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Pyramid **link = &ctx->pyr_head;
+    while (*link != NULL) {
+        Pyramid *p = *link;
+        if (p->plot != plot) {
+            *link = p->next;
+            Pyr_Free(p);
+        } else {
+            link = &p->next;
+        }
+    }
+}
+//***  Pyr_Build function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Pyr_Build --
+ *
+ *      Build the aggregated levels of a pyramid over its data: level 1 holds the min/max sample index of every pair of
+ *      samples, level k+1 combines pairs of level k blocks, up to a single block.
+ *
+ * Parameters:
+ *      Pyramid *p                   - input/output: pyramid with p->s filled
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Allocates p->imin/p->imax; total memory is about 2*n indices.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Pyr_Build(Pyramid *p) {
+    const double *y = p->s.y;
+    size_t nb = p->s.n;
+    p->nlevels = 0;
+    while (nb > 1U) {
+        nb = (nb + 1U) / 2U;
+        p->nlevels++;
+    }
+    p->imin = Tcl_Alloc((size_t)(p->nlevels + 1) * sizeof(size_t *));
+    p->imax = Tcl_Alloc((size_t)(p->nlevels + 1) * sizeof(size_t *));
+    size_t prevn = p->s.n;
+    for (int k = 0; k < p->nlevels; k++) {
+        size_t cnt = (prevn + 1U) / 2U;
+        size_t *mn = Tcl_Alloc(cnt * sizeof(size_t));
+        size_t *mx = Tcl_Alloc(cnt * sizeof(size_t));
+        for (size_t j = 0; j < cnt; j++) {
+            size_t l = 2U * j;
+            size_t r = ((l + 1U) < prevn) ? (l + 1U) : l;
+            size_t lmin = (k == 0) ? l : p->imin[k - 1][l];
+            size_t rmin = (k == 0) ? r : p->imin[k - 1][r];
+            size_t lmax = (k == 0) ? l : p->imax[k - 1][l];
+            size_t rmax = (k == 0) ? r : p->imax[k - 1][r];
+            mn[j] = (y[rmin] < y[lmin]) ? rmin : lmin;
+            mx[j] = (y[rmax] > y[lmax]) ? rmax : lmax;
+        }
+        p->imin[k] = mn;
+        p->imax[k] = mx;
+        prevn = cnt;
+    }
+}
+//***  DS_RangeMinMax function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DS_RangeMinMax --
+ *
+ *      Find the indices of the minimum and maximum samples in [a, b). With a pyramid the range is covered greedily by
+ *      the largest aligned blocks, which costs O(log n) instead of O(b - a).
+ *
+ * Parameters:
+ *      const XYSeries *s            - input: series
+ *      const Pyramid *p             - input: pyramid over s, or NULL to scan the samples
+ *      size_t a                     - input: first index (a < b)
+ *      size_t b                     - input: one past the last index
+ *      size_t *imin                 - output: index of the minimum
+ *      size_t *imax                 - output: index of the maximum
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void DS_RangeMinMax(const XYSeries *s, const Pyramid *p, size_t a, size_t b, size_t *imin, size_t *imax) {
+    const double *y = s->y;
+    size_t bmin = a;
+    size_t bmax = a;
+    size_t i = a;
+    while (i < b) {
+        int k = 0;
+        if (p != NULL) {
+            while ((k < p->nlevels) && ((i & (((size_t)1 << (k + 1)) - 1U)) == 0U) &&
+                   ((i + ((size_t)1 << (k + 1))) <= b)) {
+                k++;
+            }
+        }
+        size_t cmin = i;
+        size_t cmax = i;
+        if (k > 0) {
+            cmin = p->imin[k - 1][i >> k];
+            cmax = p->imax[k - 1][i >> k];
+        }
+        if (y[cmin] < y[bmin]) {
+            bmin = cmin;
+        }
+        if (y[cmax] > y[bmax]) {
+            bmax = cmax;
+        }
+        i += (size_t)1 << k;
+    }
+    *imin = bmin;
+    *imax = bmax;
+}
+//***  DS_AppendPoint function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DS_AppendPoint --
+ *
+ *      Append an {x y} pair to a result list.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter used for list construction
+ *      Tcl_Obj *list                - input/output: unshared result list
+ *      const XYSeries *s            - input: series
+ *      size_t i                     - input: index of the point
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Allocates Tcl objects.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void DS_AppendPoint(Tcl_Interp *interp, Tcl_Obj *list, const XYSeries *s, size_t i) {
+    Tcl_Obj *pair[2];
+    pair[0] = Tcl_NewDoubleObj(s->x[i]);
+    pair[1] = Tcl_NewDoubleObj(s->y[i]);
+    Tcl_ListObjAppendElement(interp, list, Tcl_NewListObj(2, pair));
+}
+//***  DS_MinMaxBuckets function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DS_MinMaxBuckets --
+ *
+ *      Min/max-per-bucket downsampling: the window [x0, x1] is split into npts/2 equal buckets along the scale (one per
+ *      pixel column), and the minimum and maximum sample of each non-empty bucket are emitted in scale order. Bucket
+ *      edges are found by binary search and bucket extrema with DS_RangeMinMax, so with a pyramid the cost is
+ *      O(npts * log n) regardless of the number of samples in the window.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter used for list construction
+ *      const XYSeries *s            - input: series
+ *      const Pyramid *p             - input: pyramid over s, or NULL
+ *      double x0                    - input: window start
+ *      double x1                    - input: window end (x1 >= x0)
+ *      int npts                     - input: maximum number of points to return (>= 2)
+ *      Tcl_Obj *out                 - input/output: result list of {x y} pairs
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Appends to out.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void DS_MinMaxBuckets(Tcl_Interp *interp, const XYSeries *s, const Pyramid *p, double x0, double x1, int npts,
+                             Tcl_Obj *out) {
+    int nb = npts / 2;
+    size_t a = Series_LowerBound(s, x0, 0);
+    for (int k = 0; k < nb; k++) {
+        size_t b = (k == (nb - 1)) ? Series_LowerBound(s, x1, 1)
+                                   : Series_LowerBound(s, x0 + (((x1 - x0) * (double)(k + 1)) / (double)nb), 0);
+        if (b <= a) {
+            continue;
+        }
+        size_t imin;
+        size_t imax;
+        DS_RangeMinMax(s, p, a, b, &imin, &imax);
+        size_t first = (imin < imax) ? imin : imax;
+        size_t second = (imin < imax) ? imax : imin;
+        DS_AppendPoint(interp, out, s, first);
+        if (second != first) {
+            DS_AppendPoint(interp, out, s, second);
+        }
+        a = b;
+    }
+}
+//***  DS_Lttb function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DS_Lttb --
+ *
+ *      Largest-Triangle-Three-Buckets downsampling of the samples [a, b): the first and last samples are kept and each
+ *      of the npts-2 inner buckets contributes the sample forming the largest triangle with the previously selected
+ *      sample and the average of the next bucket. This preserves the visual shape (peaks, edges) of the waveform.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter used for list construction
+ *      const XYSeries *s            - input: series
+ *      size_t a                     - input: first index
+ *      size_t b                     - input: one past the last index
+ *      int npts                     - input: number of points to return (>= 2); all samples if b-a <= npts
+ *      Tcl_Obj *out                 - input/output: result list of {x y} pairs
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Appends to out.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void DS_Lttb(Tcl_Interp *interp, const XYSeries *s, size_t a, size_t b, int npts, Tcl_Obj *out) {
+    size_t m = b - a;
+    if (m <= (size_t)npts) {
+        for (size_t i = a; i < b; i++) {
+            DS_AppendPoint(interp, out, s, i);
+        }
+        return;
+    }
+    const double *x = s->x;
+    const double *y = s->y;
+    double every = (double)(m - 2U) / (double)(npts - 2);
+    size_t sel = a;
+    DS_AppendPoint(interp, out, s, a);
+    for (int k = 0; k < (npts - 2); k++) {
+        size_t rs = a + 1U + (size_t)floor((double)k * every);
+        size_t re = a + 1U + (size_t)floor((double)(k + 1) * every);
+        size_t as = re;
+        size_t ae = a + 1U + (size_t)floor((double)(k + 2) * every);
+        if (ae > (b - 1U)) {
+            ae = b - 1U;
+        }
+        double avgx = x[b - 1U];
+        double avgy = y[b - 1U];
+        if (ae > as) {
+            avgx = 0.0;
+            avgy = 0.0;
+            for (size_t i = as; i < ae; i++) {
+                avgx += x[i];
+                avgy += y[i];
+            }
+            avgx /= (double)(ae - as);
+            avgy /= (double)(ae - as);
+        }
+        size_t best = rs;
+        double best_area = -1.0;
+        for (size_t i = rs; i < re; i++) {
+            double area = fabs(((x[sel] - avgx) * (y[i] - y[sel])) - ((x[sel] - x[i]) * (avgy - y[sel])));
+            if (area > best_area) {
+                best_area = area;
+                best = i;
+            }
+        }
+        DS_AppendPoint(interp, out, s, best);
+        sel = best;
+    }
+    DS_AppendPoint(interp, out, s, b - 1U);
+}
+
+//** event subscriptions
+//***  EvtIdToName function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * EvtIdToName --
+ *
+ *      Map an internal event identifier to the event name used by "waitevent", "eventcounts" and "on".
+ *
+ * Parameters:
+ *      int id                       - input: event identifier from enum CallbacksIds
+ *
+ * Results:
+ *      Static string with the event name, or "unknown" for an invalid identifier.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static const char *EvtIdToName(int id) {
+    static const char *const names[NUM_EVTS] = {"send_char",      "send_stat",  "controlled_exit", "send_data",
+                                                "send_init_data", "bg_running", "trigger",         "memory"};
+    if ((id < 0) || (id >= NUM_EVTS)) {
+        return "unknown";
+    }
+    return names[id];
+}
+//***  Subs_IdleProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Subs_IdleProc --
+ *
+ *      Idle handler that invokes the scripts registered with "on" for every event noted since the previous
+ *      invocation. Because Tcl runs idle handlers only after the queued events are processed, a burst of ngspice
+ *      callbacks results in one script call per event type.
+ *
+ *      Each script is called with three words appended: the event name, the number of coalesced callbacks and, for
+ *      send_data, the range {first last} of row indices appended to the stored vectors (empty for other events).
+ *      Rows converted later by Conv_IdleProc are reported with a count of 0.
+ *
+ * Parameters:
+ *      ClientData cd                - input: NgSpiceContext * that scheduled the handler
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Evaluates user scripts at global level; errors are reported with Tcl_BackgroundException(). Stops early if a
+ *      script destroys the instance. Releases the Tcl_Preserve() taken by Subs_Note().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Subs_IdleProc(ClientData cd) {
+    NgSpiceContext *ctx = (NgSpiceContext *)cd;
+    Tcl_Interp *interp = ctx->interp;
+    ctx->subs.scheduled = 0;
+    for (int e = 0; (e < NUM_EVTS) && (ctx->destroying == 0); e++) {
+        uint64_t n = ctx->subs.count[e];
+        ctx->subs.count[e] = 0;
+        int rows = ((e == SEND_DATA) && (ctx->subs.first_row >= 0) && (ctx->subs.first_row < ctx->stored_rows)) ? 1 : 0;
+        if (((n == (uint64_t)0) && (rows == 0)) || (ctx->subs.script[e] == NULL)) {
+            continue;
+        }
+        Tcl_Obj *range = Tcl_NewListObj(0, NULL);
+        if ((e == SEND_DATA) && (ctx->subs.first_row >= 0)) {
+            Tcl_ListObjAppendElement(NULL, range, Tcl_NewWideIntObj(ctx->subs.first_row));
+            Tcl_ListObjAppendElement(NULL, range, Tcl_NewWideIntObj(ctx->stored_rows - 1));
+            ctx->subs.first_row = -1;
+        }
+        Tcl_Obj *cmd = Tcl_DuplicateObj(ctx->subs.script[e]);
+        Tcl_IncrRefCount(cmd);
+        Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewStringObj(EvtIdToName(e), -1));
+        Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewWideIntObj((Tcl_WideInt)n));
+        Tcl_ListObjAppendElement(NULL, cmd, range);
+        Tcl_Preserve((ClientData)interp);
+        Tcl_WideInt t0 = Stats_Now();
+        int code = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
+        Trace_Span(ctx, "script", EvtIdToName(e), t0, (Tcl_WideInt)n);
+        if (code != TCL_OK) {
+            Tcl_BackgroundException(interp, code);
+        }
+        Tcl_Release((ClientData)interp);
+        Tcl_DecrRefCount(cmd);
+    }
+    Tcl_Release((ClientData)ctx);
+}
+//***  Subs_Note function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Subs_Note --
+ *
+ *      Records that callbacks of an event were processed by NgSpiceEventProc (or, with n = 0, that Conv_IdleProc
+ *      stored more rows) and schedules Subs_IdleProc if a script is registered for it and no handler is pending yet.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int which                    - input: event identifier
+ *      Tcl_WideInt first_row        - input: for SEND_DATA, index of the first row appended by this event
+ *      uint64_t n                   - input: number of callbacks to add to the coalesced count
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Updates ctx->subs; calls Tcl_Preserve(ctx) and Tcl_DoWhenIdle() when scheduling.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Subs_Note(NgSpiceContext *ctx, int which, Tcl_WideInt first_row, uint64_t n) {
+    if ((ctx->subs.script[which] == NULL) || (ctx->destroying == 1)) {
+        return;
+    }
+    ctx->subs.count[which] += n;
+    if ((which == SEND_DATA) && (ctx->subs.first_row < 0) && (first_row < ctx->stored_rows)) {
+        ctx->subs.first_row = first_row;
+    }
+    if (ctx->subs.scheduled == 0) {
+        ctx->subs.scheduled = 1;
+        Tcl_Preserve((ClientData)ctx);
+        Tcl_DoWhenIdle(Subs_IdleProc, (ClientData)ctx);
+    }
+}
+//***  Subs_ResetRows function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Subs_ResetRows --
+ *
+ *      Restarts row numbering after ctx->vectorData was replaced by an empty dict (new run or "vectors -clear").
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Zeroes ctx->stored_rows and drops a pending send_data notification that referred to the old rows.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Subs_ResetRows(NgSpiceContext *ctx) {
+    ctx->stored_rows = 0;
+    ctx->subs.first_row = -1;
+    ctx->subs.count[SEND_DATA] = 0;
+}
+//***  Subs_Cancel function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Subs_Cancel --
+ *
+ *      Cancels a pending Subs_IdleProc during instance deletion.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls Tcl_CancelIdleCall() and releases the context reference held by the pending handler.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Subs_Cancel(NgSpiceContext *ctx) {
+    if (ctx->subs.scheduled == 1) {
+        Tcl_CancelIdleCall(Subs_IdleProc, (ClientData)ctx);
+        ctx->subs.scheduled = 0;
+        Tcl_Release((ClientData)ctx);
+    }
+}
+//** progress reporting
+//***  Progress_Seconds function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Progress_Seconds --
+ *
+ *      Returns the time between two Tcl_Time values in seconds.
+ *
+ * Parameters:
+ *      const Tcl_Time *from         - input: earlier time
+ *      const Tcl_Time *to           - input: later time
+ *
+ * Results:
+ *      to - from in seconds (negative if to is earlier).
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static double Progress_Seconds(const Tcl_Time *from, const Tcl_Time *to) {
+    return (double)(to->sec - from->sec) + ((double)(to->usec - from->usec) * 1e-6);
+}
+//***  Progress_Parse function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Progress_Parse --
+ *
+ *      Parses a status line of the form "<analysis>: <percent>%" as sent by ngspice while an analysis runs (e.g.
+ *      "tran: 42.3%"). Other status lines ("--ready--", error texts) are not progress reports. Runs on the ngspice
+ *      thread, so it only uses the C library.
+ *
+ * Parameters:
+ *      const char *msg              - input: NUL-terminated status line
+ *      char *name                   - output: analysis name, PROGRESS_NAMELEN bytes
+ *      double *percent              - output: percent value
+ *
+ * Results:
+ *      1 if msg is a progress report, 0 otherwise (outputs are then unspecified).
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Progress_Parse(const char *msg, char *name, double *percent) {
+    const char *colon = strchr(msg, ':');
+    if ((colon == NULL) || (colon == msg)) {
+        return 0;
+    }
+    size_t len = 0;
+    for (const char *p = msg; p < colon; p++) {
+        if ((XIsIdentChar(*p, 0) == 0) && (*p != ' ')) {
+            return 0;
+        }
+        if ((*p != ' ') && (len < (size_t)(PROGRESS_NAMELEN - 1))) {
+            name[len] = *p;
+            len++;
+        }
+    }
+    name[len] = '\0';
+    char *end = NULL;
+    double v = strtod(colon + 1, &end);
+    if ((len == 0U) || (end == (colon + 1))) {
+        return 0;
+    }
+    while (*end == ' ') {
+        end++;
+    }
+    if ((*end != '%') || (isfinite(v) == 0)) {
+        return 0;
+    }
+    *percent = v;
+    return 1;
+}
+//***  Progress_Update function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Progress_Update --
+ *
+ *      Stores the latest progress report and decides whether it is passed on as a send_stat event. A new analysis
+ *      starts when the name changes or the percent goes down; its first report, the report reaching 100% and any
+ *      report arriving at least progress.interval_ms after the last passed one are passed on, the others only update
+ *      the stored value. Must be called with ctx->mutex held.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      const char *name             - input: analysis name from Progress_Parse
+ *      double percent               - input: percent from Progress_Parse
+ *      const Tcl_Time *now          - input: time the report was received
+ *
+ * Results:
+ *      1 if the report should be queued as an event, 0 if it is throttled.
+ *
+ * Side Effects:
+ *      Updates ctx->progress.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Progress_Update(NgSpiceContext *ctx, const char *name, double percent, const Tcl_Time *now) {
+    Progress *pr = &ctx->progress;
+    int emit = 0;
+    if ((pr->analysis[0] == '\0') || (strcmp(pr->analysis, name) != 0) || (percent < pr->percent)) {
+        memcpy(pr->analysis, name, PROGRESS_NAMELEN);
+        pr->start = *now;
+        pr->first = percent;
+        emit = 1;
+    } else if ((percent >= 100.0) || (pr->interval_ms <= 0) ||
+               (Progress_Seconds(&pr->emitted, now) >= ((double)pr->interval_ms * 1e-3))) {
+        emit = 1;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    pr->percent = percent;
+    pr->last = *now;
+    if (emit == 1) {
+        pr->emitted = *now;
+    }
+    return emit;
+}
+//***  Progress_Reset function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Progress_Reset --
+ *
+ *      Forgets the stored progress at the start of a new run, so the next report starts a new analysis even if it
+ *      has the same name. Must be called with ctx->mutex held.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Clears ctx->progress except the interval.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Progress_Reset(NgSpiceContext *ctx) {
+    Progress *pr = &ctx->progress;
+    pr->analysis[0] = '\0';
+    pr->percent = 0.0;
+    pr->first = 0.0;
+    pr->start.sec = 0;
+    pr->start.usec = 0;
+    pr->last = pr->start;
+    pr->emitted = pr->start;
+}
+
+//** event notifier channel
+//***  Notify_Signal function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Notify_Signal --
+ *
+ *      Make the notifier channel readable. Called by NgSpiceQueueEvent from any thread. At most one byte is written
+ *      per pass of the event loop: the pending flag is cleared by NgSpiceEventProc, so a fast run does not cost one
+ *      system call per row.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May write one byte to the write end of the notifier pipe. The write never blocks: on POSIX the descriptor is
+ *      non-blocking and a full pipe is readable anyway, on Windows nothing is written while unread bytes remain.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Notify_Signal(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if ((ctx->notify_wchan != NULL) && (ctx->notify_pending == 0)) {
+        static const char byte = '!';
+        ctx->notify_pending = 1;
+#ifdef _WIN32
+        DWORD avail = 0;
+        DWORD written = 0;
+        if ((PeekNamedPipe((HANDLE)ctx->notify_rh, NULL, 0, NULL, &avail, NULL) != 0) && (avail == 0U)) {
+            (void)WriteFile((HANDLE)ctx->notify_wh, &byte, 1, &written, NULL);
+        }
+#else
+        (void)write((int)(intptr_t)ctx->notify_wh, &byte, 1);
+#endif
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+}
+//***  Notify_Open function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Notify_Open --
+ *
+ *      Create the notifier pipe of an instance and register its read end in the interpreter.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context; must not have a notifier yet
+ *      Tcl_Interp *interp           - input: interpreter for the channel and errors
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result.
+ *
+ * Side Effects:
+ *      Creates a pipe with Tcl_CreatePipe. The read end is non-blocking and binary, registered in interp and also
+ *      held by the instance, so closing it in the script only detaches it. The write end is moved from interp to the
+ *      instance, so it is not visible to scripts; callbacks write to its OS handle directly.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Notify_Open(NgSpiceContext *ctx, Tcl_Interp *interp) {
+    Tcl_Channel rchan;
+    Tcl_Channel wchan;
+    ClientData rh;
+    ClientData wh;
+    if (Tcl_CreatePipe(interp, &rchan, &wchan, 0) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if ((Tcl_GetChannelHandle(rchan, TCL_READABLE, &rh) != TCL_OK) ||
+        (Tcl_GetChannelHandle(wchan, TCL_WRITABLE, &wh) != TCL_OK)) {
+        Tcl_UnregisterChannel(interp, rchan);
+        Tcl_UnregisterChannel(interp, wchan);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("could not get notifier pipe handles", -1));
+        return TCL_ERROR;
+    }
+#ifndef _WIN32
+    int fd = (int)(intptr_t)wh;
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+    Tcl_SetChannelOption(NULL, rchan, "-blocking", "0");
+    Tcl_SetChannelOption(NULL, rchan, "-translation", "binary");
+    Tcl_RegisterChannel(NULL, rchan);
+    Tcl_RegisterChannel(NULL, wchan);
+    Tcl_UnregisterChannel(interp, wchan);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    ctx->notify_rchan = rchan;
+    ctx->notify_wchan = wchan;
+    ctx->notify_rh = rh;
+    ctx->notify_wh = wh;
+    ctx->notify_pending = 0;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return TCL_OK;
+}
+//***  Notify_Close function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Notify_Close --
+ *
+ *      Close the notifier pipe of an instance, if any.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter the read end is registered in; NULL to drop only the
+ *                                     instance reference
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Detaches the pipe from the callbacks under ctx->mutex, closes the write end and releases the read end. The
+ *      read end sees end-of-file if the script still holds it.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Notify_Close(NgSpiceContext *ctx, Tcl_Interp *interp) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    Tcl_Channel rchan = ctx->notify_rchan;
+    Tcl_Channel wchan = ctx->notify_wchan;
+    ctx->notify_rchan = NULL;
+    ctx->notify_wchan = NULL;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (rchan == NULL) {
+        return;
+    }
+    Tcl_UnregisterChannel(NULL, wchan);
+    if ((interp != NULL) && (Tcl_IsChannelRegistered(interp, rchan) != 0)) {
+        Tcl_UnregisterChannel(interp, rchan);
+    }
+    Tcl_UnregisterChannel(NULL, rchan);
+}
+//** trace ring
+//***  Trace_Start function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trace_Start --
+ *
+ *      Starts recording into the trace ring. The ring is (re)allocated and cleared if the capacity changes or it
+ *      does not exist yet; otherwise new records are appended to the kept ones.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      size_t cap                   - input: number of records kept, 0 to keep the current capacity
+ *      const char *path             - input: file written at instance deletion, NULL to keep the current one
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Allocates ctx->trace.recs; sets ctx->trace.enabled under ctx->trace_mu.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Trace_Start(NgSpiceContext *ctx, size_t cap, const char *path) {
+    TraceRing *tr = &ctx->trace;
+    Tcl_MutexLock(&ctx->trace_mu);
+    if (cap == 0U) {
+        cap = (tr->cap > 0U) ? tr->cap : (size_t)TRACE_CAPACITY;
+    }
+    if ((tr->recs == NULL) || (cap != tr->cap)) {
+        Tcl_Free(tr->recs);
+        tr->recs = Tcl_Alloc(cap * sizeof(TraceRec));
+        tr->cap = cap;
+        tr->head = 0;
+        tr->count = 0;
+        tr->dropped = 0;
+        tr->t0 = Stats_Now();
+    }
+    if (path != NULL) {
+        Tcl_Free(tr->path);
+        tr->path = (path[0] != '\0') ? ckstrdup(path) : NULL;
+    }
+    Flag_Store(&tr->enabled, 1);
+    Tcl_MutexUnlock(&ctx->trace_mu);
+}
+//***  Trace_Free function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trace_Free --
+ *
+ *      Releases the trace ring of an instance being freed.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees ctx->trace.recs and ctx->trace.path.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Trace_Free(NgSpiceContext *ctx) {
+    Flag_Store(&ctx->trace.enabled, 0);
+    Tcl_Free(ctx->trace.recs);
+    Tcl_Free(ctx->trace.path);
+    ctx->trace.recs = NULL;
+    ctx->trace.path = NULL;
+}
+//***  Trace_JsonString function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trace_JsonString --
+ *
+ *      Writes a string as a quoted JSON string, escaping quotes, backslashes and control characters.
+ *
+ * Parameters:
+ *      FILE *f                      - input: output file
+ *      const char *s                - input: NUL-terminated string
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Writes to f.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Trace_JsonString(FILE *f, const char *s) {
+    (void)fputc('"', f);
+    for (const unsigned char *p = (const unsigned char *)s; *p != 0U; p++) {
+        if ((*p == (unsigned char)'"') || (*p == (unsigned char)'\\')) {
+            (void)fputc('\\', f);
+            (void)fputc((int)*p, f);
+        } else if (*p < 0x20U) {
+            (void)fprintf(f, "\\u%04x", (unsigned int)*p);
+        } else {
+            (void)fputc((int)*p, f);
+        }
+    }
+    (void)fputc('"', f);
+}
+//***  Trace_Dump function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Trace_Dump --
+ *
+ *      Writes the records of the trace ring, oldest first, as a Chrome trace-event JSON file that can be opened with
+ *      a trace viewer (chrome://tracing, Perfetto). Spans become complete ("X") events, instants thread-scoped "i"
+ *      events; threads are numbered in order of appearance and the owning Tcl thread is named "tcl".
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      Tcl_Interp *interp           - input: interpreter for errors, may be NULL
+ *      const char *path             - input: file name in Tcl form
+ *
+ * Results:
+ *      TCL_OK, or TCL_ERROR with a message in the interpreter result (if any) when the file cannot be written.
+ *
+ * Side Effects:
+ *      Copies the ring under ctx->trace_mu, then creates or truncates the file.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Trace_Dump(NgSpiceContext *ctx, Tcl_Interp *interp, const char *path) {
+    Tcl_MutexLock(&ctx->trace_mu);
+    const TraceRing *tr = &ctx->trace;
+    size_t n = tr->count;
+    TraceRec *recs = Tcl_Alloc((n + 1U) * sizeof(TraceRec));
+    for (size_t i = 0; i < n; i++) {
+        recs[i] = tr->recs[(tr->head + i) % tr->cap];
+    }
+    Tcl_MutexUnlock(&ctx->trace_mu);
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    const char *native = Tcl_TranslateFileName(interp, path, &ds);
+    FILE *f = (native != NULL) ? fopen(native, "w") : NULL;
+    Tcl_DStringFree(&ds);
+    if (f == NULL) {
+        Tcl_Free(recs);
+        if ((interp != NULL) && (native != NULL)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\": %s", path, Tcl_PosixError(interp)));
+        }
+        return TCL_ERROR;
+    }
+    Tcl_ThreadId *tids = Tcl_Alloc((n + 1U) * sizeof(Tcl_ThreadId));
+    size_t ntids = 0;
+    tids[ntids] = ctx->tclid;
+    ntids++;
+    (void)fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+    (void)fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"ngspicetclbridge\"}},\n"
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"tcl\"}}",
+                f);
+    for (size_t i = 0; i < n; i++) {
+        const TraceRec *r = &recs[i];
+        size_t t = 0;
+        while ((t < ntids) && (tids[t] != r->tid)) {
+            t++;
+        }
+        if (t == ntids) {
+            tids[ntids] = r->tid;
+            ntids++;
+            (void)fprintf(f,
+                          ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread "
+                          "%u\"}}",
+                          (unsigned int)(t + 1U), (unsigned int)(t + 1U));
+        }
+        (void)fputs(",\n{\"name\":", f);
+        Trace_JsonString(f, r->name);
+        (void)fprintf(f, ",\"cat\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%" TCL_LL_MODIFIER "d", r->cat,
+                      (unsigned int)(t + 1U), (long long)r->ts);
+        if (r->dur >= 0) {
+            (void)fprintf(f, ",\"ph\":\"X\",\"dur\":%" TCL_LL_MODIFIER "d", (long long)r->dur);
+        } else {
+            (void)fputs(",\"ph\":\"i\",\"s\":\"t\"", f);
+        }
+        (void)fprintf(f, ",\"args\":{\"arg\":%" TCL_LL_MODIFIER "d}}", (long long)r->arg);
+    }
+    (void)fputs("\n]}\n", f);
+    int failed = (ferror(f) != 0) ? 1 : 0;
+    if (fclose(f) != 0) {
+        failed = 1;
+    }
+    Tcl_Free(tids);
+    Tcl_Free(recs);
+    if (failed == 1) {
+        if (interp != NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\"", path));
+        }
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+//** callback recording
+//***  Rec_Append function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_Append --
+ *
+ *      Appends bytes to the payload being built. Caller holds ctx->rec_mu.
+ *
+ * Parameters:
+ *      Recorder *r                  - input/output: recorder of the instance
+ *      const void *src              - input: bytes to append
+ *      size_t n                     - input: number of bytes
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May grow r->buf.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rec_Append(Recorder *r, const void *src, size_t n) {
+    if ((r->len + n) > r->cap) {
+        size_t ncap = (r->cap > 0U) ? (r->cap * 2U) : (size_t)256;
+        while (ncap < (r->len + n)) {
+            ncap *= 2U;
+        }
+        r->buf = Tcl_Realloc(r->buf, ncap);
+        r->cap = ncap;
+    }
+    memcpy(r->buf + r->len, src, n);
+    r->len += n;
+}
+//***  Rec_AppendInt function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_AppendInt --
+ *
+ *      Appends a 32-bit integer to the payload being built. Caller holds ctx->rec_mu.
+ *
+ * Parameters:
+ *      Recorder *r                  - input/output: recorder of the instance
+ *      int v                        - input: value
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May grow r->buf.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rec_AppendInt(Recorder *r, int v) {
+    int32_t v32 = (int32_t)v;
+    Rec_Append(r, &v32, sizeof v32);
+}
+//***  Rec_AppendStr function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_AppendStr --
+ *
+ *      Appends a string as a 32-bit length followed by its bytes, without the terminating NUL. NULL is stored as an
+ *      empty string. Caller holds ctx->rec_mu.
+ *
+ * Parameters:
+ *      Recorder *r                  - input/output: recorder of the instance
+ *      const char *str              - input: NUL-terminated string or NULL
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May grow r->buf.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rec_AppendStr(Recorder *r, const char *str) {
+    uint32_t n = (str != NULL) ? (uint32_t)strlen(str) : 0U;
+    Rec_Append(r, &n, sizeof n);
+    if (n > 0U) {
+        Rec_Append(r, str, (size_t)n);
+    }
+}
+//***  Rec_Write function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_Write --
+ *
+ *      Writes one record, the header followed by the payload built in ctx->rec.buf, and empties the payload. After a
+ *      write error nothing more is written. Caller holds ctx->rec_mu and has checked that a file is open.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int type                     - input: callback id (CallbacksIds) or REC_NAMES
+ *      int flag                     - input: RecHeader flag
+ *      int aux                      - input: RecHeader aux
+ *      Tcl_WideInt ts               - input: callback time, microseconds (Stats_Now)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Writes to ctx->rec.file; updates the record and byte counters or sets ctx->rec.failed.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rec_Write(NgSpiceContext *ctx, int type, int flag, int aux, Tcl_WideInt ts) {
+    Recorder *r = &ctx->rec;
+    RecHeader h;
+    memset(&h, 0, sizeof h);
+    h.type = (uint8_t)type;
+    h.flag = (uint8_t)flag;
+    h.aux = (uint16_t)aux;
+    h.len = (uint32_t)r->len;
+    h.ts = (ts > r->t0) ? (int64_t)(ts - r->t0) : 0;
+    if (r->failed == 0) {
+        if ((fwrite(&h, sizeof h, 1, r->file) != 1U) ||
+            ((r->len > 0U) && (fwrite(r->buf, r->len, 1, r->file) != 1U))) {
+            r->failed = 1;
+        } else {
+            r->records++;
+            r->bytes += (uint64_t)(sizeof h + r->len);
+        }
+    }
+    r->len = 0;
+}
+//***  Rec_Event function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_Event --
+ *
+ *      Records a send_char, send_stat, controlled_exit or bg_running callback. The payload is the ngspice instance id,
+ *      an integer value (the exit status) and the message text, if any.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int type                     - input: callback id
+ *      int flag                     - input: running for bg_running, immediate for exits, 0 otherwise
+ *      int aux                      - input: exit_upon_exit for exits, 0 otherwise
+ *      int id                       - input: ngspice instance id passed to the callback
+ *      int value                    - input: exit status, 0 otherwise
+ *      const char *msg              - input: message text or NULL
+ *      Tcl_WideInt ts               - input: callback time, microseconds (Stats_Now)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Writes a record under ctx->rec_mu if recording.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rec_Event(NgSpiceContext *ctx, int type, int flag, int aux, int id, int value, const char *msg,
+                      Tcl_WideInt ts) {
+    Recorder *r = &ctx->rec;
+    Tcl_MutexLock(&ctx->rec_mu);
+    if (r->file != NULL) {
+        r->len = 0;
+        Rec_AppendInt(r, id);
+        Rec_AppendInt(r, value);
+        if (msg != NULL) {
+            Rec_Append(r, msg, strlen(msg));
+        }
+        Rec_Write(ctx, type, flag, aux, ts);
+    }
+    Tcl_MutexUnlock(&ctx->rec_mu);
+}
+//***  Rec_Init function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_Init --
+ *
+ *      Records a send_init_data callback: instance id, vector count, plot name, title, date and type, then number,
+ *      real flag, scale flag and name of every vector. The scale flag replaces the pdvec/pdvecscale pointers, which
+ *      are only compared by the bridge.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      pvecinfoall vinfo            - input: vector information passed to the callback
+ *      int id                       - input: ngspice instance id passed to the callback
+ *      Tcl_WideInt ts               - input: callback time, microseconds (Stats_Now)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Writes a record under ctx->rec_mu if recording.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rec_Init(NgSpiceContext *ctx, pvecinfoall vinfo, int id, Tcl_WideInt ts) {
+    Recorder *r = &ctx->rec;
+    Tcl_MutexLock(&ctx->rec_mu);
+    if (r->file != NULL) {
+        r->len = 0;
+        Rec_AppendInt(r, id);
+        Rec_AppendInt(r, vinfo->veccount);
+        Rec_AppendStr(r, vinfo->name);
+        Rec_AppendStr(r, vinfo->title);
+        Rec_AppendStr(r, vinfo->date);
+        Rec_AppendStr(r, vinfo->type);
+        for (int i = 0; i < vinfo->veccount; i++) {
+            pvecinfo vec = vinfo->vecs[i];
+            uint8_t flags[2];
+            flags[0] = vec->is_real ? 1U : 0U;
+            flags[1] = ((vec->pdvec != NULL) && (vec->pdvec == vinfo->vecs[0]->pdvecscale)) ? 1U : 0U;
+            Rec_AppendInt(r, vec->number);
+            Rec_Append(r, flags, sizeof flags);
+            Rec_AppendStr(r, vec->vecname);
+        }
+        Rec_Write(ctx, SEND_INIT_DATA, 0, 0, ts);
+    }
+    Tcl_MutexUnlock(&ctx->rec_mu);
+}
+//***  Rec_Data function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_Data --
+ *
+ *      Records a send_data callback. Vector names are not repeated in every row: a REC_NAMES record with the names is
+ *      written whenever they differ from the previous row. The row record holds the instance id, count, vecindex and
+ *      vector count, then per vector a flags byte (1 scale, 2 complex), the real part and, for complex vectors, the
+ *      imaginary part.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      pvecvaluesall all            - input: row passed to the callback
+ *      int count                    - input: count passed to the callback
+ *      int id                       - input: ngspice instance id passed to the callback
+ *      Tcl_WideInt ts               - input: callback time, microseconds (Stats_Now)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Writes one or two records and may replace ctx->rec.names under ctx->rec_mu if recording.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rec_Data(NgSpiceContext *ctx, pvecvaluesall all, int count, int id, Tcl_WideInt ts) {
+    Recorder *r = &ctx->rec;
+    Tcl_MutexLock(&ctx->rec_mu);
+    if (r->file == NULL) {
+        Tcl_MutexUnlock(&ctx->rec_mu);
+        return;
+    }
+    int same = (r->nnames == all->veccount) ? 1 : 0;
+    for (int i = 0; (same == 1) && (i < all->veccount); i++) {
+        if (strcmp(r->names[i], all->vecsa[i]->name) != 0) {
+            same = 0;
+        }
+    }
+    if (same == 0) {
+        for (int i = 0; i < r->nnames; i++) {
+            Tcl_Free(r->names[i]);
+        }
+        Tcl_Free(r->names);
+        r->names = Tcl_Alloc(((size_t)all->veccount + 1U) * sizeof(char *));
+        r->nnames = all->veccount;
+        r->len = 0;
+        Rec_AppendInt(r, all->veccount);
+        for (int i = 0; i < all->veccount; i++) {
+            r->names[i] = ckstrdup(all->vecsa[i]->name);
+            Rec_AppendStr(r, r->names[i]);
+        }
+        Rec_Write(ctx, REC_NAMES, 0, 0, ts);
+    }
+    Rec_AppendInt(r, id);
+    Rec_AppendInt(r, count);
+    Rec_AppendInt(r, all->vecindex);
+    Rec_AppendInt(r, all->veccount);
+    for (int i = 0; i < all->veccount; i++) {
+        pvecvalues v = all->vecsa[i];
+        uint8_t flags = (uint8_t)((v->is_scale ? 1U : 0U) | (v->is_complex ? 2U : 0U));
+        Rec_Append(r, &flags, sizeof flags);
+        Rec_Append(r, &v->creal, sizeof v->creal);
+        if (v->is_complex) {
+            Rec_Append(r, &v->cimag, sizeof v->cimag);
+        }
+    }
+    Rec_Write(ctx, SEND_DATA, 0, 0, ts);
+    Tcl_MutexUnlock(&ctx->rec_mu);
+}
+//***  Rec_Start function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_Start --
+ *
+ *      Creates a recording file and starts recording every callback into it.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for errors
+ *      const char *path             - input: file name in Tcl form
+ *
+ * Results:
+ *      TCL_OK, or TCL_ERROR with a message in the interpreter result if a recording is already in progress or the
+ *      file cannot be created.
+ *
+ * Side Effects:
+ *      Creates or truncates the file and writes REC_MAGIC and REC_BOM; sets up ctx->rec under ctx->rec_mu.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Rec_Start(NgSpiceContext *ctx, Tcl_Interp *interp, const char *path) {
+    Recorder *r = &ctx->rec;
+    Tcl_MutexLock(&ctx->rec_mu);
+    int busy = (r->file != NULL) ? 1 : 0;
+    Tcl_MutexUnlock(&ctx->rec_mu);
+    if (busy == 1) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("recording already in progress", -1));
+        return TCL_ERROR;
+    }
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    const char *native = Tcl_TranslateFileName(interp, path, &ds);
+    FILE *f = (native != NULL) ? fopen(native, "wb") : NULL;
+    Tcl_DStringFree(&ds);
+    if (f == NULL) {
+        if (native != NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\": %s", path, Tcl_PosixError(interp)));
+        }
+        return TCL_ERROR;
+    }
+    uint32_t bom = REC_BOM;
+    if ((fwrite(REC_MAGIC, 8, 1, f) != 1U) || (fwrite(&bom, sizeof bom, 1, f) != 1U)) {
+        (void)fclose(f);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\"", path));
+        return TCL_ERROR;
+    }
+    Tcl_MutexLock(&ctx->rec_mu);
+    Tcl_Free(r->path);
+    r->path = ckstrdup(path);
+    r->file = f;
+    r->failed = 0;
+    r->records = 0;
+    r->bytes = 8U + sizeof bom;
+    r->t0 = Stats_Now();
+    Flag_Store(&r->enabled, 1);
+    Tcl_MutexUnlock(&ctx->rec_mu);
+    return TCL_OK;
+}
+//***  Rec_Stop function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rec_Stop --
+ *
+ *      Stops recording and closes the recording file, if any.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      1 if a record could not be written or the file could not be closed cleanly, 0 otherwise.
+ *
+ * Side Effects:
+ *      Closes ctx->rec.file and frees the name table and payload buffer under ctx->rec_mu; the path and counters
+ *      are kept for "record status".
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Rec_Stop(NgSpiceContext *ctx) {
+    Recorder *r = &ctx->rec;
+    Tcl_MutexLock(&ctx->rec_mu);
+    Flag_Store(&r->enabled, 0);
+    if (r->file != NULL) {
+        if (fclose(r->file) != 0) {
+            r->failed = 1;
+        }
+        r->file = NULL;
+    }
+    for (int i = 0; i < r->nnames; i++) {
+        Tcl_Free(r->names[i]);
+    }
+    Tcl_Free(r->names);
+    Tcl_Free(r->buf);
+    r->names = NULL;
+    r->nnames = 0;
+    r->buf = NULL;
+    r->len = 0;
+    r->cap = 0;
+    int failed = r->failed;
+    Tcl_MutexUnlock(&ctx->rec_mu);
+    return failed;
+}
+
+//** events processing
+static void Conv_Schedule(NgSpiceContext *ctx);
+//***  Conv_IdleProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Conv_IdleProc --
+ *
+ *      Idle handler that converts the next budgeted slice of the row backlog (Conv_Run) and re-schedules itself while
+ *      rows remain. Tcl runs an idle handler added by an idle handler in the next idle pass, so redraws and other
+ *      handlers already pending run between two slices.
+ *
+ * Parameters:
+ *      ClientData cd                - input: NgSpiceContext * that scheduled the handler
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Extends ctx->vectorData, notes the new rows for the "on send_data" script and releases the Tcl_Preserve()
+ *      taken by Conv_Schedule().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Conv_IdleProc(ClientData cd) {
+    NgSpiceContext *ctx = (NgSpiceContext *)cd;
+    ctx->conv_scheduled = 0;
+    if (ctx->destroying == 0) {
+        Tcl_WideInt first_row = ctx->stored_rows;
+        Tcl_WideInt t0 = Stats_Now();
+        size_t n = Conv_Run(ctx, ctx->interp, 1);
+        Trace_Span(ctx, "event", "Conv_IdleProc", t0, (Tcl_WideInt)n);
+        if (n > 0U) {
+            Subs_Note(ctx, SEND_DATA, first_row, 0);
+        }
+        Conv_Schedule(ctx);
+    }
+    Tcl_Release((ClientData)ctx);
+}
+//***  Conv_Schedule function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Conv_Schedule --
+ *
+ *      Schedule Conv_IdleProc if the row backlog is not empty and no handler is pending yet.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls Tcl_Preserve(ctx) and Tcl_DoWhenIdle() when scheduling.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Conv_Schedule(NgSpiceContext *ctx) {
+    if ((ctx->pend.count > 0U) && (ctx->conv_scheduled == 0) && (ctx->destroying == 0)) {
+        ctx->conv_scheduled = 1;
+        Tcl_Preserve((ClientData)ctx);
+        Tcl_DoWhenIdle(Conv_IdleProc, (ClientData)ctx);
+    }
+}
+//***  Conv_Cancel function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Conv_Cancel --
+ *
+ *      Cancels a pending Conv_IdleProc during instance deletion.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls Tcl_CancelIdleCall() and releases the context reference held by the pending handler.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Conv_Cancel(NgSpiceContext *ctx) {
+    if (ctx->conv_scheduled == 1) {
+        Tcl_CancelIdleCall(Conv_IdleProc, (ClientData)ctx);
+        ctx->conv_scheduled = 0;
+        Tcl_Release((ClientData)ctx);
+    }
+}
+//***  NgSpiceEventProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * NgSpiceEventProc --
+ *
+ *      Tcl event handler for processing deferred ngspice callbacks in the main interpreter thread.
+ *      This procedure is invoked via Tcl's event loop when ngspice-related events are queued from background
+ *      threads or asynchronous callbacks. It unpacks the event data, updates shared state in NgSpiceContext,
+ *      and performs any required Tcl_Obj manipulations in a thread-safe manner. If generation of the event is not the
+ *      same as the current generation, skip event processing.
+ *
+ * Parameters:
+ *      Tcl_Event *ev                - input: pointer to the queued Tcl event, castable to NgSpiceEvent
+ *      int flags                    - input: bitmask of flags from Tcl's event loop (currently unused)
+ *
+ * Results:
+ *      Always returns 1 to indicate the event was processed and should be removed from the queue.
+ *
+ * Side Effects:
+ *      For SEND_INIT_DATA:
+ *          - Retrieves and clears ctx->init_snap under ctx->mutex.
+ *          - Resets previous generation vectorData
+ *          - Builds a Tcl dictionary mapping vector names to metadata ("number" and "real").
+ *          - Stores the dictionary in ctx->vectorInit, updating reference counts appropriately.
+ *          - Frees the InitSnap structure.
+ *
+ *      For SEND_DATA:
+ *          - Moves the rows of ctx->prod to the backlog ctx->pend (Conv_Take).
+ *          - Converts one budgeted slice of the backlog into ctx->vectorData (Conv_Run), so a burst of tens of
+ *            thousands of rows does not block the event loop; the rest is converted by Conv_IdleProc slices.
+ *
+ *      For SEND_CHAR and SEND_STAT:
+ *          - Flushes the file message sink (Msg_Flush); SEND_CHAR events are coalesced, the number of callbacks
+ *            is taken from ctx->char_pending.
+ *
+ *      For all other callbacks:
+ *          - No per-event processing is performed.
+ *
+ *      In all cases:
+ *          - Re-arms the notifier channel (ctx->notify_pending), so the next callback makes it readable again.
+ *          - Records the queue-to-dispatch latency in ctx->stats.dispatch; for SEND_DATA it is recorded when the rows
+ *            are visible in ctx->vectorData (Lat_DataVisible).
+ *          - Notes the event for the script registered with "on" (Subs_Note), which schedules a coalesced call.
+ *          - Adds an "event" span to the trace ring with the time the event spent in the queue as argument.
+ *          - Calls Tcl_Release() on ctx to match a Tcl_Preserve() performed when queuing the event.
+ *          - May allocate and free Tcl_Obj values.
+ *          - May adjust Tcl reference counts and free dynamically allocated buffers.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress misra-c2012-2.7 - have to comply with Tcl expected interface*/
+static int NgSpiceEventProc(Tcl_Event *ev, int flags) {
+    /* cppcheck-suppress misra-c2012-11.3 - Tcl embedding pattern*/
+    NgSpiceEvent *sp = (NgSpiceEvent *)ev;
+    NgSpiceContext *ctx = sp->ctx;
+    Tcl_Interp *interp = ctx->interp;
+    uint64_t nchar = 0;
+    Tcl_WideInt t0 = Stats_Now();
+    Stats_Queued(ctx, -1);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    uint64_t curgen = ctx->gen;
+    ctx->notify_pending = 0;
+    if (sp->callbackId == SEND_CHAR) {
+        nchar = ctx->char_pending;
+        ctx->char_pending = 0;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (sp->gen != curgen) {
+        Tcl_Release((ClientData)ctx);
+        return 1;
+    }
+    if (sp->callbackId != SEND_DATA) {
+        Lat_Add(&ctx->stats.dispatch[sp->callbackId], Stats_Now() - sp->queued);
+    } else if (ctx->stats.data_since == 0) {
+        ctx->stats.data_since = sp->queued;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    Tcl_WideInt first_row = ctx->stored_rows;
+    switch ((enum CallbacksIds)sp->callbackId) {
+    case SEND_INIT_DATA: {
+        InitSnap *isnap = NULL;
+        Lock_Enter(ctx, LOCK_MUTEX);
+        isnap = ctx->init_snap;
+        ctx->init_snap = NULL;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        if (isnap != NULL) {
+            Tcl_Obj *dict = Tcl_NewDictObj();
+            for (int i = 0; i < isnap->veccount; i++) {
+                Tcl_Obj *meta = Tcl_NewDictObj();
+                Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("number", -1), Tcl_NewIntObj(isnap->vecs[i].number));
+                Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("real", -1), Tcl_NewBooleanObj(isnap->vecs[i].is_real));
+                Tcl_DictObjPut(interp, dict, Tcl_NewStringObj(isnap->vecs[i].name, -1), meta);
+            }
+            Lock_Enter(ctx, LOCK_MUTEX);
+            if (ctx->vectorInit != NULL) {
+                Tcl_DecrRefCount(ctx->vectorInit);
+            }
+            ctx->vectorInit = dict;
+            Tcl_IncrRefCount(dict);
+            Lock_Leave(ctx, LOCK_MUTEX);
+            FreeInitSnap(isnap);
+        }
+        break;
+    }
+    case SEND_DATA:
+        Conv_Take(ctx);
+        (void)Conv_Run(ctx, interp, 1);
+        Conv_Schedule(ctx);
+        break;
+    case SEND_STAT:
+        Msg_Flush(ctx);
+        break;
+    case SEND_CHAR:
+        Msg_Flush(ctx);
+        break;
+    case BG_THREAD_RUNNING:
+        Run_Drained(ctx);
+        break;
+    default:
+        break;
+    }
+    Subs_Note(ctx, sp->callbackId, first_row, (nchar > 1U) ? nchar : 1U);
+    Trace_Span(ctx, "event", EvtIdToName(sp->callbackId), t0, t0 - sp->queued);
+    Tcl_Release((ClientData)ctx);
+    return 1;
+}
+//***  DeleteNgSpiceEventProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DeleteNgSpiceEventProc --
+ *
+ *      Predicate/deletion callback used with Tcl_DeleteEvents() to remove all pending ngspice-related
+ *      events for a specific NgSpiceContext. This is called during teardown (InstDeleteProc) to ensure
+ *      that no queued NgSpiceEvent objects referencing a soon-to-be-freed context are left in the Tcl
+ *      event queue.
+ *
+ *      The procedure is invoked by Tcl for each queued event. If the event is an NgSpiceEvent belonging
+ *      to the target context, this function:
+ *
+ *          - Releases the context reference previously preserved when the event was queued, and
+ *          - Instructs Tcl to delete the event from the queue without delivering it.
+ *
+ *      Otherwise, it tells Tcl to leave the event alone.
+ *
+ * Parameters:
+ *      Tcl_Event *evPtr          - input: pointer to a queued Tcl event. May or may not actually be
+ *                                   an NgSpiceEvent. We assume NgSpiceEvent layout only after checking.
+ *
+ *      ClientData cd             - input: opaque pointer passed to Tcl_DeleteEvents(), expected to be
+ *                                   the NgSpiceContext * whose events we want to purge.
+ *
+ * Results:
+ *      Returns 1 if the event should be removed from the queue (and not processed later).
+ *      Returns 0 if the event should be kept.
+ *
+ * Side Effects:
+ *      - If evPtr is an NgSpiceEvent whose e->ctx matches the provided NgSpiceContext:
+ *          - Calls Tcl_Release(e->ctx) to balance the Tcl_Preserve() done when the event
+ *            was queued in NgSpiceQueueEvent().
+ *          - Prevents NgSpiceEventProc from ever running for that event by returning 1.
+ *
+ *      - For all other events (not ours, or wrong instance):
+ *          - Leaves them untouched by returning 0.
+ *
+ *      This function is critical for safe teardown:
+ *          After InstDeleteProc() marks the context as destroying, it uses
+ *          Tcl_DeleteEvents(DeleteNgSpiceEventProc, ctx) so that no stale NgSpiceEvent
+ *          callbacks will later run and access freed memory.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int DeleteNgSpiceEventProc(Tcl_Event *evPtr, ClientData cd) {
+    /* cppcheck-suppress misra-c2012-11.3 - Tcl embedding pattern*/
+    NgSpiceEvent *e = (NgSpiceEvent *)evPtr;
+    const NgSpiceContext *ctx = (NgSpiceContext *)cd;
+    if (e->header.proc != NgSpiceEventProc) {
+        return 0;
+    }
+    if (e->ctx != ctx) {
+        return 0;
+    }
+    /* Balance the Tcl_Preserve(ctx) we did when queuing the event */
+    Stats_Queued(e->ctx, -1);
+    Tcl_Release((ClientData)e->ctx);
+    /* tell Tcl to delete (discard) this event */
+    return 1;
+}
+//***  NgSpiceQueueEvent function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * NgSpiceQueueEvent --
+ *
+ *      Queue an NgSpiceEvent for processing in the Tcl event loop, preserving the NgSpiceContext
+ *      until the event is handled. Events are delivered to the same thread that created the
+ *      NgSpiceContext, regardless of the calling thread.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: pointer to the ngspice context that owns the event
+ *      int callbackId               - input: identifier for the type of callback/event to be processed
+ *      uint64_t gen                 - input: generation identifier of the event
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      - If ctx->destroying is nonzero, returns immediately without queuing an event.
+ *      - Makes the notifier channel readable (Notify_Signal), if one was created with "notifier".
+ *      - Calls Tcl_Preserve(ctx) to keep the context alive until NgSpiceEventProc() calls Tcl_Release().
+ *      - Allocates an NgSpiceEvent structure via Tcl_Alloc() and initializes its fields.
+ *      - If called from the same thread as ctx->tclid, queues the event with Tcl_QueueEvent().
+ *      - If called from a different thread, queues the event with Tcl_ThreadQueueEvent() and alerts
+ *        the target thread with Tcl_ThreadAlert().
+ *      - Event is processed by NgSpiceEventProc() when the Tcl event loop runs.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; function must match the prototype defined in Tcl C API */
+static void NgSpiceQueueEvent(NgSpiceContext *ctx, int callbackId, uint64_t gen) {
+    if (Inst_Destroying(ctx) == 1) {
+        return;
+    }
+    Notify_Signal(ctx);
+    Stats_Queued(ctx, 1);
+    Tcl_Preserve((ClientData)ctx);
+    NgSpiceEvent *ev = Tcl_Alloc(sizeof *ev);
+    ev->header.proc = NgSpiceEventProc;
+    ev->header.nextPtr = NULL;
+    ev->ctx = ctx;
+    ev->callbackId = callbackId;
+    ev->gen = gen;
+    ev->queued = Stats_Now();
+    if (Tcl_GetCurrentThread() == ctx->tclid) {
+        Tcl_QueueEvent((Tcl_Event *)ev, TCL_QUEUE_TAIL);
+    } else {
+        Tcl_ThreadQueueEvent(ctx->tclid, (Tcl_Event *)ev, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(ctx->tclid);
+    }
+}
+//***  QuiesceNgspice function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * QuiesceNgspice --
+ *
+ *      Requests ngspice to halt any ongoing background simulation activity and optionally waits for confirmation.
+ *      Used during context destruction or controlled shutdown to ensure ngspice stops producing callbacks
+ *      before issuing further cleanup commands.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx            - input: pointer to the NgSpiceContext structure.
+ *      int wait_ms                    - input: maximum number of milliseconds to wait for background thread to stop;
+ *                                        if 0 or negative, returns immediately after sending the halt command.
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      - Issues a "bg_halt" command through ctx->ngSpice_Command() to request ngspice to pause or stop background work.
+ *      - If wait_ms > 0 and ctx->ngSpice_running is available:
+ *          * Polls ngSpice_running() in small time slices (25 ms) up to wait_ms total.
+ *          * Re-sends "bg_halt" every 200 ms if the background thread remains active.
+ *      - Sleeps briefly between polling intervals to reduce CPU usage.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void QuiesceNgspice(NgSpiceContext *ctx, int wait_ms) {
+    if (!ctx || !ctx->ngSpice_Command) {
+        return;
+    }
+    if (ctx->ngSpice_running && ctx->ngSpice_running() == 1) {
+        ctx->ngSpice_Command("bg_halt");
+        if (wait_ms > 0) {
+            const int slice = 25;
+            int left = wait_ms;
+            while (left > 0) {
+                if (ctx->ngSpice_running() == 0) {
+                    break;
+                }
+                if ((left % 200) == 0) {
+                    ctx->ngSpice_Command("bg_halt");
+                }
+                Tcl_Sleep(slice);
+                left -= slice;
+            }
+        }
+    }
+}
+//***  EnqueuePending function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * EnqueuePending --
+ *
+ *      Adds a command to the pending command queue of an NgSpiceContext.
+ *      Used when ngspice is in a transitional state (e.g., background thread
+ *      starting or stopping) and cannot immediately process new commands.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx    - input: target simulator context.
+ *      const char *cmd        - input: command string to queue (copied).
+ *      int capture            - input: 1 if this was invoked with -capture mode, else 0.
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      - Allocates a new PendingCmd node containing a strdup of cmd.
+ *      - Appends the node to ctx->pending_head/tail under ctx->cmd_mu.
+ *      - The queued commands will later be executed by FlushPending().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void EnqueuePending(NgSpiceContext *ctx, const char *cmd, int capture) {
+    PendingCmd *n = Tcl_Alloc(sizeof *n);
+    n->cmd = ckstrdup(cmd);
+    n->capture = capture;
+    n->next = NULL;
+    Lock_Enter(ctx, LOCK_CMD_MU);
+    if (ctx->pending_tail != NULL) {
+        ctx->pending_tail->next = n;
+    } else {
+        ctx->pending_head = n;
+    }
+    ctx->pending_tail = n;
+    Lock_Leave(ctx, LOCK_CMD_MU);
+    Trace_Instant(ctx, "pending", cmd, capture);
+}
+//***  FlushPending function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * FlushPending --
+ *
+ *      Executes and clears all commands previously queued with EnqueuePending().
+ *      This function is called when ngspice transitions back to a stable state
+ *      (e.g., after the background thread starts or stops), allowing deferred
+ *      commands to run safely.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx    - input: simulator context whose pending queue will be flushed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      - Takes ctx->cmd_mu to detach the entire queue atomically.
+ *      - For each PendingCmd node:
+ *            * If ctx->destroying is false, calls ctx->ngSpice_Command(cmd).
+ *            * Frees the command string and node.
+ *      - Leaves ctx->pending_head and ctx->pending_tail NULL after flushing.
+ *      - If ctx->destroying is true or ngSpice_Command is unavailable, queued
+ *        commands are silently discarded.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void FlushPending(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_CMD_MU);
+    PendingCmd *list = ctx->pending_head;
+    ctx->pending_head = NULL;
+    ctx->pending_tail = NULL;
+    Lock_Leave(ctx, LOCK_CMD_MU);
+    Tcl_WideInt t0 = Stats_Now();
+    Tcl_WideInt n = 0;
+    PendingCmd *p = list;
+    while (p != NULL)  {
+        PendingCmd *next = p->next;
+        if ((Inst_Destroying(ctx) == 0) && ctx->ngSpice_Command) {
+            Tcl_WideInt tc = Stats_Now();
+            ctx->ngSpice_Command((char *)p->cmd);
+            Trace_Span(ctx, "pending", p->cmd, tc, n);
+        }
+        Tcl_Free(p->cmd);
+        Tcl_Free(p);
+        p = next;
+        n++;
+    }
+    if (n > 0) {
+        Trace_Span(ctx, "pending", "FlushPending", t0, n);
+    }
+}
+//***  MsgMaybeCaptureAndSignal function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgMaybeCaptureAndSignal --
+ *
+ *      Passes a message to the message sink (Msg_Put) and, if capture mode is active,
+ *      also duplicates it into the capture queue. Increments the event counter for the
+ *      specified event type and signals any waiters.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx            - input/output: pointer to the ngspice context holding
+ *                                        message queues, mutex, condition variable, and event counters.
+ *      const char *msg                - input: message string to enqueue (typically from a callback).
+ *      int evt                        - input: index into ctx->evt_counts[] specifying the event type to update.
+ *      uint64_t *gen_out              - output (optional): set to the current generation number (ctx->gen)
+ *                                        at the time the message was queued.
+ *
+ * Results:
+ *      1 if the caller must queue a Tcl event, 0 if an event of the same type is still pending (SEND_CHAR only,
+ *      see ctx->char_pending).
+ *
+ * Side Effects:
+ *      - Passes msg to the message sink with Msg_Put() (always).
+ *      - If ctx->cap_active is true, appends msg to ctx->capq as well.
+ *      - Increments ctx->evt_counts[evt] and notifies ctx->cond to wake any waiters.
+ *      - Returns the current generation counter through gen_out, if provided.
+ *      - Thread-safe: protects all shared state with ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static inline int MsgMaybeCaptureAndSignal(NgSpiceContext *ctx, const char *msg, int evt, uint64_t *gen_out) {
+    int queue = 1;
+    Lock_Enter(ctx, LOCK_MUTEX);
+    Msg_Put(ctx, msg);
+    if (ctx->cap_active == 1) {
+        MsgQ_Push(&ctx->capq, msg);
+    }
+    ctx->evt_counts[evt]++;
+    ctx->stats.bumped[evt] = Stats_Now();
+    if (evt == SEND_CHAR) {
+        queue = (ctx->char_pending == 0U) ? 1 : 0;
+        ctx->char_pending++;
+    }
+    Tcl_ConditionNotify(&ctx->cond);
+    if (gen_out != NULL) {
+        *gen_out = ctx->gen;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return queue;
+}
+//** ngspice callbacks (instance-scoped via ctx user ptr)
+//***  SendCharCallback function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * SendCharCallback --
+ *
+ *      ngspice callback function invoked whenever new textual output is produced on ngspice’s stdout or stderr.
+ *      Captures the message, updates event counters, signals waiting threads, and queues a Tcl event
+ *      for deferred processing in the main thread unless one is already pending (a chatty deck costs one event per
+ *      pass of the event loop, not one per line).
+ *
+ * Parameters:
+ *      char *msg                      - input: pointer to the NUL-terminated message string from ngspice.
+ *      int id                         - input: identification number of the calling ngspice shared library instance
+ *                                        (usually 0; can be ignored).
+ *      void *user                     - input: user data pointer supplied during ngspice initialization,
+ *                                        expected to be an NgSpiceContext *.
+ *
+ * Results:
+ *      Always returns 0 (ignored by ngspice).
+ *
+ * Side Effects:
+ *      - If ctx is valid, msg is non-NULL, and ctx->destroying is false:
+ *          - Passes msg to the message sink (ctx->msgq by default), and if capture mode is active, also to
+ *            ctx->capq.
+ *          - Increments the SEND_CHAR event counter and signals any waiters on ctx->cond.
+ *          - Queues a SEND_CHAR Tcl event (via NgSpiceQueueEvent) for main-thread processing if ctx->char_pending
+ *            was zero.
+ *          - Writes the message to the callback recording, if "record" is active (Rec_Event).
+ *      - Thread-safe: protects shared structures with ctx->mutex internally through MsgMaybeCaptureAndSignal().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress constParameterCallback -- function signature cannot be changed */
+static int SendCharCallback(char *msg, int id, void *user) {
+    NgSpiceContext *ctx = (NgSpiceContext *)user;
+    if (!ctx || !msg || (Inst_Destroying(ctx) == 1)) {
+        return 0;
+    }
+    Tcl_WideInt t0 = Stats_Now();
+    if (Flag_Load(&ctx->rec.enabled) == 1) {
+        Rec_Event(ctx, SEND_CHAR, 0, 0, id, 0, msg, t0);
+    }
+    uint64_t mygen = 0;
+    if (MsgMaybeCaptureAndSignal(ctx, msg, SEND_CHAR, &mygen) == 1) {
+        NgSpiceQueueEvent(ctx, SEND_CHAR, mygen);
+    }
+    Stats_Callback(ctx, SEND_CHAR, t0);
+    return 0;
+}
+//***  SendStatCallback function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * SendStatCallback --
+ *
+ *      ngspice callback function invoked whenever the simulator’s status changes
+ *      (e.g., transitions such as "--ready--", "--stopped--", or "--running--") and repeatedly while an analysis
+ *      runs ("tran: 42.3%"). Progress reports are parsed into ctx->progress and throttled by Progress_Update; the
+ *      other status lines and the progress reports that pass the throttle are recorded in the message queue, update
+ *      the event counters and queue a Tcl event for processing in the main thread.
+ *
+ * Parameters:
+ *      char *msg                      - input: pointer to the NUL-terminated status message from ngspice.
+ *      int id                         - input: identification number of the calling ngspice shared library instance.
+ *      void *user                     - input: user data pointer supplied during ngspice initialization,
+ *                                        expected to be an NgSpiceContext *.
+ *
+ * Results:
+ *      Always returns 0 (ignored by ngspice).
+ *
+ * Side Effects:
+ *      - If ctx is valid and ctx->destroying is false:
+ *          - Writes the status to the callback recording, if "record" is active (Rec_Event); progress reports are
+ *            recorded before throttling.
+ *          - Stores a progress report in ctx->progress.
+ *          - Unless the report is throttled:
+ *              - Formats the message as: "# status[<id>]: <msg>".
+ *              - Appends the formatted line to ctx->msgq via QueueMsg().
+ *              - Increments the SEND_STAT event counter and signals waiters via BumpAndSignal().
+ *              - Queues a SEND_STAT Tcl event via NgSpiceQueueEvent() for deferred processing.
+ *      - Thread-safe: protects access to ctx->progress and ctx->gen with ctx->mutex; creates no Tcl objects.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress constParameterCallback -- function signature cannot be changed */
+static int SendStatCallback(char *msg, int id, void *user) {
+    NgSpiceContext *ctx = (NgSpiceContext *)user;
+    uint64_t mygen;
+    if (!ctx || !msg || (Inst_Destroying(ctx) == 1)) {
+        return 0;
+    }
+    Tcl_WideInt t0 = Stats_Now();
+    if (Flag_Load(&ctx->rec.enabled) == 1) {
+        Rec_Event(ctx, SEND_STAT, 0, 0, id, 0, msg, t0);
+    }
+    char name[PROGRESS_NAMELEN];
+    double percent;
+    if (Progress_Parse(msg, name, &percent) == 1) {
+        Tcl_Time now;
+        Tcl_GetTime(&now);
+        Lock_Enter(ctx, LOCK_MUTEX);
+        int emit = Progress_Update(ctx, name, percent, &now);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        if (emit == 0) {
+            Stats_Callback(ctx, SEND_STAT, t0);
+            return 0;
+        }
+    }
+    size_t len = strlen(msg) + 32U;
+    char *line = Tcl_Alloc(len);
+    snprintf(line, len, "# status[%d]: %s", id, msg);
+    QueueMsg(ctx, line);
+    Tcl_Free(line);
+    BumpAndSignal(ctx, SEND_STAT);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    mygen = ctx->gen;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    NgSpiceQueueEvent(ctx, SEND_STAT, mygen);
+    Stats_Callback(ctx, SEND_STAT, t0);
+    return 0;
+}
+//***  ControlledExitCallback function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * ControlledExitCallback --
+ *
+ *      ngspice callback function invoked when ngspice requests a controlled shutdown,
+ *      either due to a normal "quit" command or an internal unrecoverable error.
+ *      Signals the Tcl-side logic that ngspice has exited, updates state flags,
+ *      and queues a CONTROLLED_EXIT event for main-thread processing.
+ *
+ * Parameters:
+ *      int status                     - input: exit status code provided by ngspice.
+ *      bool immediate                 - input: if true, ngspice requests immediate unloading of the shared library.
+ *      bool exit_upon_exit            - input: if true, indicates user-requested quit; otherwise, internal ngspice
+ *                                              error.
+ *      int id                         - input: identification number of the ngspice shared library instance. void
+ *      user                           - input: user data pointer supplied during ngspice initialization, expected
+ *                                              to be anNgSpiceContext.
+ *
+ * Results:
+ *      Always returns 0 (ignored by ngspice).
+ *
+ * Side Effects:
+ *      - Writes the exit to the callback recording, if "record" is active (Rec_Event).
+ *      - Marks the ngspice context as exited (ctx->exited = 1) and clears ctx->quitting.
+ *      - Signals ctx->exit_cv to wake any threads waiting for ngspice termination.
+ *      - Increments the CONTROLLED_EXIT event counter via BumpAndSignal().
+ *      - If ctx->destroying is false:
+ *          - Captures the current generation counter (ctx->gen) under ctx->mutex.
+ *          - Queues a CONTROLLED_EXIT Tcl event for deferred handling in the main thread.
+ *      - Ensures proper synchronization using ctx->exit_mu and ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
+static int ControlledExitCallback(int status, bool immediate, bool exit_upon_exit, int id, void *user) {
+    NgSpiceContext *ctx = (NgSpiceContext *)user;
+    if (!ctx) {
+        return 0;
+    }
+    Tcl_WideInt t0 = Stats_Now();
+    if (Flag_Load(&ctx->rec.enabled) == 1) {
+        Rec_Event(ctx, CONTROLLED_EXIT, immediate ? 1 : 0, exit_upon_exit ? 1 : 0, id, status, NULL, t0);
+    }
+    Tcl_MutexLock(&ctx->exit_mu);
+    ctx->exited = 1;
+    ctx->quitting = 0;
+    Tcl_ConditionNotify(&ctx->exit_cv);
+    Tcl_MutexUnlock(&ctx->exit_mu);
+    BumpAndSignal(ctx, CONTROLLED_EXIT);
+    if (Inst_Destroying(ctx) == 0) {
+        uint64_t mygen;
+        Lock_Enter(ctx, LOCK_MUTEX);
+        mygen = ctx->gen;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        NgSpiceQueueEvent(ctx, CONTROLLED_EXIT, mygen);
+    }
+    Stats_Callback(ctx, CONTROLLED_EXIT, t0);
+    return 0;
+}
+//***  SendDataCallback function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * SendDataCallback --
+ *
+ *      ngspice callback function invoked whenever new simulation data (vector values)
+ *      become available during analysis. Each invocation provides one or more sets of
+ *      vector values that represent the current simulation point.
+ *
+ * Parameters:
+ *      pvecvaluesall all              - input: pointer to a structure containing the current set of vectors and values.
+ *      int count                      - input: number of vector sets provided (usually 1).
+ *      int id                         - input: identification number of the calling ngspice shared library instance.
+ *      void *user                     - input: user data pointer supplied during ngspice initialization,
+ *                                        expected to be an NgSpiceContext *.
+ *
+ * Results:
+ *      Always returns 0 (ignored by ngspice).
+ *
+ * Side Effects:
+ *      - If ctx is valid, count > 0, and ctx->destroying is false:
+ *          - Writes the row to the callback recording, if "record" is active (Rec_Data).
+ *          - Reads the storing flags under ctx->mutex and, unless storing is disabled ("configure -storedata 0" or
+ *            the stop memory policy), allocates a new DataRow to hold the current vector values; without it only
+ *            histograms, triggers and captures see the row.
+ *          - Copies each vector’s metadata and values into a new array of DataCell entries.
+ *          - Counts the row in ctx->stats and in the report of the active bg_run (Run_Active) under ctx->mutex.
+ *          - Folds the row into attached histogram accumulators (Hist_AccumulateRow) under ctx->mutex.
+ *          - Evaluates armed triggers on the row (Trig_EvalRow) under ctx->mutex.
+ *          - Feeds the row to capture windows (Cap_Row) under ctx->mutex.
+ *          - Evaluates derived vectors on the row and drops their -drop inputs (Derived_AppendRow) under ctx->mutex.
+ *          - Appends the completed DataRow to ctx->prod (the producer data buffer) under ctx->mutex protection.
+ *          - With a memory budget, checks the accounted memory (Mem_Check) under ctx->mutex; when it rises above
+ *            the budget, bumps and queues a MEMORY_BUDGET event and, for the halt policy, starts the halt helper
+ *            thread (Trig_StartHalt); stop is applied by Mem_Check and leaves an active recording running, drop acts
+ *            on the Tcl thread.
+ *          - Increments the SEND_DATA event counter and signals any waiting threads via BumpAndSignal().
+ *          - Queues a SEND_DATA Tcl event (NgSpiceQueueEvent) for deferred main-thread processing.
+ *          - If a trigger fired or a capture segment started: bumps and queues a TRIGGER_FIRED event and, for -halt
+ *            triggers, starts the halt helper thread (Trig_StartHalt).
+ *      - Ensures thread safety with ctx->mutex around shared buffer access.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress misra-c2012-7.3 - not in my code */
+/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
+static int SendDataCallback(pvecvaluesall all, int count, int id, void *user) {
+    NgSpiceContext *ctx = (NgSpiceContext *)user;
+    uint64_t mygen;
+    if (!ctx || !all || (count <= 0) || (Inst_Destroying(ctx) == 1)) {
+        return 0;
+    }
+    Tcl_WideInt t0 = Stats_Now();
+    if (Flag_Load(&ctx->rec.enabled) == 1) {
+        Rec_Data(ctx, all, count, id, t0);
+    }
+    /* both flags are written by the Tcl thread ("configure -storedata", reset) under ctx->mutex */
+    Lock_Enter(ctx, LOCK_MUTEX);
+    int store = ((ctx->store_data == 1) && (ctx->mem.stopped == 0)) ? 1 : 0;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    DataRow row;
+    size_t row_bytes = 0;
+    memset(&row, 0, sizeof row);
+    if (store == 1) {
+        row.veccount = all->veccount;
+        row.vecs = Tcl_Alloc(sizeof(DataCell) * (size_t)row.veccount);
+        row_bytes = sizeof(DataCell) * (size_t)row.veccount;
+        for (int i = 0; i < row.veccount; i++) {
+            pvecvalues v = all->vecsa[i];
+            size_t len = strlen(v->name) + 1U;
+            row.vecs[i].name = memcpy(Tcl_Alloc(len), v->name, len);
+            row_bytes += len;
+            row.vecs[i].is_complex = v->is_complex;
+            row.vecs[i].shared_name = 0;
+            row.vecs[i].creal = v->creal;
+            row.vecs[i].cimag = v->cimag;
+        }
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    mygen = ctx->gen;
+    ctx->stats.rows++;
+    ctx->stats.cells += (uint64_t)all->veccount;
+    RunInfo *run = Run_Active(ctx);
+    if (run != NULL) {
+        if (run->first_data == 0) {
+            run->first_data = t0;
+        }
+        run->rows++;
+    }
+    if (ctx->hist_head != NULL) {
+        Hist_AccumulateRow(ctx, all);
+    }
+    int nfired = 0;
+    int halt = 0;
+    if (ctx->trig_head != NULL) {
+        nfired = Trig_EvalRow(ctx, all, &halt);
+    }
+    if (ctx->cap_head != NULL) {
+        nfired += Cap_Row(ctx, all);
+    }
+    if (store == 1) {
+        if (ctx->derived_head != NULL) {
+            Derived_AppendRow(ctx, all, &row);
+            row_bytes = DataRow_Bytes(&row);
+        }
+        DataBuf_Ensure(&ctx->prod, ctx->prod.count + (size_t)1);
+        ctx->prod.rows[ctx->prod.count] = row;
+        ctx->prod.count++;
+        ctx->prod.bytes += row_bytes;
+    }
+    int mem_policy = -1;
+    if ((ctx->mem.budget > 0U) && (Mem_Check(ctx) == 1)) {
+        mem_policy = ctx->mem.policy;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    BumpAndSignal(ctx, SEND_DATA);
+    NgSpiceQueueEvent(ctx, SEND_DATA, mygen);
+    if (mem_policy >= 0) {
+        BumpAndSignal(ctx, MEMORY_BUDGET);
+        NgSpiceQueueEvent(ctx, MEMORY_BUDGET, mygen);
+        if (mem_policy == MEM_POLICY_HALT) {
+            Trig_StartHalt(ctx);
+        }
+    }
+    if (nfired > 0) {
+        BumpAndSignal(ctx, TRIGGER_FIRED);
+        NgSpiceQueueEvent(ctx, TRIGGER_FIRED, mygen);
+        if (halt == 1) {
+            Trig_StartHalt(ctx);
+        }
+    }
+    Stats_Callback(ctx, SEND_DATA, t0);
+    return 0;
+}
+//***  SendInitDataCallback function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * SendInitDataCallback --
+ *
+ *      ngspice callback function invoked once at the start of a simulation run,
+ *      after the simulator has completed initialization and all vectors for the
+ *      upcoming analysis have been defined. Captures metadata describing each vector
+ *      (name, index, and type), resets the data buffer, and triggers a new generation.
+ *
+ * Parameters:
+ *      pvecinfoall vinfo              - input: pointer to a structure containing information about all initialized
+ *vectors. int id                         - input: identification number of the calling ngspice shared library instance.
+ *      void *user                     - input: user data pointer supplied during ngspice initialization,
+ *                                              expected to be an NgSpiceContext *.
+ *
+ * Results:
+ *      Always returns 0 (ignored by ngspice).
+ *
+ * Side Effects:
+ *      - If ctx is valid and ctx->destroying is false:
+ *          - Writes the vector information to the callback recording, if "record" is active (Rec_Init).
+ *          - Allocates a new InitSnap structure holding vector metadata (name, number, is_real flag).
+ *          - Frees any previously stored initialization snapshot (ctx->init_snap) before replacing it.
+ *          - Resets ctx->prod (the producer data buffer) to prepare for new simulation data.
+ *          - Replaces the callback-side vector name table (ctx->run_names), determines the scale vector index from
+ *            the pdvecscale pointers, re-resolves histogram accumulators against the new table and zeroes them.
+ *          - Re-resolves derived vectors, rebuilds the keep mask and adds/removes their entries in the snapshot.
+ *          - Re-arms triggers (Trig_Reset) and capture windows (Cap_Reset), dropping the previous segments.
+ *          - Increments ctx->plot_seq, so the min/max pyramids of the previous data are dropped (Pyr_DropStale).
+ *          - Records the first init time in the report of the active bg_run (Run_Active).
+ *          - Sets ctx->new_run_pending to request a data reset in NgSpiceEventProc.
+ *          - Increments the SEND_INIT_DATA event counter and signals any waiting threads via BumpAndSignal().
+ *          - Queues a SEND_INIT_DATA Tcl event (NgSpiceQueueEvent) for deferred main-thread processing.
+ *      - Ensures thread safety by locking ctx->mutex during all shared state updates.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
+static int SendInitDataCallback(pvecinfoall vinfo, int id, void *user) {
+    NgSpiceContext *ctx = (NgSpiceContext *)user;
+    if (!ctx || !vinfo || (Inst_Destroying(ctx) == 1)) {
+        return 0;
+    }
+    Tcl_WideInt t0 = Stats_Now();
+    if (Flag_Load(&ctx->rec.enabled) == 1) {
+        Rec_Init(ctx, vinfo, id, t0);
+    }
+    InitSnap *snap = Tcl_Alloc(sizeof *snap);
+    snap->veccount = vinfo->veccount;
+    snap->vecs = Tcl_Alloc((size_t)snap->veccount * sizeof *snap->vecs);
+    char **names = Tcl_Alloc(((size_t)vinfo->veccount + (size_t)1) * sizeof(char *));
+    int scale_idx = -1;
+    for (int i = 0; i < snap->veccount; i++) {
+        pvecinfo vec = vinfo->vecs[i];
+        snap->vecs[i].name = ckstrdup(vec->vecname);
+        snap->vecs[i].number = vec->number;
+        snap->vecs[i].is_real = vec->is_real;
+        names[i] = ckstrdup(vec->vecname);
+        if ((scale_idx < 0) && (vec->pdvec != NULL) && (vec->pdvec == vinfo->vecs[0]->pdvecscale)) {
+            scale_idx = i;
+        }
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    RunInfo *run = Run_Active(ctx);
+    if ((run != NULL) && (run->init == 0)) {
+        run->init = t0;
+    }
+    RunNames_Free(ctx);
+    ctx->plot_seq++;
+    ctx->run_names = names;
+    ctx->run_veccount = vinfo->veccount;
+    ctx->scale_idx = scale_idx;
+    for (HistAcc *h = ctx->hist_head; h != NULL; h = h->next) {
+        h->vec_idx = ResolveRunVector(ctx, h->vecname);
+        Hist_Reset(h);
+    }
+    for (DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+        Derived_Resolve(ctx, d, vinfo);
+    }
+    Derived_UpdateKeep(ctx);
+    Derived_PatchSnap(ctx, snap);
+    for (Trigger *t = ctx->trig_head; t != NULL; t = t->next) {
+        Trig_Reset(ctx, t);
+    }
+    for (Capture *cap = ctx->cap_head; cap != NULL; cap = cap->next) {
+        Cap_Reset(ctx, cap);
+    }
+    Progress_Reset(ctx);
+    if (ctx->init_snap != NULL) {
+        for (int i = 0; i < ctx->init_snap->veccount; i++) {
+            Tcl_Free(ctx->init_snap->vecs[i].name);
+        }
+        Tcl_Free(ctx->init_snap->vecs);
+        Tcl_Free(ctx->init_snap);
+    }
+    ctx->init_snap = snap;
+    uint64_t mygen = ctx->gen;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    BumpAndSignal(ctx, SEND_INIT_DATA);
+    NgSpiceQueueEvent(ctx, SEND_INIT_DATA, mygen);
+    Stats_Callback(ctx, SEND_INIT_DATA, t0);
+    return 0;
+}
+//***  BGThreadRunningCallback function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * BGThreadRunningCallback --
+ *
+ *      libngspice callback that fires when the background simulation thread changes state.
+ *      We record whether the background thread just started or ended, update internal
+ *      bookkeeping, wake any waiters, and enqueue a Tcl event for the main thread.
+ *
+ * Parameters:
+ *      bool running   - false means the background thread has just STARTED,
+ *                       true  means the background thread has just STOPPED.
+ *      int id         - ngspice instance ID (unused here).
+ *      void *user     - NgSpiceContext * passed at ngSpice_Init() time.
+ *
+ * Results:
+ *      Always returns 0 (ngspice ignores the return value).
+ *
+ * Side Effects:
+ *      - If ctx is NULL or ctx->destroying is already set, we return immediately.
+ *
+ *      - Otherwise:
+ *          * Write the transition to the callback recording, if "record" is active (Rec_Event).
+ *
+ *          * Take ctx->bg_mu and update ctx->bg_started / ctx->bg_ended:
+ *                running == false:
+ *                    - mark ctx->bg_started = 1
+ *                    - if ctx->state == NGSTATE_STARTING_BG:
+ *                        set ctx->state = NGSTATE_BG_ACTIVE
+ *                        FlushPending(ctx)   ;# run any commands queued while starting
+ *
+ *                running == true:
+ *                    - mark ctx->bg_ended = 1
+ *                    - if ctx->state == NGSTATE_STOPPING_BG or NGSTATE_BG_ACTIVE:
+ *                        set ctx->state = NGSTATE_IDLE
+ *                        FlushPending(ctx)   ;# now safe to run deferred commands
+ *
+ *          * Signal ctx->bg_cv so threads waiting in WaitForBGStarted()/WaitForBGEnded()
+ *            can make progress.
+ *
+ *          * On start, begin a new run scope for the message counters (Msg_NewRun). Record the start or end time
+ *            in the report of the active bg_run (Run_Active) before waiters are woken.
+ *
+ *          * Log a human-readable status line into ctx->msgq via QueueMsg(), e.g.:
+ *                "# background thread running started"
+ *                "# background thread running ended"
+ *
+ *          * Call BumpAndSignal(ctx, BG_THREAD_RUNNING) to:
+ *                - increment the BG_THREAD_RUNNING counter in ctx->evt_counts[]
+ *                - wake up anyone blocked in waitevent bg_running
+ *
+ *          * Snapshot ctx->gen under ctx->mutex and queue a BG_THREAD_RUNNING Tcl event
+ *            (NgSpiceQueueEvent), so the main thread can service it later.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Ngspice callback signature */
+static int BGThreadRunningCallback(bool running, int id, void *user) {
+    NgSpiceContext *ctx = (NgSpiceContext *)user;
+    uint64_t mygen;
+    if (!ctx || (Inst_Destroying(ctx) == 1)) {
+        return 0;
+    }
+    Tcl_WideInt t0 = Stats_Now();
+    if (Flag_Load(&ctx->rec.enabled) == 1) {
+        Rec_Event(ctx, BG_THREAD_RUNNING, running ? 1 : 0, 0, id, 0, NULL, t0);
+    }
+    Lock_Enter(ctx, LOCK_BG_MU);
+    if (!running) {
+        if (!ctx->bg_started) {
+            ctx->bg_started = 1;
+            if (ctx->state == NGSTATE_STARTING_BG) {
+                State_Set(ctx, NGSTATE_BG_ACTIVE);
+                FlushPending(ctx);
+            }
+        }
+    } else {
+        ctx->bg_ended = 1;
+        if (ctx->state == NGSTATE_STOPPING_BG) {
+            State_Set(ctx, NGSTATE_IDLE);
+            FlushPending(ctx);
+        } else if (ctx->state == NGSTATE_BG_ACTIVE) {
+            State_Set(ctx, NGSTATE_IDLE);
+            FlushPending(ctx);
+        } else {
+            /* No action required: all valid cases handled above (MISRA 15.7) */
+        }
+    }
+    Tcl_ConditionNotify(&ctx->bg_cv);
+    Lock_Leave(ctx, LOCK_BG_MU);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (!running) {
+        Msg_NewRun(ctx);
+    }
+    RunInfo *run = Run_Active(ctx);
+    if (run != NULL) {
+        if (running) {
+            run->ended = t0;
+        } else if (run->started == 0) {
+            run->started = t0;
+        } else {
+            /* No action required: all valid cases handled above (MISRA 15.7) */
+        }
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    QueueMsg(ctx, running ? "# background thread running ended" : "# background thread running started");
+    BumpAndSignal(ctx, BG_THREAD_RUNNING);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    mygen = ctx->gen;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    NgSpiceQueueEvent(ctx, BG_THREAD_RUNNING, mygen);
+    Stats_Callback(ctx, BG_THREAD_RUNNING, t0);
+    return 0;
+}
+//***  WaitForBGStarted function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * WaitForBGStarted --
+ *
+ *      Waits until the ngspice background simulation thread has started, or until an optional timeout expires.
+ *      Ensures that subsequent operations (e.g. event waiting or destruction) occur only after ngspice has
+ *      fully initialized its background thread.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx            - input: pointer to the NgSpiceContext structure.
+ *      int timeout_ms                 - input: maximum time to wait in milliseconds (0 or negative for infinite wait).
+ *
+ * Results:
+ *      None. Returns after the background thread has started or the timeout has elapsed.
+ *
+ * Side Effects:
+ *      - Polls ngSpice_running() and waits on ctx->bg_cv until ctx->bg_started is set by BGThreadRunningCallback().
+ *      - If timeout_ms > 0, the wait is bounded by the specified duration.
+ *      - Uses Tcl_MutexLock/Tcl_ConditionWait to safely synchronize with the callback thread.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void WaitForBGStarted(NgSpiceContext *ctx, int timeout_ms) {
+    if (!ctx->ngSpice_running) {
+        Tcl_Sleep(10);
+        return;
+    }
+    Tcl_Time deadline;
+    Tcl_Time now;
+    int use_deadline = (timeout_ms > 0) ? 1 : 0;
+    if (use_deadline == 1) {
+        Tcl_GetTime(&deadline);
+        long us = (long)timeout_ms * 1000;
+        deadline.usec += us % 1000000;
+        deadline.sec += (us / 1000000) + (deadline.usec / 1000000);
+        deadline.usec %= 1000000;
+    }
+    Lock_Enter(ctx, LOCK_BG_MU);
+    while (!ctx->bg_started) {
+        if (ctx->ngSpice_running() == 1) {
+            ctx->bg_started = 1;
+            break;
+        }
+        if (!use_deadline) {
+            Lock_Wait(ctx, LOCK_BG_MU, &ctx->bg_cv, NULL);
+        } else {
+            Tcl_GetTime(&now);
+            if ((now.sec > deadline.sec) || ((now.sec == deadline.sec) && (now.usec >= deadline.usec))) {
+                break;
+            }
+            Tcl_Time rel = deadline;
+            rel.sec -= now.sec;
+            rel.usec -= now.usec;
+            if (rel.usec < 0) {
+                rel.usec += 1000000;
+                rel.sec -= 1;
+            }
+            Lock_Wait(ctx, LOCK_BG_MU, &ctx->bg_cv, &rel);
+        }
+    }
+    Lock_Leave(ctx, LOCK_BG_MU);
+}
+//***  WaitForBGEnded function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * WaitForBGEnded --
+ *
+ *      Waits until the ngspice background simulation thread has finished running, or until an optional timeout expires.
+ *      Ensures that cleanup or context destruction does not proceed while the background thread is still active.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx            - input: pointer to the NgSpiceContext structure.
+ *      int timeout_ms                 - input: maximum time to wait in milliseconds (0 or negative for infinite wait).
+ *
+ * Results:
+ *      None. Returns after the background thread has ended or the timeout has elapsed.
+ *
+ * Side Effects:
+ *      - Polls ngSpice_running() and waits on ctx->bg_cv until ctx->bg_ended is set by BGThreadRunningCallback().
+ *      - If ngSpice_running() returns 0, marks ctx->bg_ended = 1 immediately.
+ *      - Uses Tcl_MutexLock/Tcl_ConditionWait to synchronize with the callback thread.
+ *      - If timeout_ms > 0, the wait is bounded by the specified duration.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void WaitForBGEnded(NgSpiceContext *ctx, int timeout_ms) {
+    Tcl_Time deadline;
+    Tcl_Time now;
+    int use_deadline = (timeout_ms > 0) ? 1 : 0;
+    if (use_deadline == 1) {
+        Tcl_GetTime(&deadline);
+        long us = (long)timeout_ms * 1000;
+        deadline.usec += us % 1000000;
+        deadline.sec += (us / 1000000) + (deadline.usec / 1000000);
+        deadline.usec %= 1000000;
+    }
+    Lock_Enter(ctx, LOCK_BG_MU);
+    while (!ctx->bg_ended) {
+        if (!ctx->ngSpice_running || ctx->ngSpice_running() == 0) {
+            ctx->bg_ended = 1;
+            break;
+        }
+        if (!use_deadline) {
+            Lock_Wait(ctx, LOCK_BG_MU, &ctx->bg_cv, NULL);
+        } else {
+            Tcl_GetTime(&now);
+            if ((now.sec > deadline.sec) || ((now.sec == deadline.sec) && (now.usec >= deadline.usec))) {
+                break;
+            }
+            Tcl_Time rel = deadline;
+            rel.sec -= now.sec;
+            rel.usec -= now.usec;
+            if (rel.usec < 0) {
+                rel.usec += 1000000;
+                rel.sec -= 1;
+            }
+            Lock_Wait(ctx, LOCK_BG_MU, &ctx->bg_cv, &rel);
+        }
+    }
+    Lock_Leave(ctx, LOCK_BG_MU);
+}
+
+//** callback replay
+//***  Run_Reset function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Run_Reset --
+ *
+ *      Prepares the instance for a new background run, on "command bg_run" and "replay start": moves ctx->state to
+ *      NGSTATE_STARTING_BG, starts a new generation and run report, and drops the data of the previous run. Tcl
+ *      thread only.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Clears ctx->bg_started/bg_ended under ctx->bg_mu; increments ctx->gen and ctx->plot_seq, re-arms the memory
+ *      budget, begins a
+ *      report (Run_Begin) and frees ctx->init_snap, ctx->prod, ctx->vectorData and ctx->vectorInit under
+ *      ctx->mutex; discards the conversion backlog and the row counts of "on" scripts.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Run_Reset(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_BG_MU);
+    State_Set(ctx, NGSTATE_STARTING_BG);
+    ctx->bg_started = 0;
+    ctx->bg_ended = 0;
+    Lock_Leave(ctx, LOCK_BG_MU);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    ctx->gen++;
+    ctx->plot_seq++;
+    ctx->new_run_pending = 0;
+    ctx->mem.over = 0;
+    ctx->mem.stopped = 0;
+    Run_Begin(ctx);
+    if (ctx->init_snap != NULL) {
+        for (int i = 0; i < ctx->init_snap->veccount; i++) {
+            Tcl_Free(ctx->init_snap->vecs[i].name);
+        }
+        Tcl_Free(ctx->init_snap->vecs);
+        Tcl_Free(ctx->init_snap);
+        ctx->init_snap = NULL;
+    }
+    DataBuf_Free(&ctx->prod);
+    DataBuf_Init(&ctx->prod);
+    if (ctx->vectorData != NULL) {
+        Tcl_DecrRefCount(ctx->vectorData);
+    }
+    ctx->vectorData = Tcl_NewDictObj();
+    Tcl_IncrRefCount(ctx->vectorData);
+    if (ctx->vectorInit != NULL) {
+        Tcl_DecrRefCount(ctx->vectorInit);
+    }
+    ctx->vectorInit = Tcl_NewDictObj();
+    Tcl_IncrRefCount(ctx->vectorInit);
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Conv_Discard(ctx);
+    Subs_ResetRows(ctx);
+}
+//***  Rd_Bytes function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rd_Bytes --
+ *
+ *      Copies the next n bytes of a record payload. Reading past the end marks the reader bad and zero-fills dst.
+ *
+ * Parameters:
+ *      RecReader *rd                - input/output: payload reader
+ *      void *dst                    - output: destination
+ *      size_t n                     - input: number of bytes
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Advances rd->p or sets rd->bad.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Rd_Bytes(RecReader *rd, void *dst, size_t n) {
+    if ((rd->bad != 0) || ((size_t)(rd->end - rd->p) < n)) {
+        rd->bad = 1;
+        memset(dst, 0, n);
+        return;
+    }
+    memcpy(dst, rd->p, n);
+    rd->p += n;
+}
+//***  Rd_Int function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rd_Int --
+ *
+ *      Decodes a 32-bit integer written by Rec_AppendInt.
+ *
+ * Parameters:
+ *      RecReader *rd                - input/output: payload reader
+ *
+ * Results:
+ *      The value, 0 if the payload is exhausted.
+ *
+ * Side Effects:
+ *      Advances rd->p or sets rd->bad.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Rd_Int(RecReader *rd) {
+    int32_t v;
+    Rd_Bytes(rd, &v, sizeof v);
+    return (int)v;
+}
+//***  Rd_Str function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Rd_Str --
+ *
+ *      Decodes a string written by Rec_AppendStr into a new NUL-terminated copy.
+ *
+ * Parameters:
+ *      RecReader *rd                - input/output: payload reader
+ *
+ * Results:
+ *      String allocated with Tcl_Alloc (empty if the payload is exhausted); the caller frees it.
+ *
+ * Side Effects:
+ *      Advances rd->p or sets rd->bad.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static char *Rd_Str(RecReader *rd) {
+    uint32_t n;
+    Rd_Bytes(rd, &n, sizeof n);
+    if ((size_t)(rd->end - rd->p) < (size_t)n) {
+        rd->bad = 1;
+        n = 0;
+    }
+    char *s = Tcl_Alloc((size_t)n + 1U);
+    Rd_Bytes(rd, s, (size_t)n);
+    s[n] = '\0';
+    return s;
+}
+//***  Replay_Text function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Text --
+ *
+ *      Decodes the message text of a record written by Rec_Event, i.e. the rest of the payload.
+ *
+ * Parameters:
+ *      RecReader *rd                - input/output: payload reader positioned after the id and value
+ *
+ * Results:
+ *      NUL-terminated copy allocated with Tcl_Alloc; the caller frees it.
+ *
+ * Side Effects:
+ *      Consumes the payload.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static char *Replay_Text(RecReader *rd) {
+    size_t n = (rd->bad == 0) ? (size_t)(rd->end - rd->p) : 0U;
+    char *s = Tcl_Alloc(n + 1U);
+    Rd_Bytes(rd, s, n);
+    s[n] = '\0';
+    return s;
+}
+//***  Replay_Init function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Init --
+ *
+ *      Rebuilds the vector information of a record written by Rec_Init and passes it to SendInitDataCallback. Every
+ *      vector gets a distinct non-NULL pdvec and pdvecscale points to the pdvec of the recorded scale vector, so the
+ *      callback finds the scale as it does with ngspice.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      RecReader *rd                - input/output: payload reader
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls SendInitDataCallback unless the payload is malformed (rd->bad is set).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Replay_Init(NgSpiceContext *ctx, RecReader *rd) {
+    int id = Rd_Int(rd);
+    int n = Rd_Int(rd);
+    if ((n < 0) || ((size_t)n > (size_t)(rd->end - rd->p))) {
+        rd->bad = 1;
+        return;
+    }
+    vecinfoall all;
+    all.name = Rd_Str(rd);
+    all.title = Rd_Str(rd);
+    all.date = Rd_Str(rd);
+    all.type = Rd_Str(rd);
+    all.veccount = n;
+    vecinfo *infos = Tcl_Alloc(((size_t)n + 1U) * sizeof(vecinfo));
+    all.vecs = Tcl_Alloc(((size_t)n + 1U) * sizeof(pvecinfo));
+    void *scale = NULL;
+    for (int i = 0; i < n; i++) {
+        uint8_t flags[2];
+        infos[i].number = Rd_Int(rd);
+        Rd_Bytes(rd, flags, sizeof flags);
+        infos[i].is_real = (flags[0] != 0U);
+        infos[i].vecname = Rd_Str(rd);
+        infos[i].pdvec = (void *)&infos[i];
+        if ((flags[1] != 0U) && (scale == NULL)) {
+            scale = infos[i].pdvec;
+        }
+        all.vecs[i] = &infos[i];
+    }
+    for (int i = 0; i < n; i++) {
+        infos[i].pdvecscale = scale;
+    }
+    if (rd->bad == 0) {
+        (void)SendInitDataCallback(&all, id, ctx);
+    }
+    for (int i = 0; i < n; i++) {
+        Tcl_Free(infos[i].vecname);
+    }
+    Tcl_Free(all.vecs);
+    Tcl_Free(infos);
+    Tcl_Free(all.name);
+    Tcl_Free(all.title);
+    Tcl_Free(all.date);
+    Tcl_Free(all.type);
+}
+//***  Replay_Names function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Names --
+ *
+ *      Replaces the vector name table of the replay thread with the one of a REC_NAMES record.
+ *
+ * Parameters:
+ *      RecReader *rd                - input/output: payload reader
+ *      char ***names                - input/output: name table of the replay thread
+ *      int *nnames                  - input/output: number of entries in *names
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the old table and allocates a new one.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Replay_Names(RecReader *rd, char ***names, int *nnames) {
+    for (int i = 0; i < *nnames; i++) {
+        Tcl_Free((*names)[i]);
+    }
+    Tcl_Free(*names);
+    int n = Rd_Int(rd);
+    if ((n < 0) || ((size_t)n > (size_t)(rd->end - rd->p))) {
+        rd->bad = 1;
+        n = 0;
+    }
+    *names = Tcl_Alloc(((size_t)n + 1U) * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        (*names)[i] = Rd_Str(rd);
+    }
+    *nnames = n;
+}
+//***  Replay_Data function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Data --
+ *
+ *      Rebuilds the row of a record written by Rec_Data, naming the vectors from the latest REC_NAMES record, and
+ *      passes it to SendDataCallback.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      RecReader *rd                - input/output: payload reader
+ *      char **names                 - input: name table of the replay thread
+ *      int nnames                   - input: number of entries in names
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls SendDataCallback unless the payload is malformed or does not match the name table (rd->bad is set).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Replay_Data(NgSpiceContext *ctx, RecReader *rd, char **names, int nnames) {
+    int id = Rd_Int(rd);
+    int count = Rd_Int(rd);
+    vecvaluesall all;
+    all.vecindex = Rd_Int(rd);
+    all.veccount = Rd_Int(rd);
+    if ((rd->bad != 0) || (all.veccount != nnames)) {
+        rd->bad = 1;
+        return;
+    }
+    vecvalues *vals = Tcl_Alloc(((size_t)nnames + 1U) * sizeof(vecvalues));
+    all.vecsa = Tcl_Alloc(((size_t)nnames + 1U) * sizeof(pvecvalues));
+    for (int i = 0; i < nnames; i++) {
+        uint8_t flags;
+        Rd_Bytes(rd, &flags, sizeof flags);
+        vals[i].name = names[i];
+        vals[i].is_scale = ((flags & 1U) != 0U);
+        vals[i].is_complex = ((flags & 2U) != 0U);
+        Rd_Bytes(rd, &vals[i].creal, sizeof vals[i].creal);
+        vals[i].cimag = 0.0;
+        if (vals[i].is_complex) {
+            Rd_Bytes(rd, &vals[i].cimag, sizeof vals[i].cimag);
+        }
+        all.vecsa[i] = &vals[i];
+    }
+    if (rd->bad == 0) {
+        (void)SendDataCallback(&all, count, id, ctx);
+    }
+    Tcl_Free(all.vecsa);
+    Tcl_Free(vals);
+}
+//***  Replay_Pause function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Pause --
+ *
+ *      Waits until a record is due, i.e. until its recorded time divided by the replay speed has elapsed since the
+ *      replay started, or until the replay is aborted.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_WideInt due              - input: time the record is due, microseconds (Stats_Now)
+ *
+ * Results:
+ *      1 if the replay was aborted, 0 otherwise.
+ *
+ * Side Effects:
+ *      Blocks on ctx->replay.cv under ctx->replay_mu.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Replay_Pause(NgSpiceContext *ctx, Tcl_WideInt due) {
+    Tcl_MutexLock(&ctx->replay_mu);
+    while (ctx->replay.abort == 0) {
+        Tcl_WideInt left = due - Stats_Now();
+        if (left <= 0) {
+            break;
+        }
+        Tcl_Time rel;
+        rel.sec = (long)(left / 1000000);
+        rel.usec = (long)(left % 1000000);
+        Tcl_ConditionWait(&ctx->replay.cv, &ctx->replay_mu, &rel);
+    }
+    int aborted = ctx->replay.abort;
+    Tcl_MutexUnlock(&ctx->replay_mu);
+    return aborted;
+}
+//***  Replay_ThreadProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_ThreadProc --
+ *
+ *      Body of the replay thread, which stands in for the ngspice background thread: feeds every record of
+ *      ctx->replay.data to the callback it was recorded from, pausing between records according to the replay speed.
+ *      Exit records are counted but not delivered, because ControlledExitCallback would mark the loaded library as
+ *      gone. The replay ends early on "replay stop", instance deletion, a bg_halt of a -halt trigger or a malformed
+ *      record.
+ *
+ * Parameters:
+ *      ClientData cd                - input: NgSpiceContext * of the instance
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls the ngspice callbacks; updates the counters of ctx->replay under ctx->replay_mu. When the recording ends
+ *      inside a run, reports the end of the background thread (BGThreadRunningCallback), otherwise moves ctx->state
+ *      back to NGSTATE_IDLE and sends the deferred commands (FlushPending).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_ThreadCreateType Replay_ThreadProc(ClientData cd) {
+    NgSpiceContext *ctx = (NgSpiceContext *)cd;
+    const unsigned char *p = ctx->replay.data + 12;
+    const unsigned char *end = ctx->replay.data + ctx->replay.size;
+    double speed = ctx->replay.speed;
+    char **names = NULL;
+    int nnames = 0;
+    int malformed = 0;
+    Tcl_WideInt start = Stats_Now();
+    while (p < end) {
+        RecHeader h;
+        memcpy(&h, p, sizeof h);
+        RecReader rd = {p + sizeof h, p + sizeof h + h.len, 0};
+        p = rd.end;
+        if (speed > 0.0) {
+            if (Replay_Pause(ctx, start + (Tcl_WideInt)((double)h.ts / speed)) == 1) {
+                break;
+            }
+        }
+        Lock_Enter(ctx, LOCK_BG_MU);
+        int stop = ((ctx->state == NGSTATE_STOPPING_BG) || (ctx->state == NGSTATE_DEAD)) ? 1 : 0;
+        Lock_Leave(ctx, LOCK_BG_MU);
+        Tcl_MutexLock(&ctx->replay_mu);
+        stop |= ctx->replay.abort;
+        Tcl_MutexUnlock(&ctx->replay_mu);
+        if ((stop != 0) || (Inst_Destroying(ctx) == 1)) {
+            break;
+        }
+        int skipped = 0;
+        switch (h.type) {
+        case REC_NAMES:
+            Replay_Names(&rd, &names, &nnames);
+            break;
+        case SEND_DATA:
+            Replay_Data(ctx, &rd, names, nnames);
+            break;
+        case SEND_INIT_DATA:
+            Replay_Init(ctx, &rd);
+            break;
+        case SEND_CHAR:
+        case SEND_STAT: {
+            int id = Rd_Int(&rd);
+            (void)Rd_Int(&rd);
+            char *msg = Replay_Text(&rd);
+            if ((rd.bad == 0) && (h.type == (uint8_t)SEND_CHAR)) {
+                (void)SendCharCallback(msg, id, ctx);
+            } else if (rd.bad == 0) {
+                (void)SendStatCallback(msg, id, ctx);
+            } else {
+                /* No action required: all valid cases handled above (MISRA 15.7) */
+            }
+            Tcl_Free(msg);
+            break;
+        }
+        case BG_THREAD_RUNNING: {
+            int id = Rd_Int(&rd);
+            if (rd.bad == 0) {
+                (void)BGThreadRunningCallback(h.flag != 0U, id, ctx);
+            }
+            break;
+        }
+        case CONTROLLED_EXIT:
+            skipped = 1;
+            break;
+        default:
+            rd.bad = 1;
+            break;
+        }
+        Tcl_MutexLock(&ctx->replay_mu);
+        if (rd.bad != 0) {
+            ctx->replay.malformed = 1;
+        } else if (skipped == 1) {
+            ctx->replay.skipped++;
+        } else {
+            ctx->replay.delivered++;
+        }
+        Tcl_MutexUnlock(&ctx->replay_mu);
+        if (rd.bad != 0) {
+            malformed = 1;
+            break;
+        }
+    }
+    for (int i = 0; i < nnames; i++) {
+        Tcl_Free(names[i]);
+    }
+    Tcl_Free(names);
+    Lock_Enter(ctx, LOCK_BG_MU);
+    int in_run = (ctx->bg_started && !ctx->bg_ended) ? 1 : 0;
+    if (Inst_Destroying(ctx) == 1) {
+        ctx->bg_ended = 1;
+    } else if ((in_run == 0) && ((ctx->state == NGSTATE_STARTING_BG) || (ctx->state == NGSTATE_STOPPING_BG))) {
+        State_Set(ctx, NGSTATE_IDLE);
+        ctx->bg_ended = 1;
+        FlushPending(ctx);
+        Tcl_ConditionNotify(&ctx->bg_cv);
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    Lock_Leave(ctx, LOCK_BG_MU);
+    if ((in_run == 1) && (Inst_Destroying(ctx) == 0)) {
+        (void)BGThreadRunningCallback(true, 0, ctx);
+    }
+    Trace_Instant(ctx, "replay", "end", malformed);
+    Tcl_MutexLock(&ctx->replay_mu);
+    ctx->replay.done = 1;
+    Tcl_MutexUnlock(&ctx->replay_mu);
+    TCL_THREAD_CREATE_RETURN;
+}
+//***  Replay_Load function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Load --
+ *
+ *      Reads a recording made by "record" into memory and checks its magic, byte order and record framing, so the
+ *      replay thread only has to decode payloads.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter for errors
+ *      const char *path             - input: file name in Tcl form
+ *      Replay *rp                   - output: data, size and records are set on success
+ *
+ * Results:
+ *      TCL_OK, or TCL_ERROR with a message in the interpreter result.
+ *
+ * Side Effects:
+ *      Allocates rp->data.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Replay_Load(Tcl_Interp *interp, const char *path, Replay *rp) {
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    const char *native = Tcl_TranslateFileName(interp, path, &ds);
+    FILE *f = (native != NULL) ? fopen(native, "rb") : NULL;
+    Tcl_DStringFree(&ds);
+    if (f == NULL) {
+        if (native != NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\": %s", path, Tcl_PosixError(interp)));
+        }
+        return TCL_ERROR;
+    }
+    size_t cap = 65536;
+    size_t size = 0;
+    unsigned char *data = Tcl_Alloc(cap);
+    size_t got;
+    while ((got = fread(data + size, 1, cap - size, f)) > 0U) {
+        size += got;
+        if (size == cap) {
+            cap *= 2U;
+            data = Tcl_Realloc(data, cap);
+        }
+    }
+    int failed = (ferror(f) != 0) ? 1 : 0;
+    (void)fclose(f);
+    uint32_t bom = 0;
+    if ((failed == 0) && (size >= 12U)) {
+        memcpy(&bom, data + 8, sizeof bom);
+    }
+    if ((failed == 1) || (size < 12U) || (memcmp(data, REC_MAGIC, 8) != 0) || (bom != REC_BOM)) {
+        Tcl_Free(data);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("\"%s\" is not a callback recording of this host", path));
+        return TCL_ERROR;
+    }
+    uint64_t records = 0;
+    size_t off = 12;
+    while (off < size) {
+        RecHeader h;
+        if ((size - off) < sizeof h) {
+            break;
+        }
+        memcpy(&h, data + off, sizeof h);
+        if ((size - off - sizeof h) < (size_t)h.len) {
+            break;
+        }
+        off += sizeof h + (size_t)h.len;
+        records++;
+    }
+    if (off != size) {
+        Tcl_Free(data);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("recording \"%s\" is truncated after %" TCL_LL_MODIFIER "u records",
+                                               path, (unsigned long long)records));
+        return TCL_ERROR;
+    }
+    rp->data = data;
+    rp->size = size;
+    rp->records = records;
+    return TCL_OK;
+}
+//***  Replay_Join function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Join --
+ *
+ *      Waits for the replay thread, if any, optionally telling it to stop first. Tcl thread only.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      int stop                     - input: 1 to stop the replay at the next record, 0 to let it finish
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      May block until the replay ends; clears ctx->replay.active and frees the recording data.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Replay_Join(NgSpiceContext *ctx, int stop) {
+    Tcl_MutexLock(&ctx->replay_mu);
+    int active = ctx->replay.active;
+    if ((active == 1) && (stop == 1)) {
+        ctx->replay.abort = 1;
+        Tcl_ConditionNotify(&ctx->replay.cv);
+    }
+    Tcl_ThreadId tid = ctx->replay.tid;
+    Tcl_MutexUnlock(&ctx->replay_mu);
+    if (active == 1) {
+        int rc;
+        Tcl_JoinThread(tid, &rc);
+    }
+    Tcl_MutexLock(&ctx->replay_mu);
+    ctx->replay.active = 0;
+    Tcl_Free(ctx->replay.data);
+    ctx->replay.data = NULL;
+    Tcl_MutexUnlock(&ctx->replay_mu);
+}
+//***  Replay_Running function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Replay_Running --
+ *
+ *      Tells whether the replay thread is still delivering records.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *
+ * Results:
+ *      1 while a replay is in progress, 0 otherwise.
+ *
+ * Side Effects:
+ *      Reads ctx->replay under ctx->replay_mu.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Replay_Running(NgSpiceContext *ctx) {
+    Tcl_MutexLock(&ctx->replay_mu);
+    int running = ((ctx->replay.active == 1) && (ctx->replay.done == 0)) ? 1 : 0;
+    Tcl_MutexUnlock(&ctx->replay_mu);
+    return running;
+}
+
+//** instance registry
+//***  Reg_Add function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Reg_Add --
+ *
+ *      Make an instance reachable from other threads by name ("ngspicetclbridge::attach").
+ *
+ * Parameters:
+ *      const char *name             - input: fully-qualified instance command name
+ *      NgSpiceContext *ctx          - input: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Prepends an entry to the process-wide registry under g_reg_mu.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Reg_Add(const char *name, NgSpiceContext *ctx) {
+    RegEntry *e = Tcl_Alloc(sizeof *e);
+    e->name = ckstrdup(name);
+    e->ctx = ctx;
+    Tcl_MutexLock(&g_reg_mu);
+    e->next = g_reg_head;
+    g_reg_head = e;
+    Tcl_MutexUnlock(&g_reg_mu);
+}
+//***  Reg_Remove function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Reg_Remove --
+ *
+ *      Remove an instance from the registry, so no attached command can reach it any more.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Unlinks and frees the registry entry under g_reg_mu; calls already in progress are waited for by Reg_Drain.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Reg_Remove(const NgSpiceContext *ctx) {
+    Tcl_MutexLock(&g_reg_mu);
+    for (RegEntry **pp = &g_reg_head; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->ctx == ctx) {
+            RegEntry *e = *pp;
+            *pp = e->next;
+            Tcl_Free(e->name);
+            Tcl_Free(e);
+            break;
+        }
+    }
+    Tcl_MutexUnlock(&g_reg_mu);
+}
+//***  Reg_Acquire function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Reg_Acquire --
+ *
+ *      Look up a registered instance by name and pin it for one call from an attached command.
+ *
+ * Parameters:
+ *      const char *name             - input: fully-qualified instance command name
+ *
+ * Results:
+ *      Instance context, or NULL if no such instance exists (any more). A non-NULL result must be released with
+ *      Reg_Release.
+ *
+ * Side Effects:
+ *      Increments ctx->remote_refs under ctx->mutex while g_reg_mu is held (lock order: g_reg_mu, ctx->mutex).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static NgSpiceContext *Reg_Acquire(const char *name) {
+    NgSpiceContext *ctx = NULL;
+    Tcl_MutexLock(&g_reg_mu);
+    for (const RegEntry *e = g_reg_head; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            ctx = e->ctx;
+            Lock_Enter(ctx, LOCK_MUTEX);
+            ctx->remote_refs++;
+            Lock_Leave(ctx, LOCK_MUTEX);
+            break;
+        }
+    }
+    Tcl_MutexUnlock(&g_reg_mu);
+    return ctx;
+}
+//***  Reg_Release function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Reg_Release --
+ *
+ *      Release an instance pinned by Reg_Acquire.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Decrements ctx->remote_refs and notifies ctx->cond, so a pending Reg_Drain can proceed.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Reg_Release(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    ctx->remote_refs--;
+    Tcl_ConditionNotify(&ctx->cond);
+    Lock_Leave(ctx, LOCK_MUTEX);
+}
+//***  Reg_Drain function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Reg_Drain --
+ *
+ *      Wait until no attached command uses the instance any more. Called from InstDeleteProc after Reg_Remove and
+ *      after ctx->destroying is set, so blocked waits in other threads return "aborted" promptly.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Blocks the owner thread on ctx->cond while ctx->remote_refs is positive.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Reg_Drain(NgSpiceContext *ctx) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    while (ctx->remote_refs > 0) {
+        Tcl_ConditionNotify(&ctx->cond);
+        Lock_Wait(ctx, LOCK_MUTEX, &ctx->cond, NULL);
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+}
+//** free functions
+//***  InstFreeProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * InstFreeProc --
+ *
+ *      Final cleanup routine for an NgSpiceContext. This is the last stage of teardown for a simulator instance. It
+ *      runs asynchronously after Tcl_EventuallyFree() decides that no Tcl events in the queue still reference this
+ *      context.
+ *
+ *      IMPORTANT: InstFreeProc must only run after ngspice is fully quiesced and will never call back into us
+ *      again. InstDeleteProc is responsible for:
+ *          - stopping any background simulation activity,
+ *          - synchronizing with ControlledExitCallback() so ctx->exited is set,
+ *          - purging all queued NgSpiceEvent records for this ctx,
+ *          - marking ctx->destroying = 1 and moving ctx->state to NGSTATE_DEAD,
+ *          - detaching and freeing any deferred command queue.
+ *
+ *      By the time InstFreeProc executes, we assume:
+ *          - no callbacks are still racing on this ctx,
+ *          - no Tcl event in the system will try to access ctx,
+ *          - ctx is no longer visible from Tcl,
+ *          - and it is now safe to tear everything down for real.
+ *
+ * Parameters:
+ *      void *cdata            - input: pointer to the NgSpiceContext being freed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *
+ *   1. Global poison guard.
+ *      If g_heap_poisoned is nonzero, we assume libngspice went down in an unsafe or partially torn state earlier
+ *      In that mode:
+ *          - We return immediately without touching ctx.
+ *          - We do NOT free any memory owned by ctx.
+ *          - We do NOT attempt to dlclose() the ngspice handle.
+ *
+ *      Rationale: once the process is marked poisoned, libngspice (and anything it may have corrupted) is considered
+ *      unsafe to poke. We intentionally leak ctx to avoid risking a crash in a compromised heap.
+ *
+ *   2. Wake any waitevent stragglers.
+ *      As a last courtesy, we notify ctx->cond under ctx->mutex so any thread still stuck in [$s waitevent ...] can
+ *      unblock. At this point the Tcl command is already gone, but this avoids leaving a thread permanently asleep
+ *      on a dying context.
+ *
+ *   3. Release Tcl-managed objects.
+ *      We drop our holds on refcounted Tcl objects stored in the context:
+ *
+ *          if (ctx->vectorData)  Tcl_DecrRefCount(ctx->vectorData);
+ *          if (ctx->vectorInit)  Tcl_DecrRefCount(ctx->vectorInit);
+ *
+ *      After this, Tcl may free those objects if nothing else references them.
+ *
+ *   4. Free dynamic data structures owned by the context.
+ *      We clean up everything we allocated for runtime data capture:
+ *
+ *          - MsgQ_Free(&ctx->msgq);
+ *          - MsgQ_Free(&ctx->capq);
+ *          - Closes the file of the file message sink and frees the message filter (Msg_FreeClass).
+ *          - DataBuf_Free(&ctx->prod);
+ *          - DataBuf_Free(&ctx->pend);
+ *          - RunNames_Free(ctx);
+ *          - Hist_Free() on every histogram accumulator.
+ *          - Derived_Free() on every derived vector, the keep mask and the interned derived vector names.
+ *          - Pyr_Free() on every min/max pyramid.
+ *          - Releases the scripts registered with "on".
+ *          - Trig_Free() on every trigger.
+ *          - Cap_Free() on every capture window.
+ *
+ *      This releases any queued message strings, any buffered vector rows and the accumulator grids.
+ *
+ *   5. Tear down synchronization primitives. We finalize all mutexes and condition variables associated with this
+ *      context so they are no longer usable:
+ *
+ *          Tcl_ConditionFinalize(&ctx->cond);
+ *          Tcl_MutexFinalize(&ctx->mutex);
+ *
+ *          Tcl_ConditionFinalize(&ctx->exit_cv);
+ *          Tcl_MutexFinalize(&ctx->exit_mu);
+ *
+ *          Tcl_ConditionFinalize(&ctx->bg_cv);
+ *          Tcl_MutexFinalize(&ctx->bg_mu);
+ *
+ *          Tcl_MutexFinalize(&ctx->cmd_mu);
+ *          Tcl_MutexFinalize(&ctx->stats_mu);
+ *          Tcl_MutexFinalize(&ctx->trace_mu);   (after Trace_Free)
+ *          Tcl_MutexFinalize(&ctx->rec_mu);     (after the recording file is closed, Rec_Stop)
+ *          Tcl_ConditionFinalize(&ctx->replay.cv);
+ *          Tcl_MutexFinalize(&ctx->replay_mu);
+ *
+ *      After this point, no thread should attempt to lock or wait on any of these.
+ *
+ *   6. Optionally unload libngspice.
+ *      If ctx->handle is non-NULL, we attempt to close the dynamically loaded ngspice library handle with PDl_Close(),
+ *      but ONLY if it is considered safe:
+ *
+ *          - We skip dlclose() if ctx->skip_dlclose is set on this instance, or if the
  *            global g_disable_dlclose is set.
  *
- *        Both flags are set when InstDeleteProc detects that ngspice shut down abruptly
- *        (background thread vanished without a clean "ended" callback, heap may be bad).
- *        In that case we never try to unload the shared lib because that could crash.
+ *        Both flags are set when InstDeleteProc detects that ngspice shut down abruptly
+ *        (background thread vanished without a clean "ended" callback, heap may be bad).
+ *        In that case we never try to unload the shared lib because that could crash.
+ *
+ *   7. Free the context itself.
+ *      Finally we release the NgSpiceContext struct with Tcl_Free(ctx). At this point
+ *      there should be no remaining references to ctx anywhere in Tcl or in our own
+ *      queued events, also reference counts of Tcl_Objs inside ctx must be zero.
+ *
+ *      NOTE: Once ctx is freed, absolutely nothing is allowed to touch it: no events,
+ *      no callbacks, no mutex ops. This is guaranteed by the sequencing enforced in
+ *      InstDeleteProc and by Tcl_EventuallyFree().
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void InstFreeProc(void *cdata) {
+    NgSpiceContext *ctx = (NgSpiceContext *)cdata;
+    if (g_heap_poisoned == 1) {
+        return;
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    Tcl_ConditionNotify(&ctx->cond);
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (ctx->vectorData != NULL) {
+        Tcl_DecrRefCount(ctx->vectorData);
+    }
+    if (ctx->vectorInit != NULL) {
+        Tcl_DecrRefCount(ctx->vectorInit);
+    }
+    MsgQ_Free(&ctx->msgq);
+    MsgQ_Free(&ctx->capq);
+    if (ctx->msg_file != NULL) {
+        (void)fclose(ctx->msg_file);
+    }
+    Tcl_Free(ctx->msg_path);
+    Msg_FreeClass(ctx);
+    DataBuf_Free(&ctx->prod);
+    DataBuf_Free(&ctx->pend);
+    RunNames_Free(ctx);
+    while (ctx->hist_head != NULL) {
+        HistAcc *next = ctx->hist_head->next;
+        Hist_Free(ctx->hist_head);
+        ctx->hist_head = next;
+    }
+    while (ctx->derived_head != NULL) {
+        DerivedVec *next = ctx->derived_head->next;
+        Derived_Free(ctx->derived_head);
+        ctx->derived_head = next;
+    }
+    Tcl_Free(ctx->run_keep);
+    for (int i = 0; i < ctx->nderived_names; i++) {
+        Tcl_Free(ctx->derived_names[i]);
+    }
+    Tcl_Free(ctx->derived_names);
+    while (ctx->pyr_head != NULL) {
+        Pyramid *next = ctx->pyr_head->next;
+        Pyr_Free(ctx->pyr_head);
+        ctx->pyr_head = next;
+    }
+    for (int e = 0; e < NUM_EVTS; e++) {
+        if (ctx->subs.script[e] != NULL) {
+            Tcl_DecrRefCount(ctx->subs.script[e]);
+        }
+    }
+    while (ctx->trig_head != NULL) {
+        Trigger *next = ctx->trig_head->next;
+        Trig_Free(ctx->trig_head);
+        ctx->trig_head = next;
+    }
+    while (ctx->cap_head != NULL) {
+        Capture *next = ctx->cap_head->next;
+        Cap_Free(ctx->cap_head);
+        ctx->cap_head = next;
+    }
+    Tcl_ConditionFinalize(&ctx->cond);
+    Tcl_MutexFinalize(&ctx->mutex);
+    Tcl_ConditionFinalize(&ctx->exit_cv);
+    Tcl_MutexFinalize(&ctx->exit_mu);
+    Tcl_ConditionFinalize(&ctx->bg_cv);
+    Tcl_MutexFinalize(&ctx->bg_mu);
+    Tcl_MutexFinalize(&ctx->cmd_mu);
+    Tcl_MutexFinalize(&ctx->stats_mu);
+    Trace_Free(ctx);
+    Tcl_MutexFinalize(&ctx->trace_mu);
+    (void)Rec_Stop(ctx);
+    Tcl_Free(ctx->rec.path);
+    Tcl_MutexFinalize(&ctx->rec_mu);
+    Tcl_ConditionFinalize(&ctx->replay.cv);
+    Tcl_MutexFinalize(&ctx->replay_mu);
+    if (ctx->handle != NULL) {
+        if (ctx->skip_dlclose || g_disable_dlclose) {
+        } else {
+            PDl_Close(ctx->handle);
+        }
+    }
+    //PrintRefCount(ctx->vectorData);
+    //PrintRefCount(ctx->vectorInit);
+    Tcl_Free(ctx);
+}
+//***  InstDeleteProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * InstDeleteProc --
+ *
+ *      Instance deletion procedure for an NgSpiceContext. Called when the Tcl command that represents a simulator
+ *      instance is deleted (for example, via `$s1 destroy`). This function tries to shut down ngspice in a controlled
+ *      way, stop further callbacks, clean up any pending state, and (if safe) schedule final cleanup of the instance.
+ *
+ *      This function also enforces a global "poison" mode. If ngspice has ever died in a partially torn-down / unsafe
+ *      state (which can corrupt libngspice’s heap), we mark the process as contaminated by setting global flags. Once
+ *      the process is poisoned, we never call back into ngspice again, never dlclose() its handle, and we leak the
+ *      context on purpose instead of risking a crash.
+ *
+ * Parameters:
+ *      void *cdata
+ *          Pointer to the NgSpiceContext for this Tcl instance.
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *
+ *   Global poison fast path:
+ *      If g_heap_poisoned is already set when this runs, we assume the process is already contaminated from a previous
+ *      ngspice failure. In that case:
+ *
+ *          * We mark ctx->destroying = 1 so no new callbacks enqueue data or events.
+ *
+ *          * We tear down any deferred ngspice commands immediately and in a thread-safe way:
+ *                - Lock ctx->cmd_mu, detach ctx->pending_head/tail.
+ *                - Free all PendingCmd nodes outside the lock.
+ *            This prevents any queued commands from being flushed later into a dead ngspice.
+ *
+ *          * We wake any thread currently blocked in waitevent:
+ *                - Lock ctx->mutex, Tcl_ConditionNotify(&ctx->cond), unlock.
+ *
+ *          * We DO NOT:
+ *                - call QuiesceNgspice()
+ *                - call ctx->ngSpice_Command("quit")
+ *                - wait on ctx->exit_cv
+ *                - queue InstFreeProc()
+ *                - dlclose() the ngspice handle
+ *
+ *      We just return. The context (and possibly libngspice itself) is intentionally leaked because touching it could
+ *      be unsafe.
+ *
+ *   Normal shutdown path (when not already poisoned):
+ *
+ *      1. Stop further activity.
+ *         - Set ctx->destroying = 1 under ctx->exit_mu so callbacks know to stop queuing data/events.
+ *         - Force the high-level state machine into NGSTATE_DEAD under bg_mu, so future
+ *           InstObjCmd calls will reject immediately.
+ *
+ *      2. Drain and discard any deferred commands.
+ *         - Lock ctx->cmd_mu, detach the pending command list (pending_head/tail = NULL),
+ *           unlock, then free all PendingCmd nodes.
+ *           This guarantees nothing later will FlushPending() into ngspice after teardown
+ *           has begun.
+ *
+ *      3. Observe background thread state.
+ *         - Join a pending trigger halt thread (Trig_JoinHalt), so it never touches ngspice or ctx after teardown.
+ *         - Stop and join a replay thread (Replay_Join), which marks a replayed run ended, so it is not taken for an
+ *           abrupt shutdown below.
+ *         - Call WaitForBGStarted(ctx, 250) to latch whether ngspice ever told us the background thread "started"
+ *           and/or "ended".
+ *         - Snapshot:
+ *               started = ctx->bg_started
+ *               ended   = ctx->bg_ended
+ *               running_now = ctx->ngSpice_running() (if available)
+ *
+ *      4. Detect an unsafe/abrupt shutdown.
+ *         - We consider it "abrupt" only if:
+ *               (started == 1) AND
+ *               (running_now == 0) AND
+ *               (ended == 0)
+ *           That means ngspice’s bg thread used to exist, but we never got the clean "ended" callback, so we assume the
+ *           lib may be in a half-dead state.
+ *
+ *         - In that case:
+ *               abrupt_shutdown = 1;
+ *               g_heap_poisoned = 1;
+ *               g_disable_dlclose = 1;
+ *               ctx->skip_dlclose = 1;
+ *
+ *           From now on the entire process is considered poisoned and we will refuse to touch ngspice internals or
+ *           unload the library in any instance.
+ *
+ *      5. Halt the background thread if it's still legitimately running.
+ *         - If (started && !ended && !abrupt_shutdown):
+ *               QuiesceNgspice(ctx, 0);
+ *               WaitForBGEnded(ctx, 3000);
+ *           Otherwise we just mark ctx->bg_ended = 1 under bg_mu so later code won't spin.
+ *
+ *      6. Decide whether to tell ngspice to exit.
+ *         - We only send "quit" if it still looks safe:
+ *               safe_to_quit = !ctx->exited && !abrupt_shutdown
+ *           and we have a valid ctx->ngSpice_Command and we haven't already sent it.
+ *
+ *         - Safe case:
+ *               ctx->quitting = 1;
+ *               ctx->ngSpice_Command("unset askquit");
+ *               ctx->ngSpice_Command("quit");
+ *
+ *         - Unsafe case (either already exited, or abrupt_shutdown, or otherwise not safe):
+ *               We do NOT call into ngspice.
+ *               If ctx->exited is still 0, we fake a clean exit:
+ *                   Lock ctx->exit_mu;
+ *                   ctx->exited = 1;
+ *                   Tcl_ConditionNotify(&ctx->exit_cv);
+ *                   Unlock ctx->exit_mu;
+ *               We also set ctx->skip_dlclose = 1 so InstFreeProc will not dlclose()
+ *               a possibly-corrupted library.
+ *
+ *      7. Sync with exit.
+ *         - We now wait until ctx->exited is definitely 1:
+ *               Lock ctx->exit_mu;
+ *               while (!ctx->exited) Tcl_ConditionWait(&ctx->exit_cv, ...);
+ *               Unlock ctx->exit_mu;
+ *
+ *           In the normal path, ControlledExitCallback() will eventually mark exited=1 and signal exit_cv. In the
+ *           unsafe/fake-exit path above, we already forced exited=1 and notified, so this wait returns immediately.
+ *
+ *      8. Purge any queued Tcl events for this context.
+ *         - Tcl_DeleteEvents(DeleteNgSpiceEventProc, ctx) walks the Tcl event queue, drops all NgSpiceEvent entries
+ *           that still refer to this ctx, and balances their Tcl_Preserve/Tcl_Release.
+ *           After this point, no pending NgSpiceEventProc will ever run on a freed ctx.
+ *         - Subs_Cancel(ctx) drops a pending "on" script invocation (Subs_IdleProc) and its context reference.
+ *         - Notify_Close(ctx, interp) closes the notifier pipe; a read end still held by the script sees EOF.
+ *
+ *      9. Wake waitevent callers.
+ *         - Lock ctx->mutex;
+ *           Tcl_ConditionNotify(&ctx->cond);
+ *           Unlock ctx->mutex;
+ *
+ *         This unblocks anyone in [$s waitevent ...] so they don't hang forever on an instance that is going away.
+ *
+ *     10. Final disposition.
+ *         - If we just transitioned into poisoned mode (abrupt_shutdown set the globals), we stop here and return
+ *           without scheduling cleanup. We intentionally leak ctx because we consider libngspice unsafe to touch
+ *           further.
+ *
+ *         - Otherwise, the teardown steps traced so far are written to the "trace start -file" file, if any
+ *           (Trace_Dump), and we hand ownership to Tcl for orderly teardown:
+ *               Tcl_EventuallyFree(ctx, InstFreeProc);
+ *           InstFreeProc will run later (once no events still reference ctx) and will:
+ *               * release Tcl objects (vectorData, vectorInit),
+ *               * free message/data buffers,
+ *               * finalize mutexes/conditions,
+ *               * dlclose() libngspice unless skip_dlclose or g_disable_dlclose is set.
+ *
+ *   Idempotency:
+ *      Calling InstDeleteProc multiple times is safe. If ctx->destroying was already set, or if the process is already
+ *      poisoned, we just do minimal signaling / pending command drain and return. We don't try to shut ngspice down
+ *      twice.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void InstDeleteProc(void *cdata) {
+    NgSpiceContext *ctx = (NgSpiceContext *)cdata;
+    Reg_Remove(ctx);
+    if (g_heap_poisoned == 1) {
+        Tcl_MutexLock(&ctx->exit_mu);
+        ctx->destroying = 1;
+        Tcl_MutexUnlock(&ctx->exit_mu);
+        Lock_Enter(ctx, LOCK_CMD_MU);
+        PendingCmd *plist = ctx->pending_head;
+        ctx->pending_head = NULL;
+        ctx->pending_tail = NULL;
+        Lock_Leave(ctx, LOCK_CMD_MU);
+        while (plist != NULL) {
+            PendingCmd *next = plist->next;
+            Tcl_Free(plist->cmd);
+            Tcl_Free(plist);
+            plist = next;
+        }
+        /* Unblock any waitevent callers that might still be watching this ctx. */
+        Lock_Enter(ctx, LOCK_MUTEX);
+        Tcl_ConditionNotify(&ctx->cond);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return;
+    }
+    if (ctx->destroying == 1) {
+        return;
+    }
+    /* tell callbacks to stop enqueueing new work */
+    Tcl_MutexLock(&ctx->exit_mu);
+    ctx->destroying = 1;
+    Tcl_MutexUnlock(&ctx->exit_mu);
+    Tcl_WideInt t0 = Stats_Now();
+    Lock_Enter(ctx, LOCK_BG_MU);
+    State_Set(ctx, NGSTATE_DEAD);
+    Lock_Leave(ctx, LOCK_BG_MU);
+    Lock_Enter(ctx, LOCK_CMD_MU);
+    /* free commands queue */
+    PendingCmd *plist = ctx->pending_head;
+    ctx->pending_head = NULL;
+    ctx->pending_tail = NULL;
+    Lock_Leave(ctx, LOCK_CMD_MU);
+    while (plist != NULL) {
+        PendingCmd *next = plist->next;
+        Tcl_Free(plist->cmd);
+        Tcl_Free(plist);
+        plist = next;
+    }
+    /* a fired -halt trigger may still be stopping the run */
+    Trig_JoinHalt(ctx);
+    Replay_Join(ctx, 1);
+    /* Step 1: observe early bg thread state */
+    WaitForBGStarted(ctx, 250);
+    Lock_Enter(ctx, LOCK_BG_MU);
+    int started = ctx->bg_started;
+    int ended = ctx->bg_ended;
+    Lock_Leave(ctx, LOCK_BG_MU);
+    int running_now = -1;
+    if (ctx->ngSpice_running) {
+        running_now = ctx->ngSpice_running();
+    }
+    int abrupt_shutdown = 0;
+    if (started && (running_now == 0) && !ended) {
+        abrupt_shutdown = 1;
+        g_heap_poisoned = 1;
+        g_disable_dlclose = 1;
+        ctx->skip_dlclose = 1;
+    }
+    /* Step 2: try graceful halt if bg thread might still be legitimately running, and we didn't detect the abrupt
+       case. */
+    if (started && !ended && !abrupt_shutdown) {
+        Tcl_WideInt tq = Stats_Now();
+        QuiesceNgspice(ctx, 0);
+        WaitForBGEnded(ctx, 3000);
+        Trace_Span(ctx, "teardown", "quiesce", tq, 0);
+    } else {
+        Lock_Enter(ctx, LOCK_BG_MU);
+        ctx->bg_ended = 1;
+        Lock_Leave(ctx, LOCK_BG_MU);
+    }
+    /* Step 3: decide whether to call "quit" */
+    int safe_to_quit = 1;
+    if (ctx->exited == 1) {
+        safe_to_quit = 0;
+    }
+    if (abrupt_shutdown == 1) {
+        safe_to_quit = 0;
+    }
+    if (safe_to_quit && ctx->ngSpice_Command && !ctx->quitting) {
+        ctx->quitting = 1;
+        ctx->ngSpice_Command("unset askquit");
+        ctx->ngSpice_Command("quit");
+    } else if (!safe_to_quit && !ctx->exited) {
+        Tcl_MutexLock(&ctx->exit_mu);
+        ctx->exited = 1;
+        Tcl_ConditionNotify(&ctx->exit_cv);
+        Tcl_MutexUnlock(&ctx->exit_mu);
+        ctx->skip_dlclose = 1;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    /* Step 4: sync with ControlledExitCallback OR our fake exit */
+    Tcl_WideInt tx = Stats_Now();
+    Tcl_MutexLock(&ctx->exit_mu);
+    while (!ctx->exited) {
+        Tcl_ConditionWait(&ctx->exit_cv, &ctx->exit_mu, NULL);
+    }
+    Tcl_MutexUnlock(&ctx->exit_mu);
+    Trace_Span(ctx, "teardown", "exit sync", tx, safe_to_quit);
+    Tcl_DeleteEvents(DeleteNgSpiceEventProc, ctx);
+    Subs_Cancel(ctx);
+    Conv_Cancel(ctx);
+    Notify_Close(ctx, Tcl_InterpDeleted(ctx->interp) ? NULL : ctx->interp);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    Tcl_ConditionNotify(&ctx->cond);
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (g_heap_poisoned == 1) {
+        Lock_Enter(ctx, LOCK_MUTEX);
+        Tcl_ConditionNotify(&ctx->cond);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return;
+    }
+    Reg_Drain(ctx);
+    Trace_Span(ctx, "teardown", "InstDeleteProc", t0, abrupt_shutdown);
+    if (ctx->trace.path != NULL) {
+        (void)Trace_Dump(ctx, NULL, ctx->trace.path);
+    }
+    Tcl_EventuallyFree((ClientData)ctx, InstFreeProc);
+}
+//** subcommands implementations
+//***  HistogramSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * HistogramSubCmd --
+ *
+ *      Implements the "histogram" instance subcommand that manages streaming accumulators fed by SendDataCallback.
+ *
+ *          histogram create name vector -bins N -range {lo hi} ?-period T? ?-tbins M? ?-offset t0?
+ *          histogram get name ?-binary?
+ *          histogram reset name
+ *          histogram delete name
+ *          histogram names
+ *
+ *      Without -period the accumulator is a 1D value histogram. With -period it is an eye diagram: the scale value
+ *      of each row is folded modulo T (starting at t0) into M time bins (default 100).
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "histogram")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result.
+ *
+ * Side Effects:
+ *      Creates, resets or frees HistAcc entries in ctx->hist_head under ctx->mutex. A newly created accumulator is
+ *      resolved against the current run immediately, so it starts counting with the next row.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int HistogramSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "create|get|reset|delete|names ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    if (strcmp(op, "names") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        Lock_Enter(ctx, LOCK_MUTEX);
+        for (const HistAcc *h = ctx->hist_head; h != NULL; h = h->next) {
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(h->name, -1));
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, list);
+        return TCL_OK;
+    }
+    if (strcmp(op, "create") == 0) {
+        if ((objc < 5) || (((objc - 5) % 2) != 0)) {
+            Tcl_WrongNumArgs(interp, 3, objv, "name vector -bins N -range {lo hi} ?-period T? ?-tbins M? ?-offset t0?");
+            return TCL_ERROR;
+        }
+        int vbins = 0;
+        int tbins = 100;
+        double vlo = 0.0;
+        double vhi = 0.0;
+        double period = 0.0;
+        double offset = 0.0;
+        int have_range = 0;
+        for (Tcl_Size i = 5; i < objc; i += 2) {
+            const char *opt = Tcl_GetString(objv[i]);
+            if (strcmp(opt, "-bins") == 0) {
+                if ((Tcl_GetIntFromObj(interp, objv[i + 1], &vbins) != TCL_OK) || (vbins < 1)) {
+                    Tcl_SetObjResult(interp, Tcl_NewStringObj("expected positive integer after -bins", -1));
+                    return TCL_ERROR;
+                }
+            } else if (strcmp(opt, "-tbins") == 0) {
+                if ((Tcl_GetIntFromObj(interp, objv[i + 1], &tbins) != TCL_OK) || (tbins < 1)) {
+                    Tcl_SetObjResult(interp, Tcl_NewStringObj("expected positive integer after -tbins", -1));
+                    return TCL_ERROR;
+                }
+            } else if (strcmp(opt, "-period") == 0) {
+                if ((Tcl_GetDoubleFromObj(interp, objv[i + 1], &period) != TCL_OK) || !(period > 0.0)) {
+                    Tcl_SetObjResult(interp, Tcl_NewStringObj("expected positive number after -period", -1));
+                    return TCL_ERROR;
+                }
+            } else if (strcmp(opt, "-offset") == 0) {
+                if (Tcl_GetDoubleFromObj(interp, objv[i + 1], &offset) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else if (strcmp(opt, "-range") == 0) {
+                Tcl_Size rlen;
+                Tcl_Obj **relems;
+                if ((Tcl_ListObjGetElements(interp, objv[i + 1], &rlen, &relems) != TCL_OK) || (rlen != 2) ||
+                    (Tcl_GetDoubleFromObj(interp, relems[0], &vlo) != TCL_OK) ||
+                    (Tcl_GetDoubleFromObj(interp, relems[1], &vhi) != TCL_OK) || !(vhi > vlo)) {
+                    Tcl_SetObjResult(interp, Tcl_NewStringObj("expected {lo hi} with lo < hi after -range", -1));
+                    return TCL_ERROR;
+                }
+                have_range = 1;
+            } else {
+                Tcl_SetObjResult(
+                    interp,
+                    Tcl_ObjPrintf("unknown option: %s (expected -bins, -range, -period, -tbins or -offset)", opt));
+                return TCL_ERROR;
+            }
+        }
+        if ((vbins == 0) || (have_range == 0)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("options -bins and -range are required", -1));
+            return TCL_ERROR;
+        }
+        HistAcc *h = Tcl_Alloc(sizeof *h);
+        memset(h, 0, sizeof *h);
+        h->name = ckstrdup(Tcl_GetString(objv[3]));
+        h->vecname = ckstrdup(Tcl_GetString(objv[4]));
+        h->mode = (period > 0.0) ? HIST_EYE : HIST_VALUE;
+        h->vbins = vbins;
+        h->vlo = vlo;
+        h->vhi = vhi;
+        h->tbins = (h->mode == HIST_EYE) ? tbins : 1;
+        h->period = period;
+        h->offset = offset;
+        h->counts = Tcl_Alloc((size_t)h->tbins * (size_t)h->vbins * sizeof(uint64_t));
+        Hist_Reset(h);
+        Lock_Enter(ctx, LOCK_MUTEX);
+        if (Hist_Find(ctx, h->name, NULL) != NULL) {
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("histogram \"%s\" already exists", h->name));
+            Hist_Free(h);
+            return TCL_ERROR;
+        }
+        h->vec_idx = ResolveRunVector(ctx, h->vecname);
+        h->next = ctx->hist_head;
+        ctx->hist_head = h;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if ((strcmp(op, "get") != 0) && (strcmp(op, "reset") != 0) && (strcmp(op, "delete") != 0)) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("unknown option: %s (expected create, get, reset, delete or names)", op));
+        return TCL_ERROR;
+    }
+    int binary = 0;
+    if ((objc == 5) && (strcmp(op, "get") == 0)) {
+        const char *opt = Tcl_GetString(objv[4]);
+        if (strcmp(opt, "-binary") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -binary)", opt));
+            return TCL_ERROR;
+        }
+        binary = 1;
+    } else if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 3, objv, (strcmp(op, "get") == 0) ? "name ?-binary?" : "name");
+        return TCL_ERROR;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    const char *name = Tcl_GetString(objv[3]);
+    HistAcc *prev = NULL;
+    Lock_Enter(ctx, LOCK_MUTEX);
+    HistAcc *h = Hist_Find(ctx, name, &prev);
+    if (h == NULL) {
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("histogram \"%s\" does not exist", name));
+        return TCL_ERROR;
+    }
+    if (strcmp(op, "get") == 0) {
+        Tcl_SetObjResult(interp, Hist_ToObj(interp, h, binary));
+    } else if (strcmp(op, "reset") == 0) {
+        Hist_Reset(h);
+    } else {
+        if (prev == NULL) {
+            ctx->hist_head = h->next;
+        } else {
+            prev->next = h->next;
+        }
+        Hist_Free(h);
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return TCL_OK;
+}
+
+//***  ExprSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * ExprSubCmd --
+ *
+ *      Implements the "expr" instance subcommand: compiles an expression over vectors once (XExpr_Compile) and
+ *      evaluates it element-wise in C (XExpr_Eval).
+ *
+ *          expr ?-async? ?-store name? expression
+ *
+ *      Operands are read from the bridge-stored vectors, or from the current ngspice plot with -async.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "expr")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with the resulting vector (list of doubles or {re im} pairs) as result, or empty result with -store;
+ *      TCL_ERROR on syntax error, unknown vector or evaluation error.
+ *
+ * Side Effects:
+ *      With -store, puts the result into ctx->vectorData under the given name, so it is returned by "vectors" and can
+ *      be used as an operand of later expressions.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int ExprSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    int async = 0;
+    Tcl_Obj *store = NULL;
+    Tcl_Size i = 2;
+    for (; i < (objc - 1); i++) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-async") == 0) {
+            async = 1;
+        } else if ((strcmp(opt, "-store") == 0) && (i < (objc - 2))) {
+            i++;
+            store = objv[i];
+        } else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -async or -store)", opt));
+            return TCL_ERROR;
+        }
+    }
+    if (i != (objc - 1)) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-async? ?-store name? expression");
+        return TCL_ERROR;
+    }
+    char err[256];
+    XProg *prog = XExpr_Compile(Tcl_GetString(objv[objc - 1]), err, sizeof(err));
+    if (prog == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(err, -1));
+        return TCL_ERROR;
+    }
+    XCol *inputs = Tcl_Alloc((size_t)(prog->nnames + 1) * sizeof(XCol));
+    memset(inputs, 0, (size_t)(prog->nnames + 1) * sizeof(XCol));
+    if (LoadColumns(ctx, interp, prog->names, prog->alts, prog->nnames, async, inputs) != TCL_OK) {
+        Tcl_Free(inputs);
+        XProg_Free(prog);
+        return TCL_ERROR;
+    }
+    XCol out;
+    int ok = XExpr_Eval(prog, inputs, &out, err, sizeof(err));
+    for (int k = 0; k < prog->nnames; k++) {
+        XCol_Free(&inputs[k]);
+    }
+    Tcl_Free(inputs);
+    XProg_Free(prog);
+    if (ok == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(err, -1));
+        return TCL_ERROR;
+    }
+    Tcl_Obj *result = XCol_ToObj(interp, &out);
+    XCol_Free(&out);
+    if (store != NULL) {
+        Conv_Finish(ctx, interp);
+        Lock_Enter(ctx, LOCK_MUTEX);
+        if (Tcl_IsShared(ctx->vectorData)) {
+            Tcl_Obj *dup = Tcl_DuplicateObj(ctx->vectorData);
+            Tcl_IncrRefCount(dup);
+            Tcl_DecrRefCount(ctx->vectorData);
+            ctx->vectorData = dup;
+        }
+        Tcl_DictObjPut(interp, ctx->vectorData, store, result);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    Tcl_SetObjResult(interp, result);
+    return TCL_OK;
+}
+
+//***  DerivedSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DerivedSubCmd --
+ *
+ *      Implements the "derived" instance subcommand that manages vectors computed while data streams in.
+ *
+ *          derived add name expression ?-drop?
+ *          derived remove name
+ *          derived list
+ *
+ *      The expression uses the "expr" syntax; its operands are resolved to vecsa indices at SendInitDataCallback and
+ *      it is evaluated on every row in SendDataCallback (Derived_AppendRow), so the result is stored like a native
+ *      vector. With -drop the raw input vectors are not stored. The name may not be a vector of the current run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "derived")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result. "list" returns a dict name -> {expression E
+ *      drop 0|1}.
+ *
+ * Side Effects:
+ *      Creates or frees DerivedVec entries in ctx->derived_head under ctx->mutex and updates the keep mask. A vector
+ *      added during a run is resolved at the start of the next run, so it is listed by "initvectors" with its kind
+ *      and aligned with the scale from the first row.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int DerivedSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "add|remove|list ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    if (strcmp(op, "list") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_Obj *dict = Tcl_NewDictObj();
+        Lock_Enter(ctx, LOCK_MUTEX);
+        for (const DerivedVec *d = ctx->derived_head; d != NULL; d = d->next) {
+            Tcl_Obj *meta = Tcl_NewDictObj();
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("expression", -1), Tcl_NewStringObj(d->src, -1));
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("drop", -1), Tcl_NewBooleanObj(d->drop));
+            Tcl_DictObjPut(interp, dict, Tcl_NewStringObj(d->name, -1), meta);
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, dict);
+        return TCL_OK;
+    }
+    if (strcmp(op, "add") == 0) {
+        int drop = 0;
+        if (objc == 6) {
+            const char *opt = Tcl_GetString(objv[5]);
+            if (strcmp(opt, "-drop") != 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -drop)", opt));
+                return TCL_ERROR;
+            }
+            drop = 1;
+        } else if (objc != 5) {
+            Tcl_WrongNumArgs(interp, 3, objv, "name expression ?-drop?");
+            return TCL_ERROR;
+        } else {
+            /* No action required: all valid cases handled above (MISRA 15.7) */
+        }
+        char err[256];
+        XProg *prog = XExpr_Compile(Tcl_GetString(objv[4]), err, sizeof(err));
+        if (prog == NULL) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(err, -1));
+            return TCL_ERROR;
+        }
+        DerivedVec *d = Tcl_Alloc(sizeof *d);
+        memset(d, 0, sizeof *d);
+        d->name = ckstrdup(Tcl_GetString(objv[3]));
+        d->src = ckstrdup(Tcl_GetString(objv[4]));
+        d->prog = prog;
+        d->in_idx = Tcl_Alloc((size_t)(prog->nnames + 1) * sizeof(int));
+        d->in_vals = Tcl_Alloc((size_t)(prog->nnames + 1) * sizeof(XVal));
+        d->stack = Tcl_Alloc((size_t)(prog->maxstack + 1) * sizeof(XVal));
+        d->drop = drop;
+        Lock_Enter(ctx, LOCK_MUTEX);
+        if (Derived_Find(ctx, d->name, NULL) != NULL) {
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("derived vector \"%s\" already exists", d->name));
+            Derived_Free(d);
+            return TCL_ERROR;
+        }
+        if (ResolveRunVector(ctx, d->name) >= 0) {
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("vector with name \"%s\" already exists", d->name));
+            Derived_Free(d);
+            return TCL_ERROR;
+        }
+        d->cell_name = Derived_Intern(ctx, d->name);
+        DerivedVec **tail = &ctx->derived_head;
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+        *tail = d;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if (strcmp(op, "remove") == 0) {
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "name");
+            return TCL_ERROR;
+        }
+        const char *name = Tcl_GetString(objv[3]);
+        DerivedVec *prev = NULL;
+        Lock_Enter(ctx, LOCK_MUTEX);
+        DerivedVec *d = Derived_Find(ctx, name, &prev);
+        if (d == NULL) {
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("derived vector \"%s\" does not exist", name));
+            return TCL_ERROR;
+        }
+        if (prev == NULL) {
+            ctx->derived_head = d->next;
+        } else {
+            prev->next = d->next;
+        }
+        Derived_Free(d);
+        Derived_UpdateKeep(ctx);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected add, remove or list)", op));
+    return TCL_ERROR;
+}
+
+//***  CompareSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * CompareSubCmd --
+ *
+ *      Implements the "compare" instance subcommand: checks a vector against a golden reference waveform.
+ *
+ *          compare vector -binary bytes|-snapshot dict|-file path ?-abstol A? ?-reltol R? ?-shift T? ?-scale name?
+ *                  ?-async?
+ *
+ *      The vector and its scale are read from the bridge-stored vectors (or from ngspice with -async), the reference
+ *      is loaded by Cmp_LoadReference and both are compared in one pass by Cmp_Run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "compare")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict {pass 0|1 points N fails N maxdev D at X maxexcess E excessat X firstfail X} (positions are
+ *      empty when undefined), or TCL_ERROR.
+ *
+ * Side Effects:
+ *      May read a file.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int CompareSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 5) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+                         "vector -binary bytes|-snapshot dict|-file path ?-abstol A? ?-reltol R? ?-shift T? "
+                         "?-scale name? ?-async?");
+        return TCL_ERROR;
+    }
+    CmpOpts opts;
+    opts.abstol = 1e-6;
+    opts.reltol = 1e-3;
+    opts.shift = 0.0;
+    int async = 0;
+    const char *kind = NULL;
+    Tcl_Obj *src = NULL;
+    const char *scalename = NULL;
+    for (Tcl_Size i = 3; i < objc; i++) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-async") == 0) {
+            async = 1;
+            continue;
+        }
+        if (i == (objc - 1)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for option %s", opt));
+            return TCL_ERROR;
+        }
+        i++;
+        if ((strcmp(opt, "-binary") == 0) || (strcmp(opt, "-snapshot") == 0) || (strcmp(opt, "-file") == 0)) {
+            kind = opt;
+            src = objv[i];
+        } else if (strcmp(opt, "-scale") == 0) {
+            scalename = Tcl_GetString(objv[i]);
+        } else if ((strcmp(opt, "-abstol") == 0) || (strcmp(opt, "-reltol") == 0) || (strcmp(opt, "-shift") == 0)) {
+            double v;
+            if ((Tcl_GetDoubleFromObj(interp, objv[i], &v) != TCL_OK) || (v < 0.0)) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("expected non-negative number after %s", opt));
+                return TCL_ERROR;
+            }
+            if (opt[1] == 'a') {
+                opts.abstol = v;
+            } else if (opt[1] == 'r') {
+                opts.reltol = v;
+            } else {
+                opts.shift = v;
+            }
+        } else {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("unknown option: %s (expected -binary, -snapshot, -file, -abstol, -reltol, "
+                                           "-shift, -scale or -async)",
+                                           opt));
+            return TCL_ERROR;
+        }
+    }
+    if (kind == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("one of -binary, -snapshot or -file is required", -1));
+        return TCL_ERROR;
+    }
+    char *vecname = Tcl_GetString(objv[2]);
+    XYSeries act;
+    XYSeries ref;
+    if (Series_Load(ctx, interp, vecname, scalename, async, &act) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    char *refscale = CurrentScaleName(ctx, scalename);
+    int rc = Cmp_LoadReference(interp, kind, src, vecname, (refscale != NULL) ? refscale : "", &ref);
+    Tcl_Free(refscale);
+    if (rc != TCL_OK) {
+        Series_Free(&act);
+        return TCL_ERROR;
+    }
+    if (Series_Normalize(&ref) == 0) {
+        Series_Free(&act);
+        Series_Free(&ref);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("scale of the reference is not monotonic", -1));
+        return TCL_ERROR;
+    }
+    CmpResult res;
+    Cmp_Run(&act, &ref, &opts, &res);
+    Series_Free(&act);
+    Series_Free(&ref);
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("pass", -1), Tcl_NewBooleanObj((res.points > 0U) && (res.fails == 0U)));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("points", -1), Tcl_NewWideIntObj((Tcl_WideInt)res.points));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("fails", -1), Tcl_NewWideIntObj((Tcl_WideInt)res.fails));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("maxdev", -1), Tcl_NewDoubleObj(res.maxdev));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("at", -1),
+                   isnan(res.maxdev_at) ? Tcl_NewObj() : Tcl_NewDoubleObj(res.maxdev_at));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("maxexcess", -1), Tcl_NewDoubleObj(res.maxexcess));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("excessat", -1),
+                   isnan(res.maxexcess_at) ? Tcl_NewObj() : Tcl_NewDoubleObj(res.maxexcess_at));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("firstfail", -1),
+                   isnan(res.firstfail_at) ? Tcl_NewObj() : Tcl_NewDoubleObj(res.firstfail_at));
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
+}
+
+//***  DownsampleSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * DownsampleSubCmd --
+ *
+ *      Implements the "downsample" instance subcommand that returns a plot-ready reduction of a vector.
+ *
+ *          downsample vector -points N ?-method lttb|minmax? ?-range {x0 x1}? ?-scale name? ?-async?
+ *
+ *      LTTB (default) returns at most N points chosen to preserve the shape of the waveform (DS_Lttb). minmax returns
+ *      the minimum and maximum of N/2 equal buckets along the scale (DS_MinMaxBuckets); if a pyramid was built for the
+ *      vector (see PyramidSubCmd) since the latest run or plot started and neither -scale nor -async is given, its
+ *      data and levels are used.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "downsample")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a list of {x y} pairs (ready for ticklecharts line series), or TCL_ERROR.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int DownsampleSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, "vector -points N ?-method lttb|minmax? ?-range {x0 x1}? ?-scale name? ?-async?");
+        return TCL_ERROR;
+    }
+    int npts = 0;
+    int minmax = 0;
+    int async = 0;
+    int have_range = 0;
+    double x0 = 0.0;
+    double x1 = 0.0;
+    const char *scalename = NULL;
+    for (Tcl_Size i = 3; i < objc; i++) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-async") == 0) {
+            async = 1;
+            continue;
+        }
+        if (i == (objc - 1)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for option %s", opt));
+            return TCL_ERROR;
+        }
+        i++;
+        if (strcmp(opt, "-points") == 0) {
+            if ((Tcl_GetIntFromObj(interp, objv[i], &npts) != TCL_OK) || (npts < 2)) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("expected integer >= 2 after -points", -1));
+                return TCL_ERROR;
+            }
+        } else if (strcmp(opt, "-method") == 0) {
+            const char *m = Tcl_GetString(objv[i]);
+            if (strcmp(m, "minmax") == 0) {
+                minmax = 1;
+            } else if (strcmp(m, "lttb") == 0) {
+                minmax = 0;
+            } else {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown method: %s (expected lttb or minmax)", m));
+                return TCL_ERROR;
+            }
+        } else if (strcmp(opt, "-range") == 0) {
+            Tcl_Size rlen;
+            Tcl_Obj **relems;
+            if ((Tcl_ListObjGetElements(interp, objv[i], &rlen, &relems) != TCL_OK) || (rlen != 2) ||
+                (Tcl_GetDoubleFromObj(interp, relems[0], &x0) != TCL_OK) ||
+                (Tcl_GetDoubleFromObj(interp, relems[1], &x1) != TCL_OK) || (x1 < x0)) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("expected {x0 x1} with x0 <= x1 after -range", -1));
+                return TCL_ERROR;
+            }
+            have_range = 1;
+        } else if (strcmp(opt, "-scale") == 0) {
+            scalename = Tcl_GetString(objv[i]);
+        } else {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("unknown option: %s (expected -points, -method, -range, -scale or -async)", opt));
+            return TCL_ERROR;
+        }
+    }
+    if (npts == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("option -points is required", -1));
+        return TCL_ERROR;
+    }
+    const char *vecname = Tcl_GetString(objv[2]);
+    const Pyramid *pyr = NULL;
+    XYSeries local;
+    const XYSeries *s = &local;
+    memset(&local, 0, sizeof local);
+    if ((minmax == 1) && (async == 0) && (scalename == NULL)) {
+        Pyr_DropStale(ctx);
+        pyr = Pyr_Find(ctx, vecname, NULL);
+    }
+    if (pyr != NULL) {
+        s = &pyr->s;
+    } else if (Series_Load(ctx, interp, vecname, scalename, async, &local) != TCL_OK) {
+        return TCL_ERROR;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    Tcl_Obj *out = Tcl_NewListObj(0, NULL);
+    if (s->n > 0U) {
+        if (have_range == 0) {
+            x0 = s->x[0];
+            x1 = s->x[s->n - 1U];
+        }
+        if (minmax == 1) {
+            DS_MinMaxBuckets(interp, s, pyr, x0, x1, npts, out);
+        } else {
+            size_t a = Series_LowerBound(s, x0, 0);
+            size_t b = Series_LowerBound(s, x1, 1);
+            if (b > a) {
+                DS_Lttb(interp, s, a, b, npts, out);
+            }
+        }
+    }
+    Series_Free(&local);
+    Tcl_SetObjResult(interp, out);
+    return TCL_OK;
+}
+//***  PyramidSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * PyramidSubCmd --
+ *
+ *      Implements the "pyramid" instance subcommand that manages precomputed min/max pyramids used by
+ *      "downsample -method minmax" to answer zoom/pan requests in time proportional to the number of pixels.
+ *
+ *          pyramid build vector ?-scale name? ?-async?
+ *          pyramid drop vector
+ *          pyramid names
+ *
+ *      A pyramid holds a private copy of the vector taken at build time; rebuild it to include newer data. Pyramids
+ *      built before the latest run or plot started are dropped (Pyr_DropStale).
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "pyramid")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result; "build" returns the number of levels, "names"
+ *      the list of vectors with a pyramid.
+ *
+ * Side Effects:
+ *      Creates, replaces or frees Pyramid entries in ctx->pyr_head.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int PyramidSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "build|drop|names ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    Pyr_DropStale(ctx);
+    if (strcmp(op, "names") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        for (const Pyramid *p = ctx->pyr_head; p != NULL; p = p->next) {
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(p->name, -1));
+        }
+        Tcl_SetObjResult(interp, list);
+        return TCL_OK;
+    }
+    if (strcmp(op, "drop") == 0) {
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "vector");
+            return TCL_ERROR;
+        }
+        Pyramid *prev = NULL;
+        Pyramid *p = Pyr_Find(ctx, Tcl_GetString(objv[3]), &prev);
+        if (p == NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("no pyramid for vector \"%s\"", Tcl_GetString(objv[3])));
+            return TCL_ERROR;
+        }
+        if (prev == NULL) {
+            ctx->pyr_head = p->next;
+        } else {
+            prev->next = p->next;
+        }
+        Pyr_Free(p);
+        return TCL_OK;
+    }
+    if (strcmp(op, "build") != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected build, drop or names)", op));
+        return TCL_ERROR;
+    }
+    if (objc < 4) {
+        Tcl_WrongNumArgs(interp, 3, objv, "vector ?-scale name? ?-async?");
+        return TCL_ERROR;
+    }
+    int async = 0;
+    const char *scalename = NULL;
+    for (Tcl_Size i = 4; i < objc; i++) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-async") == 0) {
+            async = 1;
+        } else if ((strcmp(opt, "-scale") == 0) && (i < (objc - 1))) {
+            i++;
+            scalename = Tcl_GetString(objv[i]);
+        } else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -scale or -async)", opt));
+            return TCL_ERROR;
+        }
+    }
+    Pyramid *p = Tcl_Alloc(sizeof *p);
+    memset(p, 0, sizeof *p);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    p->plot = ctx->plot_seq;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (Series_Load(ctx, interp, Tcl_GetString(objv[3]), scalename, async, &p->s) != TCL_OK) {
+        Tcl_Free(p);
+        return TCL_ERROR;
+    }
+    p->name = ckstrdup(Tcl_GetString(objv[3]));
+    Pyr_Build(p);
+    Pyramid *prev = NULL;
+    Pyramid *old = Pyr_Find(ctx, p->name, &prev);
+    if (old != NULL) {
+        if (prev == NULL) {
+            ctx->pyr_head = old->next;
+        } else {
+            prev->next = old->next;
+        }
+        Pyr_Free(old);
+    }
+    p->next = ctx->pyr_head;
+    ctx->pyr_head = p;
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(p->nlevels));
+    return TCL_OK;
+}
+
+//***  WaitEventSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * WaitEventSubCmd --
+ *
+ *      Implements the "waitevent" subcommand of instances and attached commands: blocks the calling thread until an
+ *      event fires N more times.
+ *
+ *          waitevent name ?-n N? ?-token T? ?timeout_ms?
+ *
+ *      The wait is done by wait_for() on ctx->evt_counts[]; -token registers the waiter for "abort -token T".
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including command and "waitevent")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict {fired 0|1 count N need N status ok|timeout|aborted}, or TCL_ERROR.
+ *
+ * Side Effects:
+ *      Blocks the calling thread.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int WaitEventSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    int which;
+    uint64_t need = 1;
+    long timeout_ms = 0;
+    const char *token = NULL;
+    Tcl_Size i = 2;
+    if (objc <= i) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name ?-n N? ?-token T? ?timeout_ms?");
+        return TCL_ERROR;
+    }
+    if (NameToEvtId(objv[i++], &which) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown event: %s", Tcl_GetString(objv[i - 1])));
+        return TCL_ERROR;
+    }
+    while ((i < objc) && (Tcl_GetString(objv[i])[0] == '-')) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-n") == 0) {
+            if (((i + 1) >= objc) || (Tcl_GetWideIntFromObj(interp, objv[i + 1], (Tcl_WideInt *)&need) != TCL_OK) ||
+                (need < (uint64_t)1)) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("expected positive integer after -n", -1));
+                return TCL_ERROR;
+            }
+        } else if (strcmp(opt, "-token") == 0) {
+            if ((i + 1) >= objc) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("missing value for option -token", -1));
+                return TCL_ERROR;
+            }
+            token = Tcl_GetString(objv[i + 1]);
+        } else {
+            break;
+        }
+        i += 2;
+    }
+    if (i < objc) {
+        if (Tcl_GetLongFromObj(interp, objv[i], &timeout_ms) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        i++;
+    }
+    if (i != objc) {
+        Tcl_WrongNumArgs(interp, 2, objv, "name ?-n N? ?-token T? ?timeout_ms?");
+        return TCL_ERROR;
+    }
+    int reached;
+    uint64_t count;
+    wait_rc rc = wait_for(ctx, which, need, timeout_ms, token, &reached, &count);
+    Tcl_Obj *res = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, res, Tcl_NewStringObj("fired", -1), Tcl_NewBooleanObj(reached));
+    Tcl_DictObjPut(interp, res, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj((Tcl_WideInt)count));
+    Tcl_DictObjPut(interp, res, Tcl_NewStringObj("need", -1), Tcl_NewWideIntObj((Tcl_WideInt)need));
+    Tcl_DictObjPut(interp, res, Tcl_NewStringObj("status", -1),
+                   Tcl_NewStringObj((rc == NGSPICE_WAIT_OK)        ? "ok"
+                                    : (rc == NGSPICE_WAIT_TIMEOUT) ? "timeout"
+                                                                   : "aborted",
+                                    -1));
+    Tcl_SetObjResult(interp, res);
+    return TCL_OK;
+}
+//***  WaitAnySubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * WaitAnySubCmd --
+ *
+ *      Implements the "waitany" subcommand of instances and attached commands that blocks until the first of several
+ *      events fires.
+ *
+ *          waitany events ?-token T? ?timeout_ms?
+ *
+ *      Each element of the events list is an event name (as for "waitevent") or a pair {name N} that requires N new
+ *      occurrences. The wait is done by wait_any() on ctx->evt_counts[]; -token registers the waiter for
+ *      "abort -token T".
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "waitany")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict {status ok|timeout|aborted fired {names} counts {name count ...}}, where "fired" lists the
+ *      events whose target was reached, or TCL_ERROR.
+ *
+ * Side Effects:
+ *      Blocks the calling thread.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int WaitAnySubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    const char *token = NULL;
+    Tcl_Size i = 3;
+    if ((objc > 4) && (strcmp(Tcl_GetString(objv[3]), "-token") == 0)) {
+        token = Tcl_GetString(objv[4]);
+        i = 5;
+    }
+    if ((objc < 3) || (objc > (i + 1))) {
+        Tcl_WrongNumArgs(interp, 2, objv, "events ?-token T? ?timeout_ms?");
+        return TCL_ERROR;
+    }
+    Tcl_Size nspec;
+    Tcl_Obj **spec;
+    if (Tcl_ListObjGetElements(interp, objv[2], &nspec, &spec) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (nspec == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("expected non-empty list of events", -1));
+        return TCL_ERROR;
+    }
+    long timeout_ms = 0;
+    if ((objc == (i + 1)) && (Tcl_GetLongFromObj(interp, objv[i], &timeout_ms) != TCL_OK)) {
+        return TCL_ERROR;
+    }
+    int *which = Tcl_Alloc((size_t)nspec * sizeof(int));
+    int *reached = Tcl_Alloc((size_t)nspec * sizeof(int));
+    uint64_t *need = Tcl_Alloc((size_t)nspec * sizeof(uint64_t));
+    uint64_t *counts = Tcl_Alloc((size_t)nspec * sizeof(uint64_t));
+    Tcl_Obj **names = Tcl_Alloc((size_t)nspec * sizeof(Tcl_Obj *));
+    int code = TCL_OK;
+    for (Tcl_Size k = 0; k < nspec; k++) {
+        Tcl_Size plen;
+        Tcl_Obj **pair;
+        if (Tcl_ListObjGetElements(interp, spec[k], &plen, &pair) != TCL_OK) {
+            code = TCL_ERROR;
+            break;
+        }
+        if ((plen != 1) && (plen != 2)) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("expected event name or {name N}, got \"%s\"", Tcl_GetString(spec[k])));
+            code = TCL_ERROR;
+            break;
+        }
+        if (NameToEvtId(pair[0], &which[k]) != TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown event: %s", Tcl_GetString(pair[0])));
+            code = TCL_ERROR;
+            break;
+        }
+        names[k] = pair[0];
+        need[k] = 1;
+        if (plen == 2) {
+            Tcl_WideInt n;
+            if ((Tcl_GetWideIntFromObj(interp, pair[1], &n) != TCL_OK) || (n < 1)) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("expected positive count for event %s", Tcl_GetString(pair[0])));
+                code = TCL_ERROR;
+                break;
+            }
+            need[k] = (uint64_t)n;
+        }
+    }
+    if (code == TCL_OK) {
+        wait_rc rc = wait_any(ctx, (int)nspec, which, need, timeout_ms, token, reached, counts);
+        Tcl_Obj *fired = Tcl_NewListObj(0, NULL);
+        Tcl_Obj *cdict = Tcl_NewDictObj();
+        for (Tcl_Size k = 0; k < nspec; k++) {
+            if (reached[k] == 1) {
+                Tcl_ListObjAppendElement(interp, fired, names[k]);
+            }
+            Tcl_DictObjPut(interp, cdict, names[k], Tcl_NewWideIntObj((Tcl_WideInt)counts[k]));
+        }
+        Tcl_Obj *res = Tcl_NewDictObj();
+        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("status", -1),
+                       Tcl_NewStringObj((rc == NGSPICE_WAIT_OK)        ? "ok"
+                                        : (rc == NGSPICE_WAIT_TIMEOUT) ? "timeout"
+                                                                       : "aborted",
+                                        -1));
+        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("fired", -1), fired);
+        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("counts", -1), cdict);
+        Tcl_SetObjResult(interp, res);
+    }
+    Tcl_Free(which);
+    Tcl_Free(reached);
+    Tcl_Free(need);
+    Tcl_Free(counts);
+    Tcl_Free(names);
+    return code;
+}
+
+//***  OnSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * OnSubCmd --
+ *
+ *      Implements the "on" instance subcommand that registers Tcl scripts invoked from the event loop when ngspice
+ *      callbacks are processed, as a non-blocking alternative to "waitevent".
+ *
+ *          on ?event? ?script?
+ *
+ *      Without arguments returns the registered scripts; with an event returns its script; with an empty script
+ *      removes it. Calls are coalesced by Subs_IdleProc.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "on")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result.
+ *
+ * Side Effects:
+ *      Replaces ctx->subs.script[event]; removing a script also discards its pending count.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int OnSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc > 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?event? ?script?");
+        return TCL_ERROR;
+    }
+    if (objc == 2) {
+        Tcl_Obj *dict = Tcl_NewDictObj();
+        for (int e = 0; e < NUM_EVTS; e++) {
+            if (ctx->subs.script[e] != NULL) {
+                Tcl_DictObjPut(interp, dict, Tcl_NewStringObj(EvtIdToName(e), -1), ctx->subs.script[e]);
+            }
+        }
+        Tcl_SetObjResult(interp, dict);
+        return TCL_OK;
+    }
+    int which;
+    if (NameToEvtId(objv[2], &which) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown event: %s", Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+    }
+    if (objc == 3) {
+        if (ctx->subs.script[which] != NULL) {
+            Tcl_SetObjResult(interp, ctx->subs.script[which]);
+        }
+        return TCL_OK;
+    }
+    Tcl_Size len;
+    if (Tcl_ListObjLength(interp, objv[3], &len) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (ctx->subs.script[which] != NULL) {
+        Tcl_DecrRefCount(ctx->subs.script[which]);
+        ctx->subs.script[which] = NULL;
+    }
+    ctx->subs.count[which] = 0;
+    if (which == SEND_DATA) {
+        ctx->subs.first_row = -1;
+    }
+    if (len > 0) {
+        ctx->subs.script[which] = objv[3];
+        Tcl_IncrRefCount(objv[3]);
+    }
+    return TCL_OK;
+}
+
+//***  TriggerSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * TriggerSubCmd --
+ *
+ *      Implements the "trigger" instance subcommand that manages data-condition triggers evaluated on every row in
+ *      SendDataCallback.
+ *
+ *          trigger add name expression -above L|-below L|-settle {target tol hold} ?-halt?
+ *          trigger remove name
+ *          trigger list
+ *
+ *      The expression uses the "expr" syntax. When the condition holds (see Trig_Step) the trigger records the
+ *      interpolated scale value, bumps the "trigger" event and, with -halt, stops the background run from a helper
+ *      thread. Triggers are re-armed at the start of every run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "trigger")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result. "list" returns a dict name -> {expression E
+ *      condition {kind args} halt 0|1 fired 0|1 at X value Y row N}, with empty at/value/row until fired.
+ *
+ * Side Effects:
+ *      Creates or frees Trigger entries in ctx->trig_head under ctx->mutex. A trigger added during a run is resolved
+ *      against that run immediately and starts with the next row.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int TriggerSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "add|remove|list ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    if (strcmp(op, "list") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        static const char *const kinds[] = {"above", "below", "settle"};
+        Tcl_Obj *dict = Tcl_NewDictObj();
+        Lock_Enter(ctx, LOCK_MUTEX);
+        for (const Trigger *t = ctx->trig_head; t != NULL; t = t->next) {
+            Tcl_Obj *cond = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(interp, cond, Tcl_NewStringObj(kinds[t->kind], -1));
+            Tcl_ListObjAppendElement(interp, cond, Tcl_NewDoubleObj(t->level));
+            if (t->kind == TRIG_SETTLE) {
+                Tcl_ListObjAppendElement(interp, cond, Tcl_NewDoubleObj(t->tol));
+                Tcl_ListObjAppendElement(interp, cond, Tcl_NewDoubleObj(t->hold));
+            }
+            Tcl_Obj *meta = Tcl_NewDictObj();
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("expression", -1), Tcl_NewStringObj(t->src, -1));
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("condition", -1), cond);
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("halt", -1), Tcl_NewBooleanObj(t->halt));
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("fired", -1), Tcl_NewBooleanObj(t->fired));
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("at", -1),
+                           (t->fired == 1) ? Tcl_NewDoubleObj(t->at) : Tcl_NewObj());
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("value", -1),
+                           (t->fired == 1) ? Tcl_NewDoubleObj(t->value) : Tcl_NewObj());
+            Tcl_DictObjPut(interp, meta, Tcl_NewStringObj("row", -1),
+                           (t->fired == 1) ? Tcl_NewIntObj(t->row) : Tcl_NewObj());
+            Tcl_DictObjPut(interp, dict, Tcl_NewStringObj(t->name, -1), meta);
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, dict);
+        return TCL_OK;
+    }
+    if (strcmp(op, "remove") == 0) {
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "name");
+            return TCL_ERROR;
+        }
+        const char *name = Tcl_GetString(objv[3]);
+        Trigger *prev = NULL;
+        Lock_Enter(ctx, LOCK_MUTEX);
+        Trigger *t = Trig_Find(ctx, name, &prev);
+        if (t == NULL) {
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("trigger \"%s\" does not exist", name));
+            return TCL_ERROR;
+        }
+        if (prev == NULL) {
+            ctx->trig_head = t->next;
+        } else {
+            prev->next = t->next;
+        }
+        Trig_Free(t);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if (strcmp(op, "add") != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected add, remove or list)", op));
+        return TCL_ERROR;
+    }
+    if (objc < 7) {
+        Tcl_WrongNumArgs(interp, 3, objv, "name expression -above L|-below L|-settle {target tol hold} ?-halt?");
+        return TCL_ERROR;
+    }
+    int have_cond = 0;
+    int halt = 0;
+    Trigger cond;
+    memset(&cond, 0, sizeof cond);
+    for (Tcl_Size i = 5; i < objc; i++) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (strcmp(opt, "-halt") == 0) {
+            halt = 1;
+            continue;
+        }
+        if (i == (objc - 1)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for option %s", opt));
+            return TCL_ERROR;
+        }
+        i++;
+        int rc = Trig_ParseCondition(interp, opt, objv[i], &cond);
+        if (rc == TCL_CONTINUE) {
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("unknown option: %s (expected -above, -below, -settle or -halt)", opt));
+            return TCL_ERROR;
+        }
+        if (rc != TCL_OK) {
+            return TCL_ERROR;
+        }
+        have_cond = 1;
+    }
+    if (have_cond == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("one of -above, -below or -settle is required", -1));
+        return TCL_ERROR;
+    }
+    char err[256];
+    XProg *prog = XExpr_Compile(Tcl_GetString(objv[4]), err, sizeof(err));
+    if (prog == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(err, -1));
+        return TCL_ERROR;
+    }
+    Trigger *t = Tcl_Alloc(sizeof *t);
+    memset(t, 0, sizeof *t);
+    t->name = ckstrdup(Tcl_GetString(objv[3]));
+    t->src = ckstrdup(Tcl_GetString(objv[4]));
+    t->prog = prog;
+    t->in_idx = Tcl_Alloc((size_t)(prog->nnames + 1) * sizeof(int));
+    t->in_vals = Tcl_Alloc((size_t)(prog->nnames + 1) * sizeof(XVal));
+    t->stack = Tcl_Alloc((size_t)(prog->maxstack + 1) * sizeof(XVal));
+    t->kind = cond.kind;
+    t->level = cond.level;
+    t->tol = cond.tol;
+    t->hold = cond.hold;
+    t->halt = halt;
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (Trig_Find(ctx, t->name, NULL) != NULL) {
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("trigger \"%s\" already exists", t->name));
+        Trig_Free(t);
+        return TCL_ERROR;
+    }
+    Trig_Reset(ctx, t);
+    t->next = ctx->trig_head;
+    ctx->trig_head = t;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return TCL_OK;
+}
+
+//***  CaptureSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * CaptureSubCmd --
+ *
+ *      Implements the "capture" instance subcommand that manages oscilloscope-style capture windows: only the rows
+ *      around each trigger event are kept, so long runs can be monitored with "configure -storedata 0".
+ *
+ *          capture create name expression -above L|-below L|-settle {target tol hold} ?-pre N? ?-post M?
+ *                  ?-vectors list? ?-max K?
+ *          capture get name ?index?
+ *          capture clear name
+ *          capture delete name
+ *          capture names
+ *
+ *      The condition is the same as for "trigger"; every time it fires a segment is started with the N rows before
+ *      the trigger row, the trigger row and the M rows after it (Cap_Row). The capture re-arms when the condition
+ *      stops holding, and at most K segments (0 = unlimited) are kept per run. Segments are dropped at the start of
+ *      every run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "capture")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result. "get" returns the list of segments (or one
+ *      segment with index), each a dict {at X row N rows N data {vector values ...}}; "names" returns the list of
+ *      captures.
+ *
+ * Side Effects:
+ *      Creates or frees Capture entries in ctx->cap_head under ctx->mutex. A capture created during a run is resolved
+ *      against that run immediately and starts with the next row.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int CaptureSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "create|get|clear|delete|names ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    if (strcmp(op, "names") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        Lock_Enter(ctx, LOCK_MUTEX);
+        for (const Capture *c = ctx->cap_head; c != NULL; c = c->next) {
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(c->name, -1));
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, list);
+        return TCL_OK;
+    }
+    if ((strcmp(op, "get") == 0) || (strcmp(op, "clear") == 0) || (strcmp(op, "delete") == 0)) {
+        int want_index = ((op[0] == 'g') && (objc == 5)) ? 1 : 0;
+        if ((objc != 4) && (want_index == 0)) {
+            Tcl_WrongNumArgs(interp, 3, objv, (op[0] == 'g') ? "name ?index?" : "name");
+            return TCL_ERROR;
+        }
+        int index = -1;
+        if ((want_index == 1) && ((Tcl_GetIntFromObj(interp, objv[4], &index) != TCL_OK) || (index < 0))) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("expected non-negative integer index", -1));
+            return TCL_ERROR;
+        }
+        const char *name = Tcl_GetString(objv[3]);
+        Capture *prev = NULL;
+        Lock_Enter(ctx, LOCK_MUTEX);
+        Capture *c = Cap_Find(ctx, name, &prev);
+        if (c == NULL) {
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("capture \"%s\" does not exist", name));
+            return TCL_ERROR;
+        }
+        if (op[0] == 'c') {
+            Cap_FreeSegments(c);
+        } else if (op[0] == 'd') {
+            if (prev == NULL) {
+                ctx->cap_head = c->next;
+            } else {
+                prev->next = c->next;
+            }
+            Cap_Free(c);
+        } else if (want_index == 1) {
+            const CapSegment *s = c->seg_head;
+            for (int k = 0; (s != NULL) && (k < index); k++) {
+                s = s->next;
+            }
+            if (s == NULL) {
+                Lock_Leave(ctx, LOCK_MUTEX);
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("capture \"%s\" has no segment %d", name, index));
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, Cap_SegmentObj(interp, c, s));
+        } else {
+            Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+            for (const CapSegment *s = c->seg_head; s != NULL; s = s->next) {
+                Tcl_ListObjAppendElement(interp, list, Cap_SegmentObj(interp, c, s));
+            }
+            Tcl_SetObjResult(interp, list);
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if (strcmp(op, "create") != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected create, get, clear, delete or names)", op));
+        return TCL_ERROR;
+    }
+    if (objc < 7) {
+        Tcl_WrongNumArgs(interp, 3, objv,
+                         "name expression -above L|-below L|-settle {target tol hold} ?-pre N? ?-post M? "
+                         "?-vectors list? ?-max K?");
+        return TCL_ERROR;
+    }
+    int have_cond = 0;
+    int pre = 100;
+    int post = 100;
+    int maxseg = 0;
+    Tcl_Obj *want = NULL;
+    Trigger cond;
+    memset(&cond, 0, sizeof cond);
+    for (Tcl_Size i = 5; i < objc; i++) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if (i == (objc - 1)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for option %s", opt));
+            return TCL_ERROR;
+        }
+        i++;
+        int rc = Trig_ParseCondition(interp, opt, objv[i], &cond);
+        if (rc == TCL_OK) {
+            have_cond = 1;
+            continue;
+        }
+        if (rc != TCL_CONTINUE) {
+            return TCL_ERROR;
+        }
+        if ((strcmp(opt, "-pre") == 0) || (strcmp(opt, "-post") == 0) || (strcmp(opt, "-max") == 0)) {
+            int v;
+            if ((Tcl_GetIntFromObj(interp, objv[i], &v) != TCL_OK) || (v < 0)) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("expected non-negative integer after %s", opt));
+                return TCL_ERROR;
+            }
+            if (opt[1] == 'm') {
+                maxseg = v;
+            } else if (opt[2] == 'r') {
+                pre = v;
+            } else {
+                post = v;
+            }
+        } else if (strcmp(opt, "-vectors") == 0) {
+            Tcl_Size n;
+            if ((Tcl_ListObjLength(interp, objv[i], &n) != TCL_OK) || (n == 0)) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("expected non-empty list of vector names after -vectors", -1));
+                return TCL_ERROR;
+            }
+            want = objv[i];
+        } else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -above, -below, -settle, -pre, "
+                                                   "-post, -vectors or -max)",
+                                                   opt));
+            return TCL_ERROR;
+        }
+    }
+    if (have_cond == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("one of -above, -below or -settle is required", -1));
+        return TCL_ERROR;
+    }
+    char err[256];
+    XProg *prog = XExpr_Compile(Tcl_GetString(objv[4]), err, sizeof(err));
+    if (prog == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(err, -1));
+        return TCL_ERROR;
+    }
+    Capture *c = Tcl_Alloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->name = ckstrdup(Tcl_GetString(objv[3]));
+    c->cond = cond;
+    c->cond.src = ckstrdup(Tcl_GetString(objv[4]));
+    c->cond.prog = prog;
+    c->cond.in_idx = Tcl_Alloc((size_t)(prog->nnames + 1) * sizeof(int));
+    c->cond.in_vals = Tcl_Alloc((size_t)(prog->nnames + 1) * sizeof(XVal));
+    c->cond.stack = Tcl_Alloc((size_t)(prog->maxstack + 1) * sizeof(XVal));
+    c->pre = pre;
+    c->post = post;
+    c->maxseg = maxseg;
+    if (want != NULL) {
+        c->want = Tcl_DuplicateObj(want);
+        Tcl_IncrRefCount(c->want);
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (Cap_Find(ctx, c->name, NULL) != NULL) {
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("capture \"%s\" already exists", c->name));
+        Cap_Free(c);
+        return TCL_ERROR;
+    }
+    Cap_Reset(ctx, c);
+    c->next = ctx->cap_head;
+    ctx->cap_head = c;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return TCL_OK;
+}
+/* options of the "configure" subcommand, indexed by ConfigOptionIds */
+static const char *const configOptions[] = {"-storedata",  "-progressinterval", "-msgcapacity", "-msgsink",
+                                            "-msgfile",    "-msgkeep",          "-msgpattern",  "-convbudget",
+                                            "-convrows",   "-membudget",        "-mempolicy",   NULL};
+enum ConfigOptionIds {
+    CONFIG_STOREDATA,
+    CONFIG_PROGRESSINTERVAL,
+    CONFIG_MSGCAPACITY,
+    CONFIG_MSGSINK,
+    CONFIG_MSGFILE,
+    CONFIG_MSGKEEP,
+    CONFIG_MSGPATTERN,
+    CONFIG_CONVBUDGET,
+    CONFIG_CONVROWS,
+    CONFIG_MEMBUDGET,
+    CONFIG_MEMPOLICY
+};
+static const char *const msgSinkNames[] = {"ring", "discard", "file", NULL};
+static const char *const memPolicyNames[] = {"none", "drop", "stop", "halt", NULL};
+//***  Config_Get function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Config_Get --
+ *
+ *      Returns the current value of one "configure" option. Must be called with ctx->mutex held.
+ *
+ * Parameters:
+ *      const NgSpiceContext *ctx    - input: instance context
+ *      int idx                      - input: index into configOptions[]
+ *
+ * Results:
+ *      New Tcl_Obj with the value.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *Config_Get(const NgSpiceContext *ctx, int idx) {
+    switch ((enum ConfigOptionIds)idx) {
+    case CONFIG_STOREDATA:
+        return Tcl_NewBooleanObj(ctx->store_data);
+    case CONFIG_PROGRESSINTERVAL:
+        return Tcl_NewWideIntObj((Tcl_WideInt)ctx->progress.interval_ms);
+    case CONFIG_MSGCAPACITY:
+        return Tcl_NewWideIntObj((Tcl_WideInt)ctx->msgq.limit);
+    case CONFIG_MSGSINK:
+        return Tcl_NewStringObj(msgSinkNames[ctx->msg_sink], -1);
+    case CONFIG_MSGKEEP: {
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        for (int k = 0; k < MSG_NCAT; k++) {
+            if ((ctx->msgclass.keep & (1U << k)) != 0U) {
+                Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj(msgCatNames[k], -1));
+            }
+        }
+        return list;
+    }
+    case CONFIG_MSGPATTERN: {
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        for (int k = 0; k < ctx->msgclass.npatterns; k++) {
+            Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj(ctx->msgclass.patterns[k], -1));
+        }
+        return list;
+    }
+    case CONFIG_CONVBUDGET:
+        return Tcl_NewWideIntObj((Tcl_WideInt)ctx->conv_budget_ms);
+    case CONFIG_CONVROWS:
+        return Tcl_NewWideIntObj((Tcl_WideInt)ctx->conv_rows);
+    case CONFIG_MEMBUDGET:
+        return Tcl_NewWideIntObj((Tcl_WideInt)ctx->mem.budget);
+    case CONFIG_MEMPOLICY:
+        return Tcl_NewStringObj(memPolicyNames[ctx->mem.policy], -1);
+    default:
+        return Tcl_NewStringObj((ctx->msg_path != NULL) ? ctx->msg_path : "", -1);
+    }
+}
+//***  Mem_Rebudget function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mem_Rebudget --
+ *
+ *      Compares the memory already held with a budget just set by "configure -membudget", as Mem_Check does for
+ *      every stored row, so a budget below the current total is reported and acted on at once instead of on the next
+ *      row. A rise above the budget counts as exceeded and sends the memory event; the drop policy trims the stored
+ *      rows right away, the stop and halt policies apply to a background run in progress. Tcl thread only.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Updates ctx->mem under ctx->mutex; may queue a MEMORY_BUDGET event, drop rows (Mem_Enforce) or start the halt
+ *      thread (Trig_StartHalt).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mem_Rebudget(NgSpiceContext *ctx) {
+    uint64_t total = Mem_Refresh(ctx, NULL);
+    Lock_Enter(ctx, LOCK_BG_MU);
+    int active = ((ctx->state == NGSTATE_STARTING_BG) || (ctx->state == NGSTATE_BG_ACTIVE)) ? 1 : 0;
+    Lock_Leave(ctx, LOCK_BG_MU);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    MemBudget *m = &ctx->mem;
+    int rise = 0;
+    if (total <= m->budget) {
+        m->over = 0;
+    } else if (m->over == 0) {
+        m->over = 1;
+        m->exceeded++;
+        rise = 1;
+        if ((m->policy == MEM_POLICY_STOP) && (active == 1)) {
+            m->stopped = 1;
+        }
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    int policy = m->policy;
+    uint64_t mygen = ctx->gen;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    if (rise == 0) {
+        return;
+    }
+    BumpAndSignal(ctx, MEMORY_BUDGET);
+    NgSpiceQueueEvent(ctx, MEMORY_BUDGET, mygen);
+    if (policy == MEM_POLICY_DROP) {
+        Mem_Enforce(ctx);
+        total = Mem_Refresh(ctx, NULL);
+        Lock_Enter(ctx, LOCK_MUTEX);
+        m->over = (total > m->budget) ? 1 : 0;
+        Lock_Leave(ctx, LOCK_MUTEX);
+    } else if ((policy == MEM_POLICY_HALT) && (active == 1)) {
+        Trig_StartHalt(ctx);
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+}
+//***  Config_Set function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Config_Set --
+ *
+ *      Validates and applies the value of one "configure" option.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for errors
+ *      int idx                      - input: index into configOptions[]
+ *      Tcl_Obj *value               - input: new value
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result.
+ *
+ * Side Effects:
+ *      Updates the option field of ctx under ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Config_Set(NgSpiceContext *ctx, Tcl_Interp *interp, int idx, Tcl_Obj *value) {
+    if (idx == CONFIG_STOREDATA) {
+        int b;
+        if (Tcl_GetBooleanFromObj(interp, value, &b) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Lock_Enter(ctx, LOCK_MUTEX);
+        ctx->store_data = b;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if (idx == CONFIG_MSGSINK) {
+        int sink;
+        if (Tcl_GetIndexFromObj(interp, value, msgSinkNames, "sink", 0, &sink) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Lock_Enter(ctx, LOCK_MUTEX);
+        ctx->msg_sink = sink;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if (idx == CONFIG_MSGFILE) {
+        return Msg_SetFile(ctx, interp, Tcl_GetString(value));
+    }
+    if (idx == CONFIG_MEMPOLICY) {
+        int policy;
+        if (Tcl_GetIndexFromObj(interp, value, memPolicyNames, "policy", 0, &policy) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Lock_Enter(ctx, LOCK_MUTEX);
+        ctx->mem.policy = policy;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if (idx == CONFIG_MEMBUDGET) {
+        Tcl_WideInt w;
+        if ((Tcl_GetWideIntFromObj(NULL, value, &w) != TCL_OK) || (w < 0)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("expected integer >= 0 after -membudget", -1));
+            return TCL_ERROR;
+        }
+        Lock_Enter(ctx, LOCK_MUTEX);
+        ctx->mem.budget = (uint64_t)w;
+        if (w == 0) {
+            ctx->mem.over = 0;
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        if (w > 0) {
+            Mem_Rebudget(ctx);
+        }
+        return TCL_OK;
+    }
+    if ((idx == CONFIG_MSGKEEP) || (idx == CONFIG_MSGPATTERN)) {
+        Tcl_Size n;
+        Tcl_Obj **elems;
+        if (Tcl_ListObjGetElements(interp, value, &n, &elems) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        unsigned int keep = 0;
+        for (Tcl_Size k = 0; (k < n) && (idx == CONFIG_MSGKEEP); k++) {
+            int cat;
+            if (Tcl_GetIndexFromObj(interp, elems[k], msgCatNames, "category", 0, &cat) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            keep |= 1U << cat;
+        }
+        Lock_Enter(ctx, LOCK_MUTEX);
+        if (idx == CONFIG_MSGKEEP) {
+            ctx->msgclass.keep = keep;
+        } else {
+            Msg_SetPatterns(ctx, n, elems);
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    long n;
+    long min = (idx == CONFIG_MSGCAPACITY) ? 1 : 0;
+    if ((Tcl_GetLongFromObj(NULL, value, &n) != TCL_OK) || (n < min)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("expected integer >= %ld after %s", min, configOptions[idx]));
+        return TCL_ERROR;
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (idx == CONFIG_MSGCAPACITY) {
+        MsgQ_SetLimit(&ctx->msgq, (size_t)n);
+    } else if (idx == CONFIG_CONVBUDGET) {
+        ctx->conv_budget_ms = n;
+    } else if (idx == CONFIG_CONVROWS) {
+        ctx->conv_rows = n;
+    } else {
+        ctx->progress.interval_ms = n;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return TCL_OK;
+}
+//***  ConfigureSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * ConfigureSubCmd --
+ *
+ *      Implements the "configure" instance subcommand that queries or changes instance options.
+ *
+ *          configure
+ *          configure -option
+ *          configure -option value ?-option value ...?
+ *
+ *      Options:
+ *          -storedata bool   store every row in the vectors dict (default 1); with 0 rows are only seen by
+ *                            histograms, triggers and capture windows
+ *          -progressinterval ms
+ *                            minimum time between send_stat events caused by "analysis: N%" status lines (default
+ *                            100); throttled lines only update the value returned by "progress", 0 passes all
+ *          -msgcapacity N    number of lines kept by the "messages" ring (default NGSPICE_MSG_CAPACITY); the
+ *                            oldest lines are dropped beyond it
+ *          -msgsink ring|discard|file
+ *                            where output and status lines go (see Msg_Put), default ring
+ *          -msgfile path     file appended to by the file sink, opened immediately; empty closes it
+ *          -msgkeep categories
+ *                            only lines in one of these MsgCategories reach the sink (default empty: all)
+ *          -msgpattern patterns
+ *                            only lines matching one of these case-insensitive glob patterns reach the sink
+ *                            (default empty: all); filtered lines are still counted by "msgstats"
+ *          -convbudget ms    time budget of one slice converting streamed rows to Tcl objects (default 20); the
+ *                            rest is converted from idle handlers, 0 disables the limit
+ *          -convrows N       row budget of one conversion slice (default 0: no limit)
+ *          -membudget bytes  limit of the memory accounted by "memory" (default 0: none); checked for every stored
+ *                            row and after every conversion slice
+ *          -mempolicy none|drop|stop|halt
+ *                            action when the budget is exceeded, besides the "memory" event (default none): drop
+ *                            trims the oldest rows to MEM_DROP_TARGET percent of the budget, stop stops storing
+ *                            rows until the next run, halt stops the background run (see Mem_Check)
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "configure")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict of all options, the value of one option or an empty result after setting; TCL_ERROR on an
+ *      unknown option or a bad value.
+ *
+ * Side Effects:
+ *      Updates option fields of ctx under ctx->mutex; the new values apply from the next row or status line.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int ConfigureSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc == 2) {
+        Tcl_Obj *d = Tcl_NewDictObj();
+        Lock_Enter(ctx, LOCK_MUTEX);
+        for (int k = 0; configOptions[k] != NULL; k++) {
+            Tcl_DictObjPut(interp, d, Tcl_NewStringObj(configOptions[k], -1), Config_Get(ctx, k));
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
+        Tcl_SetObjResult(interp, d);
+        return TCL_OK;
+    }
+    if ((objc > 3) && ((objc % 2) != 0)) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-option? ?value -option value ...?");
+        return TCL_ERROR;
+    }
+    for (Tcl_Size i = 2; i < objc; i += 2) {
+        const char *opt = Tcl_GetString(objv[i]);
+        int idx = -1;
+        for (int k = 0; configOptions[k] != NULL; k++) {
+            if (strcmp(opt, configOptions[k]) == 0) {
+                idx = k;
+            }
+        }
+        if (idx < 0) {
+            Tcl_Obj *msg = Tcl_ObjPrintf("unknown option: %s (expected ", opt);
+            for (int k = 0; configOptions[k] != NULL; k++) {
+                const char *sep = (k == 0) ? "" : ((configOptions[k + 1] == NULL) ? " or " : ", ");
+                Tcl_AppendStringsToObj(msg, sep, configOptions[k], (char *)NULL);
+            }
+            Tcl_AppendToObj(msg, ")", 1);
+            Tcl_SetObjResult(interp, msg);
+            return TCL_ERROR;
+        }
+        if (objc == 3) {
+            Lock_Enter(ctx, LOCK_MUTEX);
+            Tcl_Obj *v = Config_Get(ctx, idx);
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Tcl_SetObjResult(interp, v);
+            return TCL_OK;
+        }
+        if (Config_Set(ctx, interp, idx, objv[i + 1]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}
+//***  MsgStatsSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * MsgStatsSubCmd --
+ *
+ *      Implements the "msgstats" instance subcommand that reports the message classification done by Msg_Put, so a
+ *      job runner can decide whether a run failed without scanning "messages".
+ *
+ *          msgstats ?-reset?
+ *
+ *      The run scope starts each time the background thread starts; the totals since instance creation or the last
+ *      "-reset". Lines removed by "-msgkeep"/"-msgpattern" or sent to another sink are counted as well.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "msgstats")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict {total {category N ...} run {category N ...} first {category line ...} filtered N}, where
+ *      first holds the first line of each category seen in the run; with -reset an empty result. TCL_ERROR on wrong
+ *      arguments.
+ *
+ * Side Effects:
+ *      With -reset clears all counters and first lines of ctx->msgclass under ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int MsgStatsSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc == 3) {
+        const char *opt = Tcl_GetString(objv[2]);
+        if (strcmp(opt, "-reset") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -reset)", opt));
+            return TCL_ERROR;
+        }
+        Lock_Enter(ctx, LOCK_MUTEX);
+        Msg_NewRun(ctx);
+        memset(ctx->msgclass.total, 0, sizeof(ctx->msgclass.total));
+        ctx->msgclass.filtered = 0;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+        return TCL_ERROR;
+    }
+    Tcl_Obj *total = Tcl_NewDictObj();
+    Tcl_Obj *run = Tcl_NewDictObj();
+    Tcl_Obj *first = Tcl_NewDictObj();
+    Lock_Enter(ctx, LOCK_MUTEX);
+    const MsgClass *mc = &ctx->msgclass;
+    for (int k = 0; k < MSG_NCAT; k++) {
+        Tcl_Obj *key = Tcl_NewStringObj(msgCatNames[k], -1);
+        Tcl_DictObjPut(interp, total, key, Tcl_NewWideIntObj((Tcl_WideInt)mc->total[k]));
+        Tcl_DictObjPut(interp, run, key, Tcl_NewWideIntObj((Tcl_WideInt)mc->run[k]));
+        if (mc->first[k] != NULL) {
+            Tcl_DictObjPut(interp, first, key, Tcl_NewStringObj(mc->first[k], -1));
+        }
+    }
+    Tcl_WideInt filtered = (Tcl_WideInt)mc->filtered;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("total", -1), total);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("run", -1), run);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("first", -1), first);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("filtered", -1), Tcl_NewWideIntObj(filtered));
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
+}
+//***  Stats_TimeObj function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Stats_TimeObj --
+ *
+ *      Converts a TimeStat to the dict returned by "stats".
+ *
+ * Parameters:
+ *      const TimeStat *ts           - input: statistic
+ *      const char *prefix           - input: prefix of the time keys ("" gives total_us and max_us, "wait_" gives
+ *                                     wait_us and wait_max_us)
+ *      Tcl_Obj *d                   - input/output: dict the keys are added to
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Stats_TimeObj(const TimeStat *ts, const char *prefix, Tcl_Obj *d) {
+    Tcl_Obj *total = (prefix[0] == '\0') ? Tcl_NewStringObj("total_us", -1) : Tcl_ObjPrintf("%sus", prefix);
+    if (prefix[0] == '\0') {
+        Tcl_DictObjPut(NULL, d, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj((Tcl_WideInt)ts->count));
+    }
+    Tcl_DictObjPut(NULL, d, total, Tcl_NewWideIntObj((Tcl_WideInt)ts->total));
+    Tcl_DictObjPut(NULL, d, Tcl_ObjPrintf("%smax_us", prefix), Tcl_NewWideIntObj((Tcl_WideInt)ts->max));
+}
+//***  StatsSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * StatsSubCmd --
+ *
+ *      Implements the "stats" instance subcommand that reports the hot-path telemetry of the bridge, to tell whether
+ *      the time of a slow run goes to ngspice, the callbacks, lock waits, the Tcl event backlog or conversion.
+ *
+ *          stats ?-reset?
+ *
+ *      Times are in microseconds. Callback times cover the whole callback, lock hold times exclude condition waits.
+ *      Byte counts are estimates of the memory held by ctx->prod, ctx->pend, ctx->vectorData and ctx->msgq.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "stats")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict {rows N cells N bytes {prod B pend B vectors B messages B} events {pending N max N}
+ *      callbacks {name {count N total_us T max_us T} ...} locks {name {count N wait_us T wait_max_us T hold_us T
+ *      hold_max_us T} ...} conversion {count N total_us T max_us T rows N}}; with -reset an empty result. TCL_ERROR
+ *      on wrong arguments.
+ *
+ * Side Effects:
+ *      With -reset clears the counters and timings of ctx->stats, each part under the lock guarding it; the number
+ *      of pending events is kept.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int StatsSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    Telemetry *st = &ctx->stats;
+    if (objc == 3) {
+        const char *opt = Tcl_GetString(objv[2]);
+        if (strcmp(opt, "-reset") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -reset)", opt));
+            return TCL_ERROR;
+        }
+        for (int k = 0; k < NUM_LOCKS; k++) {
+            Lock_Enter(ctx, k);
+            memset(&st->locks[k].wait, 0, sizeof(TimeStat));
+            memset(&st->locks[k].hold, 0, sizeof(TimeStat));
+            if (k == LOCK_MUTEX) {
+                st->rows = 0;
+                st->cells = 0;
+            }
+            Lock_Leave(ctx, k);
+        }
+        Tcl_MutexLock(&ctx->stats_mu);
+        memset(st->callbacks, 0, sizeof(st->callbacks));
+        st->queued_max = st->queued;
+        Tcl_MutexUnlock(&ctx->stats_mu);
+        memset(&st->conv, 0, sizeof(TimeStat));
+        st->conv_rows = 0;
+        return TCL_OK;
+    }
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+        return TCL_ERROR;
+    }
+    LockStat locks[NUM_LOCKS];
+    Lock_Enter(ctx, LOCK_MUTEX);
+    locks[LOCK_MUTEX] = st->locks[LOCK_MUTEX];
+    Tcl_WideInt rows = (Tcl_WideInt)st->rows;
+    Tcl_WideInt cells = (Tcl_WideInt)st->cells;
+    Tcl_Obj *bytes = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, bytes, Tcl_NewStringObj("prod", -1),
+                   Tcl_NewWideIntObj((Tcl_WideInt)Mem_BufBytes(&ctx->prod)));
+    Tcl_DictObjPut(interp, bytes, Tcl_NewStringObj("pend", -1),
+                   Tcl_NewWideIntObj((Tcl_WideInt)Mem_BufBytes(&ctx->pend)));
+    Tcl_DictObjPut(interp, bytes, Tcl_NewStringObj("vectors", -1),
+                   Tcl_NewWideIntObj((Tcl_WideInt)Mem_VectorBytes(ctx)));
+    Tcl_DictObjPut(interp, bytes, Tcl_NewStringObj("messages", -1),
+                   Tcl_NewWideIntObj((Tcl_WideInt)Mem_MsgBytes(&ctx->msgq)));
+    Lock_Leave(ctx, LOCK_MUTEX);
+    for (int k = LOCK_BG_MU; k < NUM_LOCKS; k++) {
+        Lock_Enter(ctx, k);
+        locks[k] = st->locks[k];
+        Lock_Leave(ctx, k);
+    }
+    TimeStat callbacks[NUM_EVTS];
+    Tcl_MutexLock(&ctx->stats_mu);
+    memcpy(callbacks, st->callbacks, sizeof(callbacks));
+    Tcl_WideInt queued = (Tcl_WideInt)st->queued;
+    Tcl_WideInt queued_max = (Tcl_WideInt)st->queued_max;
+    Tcl_MutexUnlock(&ctx->stats_mu);
+    Tcl_Obj *events = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, events, Tcl_NewStringObj("pending", -1), Tcl_NewWideIntObj(queued));
+    Tcl_DictObjPut(interp, events, Tcl_NewStringObj("max", -1), Tcl_NewWideIntObj(queued_max));
+    Tcl_Obj *cbs = Tcl_NewDictObj();
+    for (int k = 0; k < NUM_EVTS; k++) {
+        if ((k != TRIGGER_FIRED) && (k != MEMORY_BUDGET)) {
+            Tcl_Obj *cd = Tcl_NewDictObj();
+            Stats_TimeObj(&callbacks[k], "", cd);
+            Tcl_DictObjPut(interp, cbs, Tcl_NewStringObj(EvtIdToName(k), -1), cd);
+        }
+    }
+    Tcl_Obj *lks = Tcl_NewDictObj();
+    for (int k = 0; k < NUM_LOCKS; k++) {
+        Tcl_Obj *ld = Tcl_NewDictObj();
+        Tcl_DictObjPut(interp, ld, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj((Tcl_WideInt)locks[k].wait.count));
+        Stats_TimeObj(&locks[k].wait, "wait_", ld);
+        Stats_TimeObj(&locks[k].hold, "hold_", ld);
+        Tcl_DictObjPut(interp, lks, Tcl_NewStringObj(lockNames[k], -1), ld);
+    }
+    Tcl_Obj *conv = Tcl_NewDictObj();
+    Stats_TimeObj(&st->conv, "", conv);
+    Tcl_DictObjPut(interp, conv, Tcl_NewStringObj("rows", -1), Tcl_NewWideIntObj((Tcl_WideInt)st->conv_rows));
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("rows", -1), Tcl_NewWideIntObj(rows));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("cells", -1), Tcl_NewWideIntObj(cells));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("bytes", -1), bytes);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("events", -1), events);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("callbacks", -1), cbs);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("locks", -1), lks);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("conversion", -1), conv);
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
+}
+//***  Lat_HistObj function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Lat_HistObj --
  *
- *   7. Free the context itself.
- *      Finally we release the NgSpiceContext struct with Tcl_Free(ctx). At this point
- *      there should be no remaining references to ctx anywhere in Tcl or in our own
- *      queued events, also reference counts of Tcl_Objs inside ctx must be zero.
+ *      Converts latency histograms, one per event, to the dict returned by "latency".
  *
- *      NOTE: Once ctx is freed, absolutely nothing is allowed to touch it: no events,
- *      no callbacks, no mutex ops. This is guaranteed by the sequencing enforced in
- *      InstDeleteProc and by Tcl_EventuallyFree().
+ * Parameters:
+ *      const LatHist *h             - input: array of NUM_EVTS histograms indexed by CallbacksIds
+ *
+ * Results:
+ *      New dict event -> {count N p50_us T p99_us T max_us T}.
+ *
+ * Side Effects:
+ *      None.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void InstFreeProc(void *cdata) {
-    NgSpiceContext *ctx = (NgSpiceContext *)cdata;
-    if (g_heap_poisoned == 1) {
-        return;
+static Tcl_Obj *Lat_HistObj(const LatHist *h) {
+    Tcl_Obj *d = Tcl_NewDictObj();
+    for (int k = 0; k < NUM_EVTS; k++) {
+        Tcl_Obj *e = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, e, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj((Tcl_WideInt)h[k].n));
+        Tcl_DictObjPut(NULL, e, Tcl_NewStringObj("p50_us", -1),
+                       Tcl_NewWideIntObj((Tcl_WideInt)Lat_Quantile(&h[k], 0.5)));
+        Tcl_DictObjPut(NULL, e, Tcl_NewStringObj("p99_us", -1),
+                       Tcl_NewWideIntObj((Tcl_WideInt)Lat_Quantile(&h[k], 0.99)));
+        Tcl_DictObjPut(NULL, e, Tcl_NewStringObj("max_us", -1), Tcl_NewWideIntObj((Tcl_WideInt)h[k].max));
+        Tcl_DictObjPut(NULL, d, Tcl_NewStringObj(EvtIdToName(k), -1), e);
     }
-    Tcl_MutexLock(&ctx->mutex);
-    Tcl_ConditionNotify(&ctx->cond);
-    Tcl_MutexUnlock(&ctx->mutex);
-    if (ctx->vectorData != NULL) {
-        Tcl_DecrRefCount(ctx->vectorData);
+    return d;
+}
+//***  LatencySubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * LatencySubCmd --
+ *
+ *      Implements the "latency" instance subcommand that reports how long events take from the ngspice callback to
+ *      Tcl, to tune batching and detect event-loop starvation.
+ *
+ *          latency ?-reset?
+ *
+ *      "dispatch" is the time from queueing the Tcl event in the callback to NgSpiceEventProc; for send_data it ends
+ *      when the rows are visible in the vectors dict, after the conversion backlog is drained. "wake" is the time
+ *      from the counter bump in the callback to the return of a "waitevent"/"waitany" that waited for it.
+ *      Percentiles are read from log-bucketed histograms (Lat_Bucket), so they are upper bounds within 25%.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "latency")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict {dispatch {event {count N p50_us T p99_us T max_us T} ...} wake {...}}; with -reset an
+ *      empty result. TCL_ERROR on wrong arguments.
+ *
+ * Side Effects:
+ *      With -reset clears ctx->stats.dispatch and, under ctx->mutex, ctx->stats.wake.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int LatencySubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc == 3) {
+        const char *opt = Tcl_GetString(objv[2]);
+        if (strcmp(opt, "-reset") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -reset)", opt));
+            return TCL_ERROR;
+        }
+        memset(ctx->stats.dispatch, 0, sizeof(ctx->stats.dispatch));
+        Lock_Enter(ctx, LOCK_MUTEX);
+        memset(ctx->stats.wake, 0, sizeof(ctx->stats.wake));
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
     }
-    if (ctx->vectorInit != NULL) {
-        Tcl_DecrRefCount(ctx->vectorInit);
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+        return TCL_ERROR;
     }
-    MsgQ_Free(&ctx->msgq);
-    MsgQ_Free(&ctx->capq);
-    DataBuf_Free(&ctx->prod);
-    DataBuf_Free(&ctx->pend);
-    Tcl_ConditionFinalize(&ctx->cond);
-    Tcl_MutexFinalize(&ctx->mutex);
-    Tcl_ConditionFinalize(&ctx->exit_cv);
-    Tcl_MutexFinalize(&ctx->exit_mu);
-    Tcl_ConditionFinalize(&ctx->bg_cv);
-    Tcl_MutexFinalize(&ctx->bg_mu);
-    Tcl_MutexFinalize(&ctx->cmd_mu);
-    if (ctx->handle != NULL) {
-        if (ctx->skip_dlclose || g_disable_dlclose) {
+    LatHist *wake = Tcl_Alloc(sizeof(ctx->stats.wake));
+    Lock_Enter(ctx, LOCK_MUTEX);
+    memcpy(wake, ctx->stats.wake, sizeof(ctx->stats.wake));
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("dispatch", -1), Lat_HistObj(ctx->stats.dispatch));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("wake", -1), Lat_HistObj(wake));
+    Tcl_Free(wake);
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
+}
+//***  CaptureOutput function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * CaptureOutput --
+ *
+ *      Sends a command to ngspice and collects the stdout/stderr lines it prints while the command runs, as done by
+ *      "command -capture".
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for list operations
+ *      const char *cmd              - input: ngspice command
+ *      int *rcPtr                   - output: return code of ngSpice_Command
+ *
+ * Results:
+ *      New list object with the captured lines.
+ *
+ * Side Effects:
+ *      Clears ctx->capq and toggles ctx->cap_active under ctx->mutex.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *CaptureOutput(NgSpiceContext *ctx, Tcl_Interp *interp, const char *cmd, int *rcPtr) {
+    Lock_Enter(ctx, LOCK_MUTEX);
+    MsgQ_Clear(&ctx->capq);
+    ctx->cap_active = 1;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    /* cppcheck-suppress misra-c2012-11.8 - Ngspice certainly does not modify passed string*/
+    *rcPtr = ctx->ngSpice_Command((char *)cmd);
+    Tcl_Obj *outList = Tcl_NewListObj(0, NULL);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    ctx->cap_active = 0;
+    for (size_t i = 0; i < ctx->capq.count; i++) {
+        Tcl_ListObjAppendElement(interp, outList, Tcl_NewStringObj(MsgQ_At(&ctx->capq, i), -1));
+    }
+    MsgQ_Clear(&ctx->capq);
+    Lock_Leave(ctx, LOCK_MUTEX);
+    return outList;
+}
+//***  Run_Delta function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Run_Delta --
+ *
+ *      Returns the time between two RunInfo timestamps for "runinfo".
+ *
+ * Parameters:
+ *      Tcl_WideInt from             - input: earlier timestamp, microseconds, 0 if not reached
+ *      Tcl_WideInt to               - input: later timestamp, microseconds, 0 if not reached
+ *
+ * Results:
+ *      New integer object with the difference in microseconds, or an empty object if either time was not reached.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *Run_Delta(Tcl_WideInt from, Tcl_WideInt to) {
+    if ((from == 0) || (to == 0)) {
+        return Tcl_NewObj();
+    }
+    return Tcl_NewWideIntObj(to - from);
+}
+//***  Run_Obj function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Run_Obj --
+ *
+ *      Builds the "runinfo" dictionary of one run report.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter for dict operations
+ *      const RunInfo *r             - input: copy of the report
+ *      Tcl_WideInt now              - input: current time, used for the wall time of a run still in progress
+ *
+ * Results:
+ *      New dict {run N running 0|1 start_us T init_us T first_data_us T wall_us T rows N rows_per_s R halt_us T
+ *      drain_us T}; times are in microseconds from bg_run except halt_us (bg_halt to thread end) and drain_us
+ *      (thread end to the last row visible in "vectors"), and are empty when not reached.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *Run_Obj(Tcl_Interp *interp, const RunInfo *r, Tcl_WideInt now) {
+    Tcl_WideInt end = (r->ended != 0) ? r->ended : now;
+    Tcl_WideInt wall = end - r->issued;
+    double rate = (wall > 0) ? ((double)r->rows * 1e6 / (double)wall) : 0.0;
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("run", -1), Tcl_NewWideIntObj((Tcl_WideInt)r->run));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("running", -1), Tcl_NewBooleanObj(r->ended == 0));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("start_us", -1), Run_Delta(r->issued, r->started));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("init_us", -1), Run_Delta(r->issued, r->init));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("first_data_us", -1), Run_Delta(r->issued, r->first_data));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("wall_us", -1), Tcl_NewWideIntObj(wall));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("rows", -1), Tcl_NewWideIntObj((Tcl_WideInt)r->rows));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("rows_per_s", -1), Tcl_NewDoubleObj(rate));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("halt_us", -1), Run_Delta(r->halted, r->ended));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("drain_us", -1), Run_Delta(r->ended, r->drained));
+    return d;
+}
+//***  Run_ParseRusage function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Run_ParseRusage --
+ *
+ *      Converts the output of the ngspice "rusage all" command into numbers. Lines of the form "Name = number unit"
+ *      become entries Name -> number; the number is kept in the unit ngspice prints (seconds, MB, bytes...), other
+ *      lines are skipped.
+ *
+ * Parameters:
+ *      Tcl_Interp *interp           - input: interpreter for list and dict operations
+ *      Tcl_Obj *lines               - input: list of captured lines, with or without the "stdout " prefix
+ *
+ * Results:
+ *      New dict object.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *Run_ParseRusage(Tcl_Interp *interp, Tcl_Obj *lines) {
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_Size n = 0;
+    Tcl_Obj **elems = NULL;
+    if (Tcl_ListObjGetElements(NULL, lines, &n, &elems) != TCL_OK) {
+        return d;
+    }
+    for (Tcl_Size i = 0; i < n; i++) {
+        const char *line = Tcl_GetString(elems[i]);
+        if (strncmp(line, "stdout ", 7) == 0) {
+            line += 7;
+        }
+        const char *eq = strchr(line, '=');
+        if (eq == NULL) {
+            continue;
+        }
+        char *endp = NULL;
+        double v = strtod(eq + 1, &endp);
+        if (endp == (eq + 1)) {
+            continue;
+        }
+        while ((*line == ' ') || (*line == '\t')) {
+            line++;
+        }
+        const char *kend = eq;
+        while ((kend > line) && ((kend[-1] == ' ') || (kend[-1] == '\t'))) {
+            kend--;
+        }
+        if (kend > line) {
+            Tcl_DictObjPut(interp, d, Tcl_NewStringObj(line, (Tcl_Size)(kend - line)), Tcl_NewDoubleObj(v));
+        }
+    }
+    return d;
+}
+//***  RunInfoSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * RunInfoSubCmd --
+ *
+ *      Implements the "runinfo" instance subcommand that reports the timing of runs started with bg_run.
+ *
+ *          runinfo ?-all|-rusage?
+ *
+ *      The reports are filled by the callbacks as the run progresses (Run_Active) and kept for the latest
+ *      RUNINFO_KEEP runs. With -rusage the "rusage all" figures of ngspice are captured and parsed into numbers
+ *      (Run_ParseRusage); this is refused while a background run is active, as its output would mix with the run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "runinfo")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with the dict of the latest run (see Run_Obj, empty if no run was started), with an additional
+ *      "rusage" entry for -rusage, or the list of kept reports, oldest first, for -all; TCL_ERROR otherwise.
+ *
+ * Side Effects:
+ *      -rusage sends "rusage all" to ngspice.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int RunInfoSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    int all = 0;
+    int rusage = 0;
+    if (objc == 3) {
+        const char *opt = Tcl_GetString(objv[2]);
+        if (strcmp(opt, "-all") == 0) {
+            all = 1;
+        } else if (strcmp(opt, "-rusage") == 0) {
+            rusage = 1;
         } else {
-            PDl_Close(ctx->handle);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -all or -rusage)", opt));
+            return TCL_ERROR;
         }
+    } else if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-all|-rusage?");
+        return TCL_ERROR;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
     }
-    //PrintRefCount(ctx->vectorData);
-    //PrintRefCount(ctx->vectorInit);
-    Tcl_Free(ctx);
+    if (rusage == 1) {
+        Lock_Enter(ctx, LOCK_BG_MU);
+        NgState st = ctx->state;
+        Lock_Leave(ctx, LOCK_BG_MU);
+        if (st != NGSTATE_IDLE) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("rusage is not available while a background run is active", -1));
+            return TCL_ERROR;
+        }
+    }
+    RunInfo runs[RUNINFO_KEEP];
+    size_t n = 0;
+    Lock_Enter(ctx, LOCK_MUTEX);
+    uint64_t first = (ctx->run_count > (uint64_t)RUNINFO_KEEP) ? (ctx->run_count - (uint64_t)RUNINFO_KEEP) : 0U;
+    if (all == 0) {
+        first = (ctx->run_count > 0U) ? (ctx->run_count - 1U) : 0U;
+    }
+    for (uint64_t i = first; i < ctx->run_count; i++) {
+        runs[n] = ctx->runs[i % (uint64_t)RUNINFO_KEEP];
+        n++;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Tcl_WideInt now = Stats_Now();
+    if (all == 1) {
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+        for (size_t i = 0; i < n; i++) {
+            Tcl_ListObjAppendElement(interp, list, Run_Obj(interp, &runs[i], now));
+        }
+        Tcl_SetObjResult(interp, list);
+        return TCL_OK;
+    }
+    Tcl_Obj *d = (n > 0U) ? Run_Obj(interp, &runs[0], now) : Tcl_NewDictObj();
+    if (rusage == 1) {
+        int rc = 0;
+        Tcl_Obj *lines = CaptureOutput(ctx, interp, "rusage all", &rc);
+        Tcl_IncrRefCount(lines);
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("rusage", -1), Run_ParseRusage(interp, lines));
+        Tcl_DecrRefCount(lines);
+    }
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
 }
-//***  InstDeleteProc function
+//***  RecordSubCmd function
 /*
  *----------------------------------------------------------------------------------------------------------------------
  *
- * InstDeleteProc --
+ * RecordSubCmd --
  *
- *      Instance deletion procedure for an NgSpiceContext. Called when the Tcl command that represents a simulator
- *      instance is deleted (for example, via `$s1 destroy`). This function tries to shut down ngspice in a controlled
- *      way, stop further callbacks, clean up any pending state, and (if safe) schedule final cleanup of the instance.
+ *      Implements the "record" instance subcommand that writes every ngspice callback (type, time, payload) to a
+ *      compact binary file, which "replay" feeds back through the callbacks without ngspice.
  *
- *      This function also enforces a global "poison" mode. If ngspice has ever died in a partially torn-down / unsafe
- *      state (which can corrupt libngspice’s heap), we mark the process as contaminated by setting global flags. Once
- *      the process is poisoned, we never call back into ngspice again, never dlclose() its handle, and we leak the
- *      context on purpose instead of risking a crash.
+ *          record start file
+ *          record stop
+ *          record status
+ *
+ *      The file starts with REC_MAGIC and REC_BOM, followed by records made of a RecHeader and a payload in host byte
+ *      order (see Rec_Event, Rec_Init and Rec_Data).
  *
  * Parameters:
- *      void *cdata
- *          Pointer to the NgSpiceContext for this Tcl instance.
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "record")
+ *      Tcl_Obj *const objv[]        - input: argument vector
  *
  * Results:
- *      None.
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result; "stop" returns the number of records written
+ *      and fails if the file could not be written completely, "status" returns a dict {enabled 0|1 file path
+ *      records N bytes N}.
  *
  * Side Effects:
+ *      Creates, writes and closes the recording file (Rec_Start, Rec_Stop).
  *
- *   Global poison fast path:
- *      If g_heap_poisoned is already set when this runs, we assume the process is already contaminated from a previous
- *      ngspice failure. In that case:
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int RecordSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "start|stop|status ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    Recorder *r = &ctx->rec;
+    if (strcmp(op, "start") == 0) {
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "file");
+            return TCL_ERROR;
+        }
+        return Rec_Start(ctx, interp, Tcl_GetString(objv[3]));
+    }
+    if (strcmp(op, "stop") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        int failed = Rec_Stop(ctx);
+        Tcl_MutexLock(&ctx->rec_mu);
+        Tcl_WideInt n = (Tcl_WideInt)r->records;
+        Tcl_MutexUnlock(&ctx->rec_mu);
+        if (failed == 1) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\" after %" TCL_LL_MODIFIER "d records",
+                                                   (r->path != NULL) ? r->path : "", (long long)n));
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(n));
+        return TCL_OK;
+    }
+    if (strcmp(op, "status") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_Obj *d = Tcl_NewDictObj();
+        Tcl_MutexLock(&ctx->rec_mu);
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("enabled", -1), Tcl_NewBooleanObj(r->file != NULL));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("file", -1),
+                       Tcl_NewStringObj((r->path != NULL) ? r->path : "", -1));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("records", -1), Tcl_NewWideIntObj((Tcl_WideInt)r->records));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("bytes", -1), Tcl_NewWideIntObj((Tcl_WideInt)r->bytes));
+        Tcl_MutexUnlock(&ctx->rec_mu);
+        Tcl_SetObjResult(interp, d);
+        return TCL_OK;
+    }
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected start, stop or status)", op));
+    return TCL_ERROR;
+}
+//***  Replay_StatusObj function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *          * We mark ctx->destroying = 1 so no new callbacks enqueue data or events.
+ * Replay_StatusObj --
  *
- *          * We tear down any deferred ngspice commands immediately and in a thread-safe way:
- *                - Lock ctx->cmd_mu, detach ctx->pending_head/tail.
- *                - Free all PendingCmd nodes outside the lock.
- *            This prevents any queued commands from being flushed later into a dead ngspice.
+ *      Builds the status dict of the latest replay.
  *
- *          * We wake any thread currently blocked in waitevent:
- *                - Lock ctx->mutex, Tcl_ConditionNotify(&ctx->cond), unlock.
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      Tcl_Interp *interp           - input: interpreter (for dict operations)
  *
- *          * We DO NOT:
- *                - call QuiesceNgspice()
- *                - call ctx->ngSpice_Command("quit")
- *                - wait on ctx->exit_cv
- *                - queue InstFreeProc()
- *                - dlclose() the ngspice handle
+ * Results:
+ *      New dict {active 0|1 file path speed F records N delivered N skipped N malformed 0|1}.
+ *
+ * Side Effects:
+ *      Reads ctx->replay under ctx->replay_mu.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static Tcl_Obj *Replay_StatusObj(NgSpiceContext *ctx, Tcl_Interp *interp) {
+    const Replay *rp = &ctx->replay;
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_MutexLock(&ctx->replay_mu);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("active", -1), Tcl_NewBooleanObj((rp->active == 1) && (rp->done == 0)));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("file", -1), Tcl_NewStringObj((rp->path != NULL) ? rp->path : "", -1));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("speed", -1), Tcl_NewDoubleObj(rp->speed));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("records", -1), Tcl_NewWideIntObj((Tcl_WideInt)rp->records));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("delivered", -1), Tcl_NewWideIntObj((Tcl_WideInt)rp->delivered));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("skipped", -1), Tcl_NewWideIntObj((Tcl_WideInt)rp->skipped));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("malformed", -1), Tcl_NewBooleanObj(rp->malformed));
+    Tcl_MutexUnlock(&ctx->replay_mu);
+    return d;
+}
+//***  ReplaySubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * ReplaySubCmd --
+ *
+ *      Implements the "replay" instance subcommand that feeds a recording made by "record" back through the ngspice
+ *      callbacks from a thread standing in for the ngspice background thread, so the bridge can be profiled and
+ *      benchmarked on customer callback traffic without ngspice or the deck.
+ *
+ *          replay start file ?-speed factor?
+ *          replay wait
+ *          replay stop
+ *          replay status
+ *
+ *      "start" prepares the instance like "command bg_run" (Run_Reset) and returns at once; the replayed run is seen
+ *      by waitevent, on, vectors, runinfo and the other subcommands as a real one. -speed 1 (default) keeps the
+ *      recorded pauses, 2 halves them, 0 replays without pauses. Exit records are not delivered; "command" is refused
+ *      until the replay ends. A recording of several runs is replayed as one run.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "replay")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result; "start" returns the number of records in the
+ *      file, "wait", "stop" and "status" the status dict of Replay_StatusObj. "start" fails while a run or another
+ *      replay is in progress.
+ *
+ * Side Effects:
+ *      Reads the recording, creates and joins the replay thread (Replay_ThreadProc, Replay_Join). "wait" blocks until
+ *      the replay ends, without processing events.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int ReplaySubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "start|wait|stop|status ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    Replay *rp = &ctx->replay;
+    if (strcmp(op, "start") == 0) {
+        double speed = 1.0;
+        if ((objc != 4) && (objc != 6)) {
+            Tcl_WrongNumArgs(interp, 3, objv, "file ?-speed factor?");
+            return TCL_ERROR;
+        }
+        if (objc == 6) {
+            const char *opt = Tcl_GetString(objv[4]);
+            if (strcmp(opt, "-speed") != 0) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -speed)", opt));
+                return TCL_ERROR;
+            }
+            if ((Tcl_GetDoubleFromObj(NULL, objv[5], &speed) != TCL_OK) || !(speed >= 0.0)) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj("expected number >= 0 after -speed", -1));
+                return TCL_ERROR;
+            }
+        }
+        if (Replay_Running(ctx) == 1) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("replay already in progress", -1));
+            return TCL_ERROR;
+        }
+        Replay_Join(ctx, 0);
+        Lock_Enter(ctx, LOCK_BG_MU);
+        NgState st = ctx->state;
+        Lock_Leave(ctx, LOCK_BG_MU);
+        if ((st != NGSTATE_IDLE) || (Inst_Destroying(ctx) == 1)) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("simulation is running, replay needs an idle instance", -1));
+            return TCL_ERROR;
+        }
+        const char *path = Tcl_GetString(objv[3]);
+        Replay loaded;
+        memset(&loaded, 0, sizeof loaded);
+        if (Replay_Load(interp, path, &loaded) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Run_Reset(ctx);
+        Tcl_MutexLock(&ctx->replay_mu);
+        Tcl_Free(rp->path);
+        rp->path = ckstrdup(path);
+        rp->data = loaded.data;
+        rp->size = loaded.size;
+        rp->records = loaded.records;
+        rp->speed = speed;
+        rp->delivered = 0;
+        rp->skipped = 0;
+        rp->malformed = 0;
+        rp->abort = 0;
+        rp->done = 0;
+        rp->active = 1;
+        int rc = Tcl_CreateThread(&rp->tid, Replay_ThreadProc, (ClientData)ctx, TCL_THREAD_STACK_DEFAULT,
+                                  TCL_THREAD_JOINABLE);
+        if (rc != TCL_OK) {
+            rp->active = 0;
+            Tcl_Free(rp->data);
+            rp->data = NULL;
+        }
+        Tcl_MutexUnlock(&ctx->replay_mu);
+        if (rc != TCL_OK) {
+            Lock_Enter(ctx, LOCK_BG_MU);
+            State_Set(ctx, NGSTATE_IDLE);
+            Lock_Leave(ctx, LOCK_BG_MU);
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("couldn't create replay thread", -1));
+            return TCL_ERROR;
+        }
+        Trace_Instant(ctx, "replay", "start", (Tcl_WideInt)loaded.records);
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)loaded.records));
+        return TCL_OK;
+    }
+    if ((strcmp(op, "wait") == 0) || (strcmp(op, "stop") == 0) || (strcmp(op, "status") == 0)) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        if (strcmp(op, "status") != 0) {
+            Replay_Join(ctx, (strcmp(op, "stop") == 0) ? 1 : 0);
+        }
+        Tcl_SetObjResult(interp, Replay_StatusObj(ctx, interp));
+        return TCL_OK;
+    }
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected start, wait, stop or status)", op));
+    return TCL_ERROR;
+}
+//***  MemorySubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *      We just return. The context (and possibly libngspice itself) is intentionally leaked because touching it could
- *      be unsafe.
+ * MemorySubCmd --
  *
- *   Normal shutdown path (when not already poisoned):
+ *      Implements the "memory" instance subcommand that reports the memory owned by the bridge for an instance, per
+ *      category, with the state of the budget set by "configure -membudget/-mempolicy".
  *
- *      1. Stop further activity.
- *         - Set ctx->destroying = 1 so callbacks know to stop queuing data/events.
- *         - Force the high-level state machine into NGSTATE_DEAD under bg_mu, so future
- *           InstObjCmd calls will reject immediately.
+ *          memory ?-reset?
  *
- *      2. Drain and discard any deferred commands.
- *         - Lock ctx->cmd_mu, detach the pending command list (pending_head/tail = NULL),
- *           unlock, then free all PendingCmd nodes.
- *           This guarantees nothing later will FlushPending() into ngspice after teardown
- *           has begun.
+ *      Categories: rows (rows received and not converted yet), vectors (the vectors dict, estimated from its object
+ *      count), messages (message and capture rings), analysis (histograms, derived vectors, triggers, capture
+ *      windows and pyramids), trace (trace ring) and record (recorder and loaded replay). Memory held by ngspice
+ *      itself is not included.
  *
- *      3. Observe background thread state.
- *         - Call WaitForBGStarted(ctx, 250) to latch whether ngspice ever told us the background thread "started"
- *           and/or "ended".
- *         - Snapshot:
- *               started = ctx->bg_started
- *               ended   = ctx->bg_ended
- *               running_now = ctx->ngSpice_running() (if available)
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "memory")
+ *      Tcl_Obj *const objv[]        - input: argument vector
  *
- *      4. Detect an unsafe/abrupt shutdown.
- *         - We consider it "abrupt" only if:
- *               (started == 1) AND
- *               (running_now == 0) AND
- *               (ended == 0)
- *           That means ngspice’s bg thread used to exist, but we never got the clean "ended" callback, so we assume the
- *           lib may be in a half-dead state.
+ * Results:
+ *      TCL_OK with a dict {total B categories {rows B vectors B messages B analysis B trace B record B} budget B
+ *      policy name over 0|1 stopped 0|1 peak B exceeded N dropped_rows N}; with -reset an empty result. TCL_ERROR
+ *      on wrong arguments.
  *
- *         - In that case:
- *               abrupt_shutdown = 1;
- *               g_heap_poisoned = 1;
- *               g_disable_dlclose = 1;
- *               ctx->skip_dlclose = 1;
+ * Side Effects:
+ *      Refreshes the accounting (Mem_Refresh). With -reset sets the peak to the current total and clears the
+ *      exceeded and dropped row counters under ctx->mutex.
  *
- *           From now on the entire process is considered poisoned and we will refuse to touch ngspice internals or
- *           unload the library in any instance.
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int MemorySubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    static const char *const catNames[MEM_NCAT] = {"rows", "vectors", "messages", "analysis", "trace", "record"};
+    int reset = 0;
+    if (objc == 3) {
+        const char *opt = Tcl_GetString(objv[2]);
+        if (strcmp(opt, "-reset") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -reset)", opt));
+            return TCL_ERROR;
+        }
+        reset = 1;
+    } else if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+        return TCL_ERROR;
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
+    }
+    uint64_t cat[MEM_NCAT];
+    uint64_t total = Mem_Refresh(ctx, cat);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (reset == 1) {
+        ctx->mem.peak = total;
+        ctx->mem.exceeded = 0;
+        ctx->mem.dropped_rows = 0;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        return TCL_OK;
+    }
+    MemBudget m = ctx->mem;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Tcl_Obj *cats = Tcl_NewDictObj();
+    for (int k = 0; k < MEM_NCAT; k++) {
+        Tcl_DictObjPut(interp, cats, Tcl_NewStringObj(catNames[k], -1), Tcl_NewWideIntObj((Tcl_WideInt)cat[k]));
+    }
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("total", -1), Tcl_NewWideIntObj((Tcl_WideInt)total));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("categories", -1), cats);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("budget", -1), Tcl_NewWideIntObj((Tcl_WideInt)m.budget));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("policy", -1), Tcl_NewStringObj(memPolicyNames[m.policy], -1));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("over", -1), Tcl_NewBooleanObj(m.over));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("stopped", -1), Tcl_NewBooleanObj(m.stopped));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("peak", -1), Tcl_NewWideIntObj((Tcl_WideInt)m.peak));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("exceeded", -1), Tcl_NewWideIntObj((Tcl_WideInt)m.exceeded));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("dropped_rows", -1), Tcl_NewWideIntObj((Tcl_WideInt)m.dropped_rows));
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
+}
+//***  Reset_Circuits function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *      5. Halt the background thread if it's still legitimately running.
- *         - If (started && !ended && !abrupt_shutdown):
- *               QuiesceNgspice(ctx, 0);
- *               WaitForBGEnded(ctx, 3000);
- *           Otherwise we just mark ctx->bg_ended = 1 under bg_mu so later code won't spin.
+ * Reset_Circuits --
  *
- *      6. Decide whether to tell ngspice to exit.
- *         - We only send "quit" if it still looks safe:
- *               safe_to_quit = !ctx->exited && !abrupt_shutdown
- *           and we have a valid ctx->ngSpice_Command and we haven't already sent it.
+ *      Removes every circuit loaded into ngspice for "reset": sends "remcirc" until ngspice answers that no circuit
+ *      is loaded. ngspice has no call listing the circuits, so the error line is the end marker; RESET_MAX_CIRCUITS
+ *      bounds the loop for libraries that do not print it. The background thread must be stopped.
  *
- *         - Safe case:
- *               ctx->quitting = 1;
- *               ctx->ngSpice_Command("unset askquit");
- *               ctx->ngSpice_Command("quit");
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
  *
- *         - Unsafe case (either already exited, or abrupt_shutdown, or otherwise not safe):
- *               We do NOT call into ngspice.
- *               If ctx->exited is still 0, we fake a clean exit:
- *                   Lock ctx->exit_mu;
- *                   ctx->exited = 1;
- *                   Tcl_ConditionNotify(&ctx->exit_cv);
- *                   Unlock ctx->exit_mu;
- *               We also set ctx->skip_dlclose = 1 so InstFreeProc will not dlclose()
- *               a possibly-corrupted library.
+ * Results:
+ *      Number of circuits removed.
  *
- *      7. Sync with exit.
- *         - We now wait until ctx->exited is definitely 1:
- *               Lock ctx->exit_mu;
- *               while (!ctx->exited) Tcl_ConditionWait(&ctx->exit_cv, ...);
- *               Unlock ctx->exit_mu;
+ * Side Effects:
+ *      Sends "remcirc" to ngspice with the output captured in ctx->capq (see CaptureOutput); clears
+ *      ctx->has_circuit.
  *
- *           In the normal path, ControlledExitCallback() will eventually mark exited=1 and signal exit_cv. In the
- *           unsafe/fake-exit path above, we already forced exited=1 and notified, so this wait returns immediately.
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Reset_Circuits(NgSpiceContext *ctx) {
+    int removed = 0;
+    int done = 0;
+    while ((done == 0) && (removed < RESET_MAX_CIRCUITS)) {
+        Lock_Enter(ctx, LOCK_MUTEX);
+        MsgQ_Clear(&ctx->capq);
+        ctx->cap_active = 1;
+        Lock_Leave(ctx, LOCK_MUTEX);
+        int rc = ctx->ngSpice_Command("remcirc");
+        Lock_Enter(ctx, LOCK_MUTEX);
+        ctx->cap_active = 0;
+        for (size_t i = 0; i < ctx->capq.count; i++) {
+            if (Msg_Contains(MsgQ_At(&ctx->capq, i), "no circuit") == 1) {
+                done = 1;
+            }
+        }
+        MsgQ_Clear(&ctx->capq);
+        Lock_Leave(ctx, LOCK_MUTEX);
+        if (rc != 0) {
+            done = 1;
+        }
+        if (done == 0) {
+            removed++;
+        }
+    }
+    ctx->has_circuit = 0;
+    return removed;
+}
+//***  ResetSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
  *
- *      8. Purge any queued Tcl events for this context.
- *         - Tcl_DeleteEvents(DeleteNgSpiceEventProc, ctx) walks the Tcl event queue, drops all NgSpiceEvent entries
- *           that still refer to this ctx, and balances their Tcl_Preserve/Tcl_Release.
- *           After this point, no pending NgSpiceEventProc will ever run on a freed ctx.
+ * ResetSubCmd --
  *
- *      9. Wake waitevent callers.
- *         - Lock ctx->mutex;
- *           Tcl_ConditionNotify(&ctx->cond);
- *           Unlock ctx->mutex;
+ *      Implements the "reset" instance subcommand that returns an instance to the state of a new one without
+ *      unloading libngspice, so job runners can reuse an instance instead of paying for "destroy" (halt, "quit",
+ *      exit sync, dlclose) and "new" (dlopen, symbol resolution, ngSpice_Init, spinit) per job.
  *
- *         This unblocks anyone in [$s waitevent ...] so they don't hang forever on an instance that is going away.
+ *          reset
  *
- *     10. Final disposition.
- *         - If we just transitioned into poisoned mode (abrupt_shutdown set the globals), we stop here and return
- *           without scheduling cleanup. We intentionally leak ctx because we consider libngspice unsafe to touch
- *           further.
+ *      Stops a replay and a running background thread, drops deferred commands, removes all circuits
+ *      (Reset_Circuits) and plots ("destroy all"), then clears the bridge side: vectors, rows not converted yet,
+ *      messages, progress, event counts (like "eventcounts -clear"), message statistics, and every histogram,
+ *      derived vector, trigger, capture window and pyramid. Options set with "configure", "on" scripts, the
+ *      notifier channel, trace, recording and the telemetry of "stats", "latency" and "runinfo" are kept, as are the
+ *      ngspice variables and options set by commands. A new generation starts, so events of earlier runs still in
+ *      the Tcl queue are ignored.
  *
- *         - Otherwise, we hand ownership to Tcl for orderly teardown:
- *               Tcl_EventuallyFree(ctx, InstFreeProc);
- *           InstFreeProc will run later (once no events still reference ctx) and will:
- *               * release Tcl objects (vectorData, vectorInit),
- *               * free message/data buffers,
- *               * finalize mutexes/conditions,
- *               * dlclose() libngspice unless skip_dlclose or g_disable_dlclose is set.
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "reset")
+ *      Tcl_Obj *const objv[]        - input: argument vector
  *
- *   Idempotency:
- *      Calling InstDeleteProc multiple times is safe. If ctx->destroying was already set, or if the process is already
- *      poisoned, we just do minimal signaling / pending command drain and return. We don't try to shut ngspice down
- *      twice.
+ * Results:
+ *      TCL_OK with a dict {circuits N plots N time_us T}: circuits removed, plots destroyed and the time taken.
+ *      TCL_ERROR on wrong arguments, when the instance is shutting down, when ngspice has exited or when the
+ *      background thread does not stop within RESET_HALT_MS.
+ *
+ * Side Effects:
+ *      May block while the background thread stops (QuiesceNgspice, WaitForBGEnded); sends "remcirc" and
+ *      "destroy all" to ngspice; moves ctx->state to NGSTATE_IDLE under ctx->bg_mu; increments ctx->gen and frees
+ *      the data and analysis state under ctx->mutex; discards the conversion backlog and the row counts of "on"
+ *      scripts.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
-static void InstDeleteProc(void *cdata) {
-    NgSpiceContext *ctx = (NgSpiceContext *)cdata;
-    if (g_heap_poisoned == 1) {
-        ctx->destroying = 1;
-        Tcl_MutexLock(&ctx->cmd_mu);
-        PendingCmd *plist = ctx->pending_head;
-        ctx->pending_head = NULL;
-        ctx->pending_tail = NULL;
-        Tcl_MutexUnlock(&ctx->cmd_mu);
-        while (plist != NULL) {
-            PendingCmd *next = plist->next;
-            Tcl_Free(plist->cmd);
-            Tcl_Free(plist);
-            plist = next;
-        }
-        /* Unblock any waitevent callers that might still be watching this ctx. */
-        Tcl_MutexLock(&ctx->mutex);
-        Tcl_ConditionNotify(&ctx->cond);
-        Tcl_MutexUnlock(&ctx->mutex);
-        return;
+static int ResetSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
     }
-    if (ctx->destroying == 1) {
-        return;
+    Tcl_WideInt t0 = Stats_Now();
+    Lock_Enter(ctx, LOCK_BG_MU);
+    NgState st = ctx->state;
+    Lock_Leave(ctx, LOCK_BG_MU);
+    if ((st == NGSTATE_DEAD) || (Inst_Destroying(ctx) == 1) || (g_heap_poisoned == 1)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("instance is shutting down", -1));
+        return TCL_ERROR;
     }
-    /* tell callbacks to stop enqueueing new work */
-    ctx->destroying = 1;
-    Tcl_MutexLock(&ctx->bg_mu);
-    ctx->state = NGSTATE_DEAD;
-    Tcl_MutexUnlock(&ctx->bg_mu);
-    Tcl_MutexLock(&ctx->cmd_mu);
-    /* free commands queue */
+    Tcl_MutexLock(&ctx->exit_mu);
+    int exited = ctx->exited;
+    Tcl_MutexUnlock(&ctx->exit_mu);
+    if (exited == 1) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("ngspice has exited, instance can only be destroyed", -1));
+        return TCL_ERROR;
+    }
+    Replay_Join(ctx, 1);
+    /* deferred commands would be flushed into the cleaned instance by the end of the run */
+    Lock_Enter(ctx, LOCK_CMD_MU);
     PendingCmd *plist = ctx->pending_head;
     ctx->pending_head = NULL;
     ctx->pending_tail = NULL;
-    Tcl_MutexUnlock(&ctx->cmd_mu);
+    Lock_Leave(ctx, LOCK_CMD_MU);
     while (plist != NULL) {
         PendingCmd *next = plist->next;
         Tcl_Free(plist->cmd);
         Tcl_Free(plist);
         plist = next;
     }
-    /* Step 1: observe early bg thread state */
-    WaitForBGStarted(ctx, 250);
-    Tcl_MutexLock(&ctx->bg_mu);
-    int started = ctx->bg_started;
-    int ended = ctx->bg_ended;
-    Tcl_MutexUnlock(&ctx->bg_mu);
-    int running_now = -1;
-    if (ctx->ngSpice_running) {
-        running_now = ctx->ngSpice_running();
+    if (st == NGSTATE_STARTING_BG) {
+        WaitForBGStarted(ctx, 250);
     }
-    int abrupt_shutdown = 0;
-    if (started && (running_now == 0) && !ended) {
-        abrupt_shutdown = 1;
-        g_heap_poisoned = 1;
-        g_disable_dlclose = 1;
-        ctx->skip_dlclose = 1;
+    if ((ctx->ngSpice_running != NULL) && (ctx->ngSpice_running() == 1)) {
+        Lock_Enter(ctx, LOCK_BG_MU);
+        State_Set(ctx, NGSTATE_STOPPING_BG);
+        Lock_Leave(ctx, LOCK_BG_MU);
+        Run_Halted(ctx);
+        QuiesceNgspice(ctx, RESET_HALT_MS);
+        WaitForBGEnded(ctx, RESET_HALT_MS);
+        if (ctx->ngSpice_running() == 1) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("background thread did not stop, instance is not reset", -1));
+            return TCL_ERROR;
+        }
     }
-    /* Step 2: try graceful halt if bg thread might still be legitimately running, and we didn't detect the abrupt
-       case. */
-    if (started && !ended && !abrupt_shutdown) {
-        QuiesceNgspice(ctx, 0);
-        WaitForBGEnded(ctx, 3000);
-    } else {
-        Tcl_MutexLock(&ctx->bg_mu);
-        ctx->bg_ended = 1;
-        Tcl_MutexUnlock(&ctx->bg_mu);
+    Lock_Enter(ctx, LOCK_BG_MU);
+    State_Set(ctx, NGSTATE_IDLE);
+    Lock_Leave(ctx, LOCK_BG_MU);
+    int circuits = Reset_Circuits(ctx);
+    int plots = 0;
+    char **names = ctx->ngSpice_AllPlots();
+    for (Tcl_Size i = 0; (names != NULL) && (names[i] != NULL); ++i) {
+        plots++;
+    }
+    ctx->ngSpice_Command("destroy all");
+    names = ctx->ngSpice_AllPlots();
+    for (Tcl_Size i = 0; (names != NULL) && (names[i] != NULL); ++i) {
+        plots--;
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    ctx->gen++;
+    ctx->new_run_pending = 0;
+    ctx->mem.over = 0;
+    ctx->mem.stopped = 0;
+    FreeInitSnap(ctx->init_snap);
+    ctx->init_snap = NULL;
+    DataBuf_Free(&ctx->prod);
+    DataBuf_Init(&ctx->prod);
+    Tcl_DecrRefCount(ctx->vectorData);
+    ctx->vectorData = Tcl_NewDictObj();
+    Tcl_IncrRefCount(ctx->vectorData);
+    Tcl_DecrRefCount(ctx->vectorInit);
+    ctx->vectorInit = Tcl_NewDictObj();
+    Tcl_IncrRefCount(ctx->vectorInit);
+    MsgQ_Clear(&ctx->msgq);
+    Msg_NewRun(ctx);
+    memset(ctx->msgclass.total, 0, sizeof(ctx->msgclass.total));
+    ctx->msgclass.filtered = 0;
+    Progress_Reset(ctx);
+    memcpy(ctx->evt_base, ctx->evt_counts, sizeof(ctx->evt_base));
+    RunNames_Free(ctx);
+    ctx->scale_idx = -1;
+    while (ctx->hist_head != NULL) {
+        HistAcc *next = ctx->hist_head->next;
+        Hist_Free(ctx->hist_head);
+        ctx->hist_head = next;
+    }
+    while (ctx->derived_head != NULL) {
+        DerivedVec *next = ctx->derived_head->next;
+        Derived_Free(ctx->derived_head);
+        ctx->derived_head = next;
+    }
+    Derived_UpdateKeep(ctx);
+    while (ctx->trig_head != NULL) {
+        Trigger *next = ctx->trig_head->next;
+        Trig_Free(ctx->trig_head);
+        ctx->trig_head = next;
+    }
+    while (ctx->cap_head != NULL) {
+        Capture *next = ctx->cap_head->next;
+        Cap_Free(ctx->cap_head);
+        ctx->cap_head = next;
+    }
+    Lock_Leave(ctx, LOCK_MUTEX);
+    while (ctx->pyr_head != NULL) {
+        Pyramid *next = ctx->pyr_head->next;
+        Pyr_Free(ctx->pyr_head);
+        ctx->pyr_head = next;
+    }
+    Conv_Discard(ctx);
+    Subs_ResetRows(ctx);
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("circuits", -1), Tcl_NewIntObj(circuits));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("plots", -1), Tcl_NewIntObj(plots));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("time_us", -1), Tcl_NewWideIntObj(Stats_Now() - t0));
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
+}
+//***  TraceSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * TraceSubCmd --
+ *
+ *      Implements the "trace" instance subcommand that controls the opt-in trace ring of the instance.
+ *
+ *          trace start ?-capacity N? ?-file path?
+ *          trace stop
+ *          trace clear
+ *          trace dump file
+ *          trace status
+ *
+ *      While enabled, the ring records callbacks, ctx->state transitions, queued and replayed pending commands,
+ *      lock waits of 1 us or more, Tcl event processing, "on" scripts, instance subcommands and the teardown steps
+ *      of InstDeleteProc. "dump" writes Chrome trace-event JSON (Trace_Dump); with -file the ring is also dumped when
+ *      the instance is deleted, so teardown can be inspected.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "trace")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR with a message in the interpreter result; "status" returns a dict {enabled 0|1 count N
+ *      capacity N dropped N file path}, "dump" the number of records written.
+ *
+ * Side Effects:
+ *      Allocates, clears or enables ctx->trace under ctx->trace_mu; "dump" writes a file.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int TraceSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "start|stop|clear|dump|status ?args?");
+        return TCL_ERROR;
+    }
+    const char *op = Tcl_GetString(objv[2]);
+    TraceRing *tr = &ctx->trace;
+    if (strcmp(op, "start") == 0) {
+        long cap = 0;
+        const char *path = NULL;
+        if ((objc % 2) != 1) {
+            Tcl_WrongNumArgs(interp, 3, objv, "?-capacity N? ?-file path?");
+            return TCL_ERROR;
+        }
+        for (Tcl_Size i = 3; i < objc; i += 2) {
+            const char *opt = Tcl_GetString(objv[i]);
+            if (strcmp(opt, "-capacity") == 0) {
+                if ((Tcl_GetLongFromObj(NULL, objv[i + 1], &cap) != TCL_OK) || (cap < 1)) {
+                    Tcl_SetObjResult(interp, Tcl_NewStringObj("expected integer >= 1 after -capacity", -1));
+                    return TCL_ERROR;
+                }
+            } else if (strcmp(opt, "-file") == 0) {
+                path = Tcl_GetString(objv[i + 1]);
+            } else {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -capacity or -file)", opt));
+                return TCL_ERROR;
+            }
+        }
+        Trace_Start(ctx, (size_t)cap, path);
+        return TCL_OK;
+    }
+    if ((strcmp(op, "stop") == 0) || (strcmp(op, "clear") == 0)) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_MutexLock(&ctx->trace_mu);
+        if (op[0] == 's') {
+            Flag_Store(&tr->enabled, 0);
+        } else {
+            tr->head = 0;
+            tr->count = 0;
+            tr->dropped = 0;
+            tr->t0 = Stats_Now();
+        }
+        Tcl_MutexUnlock(&ctx->trace_mu);
+        return TCL_OK;
+    }
+    if (strcmp(op, "status") == 0) {
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_Obj *d = Tcl_NewDictObj();
+        Tcl_MutexLock(&ctx->trace_mu);
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("enabled", -1), Tcl_NewBooleanObj(tr->enabled));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj((Tcl_WideInt)tr->count));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("capacity", -1), Tcl_NewWideIntObj((Tcl_WideInt)tr->cap));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("dropped", -1), Tcl_NewWideIntObj((Tcl_WideInt)tr->dropped));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("file", -1),
+                       Tcl_NewStringObj((tr->path != NULL) ? tr->path : "", -1));
+        Tcl_MutexUnlock(&ctx->trace_mu);
+        Tcl_SetObjResult(interp, d);
+        return TCL_OK;
+    }
+    if (strcmp(op, "dump") == 0) {
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "file");
+            return TCL_ERROR;
+        }
+        Tcl_MutexLock(&ctx->trace_mu);
+        Tcl_WideInt n = (Tcl_WideInt)tr->count;
+        Tcl_MutexUnlock(&ctx->trace_mu);
+        if (Trace_Dump(ctx, interp, Tcl_GetString(objv[3])) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(n));
+        return TCL_OK;
+    }
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected start, stop, clear, dump or status)", op));
+    return TCL_ERROR;
+}
+//***  ProgressSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * ProgressSubCmd --
+ *
+ *      Implements the "progress" instance subcommand that returns the latest progress report of the running
+ *      analysis, as parsed by SendStatCallback.
+ *
+ *          progress
+ *
+ *      The remaining time is extrapolated linearly from the time spent and the progress made since the first report
+ *      of the analysis, so a first report above zero does not count as progress made in no time.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "progress")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with a dict {analysis name percent P eta_s S elapsed_s E}; analysis is empty before the first report
+ *      of a run and eta_s is empty until the percent has moved past the first report. TCL_ERROR on wrong arguments.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int ProgressSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, NULL);
+        return TCL_ERROR;
+    }
+    Lock_Enter(ctx, LOCK_MUTEX);
+    Progress pr = ctx->progress;
+    Lock_Leave(ctx, LOCK_MUTEX);
+    double elapsed = 0.0;
+    Tcl_Obj *eta = Tcl_NewObj();
+    if (pr.analysis[0] != '\0') {
+        elapsed = Progress_Seconds(&pr.start, &pr.last);
+        if (pr.percent >= 100.0) {
+            Tcl_SetWideIntObj(eta, 0);
+        } else if (pr.percent > pr.first) {
+            Tcl_SetWideIntObj(eta, (Tcl_WideInt)llround(elapsed * (100.0 - pr.percent) / (pr.percent - pr.first)));
+        } else {
+            /* No action required: all valid cases handled above (MISRA 15.7) */
+        }
+    }
+    Tcl_Obj *d = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("analysis", -1), Tcl_NewStringObj(pr.analysis, -1));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("percent", -1), Tcl_NewDoubleObj(pr.percent));
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("eta_s", -1), eta);
+    Tcl_DictObjPut(interp, d, Tcl_NewStringObj("elapsed_s", -1), Tcl_NewDoubleObj(elapsed));
+    Tcl_SetObjResult(interp, d);
+    return TCL_OK;
+}
+
+//***  NotifierSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * NotifierSubCmd --
+ *
+ *      Implements the "notifier" instance subcommand that exposes a readable channel for event-loop integration.
+ *
+ *          notifier
+ *          notifier -close
+ *
+ *      The channel becomes readable whenever a callback queued an event for the instance (data, status, messages,
+ *      run state), so scripts can use "fileevent" and C hosts can poll its OS handle (Tcl_GetChannelHandle) together
+ *      with other descriptors instead of polling with "after". The bytes carry no information; the reader drains
+ *      them and lets the event loop process the queued events.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including instance command and "notifier")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with the channel name (or empty after -close), or TCL_ERROR.
+ *
+ * Side Effects:
+ *      Creates the pipe on first use (Notify_Open) and registers the read end in interp again if the script closed
+ *      it; -close closes the pipe (Notify_Close).
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int NotifierSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if (objc == 3) {
+        const char *opt = Tcl_GetString(objv[2]);
+        if (strcmp(opt, "-close") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -close)", opt));
+            return TCL_ERROR;
+        }
+        Notify_Close(ctx, interp);
+        return TCL_OK;
     }
-    /* Step 3: decide whether to call "quit" */
-    int safe_to_quit = 1;
-    if (ctx->exited == 1) {
-        safe_to_quit = 0;
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-close?");
+        return TCL_ERROR;
     }
-    if (abrupt_shutdown == 1) {
-        safe_to_quit = 0;
+    if (ctx->notify_rchan == NULL) {
+        if (Notify_Open(ctx, interp) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    } else if (Tcl_IsChannelRegistered(interp, ctx->notify_rchan) == 0) {
+        Tcl_RegisterChannel(interp, ctx->notify_rchan);
+    } else {
+        /* No action required: all valid cases handled above (MISRA 15.7) */
     }
-    if (safe_to_quit && ctx->ngSpice_Command && !ctx->quitting) {
-        ctx->quitting = 1;
-        ctx->ngSpice_Command("unset askquit");
-        ctx->ngSpice_Command("quit");
-    } else if (!safe_to_quit && !ctx->exited) {
-        Tcl_MutexLock(&ctx->exit_mu);
-        ctx->exited = 1;
-        Tcl_ConditionNotify(&ctx->exit_cv);
-        Tcl_MutexUnlock(&ctx->exit_mu);
-        ctx->skip_dlclose = 1;
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_GetChannelName(ctx->notify_rchan), -1));
+    return TCL_OK;
+}
+
+//***  AbortSubCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * AbortSubCmd --
+ *
+ *      Implements the "abort" subcommand of instances and attached commands: unblocks waiters early.
+ *
+ *          abort ?-token T?
+ *
+ *      Without -token every wait in progress returns "aborted" (ctx->abort_epoch is bumped, waits started later are
+ *      not affected); with -token only the waiters registered with that token are aborted.
+ *
+ * Parameters:
+ *      NgSpiceContext *ctx          - input/output: instance context
+ *      Tcl_Interp *interp           - input: interpreter for results and errors
+ *      Tcl_Size objc                - input: number of arguments (including command and "abort")
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with "aborted", or TCL_ERROR on bad arguments.
+ *
+ * Side Effects:
+ *      Updates ctx->abort_epoch or the matching Waiter records and notifies ctx->cond under ctx->mutex. Does not stop
+ *      ngspice.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int AbortSubCmd(NgSpiceContext *ctx, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    const char *token = NULL;
+    if (objc == 4) {
+        const char *opt = Tcl_GetString(objv[2]);
+        if (strcmp(opt, "-token") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -token)", opt));
+            return TCL_ERROR;
+        }
+        token = Tcl_GetString(objv[3]);
+    } else if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-token T?");
+        return TCL_ERROR;
     } else {
         /* No action required: all valid cases handled above (MISRA 15.7) */
     }
-    /* Step 4: sync with ControlledExitCallback OR our fake exit */
-    Tcl_MutexLock(&ctx->exit_mu);
-    while (!ctx->exited) {
-        Tcl_ConditionWait(&ctx->exit_cv, &ctx->exit_mu, NULL);
+    Lock_Enter(ctx, LOCK_MUTEX);
+    if (token == NULL) {
+        ctx->abort_epoch++;
+    } else {
+        for (Waiter *w = ctx->waiters; w != NULL; w = w->next) {
+            if ((w->token != NULL) && (strcmp(w->token, token) == 0)) {
+                w->aborted = 1;
+            }
+        }
     }
-    Tcl_MutexUnlock(&ctx->exit_mu);
-    Tcl_DeleteEvents(DeleteNgSpiceEventProc, ctx);
-    Tcl_MutexLock(&ctx->mutex);
     Tcl_ConditionNotify(&ctx->cond);
-    Tcl_MutexUnlock(&ctx->mutex);
-    if (g_heap_poisoned == 1) {
-        ctx->destroying = 1;
-        Tcl_MutexLock(&ctx->mutex);
-        Tcl_ConditionNotify(&ctx->cond);
-        Tcl_MutexUnlock(&ctx->mutex);
-        return;
-    }
-    Tcl_EventuallyFree((ClientData)ctx, InstFreeProc);
+    Lock_Leave(ctx, LOCK_MUTEX);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("aborted", -1));
+    return TCL_OK;
 }
+
 //** command registering function
 //***  InstObjCmd function
 /*
@@ -2015,23 +13431,92 @@ static void InstDeleteProc(void *cdata) {
  *        starting or stopping.
  *      - While ctx->state is NGSTATE_STARTING_BG or NGSTATE_STOPPING_BG, commands are queued (EnqueuePending) instead
  *        of executed immediately.
+ *      - Refused while a callback replay is in progress ("replay start").
  *
  *   circuit list
  *      - Sends a full circuit deck to ngSpice_Circ(), building a transient NULL-terminated char** from the Tcl list.
  *      - Result: int rc from ngSpice_Circ().
  *
- *   waitevent name ?-n N? ?timeout_ms?
+ *   waitevent name ?-n N? ?-token T? ?timeout_ms?
  *      - Blocks until the given event fires N more times (default N=1), or until timeout_ms expires (default: no
  *        timeout).
  *      - Valid event names:
- *          send_char, send_stat, controlled_exit, send_data, send_init_data, bg_running.
+ *          send_char, send_stat, controlled_exit, send_data, send_init_data, bg_running, trigger, memory.
  *      - Returns a dict:
  *          fired   <bool>           (1 if condition met)
  *          count   <int64>          (cumulative count for that event)
  *          need    <int64>          (requested N)
  *          status  ok|timeout|aborted
- *        where "aborted" means ctx->aborting or ctx->destroying tripped while waiting.
- *      - Internally uses wait_for() on ctx->evt_counts[].
+ *        where "aborted" means "abort" was called during the wait (for all waiters or for token T) or
+ *        ctx->destroying tripped.
+ *      - Internally uses wait_for() on ctx->evt_counts[]; a finite timeout is a deadline for Tcl_ConditionWait(), so
+ *        the call returns as soon as the event fires. Several threads may wait at once (see "attach").
+ *
+ *   waitany events ?-token T? ?timeout_ms?
+ *      - Like waitevent, but returns when the first of several events fires; each element of events is a name or a
+ *        pair {name N}.
+ *      - Returns a dict:
+ *          status  ok|timeout|aborted
+ *          fired   <list>           (names of the events whose target was reached)
+ *          counts  <dict>           (cumulative count of every listed event)
+ *      - Internally uses wait_any() on ctx->evt_counts[].
+ *
+ *   trigger add name expression -above L|-below L|-settle {target tol hold} ?-halt? | remove name | list
+ *      - Manages data-condition triggers evaluated per row in SendDataCallback; a firing trigger records the crossing
+ *        time, bumps the "trigger" event and with -halt stops the background run (see TriggerSubCmd).
+ *
+ *   capture create|get|clear|delete|names ?args?
+ *      - Manages pre/post-trigger capture windows fed in SendDataCallback: every time the condition fires, the rows
+ *        around the trigger row are kept as a segment, and the "trigger" event is bumped (see CaptureSubCmd).
+ *
+ *   configure ?-option? ?value ...?
+ *      - Queries or sets instance options; -storedata 0 stops storing rows in the vectors dict, -progressinterval
+ *        throttles progress status lines, -convbudget/-convrows bound one row conversion slice, -membudget and
+ *        -mempolicy limit the memory of the instance (see ConfigureSubCmd).
+ *
+ *   stats ?-reset?
+ *      - Returns rows and cells ingested, estimated bytes held per buffer, the Tcl event backlog, time spent in each
+ *        callback, wait/hold times of the instance mutexes and conversion time (see StatsSubCmd).
+ *
+ *   latency ?-reset?
+ *      - Returns p50/p99/max of the callback-to-dispatch and callback-to-waiter latencies per event, from
+ *        log-bucketed histograms (see LatencySubCmd).
+ *
+ *   runinfo ?-all|-rusage?
+ *      - Returns the timing of the latest bg_run (time to thread start, first init and first data, wall time, rows,
+ *        rows per second, halt and drain latency), of the kept runs with -all, or with ngspice "rusage all" figures
+ *        (see RunInfoSubCmd).
+ *
+ *   trace start ?-capacity N? ?-file path? | stop | clear | dump file | status
+ *      - Controls the opt-in trace ring of callbacks, state changes, lock waits, event and script processing;
+ *        "dump" writes Chrome trace-event JSON (see TraceSubCmd).
+ *
+ *   record start file | stop | status
+ *      - Writes every ngspice callback with its time and payload to a compact binary file (see RecordSubCmd).
+ *
+ *   replay start file ?-speed factor? | wait | stop | status
+ *      - Feeds a recording back through the callbacks from a replay thread at the recorded or a scaled pace, without
+ *        ngspice (see ReplaySubCmd).
+ *
+ *   memory ?-reset?
+ *      - Returns the bytes held by the instance per category (rows, vectors, messages, analysis, trace, record) and
+ *        the state of the "-membudget" budget: policy, peak, times exceeded and rows dropped (see MemorySubCmd).
+ *
+ *   reset
+ *      - Returns the instance to the state of a new one without reloading libngspice: stops the background run,
+ *        removes all circuits and plots, clears vectors, messages and the analysis state and starts a new
+ *        generation; returns {circuits N plots N time_us T} (see ResetSubCmd).
+ *
+ *   progress
+ *      - Returns the latest "analysis: N%" report as {analysis percent eta_s elapsed_s} (see ProgressSubCmd).
+ *
+ *   on ?event? ?script?
+ *      - Registers a command prefix called from the event loop after the event is processed; bursts of callbacks are
+ *        coalesced into one call with "event count {first last}" appended (see Subs_IdleProc).
+ *
+ *   notifier ?-close?
+ *      - Returns a non-blocking channel that becomes readable when callbacks queued events, for "fileevent" or
+ *        select/epoll-based hosts; -close closes it (see NotifierSubCmd).
  *
  *   vectors ?-clear?
  *      - Without -clear: returns ctx->vectorData (dict: vecName -> list-of-samples).
@@ -2068,23 +13553,54 @@ static void InstDeleteProc(void *cdata) {
  *            vecName -> {number <int> real <bool>}
  *      - With -clear: replaces ctx->vectorInit with a new empty dict.
  *
- *   messages ?-clear?
- *      - Without -clear: returns Tcl list of all queued ngspice output/status lines
- *        (from SendCharCallback, SendStatCallback, BGThreadRunningCallback, ControlledExitCallback, etc.).
+ *   messages ?-clear|-stats?
+ *      - Without options: returns Tcl list of the ngspice output/status lines held in the ring ctx->msgq
+ *        (from SendCharCallback, SendStatCallback, BGThreadRunningCallback, ControlledExitCallback, etc.), at most
+ *        "configure -msgcapacity" lines, oldest first.
  *      - With -clear: clears ctx->msgq and returns nothing.
+ *      - With -stats: returns dict {sink capacity count received dropped written failed} (see Msg_Put).
+ *
+ *   msgstats ?-reset?
+ *      - Returns per-category line counters (stdout, stderr, status, error, warning, convergence) for the instance
+ *        and the current run, and the first line of each category in the run (see MsgStatsSubCmd).
  *
  *   eventcounts ?-clear?
  *      - Without -clear: returns dict of cumulative callback counters:
- *            send_char, send_stat, controlled_exit, send_data, send_init_data, bg_running.
- *      - With -clear: zeros ctx->evt_counts[].
+ *            send_char, send_stat, controlled_exit, send_data, send_init_data, bg_running, trigger, memory.
+ *      - With -clear: copies ctx->evt_counts[] to ctx->evt_base[], so the reported counts restart from zero while
+ *        the raw counters, and thus the targets of blocked waiters, are untouched.
+ *
+ *   histogram create|get|reset|delete|names ?args?
+ *      - Manages streaming accumulators folded in SendDataCallback (see HistogramSubCmd): 1D value histograms and
+ *        eye diagrams (scale folded modulo a period x value). Grids are zeroed at the start of every run.
+ *      - "get" returns a dict; with -binary the counts are a byte array of native 64-bit unsigned integers.
+ *
+ *   expr ?-async? ?-store name? expression
+ *      - Compiles an expression over vectors (arithmetic, ^, abs, mag, ph, real, imag, sqrt, log, ln, exp, db, min,
+ *        max; v(node), i(device), {name}) and evaluates it element-wise in C (see ExprSubCmd).
+ *      - Operands come from the stored vectors, or from ngspice with -async; -store saves the result as a vector.
+ *
+ *   derived add name expression ?-drop? | remove name | list
+ *      - Registers vectors computed from an "expr" expression on every row in SendDataCallback and stored like native
+ *        vectors (see DerivedSubCmd). With -drop the raw inputs are not stored.
+ *
+ *   compare vector -binary bytes|-snapshot dict|-file path ?-abstol A? ?-reltol R? ?-shift T? ?-scale name? ?-async?
+ *      - Compares a vector against a golden reference with interpolation on the scale, absolute/relative tolerance
+ *        envelopes and an optional shift tolerance, in a single merged pass (see CompareSubCmd and Cmp_Run).
+ *
+ *   downsample vector -points N ?-method lttb|minmax? ?-range {x0 x1}? ?-scale name? ?-async?
+ *      - Returns a plot-ready list of {x y} pairs reduced with LTTB or min/max per bucket (see DownsampleSubCmd).
+ *
+ *   pyramid build vector ?-scale name? ?-async? | drop vector | names
+ *      - Manages min/max pyramids that let "downsample -method minmax" answer any window in O(pixels * log n).
  *
  *   destroy
  *      - Deletes this Tcl command, which triggers InstDeleteProc(): stops bg thread, asks ngspice to quit, waits for
  *          shutdown, purges events, and schedules InstFreeProc().
  *
- *   abort
- *      - Forces any current waitevent to unblock early:
- *          sets ctx->aborting=1 and signals ctx->cond.
+ *   abort ?-token T?
+ *      - Forces current waitevent/waitany calls to unblock early, all of them or those registered with token T:
+ *          bumps ctx->abort_epoch (or marks the matching Waiter records) and signals ctx->cond (see AbortSubCmd).
  *      - Does NOT destroy the instance or stop ngspice.
  *
  * Notes / Side Effects:
@@ -2092,12 +13608,17 @@ static void InstDeleteProc(void *cdata) {
  *      - We call directly into libngspice (ctx->ngSpice_*).
  *      - We manage Tcl refcounts on ctx->vectorData / ctx->vectorInit.
  *      - "waitevent" may block while waiting for ngspice callbacks.
+ *      - Every call is added to the trace ring as a "command" span named by the subcommand (by the ngspice command
+ *        text for "command").
+ *      - Every call first waits for a pending trigger halt thread (Trig_JoinHalt), so a halt requested by a -halt
+ *        trigger is complete before any subcommand can call into ngspice.
  *
  *----------------------------------------------------------------------------------------------------------------------
  */
 static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
     int code = TCL_OK;
     NgSpiceContext *ctx = (NgSpiceContext *)cdata;
+    Tcl_WideInt t0 = Stats_Now();
     Tcl_Preserve((ClientData)ctx);
     if (objc < 2) {
         Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?args?");
@@ -2105,6 +13626,8 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
         goto done;
     }
     const char *sub = Tcl_GetString(objv[1]);
+    /* a -halt trigger may be sending bg_halt from its helper thread; ngspice must not be entered meanwhile */
+    Trig_JoinHalt(ctx);
     if (strcmp(sub, "command") == 0) {
         int do_capture = 0;
         int argi = 2;
@@ -2126,14 +13649,19 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
             /* No action required: all valid cases handled above (MISRA 15.7) */
         }
         const char *cmd = Tcl_GetString(objv[argi]);
-        Tcl_MutexLock(&ctx->bg_mu);
+        Lock_Enter(ctx, LOCK_BG_MU);
         NgState st = ctx->state;
-        Tcl_MutexUnlock(&ctx->bg_mu);
+        Lock_Leave(ctx, LOCK_BG_MU);
         if ((st == NGSTATE_DEAD) || (ctx->destroying)) {
             Tcl_SetObjResult(interp, Tcl_NewStringObj("instance is shutting down", -1));
             code = TCL_ERROR;
             goto done;
         }
+        if (Replay_Running(ctx) == 1) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("callback replay in progress, command %s is refused", cmd));
+            code = TCL_ERROR;
+            goto done;
+        }
         if (st == NGSTATE_STARTING_BG) {
             EnqueuePending(ctx, cmd, do_capture);
             Tcl_SetObjResult(interp, Tcl_ObjPrintf("background thread is starting, command %s is deffered", cmd));
@@ -2147,42 +13675,15 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
             goto done;
         }
         if (strcmp(cmd, "bg_run") == 0) {
-            Tcl_MutexLock(&ctx->bg_mu);
-            ctx->state = NGSTATE_STARTING_BG;
-            ctx->bg_started = 0;
-            ctx->bg_ended = 0;
-            Tcl_MutexUnlock(&ctx->bg_mu);
-            Tcl_MutexLock(&ctx->mutex);
-            ctx->gen++;
-            ctx->new_run_pending = 0;
-            if (ctx->init_snap != NULL) {
-                for (int i = 0; i < ctx->init_snap->veccount; i++) {
-                    Tcl_Free(ctx->init_snap->vecs[i].name);
-                }
-                Tcl_Free(ctx->init_snap->vecs);
-                Tcl_Free(ctx->init_snap);
-                ctx->init_snap = NULL;
-            }
-            DataBuf_Free(&ctx->prod);
-            DataBuf_Init(&ctx->prod);
-            if (ctx->vectorData != NULL) {
-                Tcl_DecrRefCount(ctx->vectorData);
-            }
-            ctx->vectorData = Tcl_NewDictObj();
-            Tcl_IncrRefCount(ctx->vectorData);
-            if (ctx->vectorInit != NULL) {
-                Tcl_DecrRefCount(ctx->vectorInit);
-            }
-            ctx->vectorInit = Tcl_NewDictObj();
-            Tcl_IncrRefCount(ctx->vectorInit);
-            Tcl_MutexUnlock(&ctx->mutex);
+            Run_Reset(ctx);
         }
         if (strcmp(cmd, "bg_halt") == 0) {
-            Tcl_MutexLock(&ctx->bg_mu);
+            Lock_Enter(ctx, LOCK_BG_MU);
             if (ctx->state == NGSTATE_BG_ACTIVE) {
-                ctx->state = NGSTATE_STOPPING_BG;
+                State_Set(ctx, NGSTATE_STOPPING_BG);
             }
-            Tcl_MutexUnlock(&ctx->bg_mu);
+            Lock_Leave(ctx, LOCK_BG_MU);
+            Run_Halted(ctx);
         }
         if (!do_capture) {
             /* cppcheck-suppress misra-c2012-11.8 - Ngspice certainly does not modify passed string*/
@@ -2191,19 +13692,8 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
             code = TCL_OK;
             goto done;
         } else {
-            Tcl_MutexLock(&ctx->mutex);
-            MsgQ_Clear(&ctx->capq);
-            ctx->cap_active = 1;
-            Tcl_MutexUnlock(&ctx->mutex);
-            int rc = ctx->ngSpice_Command((char *)cmd);
-            Tcl_Obj *outList = Tcl_NewListObj(0, NULL);
-            Tcl_MutexLock(&ctx->mutex);
-            ctx->cap_active = 0;
-            for (size_t i = 0; i < ctx->capq.count; i++) {
-                Tcl_ListObjAppendElement(interp, outList, Tcl_NewStringObj(ctx->capq.items[i], -1));
-            }
-            MsgQ_Clear(&ctx->capq);
-            Tcl_MutexUnlock(&ctx->mutex);
+            int rc = 0;
+            Tcl_Obj *outList = CaptureOutput(ctx, interp, cmd, &rc);
             Tcl_Obj *res = Tcl_NewDictObj();
             Tcl_DictObjPut(interp, res, Tcl_NewStringObj("rc", -1), Tcl_NewIntObj(rc));
             Tcl_DictObjPut(interp, res, Tcl_NewStringObj("output", -1), outList);
@@ -2279,56 +13769,71 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
         }
     }
     if (strcmp(sub, "waitevent") == 0) {
-        int which;
-        uint64_t need = 1;
-        long timeout_ms = 0;
-        int i = 2;
-        if (objc <= i) {
-            Tcl_WrongNumArgs(interp, 2, objv, "name ?-n N? ?timeout_ms?");
-            code = TCL_ERROR;
-            goto done;
-        }
-        if (NameToEvtId(objv[i++], &which) != TCL_OK) {
-            Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown event: %s", Tcl_GetString(objv[i - 1])));
-            code = TCL_ERROR;
-            goto done;
-        }
-        if ((i < objc) && (strcmp(Tcl_GetString(objv[i]), "-n") == 0)) {
-            if (((i + 1) >= objc) || (Tcl_GetWideIntFromObj(interp, objv[i + 1], (Tcl_WideInt *)&need) != TCL_OK) ||
-                (need < (uint64_t)1)) {
-                Tcl_SetObjResult(interp, Tcl_NewStringObj("expected positive integer after -n", -1));
-                code = TCL_ERROR;
-                goto done;
-            }
-            i += 2;
-        }
-        if (i < objc) {
-            if (Tcl_GetLongFromObj(interp, objv[i], &timeout_ms) != TCL_OK) {
-                code = TCL_ERROR;
-                goto done;
-            }
-            i++;
-        }
-        if (i != objc) {
-            Tcl_WrongNumArgs(interp, 2, objv, "name ?-n N? ?timeout_ms?");
-            code = TCL_ERROR;
-            goto done;
-        }
-        int reached;
-        uint64_t count;
-        ctx->aborting = 0;
-        wait_rc rc = wait_for(ctx, which, need, timeout_ms, &reached, &count);
-        Tcl_Obj *res = Tcl_NewDictObj();
-        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("fired", -1), Tcl_NewBooleanObj(reached));
-        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("count", -1), Tcl_NewWideIntObj((Tcl_WideInt)count));
-        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("need", -1), Tcl_NewWideIntObj((Tcl_WideInt)need));
-        Tcl_DictObjPut(interp, res, Tcl_NewStringObj("status", -1),
-                       Tcl_NewStringObj((rc == NGSPICE_WAIT_OK)        ? "ok"
-                                        : (rc == NGSPICE_WAIT_TIMEOUT) ? "timeout"
-                                                                       : "aborted",
-                                        -1));
-        Tcl_SetObjResult(interp, res);
-        code = TCL_OK;
+        code = WaitEventSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "trigger") == 0) {
+        code = TriggerSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "capture") == 0) {
+        code = CaptureSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "configure") == 0) {
+        code = ConfigureSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "progress") == 0) {
+        code = ProgressSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "msgstats") == 0) {
+        code = MsgStatsSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "stats") == 0) {
+        code = StatsSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "latency") == 0) {
+        code = LatencySubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "runinfo") == 0) {
+        code = RunInfoSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "trace") == 0) {
+        code = TraceSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "record") == 0) {
+        code = RecordSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "replay") == 0) {
+        code = ReplaySubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "memory") == 0) {
+        code = MemorySubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "reset") == 0) {
+        code = ResetSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "notifier") == 0) {
+        code = NotifierSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "on") == 0) {
+        code = OnSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "waitany") == 0) {
+        code = WaitAnySubCmd(ctx, interp, objc, objv);
         goto done;
     }
     if (strcmp(sub, "vectors") == 0) {
@@ -2354,17 +13859,22 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
             code = TCL_ERROR;
             goto done;
         }
-        Tcl_MutexLock(&ctx->mutex);
+        if (do_clear == 0) {
+            Conv_Finish(ctx, interp);
+        }
+        Lock_Enter(ctx, LOCK_MUTEX);
         if (do_clear == 1) {
             Tcl_DecrRefCount(ctx->vectorData);
             ctx->vectorData = Tcl_NewDictObj();
             Tcl_IncrRefCount(ctx->vectorData);
-            Tcl_MutexUnlock(&ctx->mutex);
+            Lock_Leave(ctx, LOCK_MUTEX);
+            Conv_Discard(ctx);
+            Subs_ResetRows(ctx);
             code = TCL_OK;
             goto done;
         } else {
             Tcl_SetObjResult(interp, ctx->vectorData);
-            Tcl_MutexUnlock(&ctx->mutex);
+            Lock_Leave(ctx, LOCK_MUTEX);
             code = TCL_OK;
             goto done;
         }
@@ -2599,17 +14109,17 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
             code = TCL_ERROR;
             goto done;
         }
-        Tcl_MutexLock(&ctx->mutex);
+        Lock_Enter(ctx, LOCK_MUTEX);
         if (do_clear == 1) {
             Tcl_DecrRefCount(ctx->vectorInit);
             ctx->vectorInit = Tcl_NewDictObj();
             Tcl_IncrRefCount(ctx->vectorInit);
-            Tcl_MutexUnlock(&ctx->mutex);
+            Lock_Leave(ctx, LOCK_MUTEX);
             code = TCL_OK;
             goto done;
         } else {
             Tcl_SetObjResult(interp, ctx->vectorInit);
-            Tcl_MutexUnlock(&ctx->mutex);
+            Lock_Leave(ctx, LOCK_MUTEX);
             code = TCL_OK;
             goto done;
         }
@@ -2620,31 +14130,52 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
             const char *opt = Tcl_GetString(objv[2]);
             if (strcmp(opt, "-clear") == 0) {
                 do_clear = 1;
+            } else if (strcmp(opt, "-stats") == 0) {
+                Tcl_Obj *d = Tcl_NewDictObj();
+                Lock_Enter(ctx, LOCK_MUTEX);
+                Tcl_DictObjPut(interp, d, Tcl_NewStringObj("sink", -1),
+                               Tcl_NewStringObj(msgSinkNames[ctx->msg_sink], -1));
+                Tcl_DictObjPut(interp, d, Tcl_NewStringObj("capacity", -1),
+                               Tcl_NewWideIntObj((Tcl_WideInt)ctx->msgq.limit));
+                Tcl_DictObjPut(interp, d, Tcl_NewStringObj("count", -1),
+                               Tcl_NewWideIntObj((Tcl_WideInt)ctx->msgq.count));
+                Tcl_DictObjPut(interp, d, Tcl_NewStringObj("received", -1),
+                               Tcl_NewWideIntObj((Tcl_WideInt)ctx->msg_received));
+                Tcl_DictObjPut(interp, d, Tcl_NewStringObj("dropped", -1),
+                               Tcl_NewWideIntObj((Tcl_WideInt)ctx->msgq.dropped));
+                Tcl_DictObjPut(interp, d, Tcl_NewStringObj("written", -1),
+                               Tcl_NewWideIntObj((Tcl_WideInt)ctx->msg_written));
+                Tcl_DictObjPut(interp, d, Tcl_NewStringObj("failed", -1),
+                               Tcl_NewWideIntObj((Tcl_WideInt)ctx->msg_failed));
+                Lock_Leave(ctx, LOCK_MUTEX);
+                Tcl_SetObjResult(interp, d);
+                code = TCL_OK;
+                goto done;
             } else {
-                Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -clear)", opt));
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown option: %s (expected -clear or -stats)", opt));
                 code = TCL_ERROR;
                 goto done;
             }
         } else if (objc != 2) {
-            Tcl_WrongNumArgs(interp, 2, objv, "?-clear?");
+            Tcl_WrongNumArgs(interp, 2, objv, "?-clear|-stats?");
             code = TCL_ERROR;
             goto done;
         } else {
             /* No action required: all valid cases handled above (MISRA 15.7) */
         }
         if (do_clear == 1) {
-            Tcl_MutexLock(&ctx->mutex);
+            Lock_Enter(ctx, LOCK_MUTEX);
             MsgQ_Clear(&ctx->msgq);
-            Tcl_MutexUnlock(&ctx->mutex);
+            Lock_Leave(ctx, LOCK_MUTEX);
             code = TCL_OK;
             goto done;
         } else {
             Tcl_Obj *list = Tcl_NewListObj(0, NULL);
-            Tcl_MutexLock(&ctx->mutex);
+            Lock_Enter(ctx, LOCK_MUTEX);
             for (size_t i = 0; i < ctx->msgq.count; i++) {
-                Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(ctx->msgq.items[i], -1));
+                Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(MsgQ_At(&ctx->msgq, i), -1));
             }
-            Tcl_MutexUnlock(&ctx->mutex);
+            Lock_Leave(ctx, LOCK_MUTEX);
             Tcl_SetObjResult(interp, list);
             code = TCL_OK;
             goto done;
@@ -2668,16 +14199,18 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
         } else {
             /* No action required: all valid cases handled above (MISRA 15.7) */
         }
-        Tcl_MutexLock(&ctx->mutex);
+        Lock_Enter(ctx, LOCK_MUTEX);
         if (do_clear == 1) {
-            memset(ctx->evt_counts, 0, sizeof(ctx->evt_counts));
-            Tcl_MutexUnlock(&ctx->mutex);
+            memcpy(ctx->evt_base, ctx->evt_counts, sizeof(ctx->evt_base));
+            Lock_Leave(ctx, LOCK_MUTEX);
             code = TCL_OK;
             goto done;
         }
         uint64_t c[NUM_EVTS];
-        memcpy(c, ctx->evt_counts, sizeof(c));
-        Tcl_MutexUnlock(&ctx->mutex);
+        for (int e = 0; e < NUM_EVTS; e++) {
+            c[e] = ctx->evt_counts[e] - ctx->evt_base[e];
+        }
+        Lock_Leave(ctx, LOCK_MUTEX);
         Tcl_Obj *d = Tcl_NewDictObj();
         Tcl_DictObjPut(interp, d, Tcl_NewStringObj("send_char", -1), Tcl_NewWideIntObj((Tcl_WideInt)c[SEND_CHAR]));
         Tcl_DictObjPut(interp, d, Tcl_NewStringObj("send_stat", -1), Tcl_NewWideIntObj((Tcl_WideInt)c[SEND_STAT]));
@@ -2688,10 +14221,36 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
                        Tcl_NewWideIntObj((Tcl_WideInt)c[SEND_INIT_DATA]));
         Tcl_DictObjPut(interp, d, Tcl_NewStringObj("bg_running", -1),
                        Tcl_NewWideIntObj((Tcl_WideInt)c[BG_THREAD_RUNNING]));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("trigger", -1), Tcl_NewWideIntObj((Tcl_WideInt)c[TRIGGER_FIRED]));
+        Tcl_DictObjPut(interp, d, Tcl_NewStringObj("memory", -1), Tcl_NewWideIntObj((Tcl_WideInt)c[MEMORY_BUDGET]));
         Tcl_SetObjResult(interp, d);
         code = TCL_OK;
         goto done;
     }
+    if (strcmp(sub, "histogram") == 0) {
+        code = HistogramSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "expr") == 0) {
+        code = ExprSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "derived") == 0) {
+        code = DerivedSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "compare") == 0) {
+        code = CompareSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "downsample") == 0) {
+        code = DownsampleSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
+    if (strcmp(sub, "pyramid") == 0) {
+        code = PyramidSubCmd(ctx, interp, objc, objv);
+        goto done;
+    }
     if (strcmp(sub, "destroy") == 0) {
         Tcl_Command token = Tcl_GetCommandFromObj(interp, objv[0]);
         Tcl_DeleteCommandFromToken(interp, token);
@@ -2699,18 +14258,17 @@ static int InstObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
         goto done;
     }
     if (strcmp(sub, "abort") == 0) {
-        ctx->aborting = 1;
-        Tcl_MutexLock(&ctx->mutex);
-        Tcl_ConditionNotify(&ctx->cond);
-        Tcl_MutexUnlock(&ctx->mutex);
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("aborted", -1));
-        code = TCL_OK;
+        code = AbortSubCmd(ctx, interp, objc, objv);
         goto done;
     }
     Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown subcommand: %s", sub));
     code = TCL_ERROR;
     goto done;
 done:
+    if ((objc >= 2) && (Flag_Load(&ctx->trace.enabled) == 1)) {
+        Tcl_Size last = (strcmp(Tcl_GetString(objv[1]), "command") == 0) ? (objc - 1) : 1;
+        Trace_Span(ctx, "command", Tcl_GetString(objv[last]), t0, code);
+    }
     Tcl_Release((ClientData)ctx);
     return code;
 }
@@ -2861,10 +14419,14 @@ static int NgSpiceNewCmd(ClientData cd, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
     NgSpiceContext *ctx = Tcl_Alloc(sizeof *ctx);
     memset(ctx, 0, sizeof *ctx);
     ctx->exited = 0;
-    MsgQ_Init(&ctx->capq);
-    MsgQ_Init(&ctx->msgq);
+    MsgQ_Init(&ctx->capq, 0);
+    MsgQ_Init(&ctx->msgq, NGSPICE_MSG_CAPACITY);
     DataBuf_Init(&ctx->prod);
     DataBuf_Init(&ctx->pend);
+    ctx->scale_idx = -1;
+    ctx->store_data = 1;
+    ctx->progress.interval_ms = 100;
+    ctx->conv_budget_ms = 20;
     ctx->interp = interp;
     ctx->tclid = Tcl_GetCurrentThread();
     memset(ctx->evt_counts, 0, sizeof(ctx->evt_counts));
@@ -2876,9 +14438,18 @@ static int NgSpiceNewCmd(ClientData cd, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
     if (NgResolveAll(interp, ctx) != TCL_OK) {
         return TCL_ERROR;
     }
+    /* Tcl creates a mutex on its first lock and tests for it without synchronization; create them all here, before
+       any callback thread exists, so a first lock in a callback never races with the creation in this thread */
+    Tcl_Mutex *mutexes[] = {&ctx->mutex,    &ctx->bg_mu,    &ctx->exit_mu, &ctx->cmd_mu,
+                            &ctx->stats_mu, &ctx->trace_mu, &ctx->rec_mu,  &ctx->replay_mu};
+    for (size_t i = 0; i < (sizeof mutexes / sizeof mutexes[0]); i++) {
+        Tcl_MutexLock(mutexes[i]);
+        Tcl_MutexUnlock(mutexes[i]);
+    }
     static unsigned long seq = 0;
     Tcl_Obj *name = Tcl_ObjPrintf("::ngspicetclbridge::s%lu", ++seq);
     Tcl_CreateObjCommand2(interp, Tcl_GetString(name), InstObjCmd, ctx, InstDeleteProc);
+    Reg_Add(Tcl_GetString(name), ctx);
     ctx->ngSpice_Init(SendCharCallback, SendStatCallback, ControlledExitCallback, SendDataCallback,
                       SendInitDataCallback, BGThreadRunningCallback, ctx);
     if (!ctx->vectorData) {
@@ -2903,6 +14474,145 @@ static int NgSpiceNewCmd(ClientData cd, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
     return TCL_OK;
 }
 
+//***  AttachedObjCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * AttachedObjCmd --
+ *
+ *      Object command procedure of a command created by "ngspicetclbridge::attach" in any thread. It gives that
+ *      thread the thread-safe subset of an instance:
+ *
+ *          waitevent name ?-n N? ?-token T? ?timeout_ms?
+ *          waitany events ?-token T? ?timeout_ms?
+ *          abort ?-token T?
+ *          detach
+ *
+ *      The instance is looked up in the registry on every call and pinned for its duration (Reg_Acquire), so
+ *      destroying the instance in its own thread makes blocked waits return "aborted" and later calls fail.
+ *
+ * Parameters:
+ *      ClientData cdata             - input: fully-qualified name of the instance (char *)
+ *      Tcl_Interp *interp           - input: interpreter of the calling thread
+ *      Tcl_Size objc                - input: number of arguments
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR, as the corresponding instance subcommand.
+ *
+ * Side Effects:
+ *      May block the calling thread; "detach" deletes the command.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int AttachedObjCmd(ClientData cdata, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    const char *name = (const char *)cdata;
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?args?");
+        return TCL_ERROR;
+    }
+    const char *sub = Tcl_GetString(objv[1]);
+    if (strcmp(sub, "detach") == 0) {
+        Tcl_DeleteCommandFromToken(interp, Tcl_GetCommandFromObj(interp, objv[0]));
+        return TCL_OK;
+    }
+    if ((strcmp(sub, "waitevent") != 0) && (strcmp(sub, "waitany") != 0) && (strcmp(sub, "abort") != 0)) {
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("unknown subcommand: %s (expected waitevent, waitany, abort or detach)", sub));
+        return TCL_ERROR;
+    }
+    NgSpiceContext *ctx = Reg_Acquire(name);
+    if (ctx == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("instance \"%s\" does not exist", name));
+        return TCL_ERROR;
+    }
+    int code;
+    if (sub[0] == 'a') {
+        code = AbortSubCmd(ctx, interp, objc, objv);
+    } else if (sub[4] == 'a') {
+        code = WaitAnySubCmd(ctx, interp, objc, objv);
+    } else {
+        code = WaitEventSubCmd(ctx, interp, objc, objv);
+    }
+    Reg_Release(ctx);
+    return code;
+}
+//***  AttachedDeleteProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * AttachedDeleteProc --
+ *
+ *      Deletion procedure of an attached command.
+ *
+ * Parameters:
+ *      ClientData cdata             - input: instance name owned by the command (char *)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Frees the instance name.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void AttachedDeleteProc(ClientData cdata) {
+    Tcl_Free((char *)cdata);
+}
+//***  NgSpiceAttachCmd function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * NgSpiceAttachCmd --
+ *
+ *      Implements "ngspicetclbridge::attach instance ?command?": creates, in the calling interpreter (usually in
+ *      another thread), a command bound to an existing instance that supports waitevent, waitany and abort (see
+ *      AttachedObjCmd), so several threads can block on one simulator.
+ *
+ * Parameters:
+ *      ClientData cd                - input: unused
+ *      Tcl_Interp *interp           - input: interpreter of the calling thread
+ *      Tcl_Size objc                - input: number of arguments
+ *      Tcl_Obj *const objv[]        - input: argument vector
+ *
+ * Results:
+ *      TCL_OK with the name of the new command (by default the instance name), or TCL_ERROR if the instance does
+ *      not exist or the command name is taken.
+ *
+ * Side Effects:
+ *      Creates a Tcl command in interp.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+/* cppcheck-suppress misra-c2012-2.7 -- unused parameters; interface must comply with Tcl expected function signature */
+static int NgSpiceAttachCmd(ClientData cd, Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    if ((objc != 2) && (objc != 3)) {
+        Tcl_WrongNumArgs(interp, 1, objv, "instance ?command?");
+        return TCL_ERROR;
+    }
+    const char *inst = Tcl_GetString(objv[1]);
+    Tcl_Obj *full = (strncmp(inst, "::", 2) == 0) ? Tcl_NewStringObj(inst, -1) : Tcl_ObjPrintf("::%s", inst);
+    Tcl_IncrRefCount(full);
+    NgSpiceContext *ctx = Reg_Acquire(Tcl_GetString(full));
+    if (ctx == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("instance \"%s\" does not exist", inst));
+        Tcl_DecrRefCount(full);
+        return TCL_ERROR;
+    }
+    Reg_Release(ctx);
+    Tcl_Obj *cmd = (objc == 3) ? objv[2] : full;
+    if (Tcl_GetCommandFromObj(interp, cmd) != NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("command \"%s\" already exists", Tcl_GetString(cmd)));
+        Tcl_DecrRefCount(full);
+        return TCL_ERROR;
+    }
+    Tcl_CreateObjCommand2(interp, Tcl_GetString(cmd), AttachedObjCmd, ckstrdup(Tcl_GetString(full)),
+                          AttachedDeleteProc);
+    Tcl_SetObjResult(interp, cmd);
+    Tcl_DecrRefCount(full);
+    return TCL_OK;
+}
+
 //***  Ngspicetclbridge_Init function
 /*
  *----------------------------------------------------------------------------------------------------------------------
@@ -2924,6 +14634,7 @@ static int NgSpiceNewCmd(ClientData cd, Tcl_Interp *interp, Tcl_Size objc, Tcl_O
  *      - Initializes Tcl stubs for compatibility with Tcl versions 8.6 through 10.0.
  *      - Creates the namespace "::ngspicetclbridge" if it does not already exist.
  *      - Registers the "::ngspicetclbridge::new" command to create new ngspice bridge instances.
+ *      - Registers the "::ngspicetclbridge::attach" command to use an instance from other threads.
  *      - Marks the package as provided via Tcl_PkgProvideEx() using PACKAGE_NAME and PACKAGE_VERSION.
  *
  *----------------------------------------------------------------------------------------------------------------------
@@ -2938,6 +14649,7 @@ DLLEXPORT int Ngspicetclbridge_Init(Tcl_Interp *interp) {
         return TCL_ERROR;
     }
     Tcl_CreateObjCommand2(interp, "::ngspicetclbridge::new", NgSpiceNewCmd, NULL, NULL);
+    Tcl_CreateObjCommand2(interp, "::ngspicetclbridge::attach", NgSpiceAttachCmd, NULL, NULL);
     if (Tcl_PkgProvideEx(interp, PACKAGE_NAME, PACKAGE_VERSION, NULL) != TCL_OK) {
         return TCL_ERROR;
     }
@@ -6,6 +6,10 @@
 #include <stdbool.h>
 #include <tclThread.h>
 #include <stdint.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <tcl.h>
 
 #define XSPICE 1
@@ -16,7 +20,17 @@ int ngSpice_LockRealloc(void);
 int ngSpice_UnlockRealloc(void);
 int ngSpice_Reset(void);
 
-enum CallbacksIds { SEND_CHAR, SEND_STAT, CONTROLLED_EXIT, SEND_DATA, SEND_INIT_DATA, BG_THREAD_RUNNING, NUM_EVTS };
+enum CallbacksIds {
+    SEND_CHAR,
+    SEND_STAT,
+    CONTROLLED_EXIT,
+    SEND_DATA,
+    SEND_INIT_DATA,
+    BG_THREAD_RUNNING,
+    TRIGGER_FIRED,
+    MEMORY_BUDGET,
+    NUM_EVTS
+};
 typedef enum { NGSPICE_WAIT_OK, NGSPICE_WAIT_TIMEOUT, NGSPICE_WAIT_ABORTED } wait_rc;
 /* Dvec flags from dvec.h of ngspice source files */
 enum dvec_flags {
@@ -78,6 +92,7 @@ typedef struct {
 typedef struct {
     char *name;
     int is_complex;
+    int shared_name; // 1 if name belongs to ctx->derived_names and is not freed with the row
     double creal;
     double cimag;
 } DataCell;
@@ -91,6 +106,7 @@ typedef struct {
     DataRow *rows;
     size_t count;
     size_t cap;
+    size_t bytes; // bytes held by the rows (cells and name copies), see DataRow_Bytes
 } DataBuf;
 
 //** define struct for symbols initialization
@@ -101,10 +117,378 @@ typedef struct {
 
 //** define message queue
 typedef struct {
-    char **items;
-    size_t count;
-    size_t cap;
+    char **items;     // ring storage of cap slots, oldest message at items[head]
+    size_t head;      // index of the oldest message
+    size_t count;     // number of messages held
+    size_t cap;       // allocated slots, grows up to limit
+    size_t limit;     // maximum number of messages, the oldest is dropped beyond it; 0 for unbounded
+    uint64_t dropped; // messages dropped to respect limit
+    size_t bytes;     // bytes of the held message copies
 } MsgQueue;
+enum MsgSinks { MSG_SINK_RING, MSG_SINK_DISCARD, MSG_SINK_FILE };
+#define NGSPICE_MSG_CAPACITY 10000 // default number of lines kept in the message ring ("-msgcapacity")
+enum MsgCategories {
+    MSG_CAT_STDOUT,
+    MSG_CAT_STDERR,
+    MSG_CAT_STATUS,
+    MSG_CAT_ERROR,
+    MSG_CAT_WARNING,
+    MSG_CAT_CONVERGENCE,
+    MSG_NCAT
+};
+typedef struct {
+    uint64_t total[MSG_NCAT]; // lines per category since instance creation or "msgstats -reset"
+    uint64_t run[MSG_NCAT];   // lines per category since the background thread last started
+    char *first[MSG_NCAT];    // first line of each category in the current run, NULL if none
+    unsigned int keep;        // bit mask of categories passed to the sink ("-msgkeep"), 0 for all
+    char **patterns;          // glob patterns, a line is passed to the sink if it matches one ("-msgpattern")
+    int npatterns;            // number of patterns, 0 for all lines
+    uint64_t filtered;        // lines not passed to the sink because of keep or patterns
+} MsgClass;
+
+//** define histogram accumulators
+typedef enum { HIST_VALUE, HIST_EYE } HistMode;
+
+typedef struct HistAcc {
+    char *name;           // accumulator name (unique per instance)
+    char *vecname;        // name of the folded vector, as given by the user
+    HistMode mode;        // HIST_VALUE (1D) or HIST_EYE (time bin x value bin)
+    int vec_idx;          // index into vecsa of the current run, -1 if unresolved
+    int vbins;            // number of value bins
+    double vlo;           // lower edge of the value range
+    double vhi;           // upper edge of the value range
+    int tbins;            // number of time bins in one period (HIST_EYE only)
+    double period;        // folding period in scale units (HIST_EYE only)
+    double offset;        // scale value that maps to the start of a period (HIST_EYE only)
+    uint64_t *counts;     // tbins*vbins (row-major, time major) or vbins counters
+    uint64_t total;       // samples folded into the grid
+    uint64_t under;       // samples below vlo
+    uint64_t over;        // samples above vhi
+    uint64_t nan;         // rows skipped for a NaN value or a non-finite scale (HIST_EYE only)
+    struct HistAcc *next; // linked list
+} HistAcc;
+
+//** define vector expression engine
+typedef enum {
+    XOP_VEC,  // push operand names[arg]
+    XOP_NUM,  // push constant num
+    XOP_NEG,  // unary minus
+    XOP_ADD,  // binary operators
+    XOP_SUB,
+    XOP_MUL,
+    XOP_DIV,
+    XOP_POW,
+    XOP_FUNC // call function arg (XFunc) with its arity
+} XOpCode;
+
+typedef enum { XF_ABS, XF_MAG, XF_PH, XF_REAL, XF_IMAG, XF_SQRT, XF_LOG, XF_LN, XF_EXP, XF_DB, XF_MIN, XF_MAX } XFunc;
+
+typedef struct {
+    XOpCode op;
+    int arg;    // operand index (XOP_VEC) or function id (XOP_FUNC)
+    double num; // constant (XOP_NUM)
+} XInstr;
+
+typedef struct {
+    XInstr *code;  // postfix program
+    int ncode;     // number of instructions
+    char **names;  // distinct operand vector names, indexed by XOP_VEC arg
+    char **alts;   // per name: the name inside v()/i() ("x#branch" for i(x)), tried when the literal one is missing
+    int nnames;    // number of operand names
+    int maxstack;  // evaluation stack depth required by the program
+} XProg;
+
+typedef struct {
+    size_t n;       // number of elements (1 broadcasts against any length)
+    int is_complex; // 1 if im is valid
+    int owned;      // 1 if re/im were allocated by the engine and may be modified in place
+    double *re;     // real parts
+    double *im;     // imaginary parts (NULL for real columns)
+} XCol;
+
+typedef struct {
+    double re;      // real part
+    double im;      // imaginary part (0 for real values)
+    int is_complex; // 1 if the value is complex
+} XVal;
+
+//** define derived vectors
+typedef struct DerivedVec {
+    char *name;              // name under which the result is stored
+    char *src;               // expression text, as given by the user
+    XProg *prog;             // compiled expression
+    char *cell_name;         // interned copy of name in ctx->derived_names, shared by the stored cells
+    int *in_idx;             // per operand of prog: index into vecsa of the current run, -1 if unresolved
+    XVal *in_vals;           // per operand of prog: value on the current row, reused for every row
+    XVal *stack;             // evaluation stack of XExpr_EvalRow (prog->maxstack + 1 entries)
+    int resolved;            // 1 if every operand was found in the current run
+    int is_real;             // 1 if the result is known to be real for the current run
+    int drop;                // 1 to drop the raw input vectors from the stored rows
+    struct DerivedVec *next; // linked list
+} DerivedVec;
+
+//** define xy series
+typedef struct {
+    double *x; // scale values, non-decreasing
+    double *y; // values (magnitude for complex vectors)
+    size_t n;  // number of points
+} XYSeries;
+
+//** define waveform comparison
+typedef struct {
+    double abstol; // absolute tolerance
+    double reltol; // tolerance relative to the reference value
+    double shift;  // allowed shift along the scale
+} CmpOpts;
+
+typedef struct {
+    size_t points;       // actual samples inside the reference scale range
+    size_t fails;        // samples outside the tolerance envelope
+    double maxdev;       // largest |actual - reference| at the same scale value
+    double maxdev_at;    // scale value of maxdev
+    double maxexcess;    // largest distance outside the tolerance envelope
+    double maxexcess_at; // scale value of maxexcess
+    double firstfail_at; // scale value of the first failing sample, NaN if none
+} CmpResult;
+
+//** define min/max pyramids
+typedef struct Pyramid {
+    char *name;           // vector name, as given by the user
+    XYSeries s;           // private copy of the vector and its scale
+    uint64_t plot;        // ctx->plot_seq when the pyramid was built
+    int nlevels;          // number of aggregated levels; level k (1-based) has blocks of 2^k samples
+    size_t **imin;        // per level k-1: index into s of the minimum of each block
+    size_t **imax;        // per level k-1: index into s of the maximum of each block
+    struct Pyramid *next; // linked list
+} Pyramid;
+
+//** define data triggers
+typedef enum { TRIG_ABOVE, TRIG_BELOW, TRIG_SETTLE } TrigKind;
+typedef struct Trigger {
+    char *name;           // trigger name, unique per instance
+    char *src;            // expression text, as given by the user
+    XProg *prog;          // compiled expression
+    int *in_idx;          // per program operand: vecsa index in the current run, -1 if not present
+    XVal *in_vals;        // per program operand: value on the current row, reused for every row
+    XVal *stack;          // evaluation stack of XExpr_EvalRow (prog->maxstack + 1 entries)
+    int resolved;         // 1 if every operand was found in the current run
+    TrigKind kind;        // condition type
+    double level;         // threshold (-above, -below) or target value (-settle)
+    double tol;           // -settle: allowed deviation from level
+    double hold;          // -settle: scale span the value has to stay within tolerance
+    int halt;             // 1 to halt the background run when the trigger fires
+    int fired;            // 1 once the condition held in the current run
+    double at;            // scale value of the crossing, NaN until fired
+    double value;         // expression value on the row that fired
+    int row;              // row index (vecindex) on which the trigger fired
+    int have_prev;        // 1 if prev_x/prev_y hold the previous row
+    double prev_x;        // scale value of the previous row
+    double prev_y;        // expression value on the previous row
+    double band_since;    // -settle: scale value where the value entered the band, NaN while outside
+    struct Trigger *next; // linked list
+} Trigger;
+
+//** define capture windows
+typedef struct CapSegment {
+    double at;               // scale value at which the condition fired
+    int row;                 // row index (vecindex) of the trigger row
+    int nrows;               // rows stored in data
+    int cap;                 // allocated rows in data
+    double *data;            // nrows x nvec {re, im} pairs, row-major
+    struct CapSegment *next; // segments in capture order
+} CapSegment;
+
+typedef struct Capture {
+    char *name;            // capture name, unique per instance
+    Trigger cond;          // condition; not linked into ctx->trig_head, re-armed after every segment
+    int pre;               // rows kept before the trigger row
+    int post;              // rows recorded after the trigger row
+    int maxseg;            // maximum number of segments per run, 0 for no limit
+    Tcl_Obj *want;         // list of vector names to capture, NULL for all vectors of the run
+    int nvec;              // number of captured vectors in the current run
+    char **names;          // nvec captured vector names
+    int *vec_idx;          // nvec vecsa indices, -1 if not present in the run
+    unsigned char *cplx;   // nvec flags: 1 if the vector delivered complex values
+    double *ring;          // pre x nvec {re, im} pairs, circular pre-trigger buffer
+    int ring_head;         // ring slot written next
+    int ring_fill;         // valid rows in ring
+    CapSegment *cur;       // segment recording post-trigger rows, NULL while armed
+    int post_left;         // post-trigger rows still to record into cur
+    int need_clear;        // 1 until the condition stops holding after a segment (edge triggering)
+    CapSegment *seg_head;  // completed and current segments of the run
+    CapSegment *seg_tail;  // last segment
+    int nseg;              // number of segments in the list
+    struct Capture *next;  // linked list
+} Capture;
+
+//** define event subscriptions
+typedef struct {
+    Tcl_Obj *script[NUM_EVTS]; // command prefix registered with "on", NULL if none
+    uint64_t count[NUM_EVTS];  // callbacks processed since the script was last invoked
+    Tcl_WideInt first_row;     // first stored row not yet reported to the send_data script, -1 if none
+    int scheduled;             // 1 while Subs_IdleProc is queued (holds a Tcl_Preserve on the context)
+} EventSubs;
+
+//** define progress
+#define PROGRESS_NAMELEN 32
+typedef struct {
+    char analysis[PROGRESS_NAMELEN]; // analysis name parsed from "name: N%" status lines, empty if none seen yet
+    double percent;                  // latest percent of that analysis
+    double first;                    // percent of the first status of the analysis
+    Tcl_Time start;                  // time the first status of the analysis was received
+    Tcl_Time last;                   // time the latest status was received
+    Tcl_Time emitted;                // time the last send_stat event was queued for a percent status
+    long interval_ms;                // minimum time between send_stat events for percent statuses, 0 for all
+} Progress;
+
+//** define telemetry
+enum LockIds { LOCK_MUTEX, LOCK_BG_MU, LOCK_CMD_MU, NUM_LOCKS };
+typedef struct {
+    uint64_t count;  // samples
+    uint64_t total;  // sum of the samples, microseconds
+    uint64_t max;    // largest sample, microseconds
+} TimeStat;
+
+typedef struct {
+    TimeStat wait;     // time spent waiting to acquire the lock
+    TimeStat hold;     // time the lock was held (condition waits excluded)
+    Tcl_WideInt since; // acquisition time of the current holder, microseconds
+} LockStat;
+
+#define LAT_BUCKETS 128 // latency histogram buckets, 4 per power of two of microseconds (see Lat_Bucket)
+typedef struct {
+    uint64_t counts[LAT_BUCKETS]; // samples per bucket
+    uint64_t n;                   // samples
+    uint64_t max;                 // largest sample, microseconds
+} LatHist;
+
+typedef struct {
+    LockStat locks[NUM_LOCKS];    // indexed by LockIds, each entry guarded by the lock it describes
+    TimeStat callbacks[NUM_EVTS]; // time spent inside each ngspice callback, guarded by stats_mu
+    uint64_t queued;              // Tcl events queued and not yet processed or deleted, guarded by stats_mu
+    uint64_t queued_max;          // largest value of queued, guarded by stats_mu
+    uint64_t rows;                // rows received by SendDataCallback, guarded by mutex
+    uint64_t cells;               // vector values received by SendDataCallback, guarded by mutex
+    TimeStat conv;                // conversion slices of Conv_Run (Tcl thread only)
+    uint64_t conv_rows;           // rows converted by Conv_Run (Tcl thread only)
+    LatHist dispatch[NUM_EVTS];   // queue-to-dispatch latency per event, send_data until visible (Tcl thread only)
+    Tcl_WideInt data_since;       // queue time of the oldest send_data event not visible yet, 0 if none (Tcl thread)
+    LatHist wake[NUM_EVTS];       // counter bump to waiter wake-up latency per event, guarded by mutex
+    Tcl_WideInt bumped[NUM_EVTS]; // time of the latest counter bump per event, guarded by mutex
+} Telemetry;
+
+//** define run reports
+#define RUNINFO_KEEP 16 // reports of the latest runs kept for "runinfo -all"
+typedef struct {
+    uint64_t run;           // sequence number, 1 for the first bg_run of the instance
+    uint64_t gen;           // ctx->gen right after bg_run
+    Tcl_WideInt issued;     // time bg_run was sent, microseconds (Stats_Now); the other times are 0 until reached
+    Tcl_WideInt started;    // BGThreadRunningCallback reported the background thread started
+    Tcl_WideInt init;       // first SendInitDataCallback of the run
+    Tcl_WideInt first_data; // first SendDataCallback of the run
+    Tcl_WideInt halted;     // bg_halt was sent before the background thread ended
+    Tcl_WideInt ended;      // BGThreadRunningCallback reported the background thread ended
+    Tcl_WideInt drained;    // all rows of the run were visible in "vectors" after the thread ended
+    uint64_t rows;          // rows received by SendDataCallback during the run
+} RunInfo;
+
+//** define trace ring
+#define TRACE_CAPACITY 16384 // default number of records kept by the trace ring ("trace start -capacity")
+#define TRACE_NAMELEN 32     // longest record name kept, longer names are truncated
+typedef struct {
+    Tcl_WideInt ts;           // start time relative to "trace start", microseconds
+    Tcl_WideInt dur;          // duration of a span in microseconds, -1 for an instant
+    Tcl_ThreadId tid;         // thread that added the record
+    const char *cat;          // static category name
+    char name[TRACE_NAMELEN]; // record name
+    Tcl_WideInt arg;          // numeric argument (event id, state, row or command count...)
+} TraceRec;
+
+typedef struct {
+    TraceRec *recs;   // ring storage of cap slots, oldest record at recs[head]; NULL until the first "trace start"
+    size_t cap;       // number of slots
+    size_t head;      // index of the oldest record
+    size_t count;     // number of records held
+    uint64_t dropped; // records overwritten since the ring was last cleared
+    int enabled;      // 1 while recording; set under trace_mu with Flag_Store, tested unlocked with Flag_Load
+    Tcl_WideInt t0;   // time of "trace start", microseconds
+    char *path;       // file written when the instance is deleted ("trace start -file"), NULL if none
+} TraceRing;
+
+//** define callback recording
+#define REC_MAGIC "NGTBREC1" // first 8 bytes of a recording file, followed by REC_BOM as uint32_t
+#define REC_BOM 0x01020304U  // byte-order mark; recordings replay on hosts of the byte order they were made on
+#define REC_NAMES 0x80       // record type of the vector name table used by the following send_data records
+typedef struct {
+    uint8_t type;  // callback id (CallbacksIds) or REC_NAMES
+    uint8_t flag;  // running for bg_running, immediate for exits, 0 otherwise
+    uint16_t aux;  // exit_upon_exit for exits, 0 otherwise
+    uint32_t len;  // payload bytes following the header
+    int64_t ts;    // callback time relative to "record start", microseconds
+} RecHeader;
+
+typedef struct {
+    FILE *file;          // recording file, NULL when not recording
+    char *path;          // file name as given to "record start"
+    int enabled;         // 1 while recording; set under rec_mu with Flag_Store, tested by the callbacks with Flag_Load
+    int failed;          // 1 after a write error, the file is closed at "record stop"
+    Tcl_WideInt t0;      // time of "record start", microseconds
+    uint64_t records;    // records written
+    uint64_t bytes;      // bytes written, headers included
+    char **names;        // vector names of the latest REC_NAMES record
+    int nnames;          // number of entries in names
+    unsigned char *buf;  // payload being built
+    size_t len;          // bytes used in buf
+    size_t cap;          // bytes allocated for buf
+} Recorder;
+
+typedef struct {
+    unsigned char *data; // whole recording read by "replay start", NULL if none
+    size_t size;         // bytes in data
+    char *path;          // file name as given to "replay start"
+    double speed;        // time scale of the pauses between records, 0 for no pauses
+    int active;          // 1 while the replay thread exists and is not joined
+    int done;            // 1 once the replay thread has delivered its last record
+    int abort;           // set by "replay stop" and instance deletion to end the thread early
+    int malformed;       // 1 if a record could not be decoded
+    Tcl_ThreadId tid;    // joinable replay thread
+    uint64_t records;    // records in data
+    uint64_t delivered;  // records passed to the callbacks
+    uint64_t skipped;    // exit records not passed to ControlledExitCallback
+    Tcl_Condition cv;    // wakes a paused replay thread on abort
+} Replay;
+
+typedef struct {
+    const unsigned char *p;   // next byte to decode
+    const unsigned char *end; // end of the payload
+    int bad;                  // set when a field runs past end
+} RecReader;
+
+//** define memory accounting
+enum MemCategories { MEM_ROWS, MEM_VECTORS, MEM_MESSAGES, MEM_ANALYSIS, MEM_TRACE, MEM_RECORD, MEM_NCAT };
+enum MemPolicies { MEM_POLICY_NONE, MEM_POLICY_DROP, MEM_POLICY_STOP, MEM_POLICY_HALT };
+#define MEM_DROP_TARGET 75 // percent of the budget the drop policy trims down to
+typedef struct {
+    uint64_t budget;       // limit of the accounted bytes, 0 for none ("-membudget")
+    int policy;            // MemPolicies value applied when the budget is exceeded ("-mempolicy")
+    uint64_t cached;       // bytes the budget check does not compute itself, refreshed by Mem_Refresh
+    uint64_t peak;         // largest total seen by a budget check or "memory"
+    int over;              // 1 while the total is above the budget, the event fires on each rise
+    int stopped;           // 1 once the stop policy stopped storing rows in the current run
+    uint64_t exceeded;     // number of times the budget was exceeded
+    uint64_t dropped_rows; // rows dropped by the drop policy
+} MemBudget;
+
+//** define instance reset
+#define RESET_MAX_CIRCUITS 4096 // most "remcirc" commands sent by "reset", bounds the loop if no error line comes
+#define RESET_HALT_MS 3000      // time "reset" waits for a running background thread to stop
+
+//** define waiters
+typedef struct Waiter {
+    const char *token;   // abort token given with -token, NULL if none
+    int aborted;         // set by "abort -token" for a matching waiter
+    struct Waiter *next; // threads blocked in wait_any() on the same context
+} Waiter;
 
 //** define commands buffer
 typedef struct PendingCmd {
@@ -174,22 +558,68 @@ typedef struct {
      *-----------------------------------------------------------------------------------------------------------------*/
     InitSnap *init_snap;                          /* One-shot vector metadata snapshot (SEND_INIT_DATA) */
     DataBuf prod;                                 /* Primary data buffer — rows appended by ngspice thread */
-    DataBuf pend;                                 /* Reserved future buffer (unused or staging) */
+    DataBuf pend;                                 /* Rows detached from prod, not converted yet (Tcl thread) */
+    long conv_budget_ms;                          /* Time budget of one conversion slice, 0 for none ("-convbudget") */
+    long conv_rows;                               /* Row budget of one conversion slice, 0 for none ("-convrows") */
+    int conv_scheduled;                           /* 1 while Conv_IdleProc is queued (holds a Tcl_Preserve) */
 
     Tcl_Obj *vectorData;                          /* Tcl dict: vector name → list(values) */
     Tcl_Obj *vectorInit;                          /* Tcl dict: vector name → {number N real 0/1} */
 
+    /*------------------------------------------------------------------------------------------------------------------
+     * Callback-side view of the current run (owned by ngspice thread, guarded by mutex)
+     *-----------------------------------------------------------------------------------------------------------------*/
+    char **run_names;                             /* Vector names of the current run, indexed like vecsa */
+    int run_veccount;                             /* Number of entries in run_names */
+    int scale_idx;                                /* Index of the scale vector in vecsa, -1 if not yet known */
+    HistAcc *hist_head;                           /* Streaming histogram/eye accumulators fed by SendDataCallback */
+    DerivedVec *derived_head;                     /* Derived vectors evaluated per row in SendDataCallback */
+    char **derived_names;                         /* Names ever given to derived vectors, freed with the instance */
+    int nderived_names;                           /* Number of entries in derived_names */
+    unsigned char *run_keep;                      /* Per vecsa index: 0 if dropped by a derived vector; NULL keeps all */
+    Pyramid *pyr_head;                            /* Min/max pyramids for downsampling (Tcl thread only) */
+    Trigger *trig_head;                           /* Data-condition triggers evaluated in SendDataCallback */
+    int halt_pending;                             /* 1 while a trigger halt thread exists and is not joined yet */
+    Tcl_ThreadId halt_tid;                        /* Joinable thread issuing "bg_halt" for a fired trigger */
+    Capture *cap_head;                            /* Pre/post-trigger capture windows fed by SendDataCallback */
+    int store_data;                               /* 0 to skip storing rows in vectorData ("configure -storedata") */
+    MemBudget mem;                                /* Memory budget and policy state ("memory"), guarded by mutex */
+    Progress progress;                            /* Latest parsed status of the running analysis */
+
+    /*------------------------------------------------------------------------------------------------------------------
+     * Event subscriptions ("on"), Tcl thread only
+     *-----------------------------------------------------------------------------------------------------------------*/
+    EventSubs subs;                               /* Per-event scripts and coalesced counts */
+    Tcl_WideInt stored_rows;                      /* Rows appended to vectorData since it was last reset */
+
     /*------------------------------------------------------------------------------------------------------------------
      * Event and message tracking
      *-----------------------------------------------------------------------------------------------------------------*/
-    MsgQueue msgq;                                /* Async message queue for log/status lines */
-    uint64_t evt_counts[NUM_EVTS];                /* Per-callback counters */
+    MsgQueue msgq;                                /* Ring of the latest log/status lines ("messages") */
+    int msg_sink;                                 /* MsgSinks value: where Msg_Put sends lines ("-msgsink") */
+    FILE *msg_file;                               /* File appended to by the file sink, NULL if none ("-msgfile") */
+    char *msg_path;                               /* Path of msg_file as given to "configure", NULL if none */
+    uint64_t msg_received;                        /* Lines passed to Msg_Put since instance creation */
+    uint64_t msg_written;                         /* Lines written to msg_file */
+    uint64_t msg_failed;                          /* Lines lost by the file sink (no file or write error) */
+    MsgClass msgclass;                            /* Per-category counters and sink filters of Msg_Put */
+    uint64_t char_pending;                        /* SEND_CHAR callbacks not yet seen by NgSpiceEventProc */
+    uint64_t evt_counts[NUM_EVTS];                /* Per-callback counters, never decreasing */
+    uint64_t evt_base[NUM_EVTS];                  /* Counter values at the last "eventcounts -clear" */
     uint64_t gen;                                 /* Generation number (run_id) for event validation */
     int new_run_pending;                          /* Marks pending new run between INIT/DATA callbacks */
+    uint64_t plot_seq;                            /* Bumped by Run_Reset and every SendInitDataCallback */
+    Tcl_Channel notify_rchan;                     /* Read end of the "notifier" pipe, NULL if not created */
+    Tcl_Channel notify_wchan;                     /* Write end of the "notifier" pipe, written by OS handle */
+    ClientData notify_rh;                         /* OS handle of notify_rchan */
+    ClientData notify_wh;                         /* OS handle of notify_wchan */
+    int notify_pending;                           /* 1 after a byte was written, cleared in NgSpiceEventProc */
 
-    int destroying;                               /* True while context teardown in progress */
+    int destroying;                               /* True while context teardown in progress (exit_mu) */
     int quitting;                                 /* True while sending "quit" command to ngspice */
-    int aborting;                                 /* Soft abort flag for waitevent unblocking */
+    uint64_t abort_epoch;                         /* Bumped by "abort"; waits started before it are aborted */
+    Waiter *waiters;                              /* Waiters blocked in wait_any(), matched by "abort -token" */
+    int remote_refs;                              /* Calls in progress from attached threads ("attach") */
     int skip_dlclose;                             /* True to skip dlclose() on unsafe shutdown */
     int has_circuit;                              /* True if circuit is loaded into ngspice */
 
@@ -205,7 +635,7 @@ typedef struct {
      * Controlled exit synchronization (used by ControlledExitCallback)
      *-----------------------------------------------------------------------------------------------------------------*/
     int exited;                                   /* 1 after ControlledExitCallback() runs */
-    Tcl_Mutex exit_mu;                            /* Protects 'exited' flag */
+    Tcl_Mutex exit_mu;                            /* Protects 'exited' and 'destroying' flags */
     Tcl_Condition exit_cv;                        /* Signaled to wake teardown waiting for exit */
 
     /*------------------------------------------------------------------------------------------------------------------
@@ -221,14 +651,40 @@ typedef struct {
     PendingCmd *pending_head;                     /* Head of queued Tcl commands awaiting safe dispatch */
     PendingCmd *pending_tail;                     /* Tail of queued Tcl commands */
     Tcl_Mutex cmd_mu;                             /* Protects pending command queue */
+
+    /*------------------------------------------------------------------------------------------------------------------
+     * Hot-path telemetry ("stats")
+     *-----------------------------------------------------------------------------------------------------------------*/
+    Telemetry stats;                              /* Counters and timings, see Telemetry for the guarding locks */
+    Tcl_Mutex stats_mu;                           /* Protects callback timings and the Tcl event queue depth */
+    RunInfo runs[RUNINFO_KEEP];                   /* Reports of the latest runs ("runinfo"), guarded by mutex */
+    uint64_t run_count;                           /* Runs started with bg_run, latest in runs[(n-1)%KEEP] */
+    TraceRing trace;                              /* Opt-in ring of timestamped spans and instants ("trace") */
+    Tcl_Mutex trace_mu;                           /* Protects trace (innermost lock, nothing is locked under it) */
+
+    /*------------------------------------------------------------------------------------------------------------------
+     * Callback recording and replay ("record", "replay")
+     *-----------------------------------------------------------------------------------------------------------------*/
+    Recorder rec;                                 /* Binary recording of the callback stream */
+    Tcl_Mutex rec_mu;                             /* Protects rec (taken at callback entry, no lock held) */
+    Replay replay;                                /* Replay of a recording through the callbacks */
+    Tcl_Mutex replay_mu;                          /* Protects replay */
 } NgSpiceContext;
 
+//** define registry of instances for attached threads
+typedef struct RegEntry {
+    char *name;              // fully-qualified instance command name
+    NgSpiceContext *ctx;     // instance context
+    struct RegEntry *next;   // linked list
+} RegEntry;
+
 //** Define a Tcl event record
 typedef struct {
     Tcl_Event header;
     NgSpiceContext *ctx;
     int callbackId;
     uint64_t gen;
+    Tcl_WideInt queued; // time the event was queued, microseconds (Stats_Now)
 } NgSpiceEvent;
 
 //** functions
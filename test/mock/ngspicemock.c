@@ -0,0 +1,795 @@
+/*
+ * ngspicemock.c --
+ *
+ *      Stand-in for libngspice used to test and benchmark the bridge without ngspice. It implements the sharedspice.h
+ *      entry points resolved by NgResolveAll and emits synthetic SendInitData/SendData/SendChar/SendStat/
+ *      BGThreadRunning streams, so the bridge's own overhead can be measured apart from the ngspice solver.
+ *
+ *      The stream is configured through ngSpice_Command, like any other ngspice command:
+ *
+ *          mock vectors N      number of vectors including the scale (default 4)
+ *          mock rows N         rows sent per run (default 1000)
+ *          mock rate R         rows per second, 0 to send as fast as possible (default 0)
+ *          mock burst B        rows sent back to back before pausing for B/R seconds (default 1)
+ *          mock chars N        one "stdout" line every N rows, 0 for none (default 0)
+ *          mock stat N         one "tran: x%" status every N rows, 0 for none (default 100)
+ *          mock complex 0|1    complex vectors over a frequency scale, as an ac analysis (default 0)
+ *          mock keep 0|1       keep the data of the last run for ngGet_Vec_Info (default 1)
+ *          mock threads N      extra threads sending stdout and status lines during a run (default 0)
+ *          mock noise R        lines per second of each extra thread, 0 for as fast as possible (default 10000)
+ *          mock nan N          every Nth row holds NaN in all vectors, the scale included, 0 for none (default 0)
+ *          mock reset          restore the defaults
+ *          mock                print the settings
+ *
+ *      "bg_run" sends a run from a background thread, "run" from the calling thread, "bg_halt" stops the background
+ *      run and waits for it, "quit" calls ControlledExit. "echo text" prints text and "rusage ..." prints fixed
+ *      figures. ngSpice_Circ only counts the circuits, "remcirc" removes one or prints the ngspice error when none is
+ *      left, and "destroy all" drops the plot of the last run; other commands are accepted and ignored. Vector j of row k holds sin(2*pi*k/100 + j) over a scale of
+ *      k ns (or (k+1) kHz), so results are deterministic.
+ *
+ *      Built by "make mock"; POSIX threads only.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#define XSPICE 1
+#define SHARED_MODULE 1
+#include "sharedspice.h"
+
+#define MOCK_MAXVECS 1024
+#define MOCK_MAXTHREADS 64
+#define MOCK_PERIOD 100.0
+#define MOCK_TWO_PI 6.283185307179586
+
+//** state
+typedef struct {
+    int vectors;  // vectors including the scale
+    long rows;    // rows per run
+    double rate;  // rows per second, 0 for unthrottled
+    long burst;   // rows per burst
+    long chars;   // rows between stdout lines, 0 for none
+    long stat;    // rows between status lines, 0 for none
+    int complex;  // 1 for complex vectors over a frequency scale
+    int keep;     // 1 to keep the data of the last run
+    int threads;  // extra threads sending lines during a run
+    double noise; // lines per second of each extra thread, 0 for unthrottled
+    long nan;     // rows between NaN rows, 0 for none
+} MockConfig;
+
+static const MockConfig mock_defaults = {4, 1000, 0.0, 1, 0, 100, 0, 1, 0, 10000.0, 0};
+
+static pthread_mutex_t mock_mu = PTHREAD_MUTEX_INITIALIZER; // guards the settings, callbacks and run flags
+static MockConfig mock_cfg = {4, 1000, 0.0, 1, 0, 100, 0, 1, 0, 10000.0, 0};
+static SendChar *cb_char = NULL;
+static SendStat *cb_stat = NULL;
+static ControlledExit *cb_exit = NULL;
+static SendData *cb_data = NULL;
+static SendInitData *cb_init = NULL;
+static BGThreadRunning *cb_bg = NULL;
+static void *cb_user = NULL;
+static pthread_t bg_thread;
+static int bg_joinable = 0; // 1 while bg_thread has to be joined
+static pthread_t old_thread;
+static int old_joinable = 0; // 1 while old_thread, a run that ended itself, has to be joined
+static int running = 0;     // 1 while a run is sending rows
+static int halt = 0;        // set by bg_halt, polled by the run
+static int plot_seq = 0;    // number of the current plot ("tran1", "ac2"...)
+static int noise_stop = 0;  // set at the end of a run to stop the extra threads
+static int circuits = 0;    // circuits loaded with ngSpice_Circ and not removed with "remcirc"
+
+/* Plot and vector data are changed by the run under data_mu, which ngSpice_LockRealloc holds for the caller; as in
+   ngspice, ngGet_Vec_Info and ngSpice_AllVecs read them without locking. */
+static pthread_mutex_t data_mu = PTHREAD_MUTEX_INITIALIZER;
+static char plot_name[32] = "const";
+static char *vec_names[MOCK_MAXVECS + 1];
+static int vec_count = 0;
+static double *vec_real[MOCK_MAXVECS];    // kept data of the last run, one array per vector
+static ngcomplex_t *vec_comp[MOCK_MAXVECS];
+static long vec_len = 0;
+static vector_info vec_info;
+static char *input_path = NULL;
+static char *plots[3] = {plot_name, NULL, NULL}; // the plot of the last run and "const" after a run
+static char *no_nodes[1] = {NULL};
+
+//** helpers
+//***  Mock_Print function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_Print --
+ *
+ *      Sends one formatted line through the SendChar callback, prefixed with "stdout " like ngspice does.
+ *
+ * Parameters:
+ *      const char *fmt              - input: printf format, followed by its arguments
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Calls the SendChar callback, if registered. Must be called without mock_mu held.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mock_Print(const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+    memcpy(line, "stdout ", 7);
+    va_start(ap, fmt);
+    vsnprintf(line + 7, sizeof(line) - 7, fmt, ap);
+    va_end(ap);
+    if (cb_char != NULL) {
+        cb_char(line, 0, cb_user);
+    }
+}
+//***  Mock_Now function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_Now --
+ *
+ *      Current CLOCK_MONOTONIC time in seconds.
+ *
+ * Parameters:
+ *      None.
+ *
+ * Results:
+ *      Seconds as a double.
+ *
+ * Side Effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static double Mock_Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec * 1e-9);
+}
+//***  Mock_Sleep function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_Sleep --
+ *
+ *      Sleeps until an absolute Mock_Now time, used to pace rows at the configured rate without drift.
+ *
+ * Parameters:
+ *      double until                 - input: wake-up time in seconds
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Blocks the calling thread.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mock_Sleep(double until) {
+    double d = until - Mock_Now();
+    if (d > 0.0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)d;
+        ts.tv_nsec = (long)((d - (double)ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+//***  Mock_FreeData function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_FreeData --
+ *
+ *      Frees the vector names and the kept data of the last run. Caller holds data_mu.
+ *
+ * Parameters:
+ *      None.
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Empties vec_names, vec_real, vec_comp.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mock_FreeData(void) {
+    for (int j = 0; j < vec_count; j++) {
+        free(vec_names[j]);
+        free(vec_real[j]);
+        free(vec_comp[j]);
+        vec_names[j] = NULL;
+        vec_real[j] = NULL;
+        vec_comp[j] = NULL;
+    }
+    vec_names[0] = NULL;
+    vec_count = 0;
+    vec_len = 0;
+}
+
+//** run
+//***  Mock_NoiseProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_NoiseProc --
+ *
+ *      Body of the extra threads started by a run with "mock threads N": sends stdout lines and status lines, in
+ *      turn, at the "mock noise" rate until the run ends or is halted, so SendChar and SendStat race with SendData.
+ *
+ * Parameters:
+ *      void *arg                    - input: thread number (intptr_t)
+ *
+ * Results:
+ *      NULL.
+ *
+ * Side Effects:
+ *      Calls the SendChar and SendStat callbacks.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void *Mock_NoiseProc(void *arg) {
+    int id = (int)(intptr_t)arg;
+    pthread_mutex_lock(&mock_mu);
+    double rate = mock_cfg.noise;
+    pthread_mutex_unlock(&mock_mu);
+    double t0 = Mock_Now();
+    for (long k = 0;; k++) {
+        pthread_mutex_lock(&mock_mu);
+        int stop = (noise_stop == 1) || (halt == 1);
+        pthread_mutex_unlock(&mock_mu);
+        if (stop) {
+            break;
+        }
+        if ((k % 2) == 0) {
+            Mock_Print("mock thread %d line %ld", id, k);
+        } else if (cb_stat != NULL) {
+            char status[64];
+            snprintf(status, sizeof status, "mock thread %d: %ld", id, k);
+            cb_stat(status, 0, cb_user);
+        }
+        if (rate > 0.0) {
+            Mock_Sleep(t0 + ((double)(k + 1) / rate));
+        }
+    }
+    return NULL;
+}
+//***  Mock_Run function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_Run --
+ *
+ *      Sends one synthetic run: SendInitData with the vector table, then the configured number of rows through
+ *      SendData, paced by rate and burst, with interleaved stdout and status lines, and a final "--ready--" status.
+ *      The extra threads of "mock threads N" run from SendInitData until the last row and are joined before the
+ *      final status.
+ *
+ * Parameters:
+ *      int bg                       - input: 1 when running on the background thread (BGThreadRunning is called)
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Replaces the current plot and the kept vector data; calls the registered callbacks. Stops early after
+ *      bg_halt.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mock_Run(int bg) {
+    pthread_mutex_lock(&mock_mu);
+    MockConfig cfg = mock_cfg;
+    pthread_mutex_unlock(&mock_mu);
+    if ((cfg.vectors < 1) || (cfg.vectors > MOCK_MAXVECS)) {
+        cfg.vectors = 1;
+    }
+    pthread_mutex_lock(&data_mu);
+    Mock_FreeData();
+    plot_seq++;
+    snprintf(plot_name, sizeof plot_name, "%s%d", (cfg.complex == 1) ? "ac" : "tran", plot_seq);
+    plots[1] = "const";
+    vec_count = cfg.vectors;
+    for (int j = 0; j < vec_count; j++) {
+        char name[32];
+        if (j == 0) {
+            snprintf(name, sizeof name, "%s", (cfg.complex == 1) ? "frequency" : "time");
+        } else {
+            snprintf(name, sizeof name, "v(n%d)", j);
+        }
+        vec_names[j] = strdup(name);
+        if (cfg.keep == 1) {
+            vec_real[j] = calloc((size_t)cfg.rows + 1U, sizeof(double));
+            if ((cfg.complex == 1) && (j > 0)) {
+                vec_comp[j] = calloc((size_t)cfg.rows + 1U, sizeof(ngcomplex_t));
+            }
+        }
+    }
+    vec_names[vec_count] = NULL;
+    pthread_mutex_unlock(&data_mu);
+
+    size_t n = (size_t)cfg.vectors;
+    vecinfo *vi = calloc(n, sizeof(vecinfo));
+    pvecinfo *pvi = calloc(n, sizeof(pvecinfo));
+    vecvalues *vv = calloc(n, sizeof(vecvalues));
+    pvecvalues *pvv = calloc(n, sizeof(pvecvalues));
+    for (size_t j = 0; j < n; j++) {
+        vi[j].number = (int)j;
+        vi[j].vecname = vec_names[j];
+        vi[j].is_real = (cfg.complex == 0) || (j == 0);
+        vi[j].pdvec = &vi[j];
+        vi[j].pdvecscale = &vi[0];
+        pvi[j] = &vi[j];
+        vv[j].name = vec_names[j];
+        vv[j].is_scale = (j == 0);
+        vv[j].is_complex = (cfg.complex == 1) && (j > 0);
+        pvv[j] = &vv[j];
+    }
+    vecinfoall all;
+    all.name = plot_name;
+    all.title = "ngspice mock";
+    all.date = "today";
+    all.type = (cfg.complex == 1) ? "ac" : "tran";
+    all.veccount = (int)n;
+    all.vecs = pvi;
+    vecvaluesall row;
+    row.veccount = (int)n;
+    row.vecsa = pvv;
+
+    if ((bg == 1) && (cb_bg != NULL)) {
+        cb_bg(false, 0, cb_user);
+    }
+    if (cb_init != NULL) {
+        cb_init(&all, 0, cb_user);
+    }
+    pthread_t noise[MOCK_MAXTHREADS];
+    int nnoise = 0;
+    pthread_mutex_lock(&mock_mu);
+    noise_stop = 0;
+    pthread_mutex_unlock(&mock_mu);
+    while ((nnoise < cfg.threads) &&
+           (pthread_create(&noise[nnoise], NULL, Mock_NoiseProc, (void *)(intptr_t)(nnoise + 1)) == 0)) {
+        nnoise++;
+    }
+    long burst = (cfg.burst > 0) ? cfg.burst : 1;
+    double t0 = Mock_Now();
+    long k = 0;
+    for (k = 0; k < cfg.rows; k++) {
+        pthread_mutex_lock(&mock_mu);
+        int stop = halt;
+        pthread_mutex_unlock(&mock_mu);
+        if (stop == 1) {
+            break;
+        }
+        double scale = (cfg.complex == 1) ? (1e3 * (double)(k + 1)) : (1e-9 * (double)k);
+        vv[0].creal = scale;
+        vv[0].cimag = 0.0;
+        for (size_t j = 1; j < n; j++) {
+            double ph = (MOCK_TWO_PI * (double)k / MOCK_PERIOD) + (double)j;
+            vv[j].creal = sin(ph);
+            vv[j].cimag = (cfg.complex == 1) ? cos(ph) : 0.0;
+        }
+        if ((cfg.nan > 0) && (((k + 1) % cfg.nan) == 0)) {
+            for (size_t j = 0; j < n; j++) {
+                vv[j].creal = NAN;
+                vv[j].cimag = (vv[j].is_complex) ? NAN : 0.0;
+            }
+        }
+        if (cfg.keep == 1) {
+            pthread_mutex_lock(&data_mu);
+            for (size_t j = 0; j < n; j++) {
+                vec_real[j][k] = vv[j].creal;
+                if (vec_comp[j] != NULL) {
+                    vec_comp[j][k].cx_real = vv[j].creal;
+                    vec_comp[j][k].cx_imag = vv[j].cimag;
+                }
+            }
+            vec_len = k + 1;
+            pthread_mutex_unlock(&data_mu);
+        }
+        row.vecindex = (int)k;
+        if (cb_data != NULL) {
+            cb_data(&row, (int)n, 0, cb_user);
+        }
+        if ((cfg.chars > 0) && ((k % cfg.chars) == 0)) {
+            Mock_Print("mock row %ld", k);
+        }
+        if ((cfg.stat > 0) && ((k % cfg.stat) == 0) && (cb_stat != NULL)) {
+            char status[64];
+            snprintf(status, sizeof status, "%s: %.1f%%", all.type, 100.0 * (double)k / (double)cfg.rows);
+            cb_stat(status, 0, cb_user);
+        }
+        if ((cfg.rate > 0.0) && (((k + 1) % burst) == 0)) {
+            Mock_Sleep(t0 + ((double)(k + 1) / cfg.rate));
+        }
+    }
+    pthread_mutex_lock(&mock_mu);
+    noise_stop = 1;
+    pthread_mutex_unlock(&mock_mu);
+    for (int j = 0; j < nnoise; j++) {
+        pthread_join(noise[j], NULL);
+    }
+    if (cb_stat != NULL) {
+        cb_stat("--ready--", 0, cb_user);
+    }
+    pthread_mutex_lock(&mock_mu);
+    running = 0;
+    pthread_mutex_unlock(&mock_mu);
+    if ((bg == 1) && (cb_bg != NULL)) {
+        cb_bg(true, 0, cb_user);
+    }
+    free(vi);
+    free(pvi);
+    free(vv);
+    free(pvv);
+}
+//***  Mock_ThreadProc function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_ThreadProc --
+ *
+ *      Body of the background thread started by "bg_run".
+ *
+ * Parameters:
+ *      void *arg                    - input: unused
+ *
+ * Results:
+ *      NULL.
+ *
+ * Side Effects:
+ *      See Mock_Run.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void *Mock_ThreadProc(void *arg) {
+    (void)arg;
+    Mock_Run(1);
+    return NULL;
+}
+//***  Mock_Join function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_Join --
+ *
+ *      Asks the background run to stop (if halt is set) and waits for its thread. Caller must not hold mock_mu. When
+ *      called from the background thread itself, as the bridge does when it sends queued commands from the
+ *      BGThreadRunning callback, the thread cannot be joined: it is kept in old_thread and joined by the next call
+ *      from another thread, so no run outlives ngSpice_Init.
+ *
+ * Parameters:
+ *      int stop                     - input: 1 to halt the run, 0 to wait for it to finish
+ *
+ * Results:
+ *      None.
+ *
+ * Side Effects:
+ *      Joins bg_thread and old_thread.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static void Mock_Join(int stop) {
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&mock_mu);
+    if (stop == 1) {
+        halt = 1;
+    }
+    int old = (old_joinable == 1) && !pthread_equal(old_thread, self);
+    pthread_t otid = old_thread;
+    if (old) {
+        old_joinable = 0;
+    }
+    if ((bg_joinable == 1) && pthread_equal(bg_thread, self)) {
+        old_thread = bg_thread;
+        old_joinable = 1;
+        bg_joinable = 0;
+    }
+    int joinable = bg_joinable;
+    pthread_t tid = bg_thread;
+    bg_joinable = 0;
+    pthread_mutex_unlock(&mock_mu);
+    if (joinable == 1) {
+        pthread_join(tid, NULL);
+    }
+    if (old) {
+        pthread_join(otid, NULL);
+    }
+}
+//***  Mock_Configure function
+/*
+ *----------------------------------------------------------------------------------------------------------------------
+ *
+ * Mock_Configure --
+ *
+ *      Handles the "mock ..." commands described at the top of the file.
+ *
+ * Parameters:
+ *      const char *args             - input: text after "mock"
+ *
+ * Results:
+ *      0 on success, 1 for an unknown setting or a bad value (an error line is printed).
+ *
+ * Side Effects:
+ *      Updates mock_cfg under mock_mu.
+ *
+ *----------------------------------------------------------------------------------------------------------------------
+ */
+static int Mock_Configure(const char *args) {
+    char key[32] = "";
+    double v = 0.0;
+    int nf = sscanf(args, " %31s %lf", key, &v);
+    if (nf <= 0) {
+        pthread_mutex_lock(&mock_mu);
+        MockConfig c = mock_cfg;
+        pthread_mutex_unlock(&mock_mu);
+        Mock_Print("mock vectors %d rows %ld rate %g burst %ld chars %ld stat %ld complex %d keep %d threads %d "
+                   "noise %g nan %ld",
+                   c.vectors, c.rows, c.rate, c.burst, c.chars, c.stat, c.complex, c.keep, c.threads, c.noise, c.nan);
+        return 0;
+    }
+    int rc = 0;
+    pthread_mutex_lock(&mock_mu);
+    if (strcmp(key, "reset") == 0) {
+        mock_cfg = mock_defaults;
+    } else if ((nf != 2) || (v < 0.0)) {
+        rc = 1;
+    } else if ((strcmp(key, "vectors") == 0) && (v >= 1.0) && (v <= (double)MOCK_MAXVECS)) {
+        mock_cfg.vectors = (int)v;
+    } else if (strcmp(key, "rows") == 0) {
+        mock_cfg.rows = (long)v;
+    } else if (strcmp(key, "rate") == 0) {
+        mock_cfg.rate = v;
+    } else if ((strcmp(key, "burst") == 0) && (v >= 1.0)) {
+        mock_cfg.burst = (long)v;
+    } else if (strcmp(key, "chars") == 0) {
+        mock_cfg.chars = (long)v;
+    } else if (strcmp(key, "stat") == 0) {
+        mock_cfg.stat = (long)v;
+    } else if (strcmp(key, "complex") == 0) {
+        mock_cfg.complex = (v != 0.0);
+    } else if (strcmp(key, "keep") == 0) {
+        mock_cfg.keep = (v != 0.0);
+    } else if ((strcmp(key, "threads") == 0) && (v <= (double)MOCK_MAXTHREADS)) {
+        mock_cfg.threads = (int)v;
+    } else if (strcmp(key, "noise") == 0) {
+        mock_cfg.noise = v;
+    } else if (strcmp(key, "nan") == 0) {
+        mock_cfg.nan = (long)v;
+    } else {
+        rc = 1;
+    }
+    pthread_mutex_unlock(&mock_mu);
+    if (rc != 0) {
+        Mock_Print("Error: bad mock setting: %s", args);
+    }
+    return rc;
+}
+
+//** sharedspice.h entry points
+IMPEXP
+int ngSpice_Init(SendChar *printfcn, SendStat *statfcn, ControlledExit *ngexit, SendData *sdata,
+                 SendInitData *sinitdata, BGThreadRunning *bgtrun, void *userData) {
+    Mock_Join(1);
+    pthread_mutex_lock(&mock_mu);
+    cb_char = printfcn;
+    cb_stat = statfcn;
+    cb_exit = ngexit;
+    cb_data = sdata;
+    cb_init = sinitdata;
+    cb_bg = bgtrun;
+    cb_user = userData;
+    halt = 0;
+    running = 0;
+    pthread_mutex_unlock(&mock_mu);
+    Mock_Print("******");
+    Mock_Print("** ngspice mock library (sharedspice %s)", NGSPICE_PACKAGE_VERSION);
+    Mock_Print("******");
+    return 0;
+}
+
+IMPEXP
+int ngSpice_Init_Sync(GetVSRCData *vsrcdat, GetISRCData *isrcdat, GetSyncData *syncdat, int *ident, void *userData) {
+    (void)vsrcdat;
+    (void)isrcdat;
+    (void)syncdat;
+    (void)ident;
+    (void)userData;
+    return 0;
+}
+
+IMPEXP
+int ngSpice_Command(char *command) {
+    if (command == NULL) {
+        return 0;
+    }
+    if (strcmp(command, "bg_run") == 0) {
+        pthread_mutex_lock(&mock_mu);
+        int busy = running;
+        pthread_mutex_unlock(&mock_mu);
+        if (busy == 1) {
+            Mock_Print("Warning: cannot start background thread, simulation is already running");
+            return 1;
+        }
+        Mock_Join(0);
+        pthread_mutex_lock(&mock_mu);
+        halt = 0;
+        running = 1;
+        bg_joinable = (pthread_create(&bg_thread, NULL, Mock_ThreadProc, NULL) == 0);
+        if (bg_joinable == 0) {
+            running = 0;
+        }
+        pthread_mutex_unlock(&mock_mu);
+        return 0;
+    }
+    if (strcmp(command, "bg_halt") == 0) {
+        Mock_Join(1);
+        return 0;
+    }
+    if (strcmp(command, "run") == 0) {
+        Mock_Join(0);
+        pthread_mutex_lock(&mock_mu);
+        halt = 0;
+        running = 1;
+        pthread_mutex_unlock(&mock_mu);
+        Mock_Run(0);
+        return 0;
+    }
+    if (strcmp(command, "quit") == 0) {
+        Mock_Join(1);
+        if (cb_exit != NULL) {
+            cb_exit(0, false, true, 0, cb_user);
+        }
+        return 0;
+    }
+    if ((strncmp(command, "mock", 4) == 0) && ((command[4] == '\0') || (command[4] == ' '))) {
+        return Mock_Configure(command + 4);
+    }
+    if (strncmp(command, "echo ", 5) == 0) {
+        Mock_Print("%s", command + 5);
+        return 0;
+    }
+    if (strcmp(command, "remcirc") == 0) {
+        pthread_mutex_lock(&mock_mu);
+        int loaded = circuits;
+        circuits = (loaded > 0) ? (loaded - 1) : 0;
+        pthread_mutex_unlock(&mock_mu);
+        if (loaded == 0) {
+            Mock_Print("Error: there is no circuit loaded.");
+        }
+        return 0;
+    }
+    if (strcmp(command, "destroy all") == 0) {
+        Mock_Join(1);
+        pthread_mutex_lock(&data_mu);
+        Mock_FreeData();
+        snprintf(plot_name, sizeof plot_name, "const");
+        plots[1] = NULL;
+        pthread_mutex_unlock(&data_mu);
+        return 0;
+    }
+    if (strncmp(command, "rusage", 6) == 0) {
+        Mock_Print("Total analysis time (seconds) = 0.001");
+        Mock_Print("Total elapsed time (seconds) = 0.002");
+        Mock_Print("Current dynamic memory usage = 1.000 MB,");
+        return 0;
+    }
+    return 0;
+}
+
+IMPEXP
+pvector_info ngGet_Vec_Info(char *vecname) {
+    pvector_info result = NULL;
+    for (int j = 0; (vecname != NULL) && (j < vec_count); j++) {
+        if (strcmp(vec_names[j], vecname) == 0) {
+            vec_info.v_name = vec_names[j];
+            vec_info.v_type = (j == 0) ? ((strncmp(plot_name, "ac", 2) == 0) ? 2 : 1) : 3;
+            vec_info.v_flags = (vec_comp[j] != NULL) ? 2 : 1;
+            vec_info.v_realdata = (vec_comp[j] != NULL) ? NULL : vec_real[j];
+            vec_info.v_compdata = vec_comp[j];
+            vec_info.v_length = (vec_real[j] != NULL) ? (int)vec_len : 0;
+            result = &vec_info;
+            break;
+        }
+    }
+    return result;
+}
+
+IMPEXP
+char *ngCM_Input_Path(const char *path) {
+    pthread_mutex_lock(&mock_mu);
+    if (path != NULL) {
+        free(input_path);
+        input_path = strdup(path);
+    }
+    char *p = input_path;
+    pthread_mutex_unlock(&mock_mu);
+    return p;
+}
+
+IMPEXP
+pevt_shared_data ngGet_Evt_NodeInfo(char *nodename) {
+    (void)nodename;
+    return NULL;
+}
+
+IMPEXP
+char **ngSpice_AllEvtNodes(void) {
+    return no_nodes;
+}
+
+IMPEXP
+int ngSpice_Init_Evt(SendEvtData *sevtdata, SendInitEvtData *sinitevtdata, void *userData) {
+    (void)sevtdata;
+    (void)sinitevtdata;
+    (void)userData;
+    return 0;
+}
+
+IMPEXP
+int ngSpice_Circ(char **circarray) {
+    (void)circarray;
+    pthread_mutex_lock(&mock_mu);
+    circuits++;
+    pthread_mutex_unlock(&mock_mu);
+    return 0;
+}
+
+IMPEXP
+char *ngSpice_CurPlot(void) {
+    return plot_name;
+}
+
+IMPEXP
+char **ngSpice_AllPlots(void) {
+    return plots;
+}
+
+IMPEXP
+char **ngSpice_AllVecs(char *plotname) {
+    (void)plotname;
+    return vec_names;
+}
+
+IMPEXP
+NG_BOOL ngSpice_running(void) {
+    pthread_mutex_lock(&mock_mu);
+    int r = running;
+    pthread_mutex_unlock(&mock_mu);
+    return r == 1;
+}
+
+IMPEXP
+NG_BOOL ngSpice_SetBkpt(double time) {
+    (void)time;
+    return true;
+}
+
+IMPEXP
+int ngSpice_nospinit(void) {
+    return 0;
+}
+
+IMPEXP
+int ngSpice_nospiceinit(void) {
+    return 0;
+}
+
+IMPEXP
+int ngSpice_LockRealloc(void) {
+    pthread_mutex_lock(&data_mu);
+    return 0;
+}
+
+IMPEXP
+int ngSpice_UnlockRealloc(void) {
+    pthread_mutex_unlock(&data_mu);
+    return 0;
+}